@@ -1,7 +1,8 @@
 /**
  * @brief Show block device statistics, where available.
  *
- * Shows cache hit/miss/write counts for ATA devices, mostly.
+ * Shows block cache hit/miss/eviction/write counts for a disk.
+ * /proc/blockcache has the same counters for every disk at once.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -27,7 +28,7 @@ int main(int argc, char * argv[]) {
 
 	uint64_t stats[4] = {-1};
 
-	long res = ioctl(fd, 0x2A01234UL, &stats);
+	long res = ioctl(fd, IOCTLBLOCKSTATS, &stats);
 
 	if (res < 0) {
 		fprintf(stderr, "ioctl: %ld\n", res);
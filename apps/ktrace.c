@@ -0,0 +1,306 @@
+/**
+ * @brief ktrace - record kernel events as a timeline
+ *
+ * Turns on the kernel's event trace, runs a command, and writes what
+ * was recorded in /proc/trace out as Chrome trace event JSON, which
+ * can be loaded into chrome://tracing or Perfetto. Each core gets a
+ * track showing which thread it was running, and each thread gets
+ * its system calls, page faults and block I/O as nested slices.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <kernel/trace.h>
+
+/* Fake process the per-core tracks are grouped under. */
+#define CPU_PID 1000000
+#define MAX_CPUS 32
+
+struct name {
+	int pid; /* -1 until we see the thread do something */
+	int tid;
+	char name[64];
+	struct name * next;
+};
+
+static struct name * names = NULL;
+
+static int control(const char * cmd) {
+	int fd = open("/proc/trace", O_WRONLY);
+	if (fd < 0) return -1;
+	int status = write(fd, cmd, strlen(cmd));
+	close(fd);
+	return status < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Thread names, from /proc while they are still around.
+ */
+static const char * thread_name(int tid) {
+	for (struct name * n = names; n; n = n->next) {
+		if (n->tid == tid) return n->name;
+	}
+
+	struct name * n = calloc(1, sizeof(struct name));
+	n->pid = -1;
+	n->tid = tid;
+	snprintf(n->name, sizeof(n->name), "%d", tid);
+
+	char path[64], line[128];
+	snprintf(path, sizeof(path), "/proc/%d/status", tid);
+	FILE * f = fopen(path, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, "Name:", 5)) continue;
+			char * start = line + 5;
+			while (*start == ' ' || *start == '\t') start++;
+			start[strcspn(start, "\n\"\\")] = '\0';
+			snprintf(n->name, sizeof(n->name), "%s [%d]", start, tid);
+			break;
+		}
+		fclose(f);
+	}
+
+	n->next = names;
+	names = n;
+	return n->name;
+}
+
+static struct name * find_name(int tid) {
+	thread_name(tid);
+	for (struct name * n = names; n; n = n->next) {
+		if (n->tid == tid) return n;
+	}
+	return NULL;
+}
+
+static int time_sort(const void * a, const void * b) {
+	const struct trace_event * left = a, * right = b;
+	return left->time < right->time ? -1 : left->time > right->time;
+}
+
+static void * read_trace(size_t * size) {
+	FILE * f = fopen("/proc/trace", "r");
+	if (!f) return NULL;
+
+	size_t avail = 65536, used = 0;
+	char * buf = malloc(avail);
+	size_t r;
+	while ((r = fread(buf + used, 1, avail - used, f)) > 0) {
+		used += r;
+		if (used == avail) {
+			avail *= 2;
+			buf = realloc(buf, avail);
+		}
+	}
+	fclose(f);
+	*size = used;
+	return buf;
+}
+
+static void emit(FILE * out, int * first, const char * fmt, ...) __attribute__((format(printf, 3, 4)));
+static void emit(FILE * out, int * first, const char * fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	fprintf(out, "%s\n  ", *first ? "" : ",");
+	vfprintf(out, fmt, args);
+	va_end(args);
+	*first = 0;
+}
+
+static int dump(FILE * out) {
+	size_t size;
+	char * buf = read_trace(&size);
+	if (!buf || size < sizeof(struct trace_header)) {
+		fprintf(stderr, "ktrace: /proc/trace: %s\n", buf ? "short read" : strerror(errno));
+		return 1;
+	}
+
+	struct trace_header * header = (struct trace_header *)buf;
+	if (header->magic != TRACE_MAGIC || header->event_size != sizeof(struct trace_event)) {
+		fprintf(stderr, "ktrace: /proc/trace: unrecognized format\n");
+		return 1;
+	}
+
+	size_t count = (size - sizeof(struct trace_header)) / sizeof(struct trace_event);
+	if (count > header->count) count = header->count;
+	struct trace_event * events = (struct trace_event *)(buf + sizeof(struct trace_header));
+	qsort(events, count, sizeof(struct trace_event), time_sort);
+
+	double mhz = header->mhz ? header->mhz : 1;
+	uint64_t base = count ? events[0].time : 0;
+#define TS(t) (((t) - base) / mhz)
+
+	int first = 1;
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"lost\":%llu},\"traceEvents\":[",
+		(unsigned long long)header->lost);
+	emit(out, &first, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"CPUs\"}}", CPU_PID);
+
+	/* Who each core is running, and since when. */
+	int running[MAX_CPUS];
+	uint64_t since[MAX_CPUS];
+	int seen[MAX_CPUS] = {0};
+
+	for (size_t i = 0; i < count; ++i) {
+		struct trace_event * e = &events[i];
+		int cpu = e->cpu % MAX_CPUS;
+
+		if (!seen[cpu]) {
+			emit(out, &first, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"cpu %d\"}}",
+				CPU_PID, cpu, cpu);
+			seen[cpu] = 1;
+			running[cpu] = -1;
+		}
+
+		if (e->type != TRACE_SWITCH) find_name(e->tid)->pid = e->pid;
+
+		switch (e->type) {
+			case TRACE_SWITCH:
+				if (running[cpu] >= 0) {
+					emit(out, &first, "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+						thread_name(running[cpu]), CPU_PID, cpu, TS(since[cpu]), (e->time - since[cpu]) / mhz);
+				}
+				running[cpu] = e->b;
+				since[cpu] = e->time;
+				break;
+			case TRACE_WAKEUP:
+				emit(out, &first, "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"wakeup %s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"cpu\":%llu}}",
+					thread_name(e->a), e->pid, e->tid, TS(e->time), (unsigned long long)e->b);
+				break;
+			case TRACE_SYSCALL_ENTER:
+				emit(out, &first, "{\"ph\":\"B\",\"name\":\"syscall %llu\",\"cat\":\"syscall\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"arg0\":\"%#llx\"}}",
+					(unsigned long long)e->a, e->pid, e->tid, TS(e->time), (unsigned long long)e->b);
+				break;
+			case TRACE_SYSCALL_EXIT:
+				emit(out, &first, "{\"ph\":\"E\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"return\":%lld}}",
+					e->pid, e->tid, TS(e->time), (long long)e->b);
+				break;
+			case TRACE_FAULT_ENTER:
+				emit(out, &first, "{\"ph\":\"B\",\"name\":\"page fault\",\"cat\":\"mm\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"address\":\"%#llx\",\"flags\":%llu}}",
+					e->pid, e->tid, TS(e->time), (unsigned long long)e->a, (unsigned long long)e->b);
+				break;
+			case TRACE_FAULT_EXIT:
+				emit(out, &first, "{\"ph\":\"E\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"response\":%llu}}",
+					e->pid, e->tid, TS(e->time), (unsigned long long)e->b);
+				break;
+			case TRACE_BLOCK_READ_BEGIN:
+			case TRACE_BLOCK_WRITE_BEGIN:
+				emit(out, &first, "{\"ph\":\"B\",\"name\":\"block %s\",\"cat\":\"block\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"sector\":%llu,\"count\":%llu}}",
+					e->type == TRACE_BLOCK_READ_BEGIN ? "read" : "write",
+					e->pid, e->tid, TS(e->time), (unsigned long long)e->a, (unsigned long long)e->b);
+				break;
+			case TRACE_BLOCK_READ_END:
+			case TRACE_BLOCK_WRITE_END:
+				emit(out, &first, "{\"ph\":\"E\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+					e->pid, e->tid, TS(e->time));
+				break;
+			case TRACE_NET_RX:
+			case TRACE_NET_TX:
+				emit(out, &first, "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"net %s\",\"cat\":\"net\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"length\":%llu,\"type\":\"%#06llx\"}}",
+					e->type == TRACE_NET_RX ? "rx" : "tx",
+					e->pid, e->tid, TS(e->time), (unsigned long long)e->a, (unsigned long long)e->b);
+				break;
+		}
+	}
+
+	/* Close off whatever each core was running at the end. */
+	uint64_t last = count ? events[count-1].time : 0;
+	for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+		if (!seen[cpu] || running[cpu] < 0) continue;
+		emit(out, &first, "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			thread_name(running[cpu]), CPU_PID, cpu, TS(since[cpu]), (last - since[cpu]) / mhz);
+	}
+
+	/* Name the thread tracks too. */
+	for (struct name * n = names; n; n = n->next) {
+		if (n->pid < 0) continue;
+		emit(out, &first, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			n->tid, n->tid, n->name);
+	}
+
+	fprintf(out, "\n]}\n");
+	fprintf(stderr, "ktrace: %zu events, %llu lost\n", count, (unsigned long long)header->lost);
+	free(buf);
+	return 0;
+}
+
+static int usage(char * argv[]) {
+#define T_I "\033[3m"
+#define T_O "\033[0m"
+	fprintf(stderr, "usage: %s [-o FILE] command...\n"
+			"       %s -s\n"
+			"       %s -d [-o FILE]\n"
+			"\n"
+			"  -o FILE    " T_I "Write the trace here instead of ktrace.json." T_O "\n"
+			"  -s         " T_I "Start tracing and return." T_O "\n"
+			"  -d         " T_I "Stop tracing and write out what was recorded." T_O "\n"
+			"  -h         " T_I "Show this help text." T_O "\n",
+			argv[0], argv[0], argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	const char * output = "ktrace.json";
+	int start_only = 0, dump_only = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "+o:sdh")) != -1) {
+		switch (opt) {
+			case 'o': output = optarg; break;
+			case 's': start_only = 1; break;
+			case 'd': dump_only = 1; break;
+			default: return usage(argv);
+		}
+	}
+
+	if (start_only) {
+		if (control("clear") < 0 || control("start") < 0) {
+			fprintf(stderr, "%s: /proc/trace: %s\n", argv[0], strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+
+	int status = 0;
+	if (!dump_only) {
+		if (optind == argc) return usage(argv);
+
+		if (control("clear") < 0 || control("start") < 0) {
+			fprintf(stderr, "%s: /proc/trace: %s\n", argv[0], strerror(errno));
+			return 1;
+		}
+
+		pid_t child = fork();
+		if (!child) {
+			execvp(argv[optind], &argv[optind]);
+			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
+			exit(127);
+		}
+		waitpid(child, &status, 0);
+	}
+
+	control("stop");
+
+	FILE * out = strcmp(output, "-") ? fopen(output, "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], output, strerror(errno));
+		return 1;
+	}
+	int result = dump(out);
+	if (out != stdout) fclose(out);
+
+	if (result) return result;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,568 @@
+/**
+ * @brief perf - sampling profiler front end
+ *
+ * Starts the kernel's sampling profiler, runs a command, and then
+ * reports where the time went, by function, from the samples left in
+ * /proc/profile. Kernel addresses are resolved with /proc/kallsyms and
+ * userspace addresses with the symbol tables of the binaries and
+ * libraries found in the process's memory maps.
+ *
+ * Maps are read while the command is running, so libraries loaded and
+ * unloaded in between two polls may show up as bare addresses.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <toaru/hashmap.h>
+#include <kernel/elf.h>
+
+#define MAX_DEPTH 8
+#define POLL_INTERVAL 100000 /* microseconds */
+#define KERNEL_BASE 0xffff800000000000UL
+
+struct sample {
+	pid_t pid;
+	int user;
+	int depth;
+	uintptr_t ip[MAX_DEPTH];
+};
+
+struct symbol {
+	uintptr_t addr;
+	char * name;
+};
+
+struct object {
+	char * name;
+	int is_exec;
+	struct symbol * syms;
+	size_t count;
+	struct object * next;
+};
+
+struct mapping {
+	uintptr_t start, end, offset;
+	struct object * obj;
+};
+
+struct process {
+	pid_t pid;
+	struct mapping * maps;
+	size_t count;
+	struct process * next;
+};
+
+struct module {
+	uintptr_t base;
+	size_t size;
+	char name[256];
+};
+
+struct entry {
+	char * name;
+	unsigned long count;
+};
+
+static struct sample * samples = NULL;
+static size_t sample_count = 0;
+static size_t sample_space = 0;
+static unsigned long lost = 0;
+
+static struct object kernel = { "kernel", 0, NULL, 0, NULL };
+static struct module * modules = NULL;
+static size_t module_count = 0;
+
+static struct object * objects = NULL;
+static struct process * processes = NULL;
+
+static char * exe_path = NULL;
+static const char * exe_name = NULL;
+static pid_t child = 0;
+
+static int symbol_sort(const void * a, const void * b) {
+	const struct symbol * left = a, * right = b;
+	return left->addr < right->addr ? -1 : left->addr > right->addr;
+}
+
+static int entry_sort(const void * a, const void * b) {
+	const struct entry * left = a, * right = b;
+	return left->count > right->count ? -1 : left->count < right->count;
+}
+
+static void add_symbol(struct object * obj, size_t * space, uintptr_t addr, const char * name) {
+	if (obj->count == *space) {
+		*space = *space ? *space * 2 : 64;
+		obj->syms = realloc(obj->syms, sizeof(struct symbol) * *space);
+	}
+	obj->syms[obj->count].addr = addr;
+	obj->syms[obj->count].name = strdup(name);
+	obj->count++;
+}
+
+/**
+ * @brief Find the symbol covering @p addr, or NULL if it comes before all of them.
+ */
+static struct symbol * find_symbol(struct object * obj, uintptr_t addr) {
+	if (!obj->count || addr < obj->syms[0].addr) return NULL;
+	size_t lo = 0, hi = obj->count;
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (obj->syms[mid].addr <= addr) lo = mid;
+		else hi = mid;
+	}
+	return &obj->syms[lo];
+}
+
+static size_t read_symbols(struct object * obj, FILE * f, Elf64_Header * header, Elf64_Word type) {
+	size_t space = obj->count;
+	for (unsigned int i = 0; i < header->e_shnum; ++i) {
+		Elf64_Shdr shdr;
+		fseek(f, header->e_shoff + header->e_shentsize * i, SEEK_SET);
+		if (fread(&shdr, sizeof(Elf64_Shdr), 1, f) != 1) break;
+		if (shdr.sh_type != type || shdr.sh_size > 0x40000000) continue;
+
+		Elf64_Shdr strhdr;
+		fseek(f, header->e_shoff + header->e_shentsize * shdr.sh_link, SEEK_SET);
+		if (fread(&strhdr, sizeof(Elf64_Shdr), 1, f) != 1) break;
+
+		Elf64_Sym * syms = malloc(shdr.sh_size);
+		char * strtab = malloc(strhdr.sh_size + 1);
+		fseek(f, shdr.sh_offset, SEEK_SET);
+		fread(syms, shdr.sh_size, 1, f);
+		fseek(f, strhdr.sh_offset, SEEK_SET);
+		fread(strtab, strhdr.sh_size, 1, f);
+		strtab[strhdr.sh_size] = '\0';
+
+		for (size_t j = 0; j < shdr.sh_size / sizeof(Elf64_Sym); ++j) {
+			if (!syms[j].st_value || (syms[j].st_info & 0xF) != STT_FUNC) continue;
+			if (syms[j].st_name >= strhdr.sh_size) continue;
+			add_symbol(obj, &space, syms[j].st_value, strtab + syms[j].st_name);
+		}
+
+		free(syms);
+		free(strtab);
+	}
+	return obj->count;
+}
+
+/**
+ * @brief Read function symbols from an ELF file.
+ *
+ * Uses the full symbol table if the file still has one, and the
+ * dynamic symbols otherwise.
+ */
+static void load_elf_symbols(struct object * obj, const char * path) {
+	FILE * f = fopen(path, "r");
+	if (!f) return;
+
+	Elf64_Header header;
+	if (fread(&header, sizeof(Elf64_Header), 1, f) != 1 || memcmp("\x7F" "ELF", &header, 4)) {
+		fclose(f);
+		return;
+	}
+	obj->is_exec = header.e_type == ET_EXEC;
+
+	if (!read_symbols(obj, f, &header, SHT_SYMTAB)) read_symbols(obj, f, &header, SHT_DYNSYM);
+
+	fclose(f);
+	qsort(obj->syms, obj->count, sizeof(struct symbol), symbol_sort);
+}
+
+/**
+ * @brief Find a binary or library by the name the kernel gives it in
+ *        the maps, which is only the last path component.
+ */
+static struct object * find_object(const char * name) {
+	for (struct object * obj = objects; obj; obj = obj->next) {
+		if (!strcmp(obj->name, name)) return obj;
+	}
+
+	struct object * obj = calloc(1, sizeof(struct object));
+	obj->name = strdup(name);
+	obj->next = objects;
+	objects = obj;
+
+	if (exe_name && !strcmp(exe_name, name)) {
+		load_elf_symbols(obj, exe_path);
+		return obj;
+	}
+
+	static const char * dirs[] = { "/lib", "/usr/lib", "/bin", "/usr/bin" };
+	for (size_t i = 0; i < sizeof(dirs) / sizeof(*dirs); ++i) {
+		char path[1024];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", dirs[i], name);
+		if (stat(path, &st)) continue;
+		load_elf_symbols(obj, path);
+		break;
+	}
+	return obj;
+}
+
+static struct process * find_process(pid_t pid) {
+	for (struct process * proc = processes; proc; proc = proc->next) {
+		if (proc->pid == pid) return proc;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Take a fresh copy of a process's executable mappings.
+ *
+ * The previous copy is kept if the process has already gone away.
+ * For the command we started, we also wait until it has actually
+ * exec'd, so we don't record our own maps from before the exec.
+ */
+static void load_maps(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	FILE * f = fopen(path, "r");
+	if (!f) return;
+
+	struct mapping * maps = NULL;
+	size_t count = 0, space = 0;
+	int execd = pid != child;
+
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long start, end, offset, dev, inode;
+		char perms[8], name[256];
+		if (sscanf(line, "%lx-%lx %7s %lx %lx %lu %255s", &start, &end, perms, &offset, &dev, &inode, name) != 7) continue;
+		if (perms[2] != 'x' || name[0] == '[') continue;
+
+		if (count == space) {
+			space = space ? space * 2 : 16;
+			maps = realloc(maps, sizeof(struct mapping) * space);
+		}
+		maps[count].start  = start;
+		maps[count].end    = end;
+		maps[count].offset = offset;
+		maps[count].obj    = find_object(name);
+		count++;
+
+		if (exe_name && !strcmp(exe_name, name)) execd = 1;
+	}
+	fclose(f);
+
+	if (!count || !execd) {
+		free(maps);
+		return;
+	}
+
+	struct process * proc = find_process(pid);
+	if (!proc) {
+		proc = calloc(1, sizeof(struct process));
+		proc->pid = pid;
+		proc->next = processes;
+		processes = proc;
+	}
+	free(proc->maps);
+	proc->maps = maps;
+	proc->count = count;
+}
+
+static void load_kernel_symbols(void) {
+	FILE * f = fopen("/proc/kallsyms", "r");
+	if (f) {
+		size_t space = 0;
+		char line[512];
+		while (fgets(line, sizeof(line), f)) {
+			unsigned long addr;
+			char name[256];
+			if (sscanf(line, "%lx %255s", &addr, name) != 2 || !addr) continue;
+			add_symbol(&kernel, &space, addr, name);
+		}
+		fclose(f);
+		qsort(kernel.syms, kernel.count, sizeof(struct symbol), symbol_sort);
+	}
+
+	f = fopen("/proc/modules", "r");
+	if (f) {
+		char line[512];
+		while (fgets(line, sizeof(line), f)) {
+			struct module mod;
+			size_t file_size;
+			if (sscanf(line, "%lx %zu %zu %255s", &mod.base, &file_size, &mod.size, mod.name) != 4) continue;
+			modules = realloc(modules, sizeof(struct module) * (module_count + 1));
+			modules[module_count++] = mod;
+		}
+		fclose(f);
+	}
+}
+
+/**
+ * @brief Name the function containing @p ip, as "function [object]".
+ */
+static void describe(struct sample * s, uintptr_t ip, char * out, size_t size) {
+	if (ip >= KERNEL_BASE) {
+		for (size_t i = 0; i < module_count; ++i) {
+			if (ip >= modules[i].base && ip < modules[i].base + modules[i].size) {
+				snprintf(out, size, "%#zx [%s]", ip - modules[i].base, modules[i].name);
+				return;
+			}
+		}
+		struct symbol * sym = find_symbol(&kernel, ip);
+		if (sym) snprintf(out, size, "%s [kernel]", sym->name);
+		else snprintf(out, size, "%#zx [kernel]", ip);
+		return;
+	}
+
+	struct process * proc = find_process(s->pid);
+	for (size_t i = 0; proc && i < proc->count; ++i) {
+		struct mapping * map = &proc->maps[i];
+		if (ip < map->start || ip >= map->end) continue;
+		uintptr_t base = map->obj->is_exec ? 0 : map->start - map->offset;
+		struct symbol * sym = find_symbol(map->obj, ip - base);
+		if (sym) snprintf(out, size, "%s [%s]", sym->name, map->obj->name);
+		else snprintf(out, size, "%#zx [%s]", ip, map->obj->name);
+		return;
+	}
+
+	/* We never saw its maps; if it's the command we ran, try the binary itself. */
+	if (s->pid == child && exe_name) {
+		struct object * obj = find_object(exe_name);
+		struct symbol * sym = obj->is_exec ? find_symbol(obj, ip) : NULL;
+		if (sym) {
+			snprintf(out, size, "%s [%s]", sym->name, obj->name);
+			return;
+		}
+	}
+
+	snprintf(out, size, "%#zx [unknown]", ip);
+}
+
+static int control(const char * cmd) {
+	int fd = open("/proc/profile", O_WRONLY);
+	if (fd < 0) return -1;
+	int status = write(fd, cmd, strlen(cmd));
+	close(fd);
+	return status < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Move everything the kernel has recorded so far into @c samples.
+ */
+static void drain(void) {
+	FILE * f = fopen("/proc/profile", "r");
+	if (!f) return;
+
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') {
+			int cpu;
+			unsigned long n;
+			if (sscanf(line, "# cpu %d lost %lu", &cpu, &n) == 2) lost += n;
+			continue;
+		}
+
+		struct sample s = {0};
+		char * save;
+		char * tok = strtok_r(line, " \n", &save); /* cpu */
+		if (!tok || !(tok = strtok_r(NULL, " \n", &save))) continue;
+		s.pid = atoi(tok);
+		if (!(tok = strtok_r(NULL, " \n", &save))) continue; /* tid */
+		if (!(tok = strtok_r(NULL, " \n", &save))) continue;
+		s.user = *tok == 'u';
+		while (s.depth < MAX_DEPTH && (tok = strtok_r(NULL, " \n", &save))) {
+			s.ip[s.depth++] = strtoul(tok, NULL, 16);
+		}
+		if (!s.depth) continue;
+
+		if (s.user && !find_process(s.pid)) load_maps(s.pid);
+
+		if (sample_count == sample_space) {
+			sample_space = sample_space ? sample_space * 2 : 1024;
+			samples = realloc(samples, sizeof(struct sample) * sample_space);
+		}
+		samples[sample_count++] = s;
+	}
+	fclose(f);
+}
+
+static void count(hashmap_t * map, const char * key) {
+	hashmap_set(map, key, (void*)((uintptr_t)hashmap_get(map, key) + 1));
+}
+
+static struct entry * sorted(hashmap_t * map, size_t * out) {
+	size_t n = 0;
+	hashmap_foreach(iter, map) n++;
+
+	struct entry * entries = malloc(sizeof(struct entry) * (n ? n : 1));
+	size_t i = 0;
+	hashmap_foreach(iter, map) {
+		char * key;
+		void * value;
+		hashmap_iter_get(&iter, &key, &value);
+		entries[i].name = key;
+		entries[i].count = (uintptr_t)value;
+		i++;
+	}
+	qsort(entries, n, sizeof(struct entry), entry_sort);
+	*out = n;
+	return entries;
+}
+
+static void report(pid_t only, int want_kernel, int want_user, int callgraph, int limit) {
+	hashmap_t * flat = hashmap_create(64);
+	hashmap_t * chains = hashmap_create(64);
+	unsigned long total = 0, in_kernel = 0;
+
+	for (size_t i = 0; i < sample_count; ++i) {
+		struct sample * s = &samples[i];
+		if (only && s->pid != only) continue;
+		if (s->user ? !want_user : !want_kernel) continue;
+
+		total++;
+		if (!s->user) in_kernel++;
+
+		char leaf[256];
+		describe(s, s->ip[0], leaf, sizeof(leaf));
+		count(flat, leaf);
+
+		if (callgraph) {
+			char chain[(256 + 4) * MAX_DEPTH];
+			strcpy(chain, leaf);
+			for (int j = 1; j < s->depth; ++j) {
+				char caller[256];
+				/* Return addresses point after the call; look up the call itself. */
+				describe(s, s->ip[j] - 1, caller, sizeof(caller));
+				strcat(chain, " <- ");
+				strcat(chain, caller);
+			}
+			count(chains, chain);
+		}
+	}
+
+	printf("# %lu samples (%lu kernel, %lu user), %lu lost\n", total, in_kernel, total - in_kernel, lost);
+	if (!total) return;
+	printf("# overhead  samples  symbol\n");
+
+	size_t flat_count, chain_count = 0;
+	struct entry * top = sorted(flat, &flat_count);
+	struct entry * paths = callgraph ? sorted(chains, &chain_count) : NULL;
+
+	for (size_t i = 0; i < flat_count && (int)i < limit; ++i) {
+		printf("  %7.2f%%  %7lu  %s\n", 100.0 * top[i].count / total, top[i].count, top[i].name);
+		if (!callgraph) continue;
+
+		size_t len = strlen(top[i].name);
+		int shown = 0;
+		for (size_t j = 0; j < chain_count && shown < 5; ++j) {
+			if (strncmp(paths[j].name, top[i].name, len)) continue;
+			if (paths[j].name[len] != '\0' && paths[j].name[len] != ' ') continue;
+			printf("             %7.2f%%  %s\n", 100.0 * paths[j].count / total, paths[j].name);
+			shown++;
+		}
+	}
+}
+
+#define DEFAULT_PATH "/bin:/usr/bin"
+static char * find_binary(const char * file) {
+	if (strchr(file, '/')) return strdup(file);
+
+	char * path = getenv("PATH");
+	char * xpath = strdup(path ? path : DEFAULT_PATH);
+	char * p, * last;
+	for (p = strtok_r(xpath, ":", &last); p; p = strtok_r(NULL, ":", &last)) {
+		char exe[1024];
+		struct stat st;
+		snprintf(exe, sizeof(exe), "%s/%s", p, file);
+		if (stat(exe, &st) || !(st.st_mode & 0111)) continue;
+		free(xpath);
+		return strdup(exe);
+	}
+	free(xpath);
+	return NULL;
+}
+
+static int usage(char * argv[]) {
+#define T_I "\033[3m"
+#define T_O "\033[0m"
+	fprintf(stderr, "usage: %s [-agku] [-n COUNT] command...\n"
+			"       %s -r [-gku] [-n COUNT] [-p PID]\n"
+			"\n"
+			"  -a         " T_I "Report every process, not just the command." T_O "\n"
+			"  -g         " T_I "Show the most common call chains under each function." T_O "\n"
+			"  -k         " T_I "Only count samples taken in the kernel." T_O "\n"
+			"  -u         " T_I "Only count samples taken in userspace." T_O "\n"
+			"  -n COUNT   " T_I "Show this many functions (default 25)." T_O "\n"
+			"  -p PID     " T_I "Only count samples from this process." T_O "\n"
+			"  -r         " T_I "Stop the profiler and report what it has recorded." T_O "\n"
+			"  -h         " T_I "Show this help text." T_O "\n",
+			argv[0], argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int all = 0, callgraph = 0, want_kernel = 1, want_user = 1, limit = 25, existing = 0;
+	pid_t only = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "+agkun:p:rh")) != -1) {
+		switch (opt) {
+			case 'a': all = 1; break;
+			case 'g': callgraph = 1; break;
+			case 'k': want_user = 0; want_kernel = 1; break;
+			case 'u': want_kernel = 0; want_user = 1; break;
+			case 'n': limit = atoi(optarg); break;
+			case 'p': only = atoi(optarg); break;
+			case 'r': existing = 1; break;
+			default: return usage(argv);
+		}
+	}
+
+	if (!existing && optind == argc) return usage(argv);
+
+	load_kernel_symbols();
+
+	if (existing) {
+		control("stop");
+		drain();
+		report(only, want_kernel, want_user, callgraph, limit);
+		return 0;
+	}
+
+	exe_path = find_binary(argv[optind]);
+	if (!exe_path) {
+		fprintf(stderr, "%s: %s: No such file or not an executable.\n", argv[0], argv[optind]);
+		return 1;
+	}
+	exe_name = strrchr(exe_path, '/') ? strrchr(exe_path, '/') + 1 : exe_path;
+
+	if (control("clear") < 0 || control("start") < 0) {
+		fprintf(stderr, "%s: /proc/profile: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+
+	child = fork();
+	if (!child) {
+		execv(exe_path, &argv[optind]);
+		fprintf(stderr, "%s: %s: %s\n", argv[0], exe_path, strerror(errno));
+		exit(127);
+	}
+
+	int status;
+	while (waitpid(child, &status, WNOHANG) == 0) {
+		load_maps(child);
+		drain();
+		usleep(POLL_INTERVAL);
+	}
+
+	control("stop");
+	drain();
+
+	report(all ? only : (only ? only : child), want_kernel, want_user, callgraph, limit);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -29,6 +29,9 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/futex.h>
+#include <sys/epoll.h>
+#include <sched.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
@@ -199,6 +202,21 @@ const char * syscall_names[] = {
 	[SYS_SETTLSBASE]   = "set_tls_base",
 	[SYS_INSMOD]       = "insmod",
 	[SYS_GETSID]       = "getsid",
+	[SYS_GETPRIORITY]  = "getpriority",
+	[SYS_SETPRIORITY]  = "setpriority",
+	[SYS_SCHED_GETSCHEDULER] = "sched_getscheduler",
+	[SYS_SCHED_SETSCHEDULER] = "sched_setscheduler",
+	[SYS_SCHED_GETPARAM]     = "sched_getparam",
+	[SYS_FUTEX]              = "futex",
+	[SYS_EPOLL_CREATE]       = "epoll_create",
+	[SYS_EPOLL_CTL]          = "epoll_ctl",
+	[SYS_EPOLL_WAIT]         = "epoll_wait",
+	[SYS_MPROTECT]           = "mprotect",
+	[SYS_MADVISE]            = "madvise",
+	[SYS_SCHED_SETAFFINITY]  = "sched_setaffinity",
+	[SYS_SCHED_GETAFFINITY]  = "sched_getaffinity",
+	[SYS_NANOSLEEP]          = "nanosleep",
+	[SYS_FADVISE]            = "fadvise",
 };
 
 char syscall_mask[] = {
@@ -303,6 +321,21 @@ char syscall_mask[] = {
 	[SYS_SETTLSBASE]   = 1,
 	[SYS_INSMOD]       = 1,
 	[SYS_GETSID]       = 1,
+	[SYS_GETPRIORITY]  = 1,
+	[SYS_SETPRIORITY]  = 1,
+	[SYS_SCHED_GETSCHEDULER] = 1,
+	[SYS_SCHED_SETSCHEDULER] = 1,
+	[SYS_SCHED_GETPARAM]     = 1,
+	[SYS_FUTEX]              = 1,
+	[SYS_EPOLL_CREATE]       = 1,
+	[SYS_EPOLL_CTL]          = 1,
+	[SYS_EPOLL_WAIT]         = 1,
+	[SYS_MPROTECT]           = 1,
+	[SYS_MADVISE]            = 1,
+	[SYS_SCHED_SETAFFINITY]  = 1,
+	[SYS_SCHED_GETAFFINITY]  = 1,
+	[SYS_NANOSLEEP]          = 1,
+	[SYS_FADVISE]            = 1,
 };
 
 static const int syscall_set_net[] = {
@@ -322,11 +355,12 @@ static const int syscall_set_desc[] = {
 	SYS_OPEN, SYS_READ, SYS_WRITE, SYS_CLOSE, SYS_STAT, SYS_FSWAIT,
 	SYS_FSWAIT2, SYS_FSWAIT3, SYS_SEEK, SYS_IOCTL, SYS_PIPE, SYS_PIPE2,
 	SYS_DUP2, SYS_READDIR, SYS_OPENPTY, SYS_PREAD, SYS_PWRITE, SYS_FCNTL,
-	SYS_FCHMOD, SYS_FCHOWN, SYS_FTRUNCATE, SYS_DUP3, SYS_INSMOD, -1
+	SYS_FCHMOD, SYS_FCHOWN, SYS_FTRUNCATE, SYS_DUP3, SYS_INSMOD,
+	SYS_EPOLL_CREATE, SYS_EPOLL_CTL, SYS_EPOLL_WAIT, SYS_FADVISE, -1
 };
 
 static const int syscall_set_memory[] = {
-	SYS_SBRK, SYS_MMAP, SYS_MUNMAP, -1
+	SYS_SBRK, SYS_MMAP, SYS_MUNMAP, SYS_MPROTECT, SYS_MADVISE, -1
 };
 
 static const int syscall_set_signal[] = {
@@ -1025,6 +1059,7 @@ static void mmap_flags_arg(int flags) {
 		H(MAP_PRIVATE);
 		H(MAP_FIXED);
 		H(MAP_ANONYMOUS);
+		H(MAP_POPULATE);
 		if (flags) fprintf(logfile,"%#x",flags);
 	}
 }
@@ -1233,6 +1268,30 @@ static void handle_syscall(struct Pid * child, pid_t pid, struct URegs * r) {
 			int_arg(uregs_syscall_arg3(r)); COMMA;
 			pointer_arg(uregs_syscall_arg4(r));
 			break;
+		case SYS_EPOLL_CREATE:
+			if (uregs_syscall_arg1(r) == EPOLL_CLOEXEC) {
+				fprintf(logfile, "EPOLL_CLOEXEC");
+			} else {
+				int_arg(uregs_syscall_arg1(r));
+			}
+			break;
+		case SYS_EPOLL_CTL:
+			fd_arg(pid, uregs_syscall_arg1(r)); COMMA;
+			switch (uregs_syscall_arg2(r)) {
+				C(EPOLL_CTL_ADD);
+				C(EPOLL_CTL_DEL);
+				C(EPOLL_CTL_MOD);
+				default: int_arg(uregs_syscall_arg2(r)); break;
+			} COMMA;
+			fd_arg(pid, uregs_syscall_arg3(r)); COMMA;
+			pointer_arg(uregs_syscall_arg4(r)); /* struct epoll_event */
+			break;
+		case SYS_EPOLL_WAIT:
+			fd_arg(pid, uregs_syscall_arg1(r)); COMMA;
+			pointer_arg(uregs_syscall_arg2(r)); COMMA; /* struct epoll_event array */
+			int_arg(uregs_syscall_arg3(r)); COMMA;
+			int_arg(uregs_syscall_arg4(r));
+			break;
 		case SYS_IOCTL:
 			fd_arg(pid, uregs_syscall_arg1(r)); COMMA;
 			int_arg(uregs_syscall_arg2(r)); COMMA;
@@ -1257,6 +1316,10 @@ static void handle_syscall(struct Pid * child, pid_t pid, struct URegs * r) {
 			uint_arg(uregs_syscall_arg1(r)); COMMA;
 			uint_arg(uregs_syscall_arg2(r));
 			break;
+		case SYS_NANOSLEEP:
+			pointer_arg(uregs_syscall_arg1(r)); COMMA; /* struct timespec */
+			pointer_arg(uregs_syscall_arg2(r));
+			break;
 		case SYS_PIPE:
 			/* Arg is a pointer */
 			break;
@@ -1415,6 +1478,37 @@ static void handle_syscall(struct Pid * child, pid_t pid, struct URegs * r) {
 			pointer_arg(uregs_syscall_arg1(r)); COMMA;
 			uint_arg(uregs_syscall_arg2(r));
 			break;
+		case SYS_MPROTECT:
+			pointer_arg(uregs_syscall_arg1(r)); COMMA;
+			uint_arg(uregs_syscall_arg2(r)); COMMA;
+			mmap_prot_arg(uregs_syscall_arg3(r));
+			break;
+		case SYS_MADVISE:
+			pointer_arg(uregs_syscall_arg1(r)); COMMA;
+			uint_arg(uregs_syscall_arg2(r)); COMMA;
+			switch (uregs_syscall_arg3(r)) {
+				C(MADV_NORMAL);
+				C(MADV_RANDOM);
+				C(MADV_SEQUENTIAL);
+				C(MADV_WILLNEED);
+				C(MADV_DONTNEED);
+				default: int_arg(uregs_syscall_arg3(r)); break;
+			}
+			break;
+		case SYS_FADVISE:
+			fd_arg(pid, uregs_syscall_arg1(r)); COMMA;
+			int_arg(uregs_syscall_arg2(r)); COMMA;
+			int_arg(uregs_syscall_arg3(r)); COMMA;
+			switch (uregs_syscall_arg4(r)) {
+				C(POSIX_FADV_NORMAL);
+				C(POSIX_FADV_RANDOM);
+				C(POSIX_FADV_SEQUENTIAL);
+				C(POSIX_FADV_WILLNEED);
+				C(POSIX_FADV_DONTNEED);
+				C(POSIX_FADV_NOREUSE);
+				default: int_arg(uregs_syscall_arg4(r)); break;
+			}
+			break;
 		case SYS_SETTLSBASE:
 			pointer_arg(uregs_syscall_arg1(r));
 			break;
@@ -1444,8 +1538,59 @@ static void handle_syscall(struct Pid * child, pid_t pid, struct URegs * r) {
 			break;
 		case SYS_GETPGID:
 		case SYS_GETSID:
+		case SYS_SCHED_GETSCHEDULER:
 			int_arg(uregs_syscall_arg1(r));
 			break;
+		case SYS_GETPRIORITY:
+		case SYS_SETPRIORITY:
+			switch (uregs_syscall_arg1(r)) {
+				C(PRIO_PROCESS);
+				C(PRIO_PGRP);
+				C(PRIO_USER);
+				default: int_arg(uregs_syscall_arg1(r)); break;
+			} COMMA;
+			int_arg(uregs_syscall_arg2(r));
+			if (uregs_syscall_num(r) == SYS_SETPRIORITY) {
+				COMMA;
+				int_arg(uregs_syscall_arg3(r));
+			}
+			break;
+		case SYS_SCHED_SETSCHEDULER:
+			int_arg(uregs_syscall_arg1(r)); COMMA;
+			switch (uregs_syscall_arg2(r)) {
+				C(SCHED_OTHER);
+				C(SCHED_FIFO);
+				C(SCHED_RR);
+				default: int_arg(uregs_syscall_arg2(r)); break;
+			} COMMA;
+			pointer_arg(uregs_syscall_arg3(r)); /* struct sched_param */
+			break;
+		case SYS_SCHED_GETPARAM:
+			int_arg(uregs_syscall_arg1(r)); COMMA;
+			pointer_arg(uregs_syscall_arg2(r)); /* struct sched_param */
+			break;
+		case SYS_SCHED_SETAFFINITY:
+		case SYS_SCHED_GETAFFINITY:
+			int_arg(uregs_syscall_arg1(r)); COMMA;
+			uint_arg(uregs_syscall_arg2(r)); COMMA;
+			pointer_arg(uregs_syscall_arg3(r)); /* cpu_set_t */
+			break;
+		case SYS_FUTEX:
+			pointer_arg(uregs_syscall_arg1(r)); COMMA;
+			switch (uregs_syscall_arg2(r)) {
+				C(FUTEX_WAIT);
+				C(FUTEX_WAKE);
+				C(FUTEX_REQUEUE);
+				default: int_arg(uregs_syscall_arg2(r)); break;
+			} COMMA;
+			uint_arg(uregs_syscall_arg3(r));
+			if (uregs_syscall_arg2(r) == FUTEX_REQUEUE) {
+				COMMA; uint_arg(uregs_syscall_arg4(r));
+				COMMA; pointer_arg(uregs_syscall_arg5(r));
+			} else if (uregs_syscall_arg2(r) == FUTEX_WAIT) {
+				COMMA; pointer_arg(uregs_syscall_arg4(r)); /* struct timespec */
+			}
+			break;
 		/* These have no arguments: */
 		case SYS_YIELD:
 		case SYS_FORK:
@@ -0,0 +1,87 @@
+/**
+ * @brief timerlat - measure how late sleeps wake up
+ *
+ * Sleeps for a fixed interval over and over and reports how far past
+ * the requested time each wakeup landed: the timer slack a program
+ * sleeping for short periods can expect.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+static const long buckets[] = { 10, 100, 1000, 10000, 100000 };
+#define BUCKETS (sizeof(buckets) / sizeof(*buckets))
+
+static uint64_t now_us(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-i INTERVAL] [-n COUNT]\n"
+		"\n"
+		"Sleep COUNT times for INTERVAL microseconds each and report\n"
+		"how late the wakeups were. Defaults are -i 1000 -n 1000.\n",
+		argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	long interval = 1000;
+	long count = 1000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:n:h")) != -1) {
+		switch (opt) {
+			case 'i':
+				interval = atol(optarg);
+				break;
+			case 'n':
+				count = atol(optarg);
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (interval < 0 || count <= 0) return usage(argv);
+
+	struct timespec req = { interval / 1000000, (interval % 1000000) * 1000 };
+	uint64_t min = UINT64_MAX, max = 0, total = 0;
+	unsigned long histogram[BUCKETS + 1] = {0};
+
+	for (long i = 0; i < count; ++i) {
+		uint64_t before = now_us();
+		nanosleep(&req, NULL);
+		uint64_t after = now_us();
+
+		uint64_t slept = after - before;
+		uint64_t late = slept > (uint64_t)interval ? slept - interval : 0;
+		if (late < min) min = late;
+		if (late > max) max = late;
+		total += late;
+
+		size_t b = 0;
+		while (b < BUCKETS && (long)late >= buckets[b]) b++;
+		histogram[b]++;
+	}
+
+	printf("%ld sleeps of %ld us\n", count, interval);
+	printf("late by: min %llu us, avg %llu us, max %llu us\n",
+		(unsigned long long)min, (unsigned long long)(total / count), (unsigned long long)max);
+	for (size_t b = 0; b <= BUCKETS; ++b) {
+		if (b < BUCKETS) printf("  < %6ld us: %lu\n", buckets[b], histogram[b]);
+		else printf("  >=%6ld us: %lu\n", buckets[BUCKETS-1], histogram[b]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+/**
+ * The clock page is a read-only page the kernel maps into every
+ * process so that the time can be read without a system call. Its
+ * address is passed to new programs as AT_CLOCKPAGE in the auxiliary
+ * vector.
+ *
+ * Time since the epoch, in microseconds, is
+ *
+ *     boot_time * 1000000 + counter * scale / mhz - basis
+ *
+ * where counter is the timestamp counter on x86-64 and CNTPCT_EL0
+ * on aarch64. The kernel makes @c seq odd while it is rewriting the
+ * page; readers should try again if it was odd or changed.
+ */
+#include <stdint.h>
+
+struct clock_page {
+	volatile uint32_t seq;
+	uint32_t scale;
+	uint64_t mhz;
+	uint64_t basis;
+	uint64_t boot_time;
+};
@@ -0,0 +1,16 @@
+#pragma once
+#include <_cheader.h>
+_Begin_C_Header
+
+#define SCHED_OTHER 0
+#define SCHED_FIFO  1
+#define SCHED_RR    2
+
+#define SCHED_PRIORITY_MIN 1
+#define SCHED_PRIORITY_MAX 99
+
+struct sched_param {
+	int sched_priority;
+};
+
+_End_C_Header
@@ -52,10 +52,18 @@ struct flock {
 #define FD_CLOEXEC (1 << 0)
 #define FD_CLOFORK (1 << 1)
 
+#define POSIX_FADV_NORMAL     0
+#define POSIX_FADV_RANDOM     1
+#define POSIX_FADV_SEQUENTIAL 2
+#define POSIX_FADV_WILLNEED   3
+#define POSIX_FADV_DONTNEED   4
+#define POSIX_FADV_NOREUSE    5
+
 #ifndef __kernel__
 extern int open (const char *, int, ...);
 extern int fcntl(int fd, int cmd, ...);
 extern int creat(const char *path, mode_t mode);
+extern int posix_fadvise(int fd, off_t offset, off_t len, int advice);
 #endif
 
 _End_C_Header
@@ -17,7 +17,8 @@ union PML {
 		uint64_t pxn:1;
 		uint64_t uxn:1;
 		uint64_t mmap_shared:1;
-		uint64_t avail:3;
+		uint64_t prot_none:1; /* not present, but still has its frame */
+		uint64_t avail:2;
 		uint64_t ignored:5;
 	} bits;
 
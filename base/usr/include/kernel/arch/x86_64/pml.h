@@ -14,7 +14,7 @@ union PML {
         uint64_t global:1;
         uint64_t cow_pending:1;
         uint64_t mmap_shared:1;
-        uint64_t _available2:1;
+        uint64_t prot_none:1; /* not present, but still has its frame */
         uint64_t page:28;
         uint64_t reserved:12;
         uint64_t _available3:11;
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+
+#define BLOCKCACHE_BLOCK 4096
+
+/**
+ * Driver callback moving @p count whole blocks, starting at block
+ * @p block, to or from @p buffer. Returns 0 or a negative errno.
+ */
+typedef int (*blockcache_io_t)(void * device, uint64_t block, size_t count, uint8_t * buffer);
+
+struct blockcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t writes;
+	uint64_t writebacks;
+	uint64_t direct;      /* blocks moved straight between the device and the caller */
+};
+
+struct blockcache_inflight;
+
+struct blockcache {
+	struct blockcache * next;
+	char name[32];
+	void * device;
+	blockcache_io_t read;
+	blockcache_io_t write;
+	size_t cached;        /* blocks in the cache, clean or dirty */
+	size_t dirty;         /* blocks waiting to be written back */
+	size_t writing;       /* blocks being written back right now */
+	struct blockcache_inflight * inflight; /* direct writes in progress */
+	struct blockcache_stats stats;
+};
+
+struct blockcache * blockcache_create(const char * name, void * device, blockcache_io_t read, blockcache_io_t write);
+ssize_t blockcache_read(struct blockcache * cache, off_t offset, size_t size, uint8_t * buffer);
+ssize_t blockcache_write(struct blockcache * cache, off_t offset, size_t size, const uint8_t * buffer);
+int blockcache_sync(struct blockcache * cache);
+int blockcache_ioctl(struct blockcache * cache, unsigned long request, void * argp);
+struct blockcache * blockcache_list(void);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/* Largest block the buddy allocator tracks is 2^BUDDY_MAX_ORDER frames. */
+#define BUDDY_MAX_ORDER 10
+
+#define BUDDY_NO_FRAME ((uintptr_t)-1)
+
+extern int buddy_ready;
+
+void buddy_init(uintptr_t base, size_t count);
+uintptr_t buddy_alloc_frame(void);
+void buddy_free_frame(uintptr_t frame);
+uintptr_t buddy_alloc_contiguous(size_t n);
+void buddy_reserve(uintptr_t frame);
+size_t buddy_free_count(void);
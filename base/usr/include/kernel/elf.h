@@ -355,11 +355,20 @@ typedef struct Elf64_Phdr {
 #define DT_INIT_ARRAYSZ 27
 #define DT_FINI_ARRAYSZ 28
 #define DT_RUNPATH      29
+#define DT_FLAGS        30
+#define DT_GNU_HASH     0x6FFFFEF5
+#define DT_FLAGS_1      0x6FFFFFFB
 #define DT_LOOS   0x60000000
 #define DT_HIOS   0x6FFFFFFF
 #define DT_LOPROC 0x70000000
 #define DT_HIPROC 0x7FFFFFFF
 
+/**
+ * DT_FLAGS / DT_FLAGS_1 values
+ */
+#define DF_BIND_NOW     0x08
+#define DF_1_NOW        0x01
+
 typedef struct Elf64_Dyn {
 	Elf64_Sxword d_tag;
 	union {
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+#include <sys/epoll.h>
+
+extern void epoll_install(void);
+extern fs_node_t * epoll_create_node(void);
+extern long epoll_ctl_node(fs_node_t * node, int op, int fd, fs_node_t * target, struct epoll_event * event);
+extern long epoll_wait_node(fs_node_t * node, struct epoll_event * events, int maxevents, int timeout);
+extern int epoll_is_watch(void * waiter);
+extern int epoll_alert_locked(void * waiter, void * value);
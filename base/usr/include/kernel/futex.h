@@ -0,0 +1,8 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <bits/timespec.h>
+
+extern long futex_wait(volatile uint32_t * uaddr, uint32_t val, const struct timespec * timeout);
+extern long futex_wake(volatile uint32_t * uaddr, int count);
+extern long futex_requeue(volatile uint32_t * uaddr, int count, int requeue, volatile uint32_t * uaddr2);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <kernel/types.h>
+
+#define LOCKSTAT_SITES 512
+
+/**
+ * Contention statistics for one spin_lock call site, identified
+ * by the name of the lock expression and the function taking it.
+ * Hold times are in arch_perf_timer units.
+ */
+struct lockstat {
+	const char * volatile func;
+	const char * volatile name;
+	uint64_t acquisitions;
+	uint64_t contended;
+	uint64_t spins;
+	uint64_t hold_total;
+	uint64_t hold_max;
+};
+
+extern struct lockstat lockstat_sites[LOCKSTAT_SITES];
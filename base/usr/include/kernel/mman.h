@@ -2,10 +2,15 @@
 
 #include <stdint.h>
 #include <kernel/types.h>
+#include <kernel/process.h>
 
 extern long mmap_sbrk(size_t size);
 extern long do_mmap(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * file, off_t offset);
 extern long mmap_unmap(uintptr_t addr, size_t length);
+extern long mmap_protect(uintptr_t addr, size_t length, int prot);
+extern long mmap_advise(uintptr_t addr, size_t length, int advice);
+extern memmap_t * mmap_find(page_directory_t * dir, uintptr_t addr);
+extern void mmap_clone_mappings(page_directory_t * to, page_directory_t * from);
 
 enum fault_code {
 	FAULT_CODE_FROM_KERNEL = 0x00000001,
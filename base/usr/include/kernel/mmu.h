@@ -32,7 +32,7 @@ void mmu_frame_release(uintptr_t frame_addr);
 int mmu_frame_test(uintptr_t frame_addr);
 uintptr_t mmu_first_n_frames(int n);
 uintptr_t mmu_first_frame(void);
-void mmu_frame_allocate(union PML * page, unsigned int flags);
+int mmu_frame_allocate(union PML * page, unsigned int flags);
 void mmu_frame_map_address(union PML * page, unsigned int flags, uintptr_t physAddr);
 void mmu_frame_free(union PML * page);
 uintptr_t mmu_map_to_physical(union PML * root, uintptr_t virtAddr);
@@ -45,6 +45,8 @@ void mmu_invalidate(uintptr_t addr);
 void mmu_flush(char*);
 uintptr_t mmu_allocate_a_frame(void);
 uintptr_t mmu_allocate_n_frames(int n);
+uintptr_t mmu_allocate_a_frame_or_panic(void);
+uintptr_t mmu_allocate_n_frames_or_panic(int n);
 union PML * mmu_get_kernel_directory(void);
 void * mmu_map_from_physical(uintptr_t frameaddress);
 void * mmu_map_mmio_region(uintptr_t physical_address, size_t size);
@@ -58,3 +60,7 @@ void * sbrk(size_t);
 
 union PML * mmu_get_page_other(union PML * root, uintptr_t virtAddr);
 int mmu_validate_user_pointer(const void * addr, size_t size, int flags);
+
+void mmu_unmap_user(uintptr_t addr, size_t size);
+void mmu_protect_user(uintptr_t addr, size_t size, int prot, int shared);
+int mmu_map_user_huge(union PML * root, uintptr_t virtAddr, uintptr_t physAddr, int flags);
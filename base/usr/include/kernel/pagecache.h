@@ -0,0 +1,15 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+
+ssize_t pagecache_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer);
+void pagecache_write(fs_node_t * node, off_t offset, size_t size, const uint8_t * buffer);
+void pagecache_truncate(fs_node_t * node, size_t size);
+void pagecache_readahead(fs_node_t * node, off_t offset, size_t size);
+void pagecache_evict(fs_node_t * node, off_t offset, size_t size);
+int pagecache_fault_map(fs_node_t * node, union PML * page, off_t offset, int fault_flags, int map_flags, int prot, int * mmu_flags);
+void pagecache_frame_ref(uintptr_t frame);
+void pagecache_frame_unref(uintptr_t frame);
+size_t pagecache_reclaim(size_t count);
+size_t pagecache_size(void);
@@ -21,6 +21,7 @@
 
 
 #define PROC_REUSE_FDS 0x0001
+#define TLB_SHOOTDOWN_SLOTS 16
 #define KERNEL_STACK_SIZE 0x9000
 #define USER_ROOT_UID 0
 
@@ -28,7 +29,9 @@ typedef struct {
 	intptr_t refcount;
 	union PML * directory;
 	spin_lock_t lock;
-	struct memmap * mappings;
+	struct memmap * mappings; /* sorted by address */
+	struct memmap * map_tree; /* the same mappings, for lookups; see mmap_find */
+	volatile uint32_t cpu_mask; /* cores that currently have this directory loaded */
 } page_directory_t;
 
 typedef struct {
@@ -102,6 +105,22 @@ struct signal_config {
 
 #define PROC_FLAG_RESTORE_SIGMASK    0x100
 
+/**
+ * @brief Timed sleep or fswait timeout.
+ *
+ * Every process carries one of these, as it can only be in one
+ * timed wait at a time. While armed, it sits in the timer heap
+ * of the core that armed it.
+ */
+typedef struct sleeper {
+	uint64_t end_tick;
+	uint64_t end_subtick;
+	struct process * process;
+	int is_fswait;       /* 1 for fswait timeouts, -1 once a plain timed sleep has expired */
+	int core;          /* cpu_id+1 of the core whose heap holds this timer, or 0 if not armed */
+	size_t heap_index; /* position in that heap */
+} sleeper_t;
+
 typedef struct process {
 	pid_t id;    /* PID */
 	pid_t tgid; /* thread group */
@@ -133,8 +152,7 @@ typedef struct process {
 
 	node_t sched_node;
 	node_t sleep_node;
-	node_t * timed_sleep_node;
-	node_t * timeout_node;
+	sleeper_t timer;
 
 	struct timeval start;
 	int awoken_index;
@@ -179,21 +197,29 @@ typedef struct process {
 	struct pty * pty;
 
 	struct process * process;
+
+	volatile int sched_queued; /* set while sched_node is in (or moving between) core ready queues */
+
+	/* Scheduling class */
+	int sched_policy;   /* SCHED_OTHER, SCHED_FIFO, or SCHED_RR */
+	int sched_priority; /* static priority for the realtime classes, 1 through 99 */
+	int nice;           /* weight for SCHED_OTHER, -20 (heaviest) through 19 */
+	uint64_t vruntime;  /* weighted perf timer time consumed under SCHED_OTHER */
+	int sched_cpu;      /* core whose min_vruntime vruntime is relative to; owner is where it last ran */
+	uint64_t cpu_mask;  /* cores this may run on, one bit per cpu_id; 0 for any */
+
+	/* Page faults that were handled, counted on the main thread */
+	size_t faults_minor; /* without reading from a file */
+	size_t faults_major; /* that read a page from a file */
 } process_t;
 
 _Static_assert((__builtin_offsetof(process_t,flags) == 20), "flags is not at expected offset for assembly");
 
-typedef struct {
-	uint64_t end_tick;
-	uint64_t end_subtick;
-	process_t * process;
-	int is_fswait;
-} sleeper_t;
-
 typedef struct memmap {
 	page_directory_t * owner;
 	int flags;
 	int prot;
+	int advice; /* MADV_ hint from madvise() */
 
 	uintptr_t base;
 	intptr_t  length;
@@ -202,6 +228,10 @@ typedef struct memmap {
 
 	struct memmap * prev;
 	struct memmap * next;
+
+	struct memmap * left;
+	struct memmap * right;
+	int height;
 } memmap_t;
 
 struct ProcessorLocal {
@@ -252,6 +282,54 @@ struct ProcessorLocal {
 	uintptr_t sp_el1;
 	uint64_t  midr;
 #endif
+
+	/**
+	 * @brief Core-local scheduler ready queues.
+	 *
+	 * Processes made ready are placed on the queues of the core they
+	 * last ran on. Realtime processes always run before anything in
+	 * the weighted-fair queue. Cores that run dry, or that find
+	 * themselves much less loaded than a neighbor during periodic
+	 * balancing, steal from the busiest core. Access to these must go through
+	 * processor_local_data[] rather than this_core, as they are
+	 * passed by pointer to the list functions.
+	 */
+	list_t ready_queue;  /* SCHED_OTHER processes, ordered by vruntime */
+	list_t rt_queue;     /* SCHED_FIFO and SCHED_RR processes, ordered by priority */
+	spin_lock_t ready_lock;
+	uint64_t min_vruntime;        /* vruntime of the last SCHED_OTHER process dispatched here */
+	uint64_t sched_last_balance;  /* perf timer stamp of the last periodic balance */
+	unsigned long sched_enqueued; /* processes placed on this core's queue */
+	unsigned long sched_steals;   /* processes this core pulled from other queues */
+	unsigned long sched_stolen;   /* processes other cores pulled from this queue */
+
+	/**
+	 * @brief Core-local timer base.
+	 *
+	 * Binary min-heap of the sleepers armed on this core, ordered
+	 * by expiry, which this core's timer interrupt expires. @c timer_next
+	 * holds the earliest expiry so the interrupt can check it without
+	 * locking. The timer is one-shot; @c timer_deadline is when it was
+	 * last set to fire, in the same units.
+	 */
+	sleeper_t ** timer_heap;
+	size_t timer_count;
+	size_t timer_capacity;
+	volatile uint64_t timer_next;
+	uint64_t timer_deadline;
+	spin_lock_t timer_lock;
+
+	/**
+	 * @brief TLB shootdown mailbox.
+	 *
+	 * Other cores leave pages they need this core to invalidate in
+	 * @c tlb_pending and send an IPI only if one isn't already on its
+	 * way. If the slots fill up, @c tlb_flush_all asks for a full flush.
+	 */
+	page_directory_t * current_directory;
+	volatile uintptr_t tlb_pending[TLB_SHOOTDOWN_SLOTS];
+	volatile int tlb_flush_all;
+	volatile int tlb_ipi_pending;
 };
 
 extern struct ProcessorLocal processor_local_data[];
@@ -278,13 +356,20 @@ extern void process_delete(process_t * proc);
 extern void make_process_ready(volatile process_t * proc);
 extern volatile process_t * next_ready_process(void);
 extern int wakeup_queue(list_t * queue);
+extern int wakeup_queue_one(list_t * queue);
 extern int wakeup_queue_interrupted(list_t * queue);
 extern int sleep_on(list_t * queue);
 extern int sleep_on_unlocking(list_t * queue, spin_lock_t * release);
+extern int sleep_on_unlocking_timeout(list_t * queue, spin_lock_t * release, unsigned long seconds, unsigned long subseconds);
 extern int process_alert_node(process_t * process, void * value);
+extern int process_alert_node_locked(process_t * process, void * value);
+extern void process_node_wait(void * waiter, void * value);
 extern void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds);
 extern void switch_task(uint8_t reschedule);
+extern void switch_task_preempt(void);
+extern void sched_program_timer(int expired);
 extern int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout);
+extern int process_sleep_on_nodes(process_t * process, fs_node_t * nodes[], int timeout);
 extern process_t * process_get_parent(process_t * process);
 extern int process_is_ready(process_t * proc);
 extern void wakeup_sleepers(unsigned long seconds, unsigned long subseconds);
@@ -293,7 +378,10 @@ extern __attribute__((noreturn)) void switch_next(void);
 extern int process_awaken_from_fswait(process_t * process, int index);
 extern void process_awaken_signal(process_t * process);
 extern void process_release_directory(page_directory_t * dir);
+extern void process_set_directory(page_directory_t * dir);
 extern process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * name, void * argp);
+extern int sched_set_affinity(volatile process_t * proc, uint64_t mask);
+extern uint64_t sched_get_affinity(volatile process_t * proc);
 extern pid_t fork(void);
 extern pid_t clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg);
 extern int waitpid(int pid, int * status, int options);
@@ -309,8 +397,6 @@ extern size_t process_get_tty(process_t * proc, size_t len, char * out);
 
 extern tree_t * process_tree;  /* Parent->Children tree */
 extern list_t * process_list;  /* Flat storage */
-extern list_t * process_queue; /* Ready queue */
-extern list_t * sleep_queue;
 
 extern void arch_enter_tasklet(void);
 extern __attribute__((noreturn)) void arch_resume_user(void);
@@ -3,12 +3,14 @@
 #include <kernel/vfs.h>
 
 typedef void (*procfs_populate_t)(fs_node_t * node);
+typedef ssize_t (*procfs_write_t)(fs_node_t * node, const char * buf, size_t size);
 
 struct procfs_entry {
 	intptr_t     id;
 	const char *       name;
 	procfs_populate_t func;
 	int flags;
+	procfs_write_t write;
 };
 
 typedef struct procfs_entry_node {
@@ -17,6 +19,7 @@ typedef struct procfs_entry_node {
 	size_t avail;
 	size_t used;
 	procfs_populate_t func;
+	procfs_write_t write;
 	list_t * files;
 } procfs_entry_t;
 
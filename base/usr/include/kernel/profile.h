@@ -0,0 +1,44 @@
+#pragma once
+
+#include <kernel/types.h>
+
+#define PROFILE_CPUS     32
+#define PROFILE_SAMPLES  4096 /* per core */
+#define PROFILE_DEPTH    8
+#define PROFILE_INTERVAL 1000 /* microseconds */
+
+/**
+ * One timer interrupt's worth of profile. @c ip[0] is where the core
+ * was interrupted and the rest are return addresses found by walking
+ * frame pointers, innermost first.
+ */
+struct profile_sample {
+	pid_t pid;
+	pid_t tid;
+	uint16_t user;
+	uint16_t depth;
+	uintptr_t ip[PROFILE_DEPTH];
+};
+
+/**
+ * Samples are only ever written by the core that owns the ring, from
+ * its timer interrupt. @c head counts every sample ever written and
+ * @c tail every sample read back out, so the ring holds the last
+ * PROFILE_SAMPLES of them and anything older is counted in @c lost.
+ */
+struct profile_ring {
+	struct profile_sample * samples;
+	volatile uint64_t head;
+	uint64_t tail;
+	uint64_t lost;
+};
+
+extern volatile int profile_running;
+extern struct profile_ring profile_rings[PROFILE_CPUS];
+
+extern void profile_sample(uintptr_t ip, uintptr_t bp, int user);
+extern int profile_start(void);
+extern void profile_stop(void);
+extern void profile_clear(void);
+extern int profile_next(int cpu, struct profile_sample * out);
+extern uint64_t profile_lost(int cpu);
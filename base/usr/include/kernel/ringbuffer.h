@@ -15,8 +15,10 @@ typedef struct {
 	list_t * wait_queue_writers;
 	int internal_stop;
 	list_t * alert_waiters;
+	list_t * alert_writers; /* waiting for room, not data */
 	int discard;
 	int soft_stop;
+	int frame;    /* buffer is a whole frame, not from the heap */
 } ring_buffer_t;
 
 size_t ring_buffer_unread(ring_buffer_t * ring_buffer);
@@ -30,6 +32,8 @@ void ring_buffer_destroy(ring_buffer_t * ring_buffer);
 void ring_buffer_interrupt(ring_buffer_t * ring_buffer);
 void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer);
 void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process);
+void ring_buffer_alert_writers(ring_buffer_t * ring_buffer);
+void ring_buffer_select_wait_write(ring_buffer_t * ring_buffer, void * process);
 void ring_buffer_eof(ring_buffer_t * ring_buffer);
 void ring_buffer_discard(ring_buffer_t * ring_buffer);
 
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <kernel/spinlock.h>
+
+#define KMEM_CPUS        32
+#define KMEM_CPU_OBJECTS 32
+#define KMEM_CPU_BATCH   16
+
+/* Objects must leave room for at least one per page after the slab header. */
+#define KMEM_SLAB_HEADER 64
+#define KMEM_MAX_OBJECT  (0x1000 - KMEM_SLAB_HEADER)
+
+/**
+ * Free objects held by one core, so allocations and frees
+ * on that core don't have to touch the cache's lock.
+ */
+struct kmem_cpu_cache {
+	spin_lock_t lock;
+	int count;
+	uint64_t allocs;
+	uint64_t frees;
+	void * objects[KMEM_CPU_OBJECTS];
+};
+
+/**
+ * An object cache: one-page slabs of fixed-size objects,
+ * fronted by per-core caches of free objects.
+ */
+typedef struct kmem_cache {
+	const char * name;
+	size_t object_size;  /* as requested */
+	size_t size;         /* with alignment padding */
+	size_t per_slab;
+	spin_lock_t lock;
+	struct kmem_slab * partial;  /* slabs with free objects */
+	size_t slabs;
+	size_t free;         /* free objects in slabs, not counting core caches */
+	size_t empty;        /* slabs with no objects in use */
+	struct kmem_cache * next;
+	struct kmem_cpu_cache cpu[KMEM_CPUS];
+} kmem_cache_t;
+
+extern kmem_cache_t * kmem_cache_create(const char * name, size_t size, size_t align);
+extern void kmem_cache_init(kmem_cache_t * cache, const char * name, size_t size, size_t align);
+extern void * kmem_cache_alloc(kmem_cache_t * cache);
+extern void kmem_cache_free(kmem_cache_t * cache, void * obj);
+
+extern kmem_cache_t * kmem_cache_of(void * obj);
+extern kmem_cache_t * kmem_cache_list(void);
+extern size_t kmem_cache_pages(void);
+extern void kmalloc_heap_info(size_t * blocks, size_t * free_blocks, size_t * free_bytes, size_t * largest);
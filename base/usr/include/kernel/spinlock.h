@@ -4,21 +4,56 @@
 #include <kernel/misc.h>
 #include <kernel/printf.h>
 
+struct lockstat;
+
+/**
+ * Ticket lock: acquirers take a ticket from @c next and wait until
+ * @c serving reaches it, so cores get the lock in the order they asked.
+ */
 typedef volatile struct {
-    volatile int latch[1];
+    volatile uint32_t next;
+    volatile uint32_t serving;
     int owner;
     const char * func;
+    struct lockstat * stat; /* lockstat site of the current holder, if enabled */
+    uint64_t acquired;      /* when the current holder took the lock, if stat is set */
 } spin_lock_t;
-#define spin_init(lock) do { (lock).owner = 0; (lock).latch[0] = 0; (lock).func = NULL; } while (0)
+#define spin_init(lock) do { (lock).owner = 0; (lock).next = 0; (lock).serving = 0; (lock).func = NULL; (lock).stat = NULL; } while (0)
 
 #ifdef __aarch64__
-extern void arch_spin_lock_acquire(const char * name, spin_lock_t * lock, const char * func);
+extern unsigned long arch_spin_lock_acquire(spin_lock_t * lock);
 extern void arch_spin_lock_release(spin_lock_t * lock);
-#define spin_lock(lock) arch_spin_lock_acquire(#lock, &lock, __func__)
-#define spin_unlock(lock) arch_spin_lock_release(&lock)
 #else
-#define spin_lock(lock) do { while (__sync_lock_test_and_set((lock).latch, 0x01)); (lock).owner = this_core->cpu_id+1; (lock).func = __func__; } while (0)
-#define spin_unlock(lock) do { (lock).func = NULL; (lock).owner = -1; __sync_lock_release((lock).latch); } while (0)
+/**
+ * @returns the number of times we had to spin, for lockstat
+ */
+static inline unsigned long arch_spin_lock_acquire(spin_lock_t * lock) {
+	unsigned long spins = 0;
+	uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	while (__atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE) != ticket) {
+		asm volatile ("pause" ::: "memory");
+		spins++;
+	}
+	return spins;
+}
+
+static inline void arch_spin_lock_release(spin_lock_t * lock) {
+	__atomic_store_n(&lock->serving, lock->serving + 1, __ATOMIC_RELEASE);
+}
 #endif
 
+extern int lockstat_enabled;
+extern void lockstat_acquire(spin_lock_t * lock, const char * name, const char * func, unsigned long spins);
+extern void lockstat_release(spin_lock_t * lock);
+
+#define spin_lock(lock) do { \
+	unsigned long __spins = arch_spin_lock_acquire(&(lock)); \
+	(lock).owner = this_core->cpu_id+1; (lock).func = __func__; \
+	if (__builtin_expect(lockstat_enabled, 0)) lockstat_acquire(&(lock), #lock, __func__, __spins); \
+} while (0)
+#define spin_unlock(lock) do { \
+	if (__builtin_expect((lock).stat != NULL, 0)) lockstat_release(&(lock)); \
+	(lock).func = NULL; (lock).owner = -1; arch_spin_lock_release(&(lock)); \
+} while (0)
+
 #include <kernel/process.h>
@@ -5,3 +5,6 @@
 extern void relative_time(unsigned long, unsigned long, unsigned long *, unsigned long *);
 extern uint64_t now(void);
 extern uint64_t arch_perf_timer(void);
+extern void arch_timer_oneshot(uint64_t deadline);
+extern void clock_page_update(uint32_t scale, uint64_t mhz, uint64_t basis, uint64_t boot_time);
+extern uintptr_t clock_page_map(void);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Kernel event trace, read back through /proc/trace as a
+ * struct trace_header followed by @c count struct trace_event
+ * records, oldest first within each core.
+ */
+#define TRACE_MAGIC  0x45435254 /* "TRCE" */
+
+enum trace_type {
+	TRACE_NONE,
+	TRACE_SWITCH,              /* a: previous thread, b: next thread */
+	TRACE_WAKEUP,              /* a: woken thread, b: core it was queued on */
+	TRACE_SYSCALL_ENTER,       /* a: system call number, b: first argument */
+	TRACE_SYSCALL_EXIT,        /* a: system call number, b: return value */
+	TRACE_FAULT_ENTER,         /* a: faulting address, b: fault flags */
+	TRACE_FAULT_EXIT,          /* a: faulting address, b: response */
+	TRACE_BLOCK_READ_BEGIN,    /* a: first sector, b: sector count */
+	TRACE_BLOCK_READ_END,      /* a: first sector, b: sector count */
+	TRACE_BLOCK_WRITE_BEGIN,   /* a: first sector, b: sector count */
+	TRACE_BLOCK_WRITE_END,     /* a: first sector, b: sector count */
+	TRACE_NET_RX,              /* a: frame length, b: ethertype */
+	TRACE_NET_TX,              /* a: frame length, b: ethertype */
+};
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t event_size;
+	uint64_t mhz;   /* timestamp ticks per microsecond */
+	uint64_t count;
+	uint64_t lost;  /* overwritten before they were read */
+};
+
+struct trace_event {
+	uint64_t time;  /* arch_perf_timer() */
+	uint32_t seq;
+	uint16_t type;
+	uint16_t cpu;
+	int32_t  pid;
+	int32_t  tid;
+	uint64_t a;
+	uint64_t b;
+};
+
+#ifdef _KERNEL_
+#define TRACE_CPUS   32
+#define TRACE_EVENTS 8192 /* per core */
+
+extern volatile int trace_enabled;
+extern void trace_record(int type, uint64_t a, uint64_t b);
+
+/**
+ * Tracepoints cost a load and a predicted branch while tracing is off.
+ */
+#define TRACE(type, a, b) do { \
+	if (__builtin_expect(trace_enabled, 0)) trace_record((type), (uint64_t)(a), (uint64_t)(b)); \
+} while (0)
+
+extern int trace_start(void);
+extern void trace_stop(void);
+extern void trace_clear(void);
+extern void trace_bounds(int cpu, uint64_t * start, uint64_t * end, uint64_t * lost);
+extern int trace_copy(int cpu, uint64_t index, struct trace_event * out);
+#endif
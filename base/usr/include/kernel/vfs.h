@@ -22,6 +22,8 @@
 #define FS_SYMLINK     0x20
 #define FS_MOUNTPOINT  0x40
 #define FS_SOCKET      0x80
+#define FS_CACHED      0x100 /* Contents may be kept in the page cache */
+#define FS_CONTIGUOUS  0x200 /* fault_map hands out physically contiguous memory */
 
 #define _IFMT       0170000 /* type of file */
 #define     _IFDIR  0040000 /* directory */
@@ -50,11 +52,20 @@ typedef int (*symlink_type_t) (struct fs_node *, const char * name, const char *
 typedef ssize_t (*readlink_type_t) (struct fs_node *, char * buf, size_t size);
 typedef int (*selectcheck_type_t) (struct fs_node *);
 typedef int (*selectwait_type_t) (struct fs_node *, void * process);
+typedef int (*pollcheck_type_t) (struct fs_node *);
 typedef int (*chown_type_t) (struct fs_node *, uid_t, gid_t);
 typedef int (*truncate_type_t) (struct fs_node *, size_t size);
 typedef int (*rename_type_t) (struct fs_node *, struct fs_node *, const char *, struct fs_node *, const char *);
 typedef int (*fault_map_t) (struct fs_node *, union PML *, off_t offset, int fault_flags, int map_flags, int prot, int *mmu_flags);
 
+/* How an open file is being read, for readahead in the page cache */
+struct fs_readahead {
+	uint64_t next;     /* page just past where the last read ended */
+	uint64_t ahead;    /* pages before this have already been asked for */
+	uint32_t window;   /* pages to stay ahead of the reader; 0 while reads look random */
+	int advice;        /* POSIX_FADV_ hint from posix_fadvise() */
+};
+
 typedef struct fs_node {
 	struct fs_node * mount;      /* Root fs_node_t entry of mountpoint. */
 	char name[256];         /* The filename. */
@@ -94,9 +105,12 @@ typedef struct fs_node {
 	truncate_type_t truncate;
 	selectcheck_type_t selectcheck;
 	selectwait_type_t selectwait;
+	pollcheck_type_t pollcheck;
 	chown_type_t chown;
 	rename_type_t rename;
 	fault_map_t fault_map;
+
+	struct fs_readahead readahead;
 } fs_node_t;
 
 struct vfs_entry {
@@ -116,6 +130,7 @@ ssize_t read_fs(fs_node_t *node,  off_t offset, size_t size, uint8_t *buffer);
 ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
 void open_fs(fs_node_t *node, unsigned int flags);
 void close_fs(fs_node_t *node);
+void close_fs_nested(fs_node_t *node);
 int readdir_fs(fs_node_t *node, unsigned long index, struct dirent *dent);
 fs_node_t *finddir_fs(fs_node_t *node, const char *name);
 int mkdir_fs(const char *name, mode_t permission, fs_node_t **out);
@@ -124,6 +139,7 @@ fs_node_t *kopen(const char *filename, unsigned int flags);
 fs_node_t *kopen_error(const char *filename, unsigned int flags, int *error);
 char *canonicalize_path(const char *cwd, const char *input);
 fs_node_t *clone_fs(fs_node_t * source);
+fs_node_t *vfs_node_alloc(void);
 int ioctl_fs(fs_node_t *node, unsigned long request, void * argp);
 int chmod_fs(fs_node_t *node, mode_t mode);
 int chown_fs(fs_node_t *node, uid_t uid, gid_t gid);
@@ -132,6 +148,7 @@ int symlink_fs(const char * value, const char * name);
 ssize_t readlink_fs(fs_node_t * node, char * buf, size_t size);
 int selectcheck_fs(fs_node_t * node);
 int selectwait_fs(fs_node_t * node, void * process);
+int pollcheck_fs(fs_node_t * node);
 int truncate_fs(fs_node_t * node, size_t size);
 
 void vfs_install(void);
@@ -12,4 +12,20 @@ extern void *valloc(size_t size);
 
 extern size_t malloc_usable_size(void *ptr);
 
+struct mallinfo {
+	int arena;    /* Bytes in small and medium segments */
+	int ordblks;  /* Free medium chunks */
+	int smblks;   /* Free small cells */
+	int hblks;    /* Large allocations, each its own mapping */
+	int hblkhd;   /* Bytes in large allocations */
+	int usmblks;  /* Most bytes ever mapped at once */
+	int fsmblks;  /* Bytes in free small cells */
+	int uordblks; /* Bytes allocated */
+	int fordblks; /* Bytes free */
+	int keepcost; /* Unused */
+};
+
+extern struct mallinfo mallinfo(void);
+extern void malloc_stats(void);
+
 _End_C_Header
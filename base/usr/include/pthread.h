@@ -2,17 +2,14 @@
 
 #include <_cheader.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <bits/timespec.h>
 
 _Begin_C_Header
 
 typedef struct __pthread * pthread_t;
 typedef unsigned int pthread_attr_t;
 
-typedef struct {
-	int volatile atomic_lock;
-	int volatile readers;
-	int writerPid;
-} pthread_rwlock_t;
 
 extern int pthread_create(pthread_t * thread, pthread_attr_t * attr, void *(*start_routine)(void *), void * arg);
 extern void pthread_exit(void * value);
@@ -23,12 +20,37 @@ extern int pthread_detach(pthread_t thread);
 extern void pthread_cleanup_push(void (*routine)(void *), void *arg);
 extern void pthread_cleanup_pop(int execute);
 
+/* 0 is unlocked, 1 is locked, 2 is locked with sleeping waiters */
 typedef int volatile pthread_mutex_t;
 typedef int pthread_mutexattr_t;
 
+typedef struct {
+	volatile uint32_t seq;
+	pthread_mutex_t * mutex;
+} pthread_cond_t;
+typedef int pthread_condattr_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	int volatile readers; /* -1 when held by a writer */
+	int writerPid;
+	volatile uint32_t seq;
+} pthread_rwlock_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned int count;
+	unsigned int waiting;
+	volatile uint32_t generation;
+} pthread_barrier_t;
+typedef int pthread_barrierattr_t;
+
 extern int pthread_join(pthread_t thread, void **retval);
 
 #define PTHREAD_MUTEX_INITIALIZER 0
+#define PTHREAD_COND_INITIALIZER {0,0}
+#define PTHREAD_RWLOCK_INITIALIZER {0,0,0,0}
+#define PTHREAD_BARRIER_SERIAL_THREAD -1
 
 extern int pthread_mutex_lock(pthread_mutex_t *mutex);
 extern int pthread_mutex_trylock(pthread_mutex_t *mutex);
@@ -43,6 +65,19 @@ extern int pthread_rwlock_init(pthread_rwlock_t * lock, void * args);
 extern int pthread_rwlock_wrlock(pthread_rwlock_t * lock);
 extern int pthread_rwlock_rdlock(pthread_rwlock_t * lock);
 extern int pthread_rwlock_unlock(pthread_rwlock_t * lock);
+extern int pthread_rwlock_tryrdlock(pthread_rwlock_t * lock);
+extern int pthread_rwlock_trywrlock(pthread_rwlock_t * lock);
 extern int pthread_rwlock_destroy(pthread_rwlock_t * lock);
 
+extern int pthread_cond_init(pthread_cond_t * cond, const pthread_condattr_t * attr);
+extern int pthread_cond_destroy(pthread_cond_t * cond);
+extern int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex);
+extern int pthread_cond_timedwait(pthread_cond_t * cond, pthread_mutex_t * mutex, const struct timespec * abstime);
+extern int pthread_cond_signal(pthread_cond_t * cond);
+extern int pthread_cond_broadcast(pthread_cond_t * cond);
+
+extern int pthread_barrier_init(pthread_barrier_t * barrier, const pthread_barrierattr_t * attr, unsigned int count);
+extern int pthread_barrier_destroy(pthread_barrier_t * barrier);
+extern int pthread_barrier_wait(pthread_barrier_t * barrier);
+
 _End_C_Header
@@ -1,9 +1,32 @@
 #pragma once
 
 #include <_cheader.h>
+#include <sys/types.h>
+#include <bits/sched.h>
 
 _Begin_C_Header
+
+#define CPU_SETSIZE 64
+
+typedef struct {
+	unsigned long __bits;
+} cpu_set_t;
+
+#define CPU_ZERO(set)       ((set)->__bits = 0)
+#define CPU_SET(cpu,set)    ((cpu) < CPU_SETSIZE ? ((set)->__bits |= (1UL << (cpu))) : 0)
+#define CPU_CLR(cpu,set)    ((cpu) < CPU_SETSIZE ? ((set)->__bits &= ~(1UL << (cpu))) : 0)
+#define CPU_ISSET(cpu,set)  ((cpu) < CPU_SETSIZE ? !!((set)->__bits & (1UL << (cpu))) : 0)
+#define CPU_COUNT(set)      __builtin_popcountl((set)->__bits)
+
 extern int sched_yield(void);
+extern int sched_setscheduler(pid_t pid, int policy, const struct sched_param * param);
+extern int sched_getscheduler(pid_t pid);
+extern int sched_setparam(pid_t pid, const struct sched_param * param);
+extern int sched_getparam(pid_t pid, struct sched_param * param);
+extern int sched_get_priority_min(int policy);
+extern int sched_get_priority_max(int policy);
+extern int sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t * mask);
+extern int sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t * mask);
 
 #if defined(_TOARU_SOURCE)
 #include <stdint.h>
@@ -21,6 +21,7 @@
 #define AT_FPUCW     18
 #define AT_SECURE    23
 #define AT_RANDOM    25
+#define AT_CLOCKPAGE 29 /* Read-only clock page, see bits/clockpage.h */
 #define AT_EXECFN    31
 
 #ifndef __kernel__
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define EPOLLIN   0x001
+#define EPOLLOUT  0x004
+#define EPOLLERR  0x008
+#define EPOLLHUP  0x010
+#define EPOLLET   (1U << 31)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLL_CLOEXEC 0x10000 /* same as O_CLOEXEC */
+
+typedef union epoll_data {
+	void * ptr;
+	int fd;
+	uint32_t u32;
+	uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+	uint32_t events;
+	epoll_data_t data;
+};
+
+#ifndef __kernel__
+
+extern int epoll_create(int size);
+extern int epoll_create1(int flags);
+extern int epoll_ctl(int epfd, int op, int fd, struct epoll_event * event);
+extern int epoll_wait(int epfd, struct epoll_event * events, int maxevents, int timeout);
+
+#endif
+
+_End_C_Header
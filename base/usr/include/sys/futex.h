@@ -0,0 +1,23 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+#include <time.h>
+
+_Begin_C_Header
+
+#define FUTEX_WAIT    0
+#define FUTEX_WAKE    1
+#define FUTEX_REQUEUE 3
+
+#ifndef __kernel__
+
+/**
+ * For FUTEX_REQUEUE, @p timeout is reinterpreted as the maximum
+ * number of waiters to move to @p uaddr2.
+ */
+extern int futex(volatile uint32_t * uaddr, int op, uint32_t val, const struct timespec * timeout, volatile uint32_t * uaddr2);
+
+#endif
+
+_End_C_Header
@@ -7,6 +7,8 @@
 #define IOCTLTTYLOGIN 0x4F02
 #define IOCTLSYNC     0x4F03
 
+#define IOCTLBLOCKSTATS 0x2A01234UL
+
 #define IOCTL_PACKETFS_QUEUED 0x5050
 
 #define FIONBIO  0x4e424c4b
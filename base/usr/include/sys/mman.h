@@ -13,17 +13,33 @@
 
 #define MAP_FIXED      0x0010
 #define MAP_ANONYMOUS  0x0020
+#define MAP_POPULATE   0x8000
 
 #define MAP_ANON       MAP_ANONYMOUS
 
 #define MAP_FAILED ((void*)-1)
 
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
+#define POSIX_MADV_NORMAL     MADV_NORMAL
+#define POSIX_MADV_RANDOM     MADV_RANDOM
+#define POSIX_MADV_SEQUENTIAL MADV_SEQUENTIAL
+#define POSIX_MADV_WILLNEED   MADV_WILLNEED
+#define POSIX_MADV_DONTNEED   MADV_DONTNEED
+
 _Begin_C_Header
 
 #ifndef __kernel__
 
 extern void * mmap(void *,size_t,int,int,int,off_t);
 extern int munmap(void*,size_t);
+extern int mprotect(void*,size_t,int);
+extern int madvise(void*,size_t,int);
+extern int posix_madvise(void*,size_t,int);
 extern int shm_open(const char *, int, mode_t);
 extern int shm_unlink(const char *);
 
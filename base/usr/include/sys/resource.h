@@ -6,6 +6,13 @@
 #define RUSAGE_SELF 0
 #define RUSAGE_CHILDREN - 1
 
+#define PRIO_PROCESS 0
+#define PRIO_PGRP    1
+#define PRIO_USER    2
+
+#define PRIO_MIN (-20)
+#define PRIO_MAX 20
+
 _Begin_C_Header
 
 struct rusage {
@@ -15,6 +22,8 @@ struct rusage {
 
 #ifndef _KERNEL_
 int getrusage(int, struct rusage *);
+int getpriority(int, id_t);
+int setpriority(int, id_t, int);
 #endif
 
 _End_C_Header
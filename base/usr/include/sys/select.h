@@ -0,0 +1,19 @@
+#pragma once
+
+#include <_cheader.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+_Begin_C_Header
+
+#define FD_SET(fd, set)   ((set)->fds_bits[(fd) / NFDBITS] |= (1U << ((fd) % NFDBITS)))
+#define FD_CLR(fd, set)   ((set)->fds_bits[(fd) / NFDBITS] &= ~(1U << ((fd) % NFDBITS)))
+#define FD_ISSET(fd, set) (!!((set)->fds_bits[(fd) / NFDBITS] & (1U << ((fd) % NFDBITS))))
+#define FD_ZERO(set) do { \
+	for (unsigned int __i = 0; __i < sizeof((set)->fds_bits) / sizeof(fd_mask); ++__i) (set)->fds_bits[__i] = 0; \
+} while (0)
+
+/* Implemented with poll(); exceptfds never has anything to report. */
+extern int select(int nfds, fd_set * readfds, fd_set * writefds, fd_set * exceptfds, struct timeval * timeout);
+
+_End_C_Header
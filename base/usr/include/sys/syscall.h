@@ -103,3 +103,19 @@
 #define SYS_NPROC 100
 #define SYS_SETTLSBASE 101
 #define SYS_GETSID 102
+#define SYS_GETPRIORITY 103
+#define SYS_SETPRIORITY 104
+#define SYS_SCHED_GETSCHEDULER 105
+#define SYS_SCHED_SETSCHEDULER 106
+#define SYS_SCHED_GETPARAM 107
+#define SYS_FUTEX 108
+#define SYS_EPOLL_CREATE 109
+#define SYS_EPOLL_CTL 110
+#define SYS_EPOLL_WAIT 111
+#define SYS_MPROTECT 112
+#define SYS_MADVISE 113
+#define SYS_SCHED_SETAFFINITY 114
+#define SYS_SCHED_GETAFFINITY 115
+#define SYS_NANOSLEEP 116
+#define SYS_FADVISE 117
+#define SYS_POLL 118
@@ -29,11 +29,13 @@ typedef long ssize_t;
 typedef unsigned long useconds_t;
 typedef long suseconds_t;
 typedef int pid_t;
+typedef int id_t;
 
 #define FD_SETSIZE 64 /* compatibility with newlib */
 typedef unsigned int fd_mask;
+#define NFDBITS (8 * (int)sizeof(fd_mask))
 typedef struct _fd_set {
-    fd_mask fds_bits[1]; /* should be 64 bits */
+    fd_mask fds_bits[FD_SETSIZE / NFDBITS];
 } fd_set;
 
 _End_C_Header
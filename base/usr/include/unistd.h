@@ -116,6 +116,7 @@ extern int setpgid(pid_t, pid_t);
 extern pid_t getpgid(pid_t);
 extern pid_t getpgrp(void);
 extern pid_t getsid(pid_t);
+extern int nice(int);
 
 extern unsigned int alarm(unsigned int seconds);
 
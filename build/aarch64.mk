@@ -46,6 +46,7 @@ EMU_ARGS += -device AC97
 EMU_ARGS += -d guest_errors
 EMU_ARGS += -net user
 EMU_ARGS += -netdev hubport,id=u1,hubid=0, -device e1000e,netdev=u1
+#EMU_ARGS += -drive file=disk.img,format=raw,if=none,id=vd0 -device virtio-blk-pci,drive=vd0,num-queues=$(SMP)
 EMU_ARGS += -name "ToaruOS ${ARCH}"
 
 EMU_RAMDISK = -fw_cfg name=opt/org.toaruos.initrd,file=ramdisk.igz
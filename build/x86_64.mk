@@ -38,6 +38,9 @@ EMU_ARGS += -name "ToaruOS ${ARCH}"
 #EMU_ARGS += -netdev hubport,id=u1,hubid=0, -device e1000e,netdev=u1  -object filter-dump,id=f1,netdev=u1,file=qemu-e1000e.pcap
 #EMU_ARGS += -netdev hubport,id=u2,hubid=0, -device e1000e,netdev=u2
 
+# Attach a disk image as a virtio block device (/dev/vda), one queue per CPU
+#EMU_ARGS += -drive file=disk.img,format=raw,if=none,id=vd0 -device virtio-blk-pci,drive=vd0,num-queues=$(SMP)
+
 # Add an XHCI tablet if you want to dev on USB
 #EMU_ARGS += -device qemu-xhci -device usb-tablet
 
@@ -498,7 +498,7 @@ static void ramfb_init(const char * value) {
 			lfb_memsize = lfb_resolution_s * lfb_resolution_y;
 			uint64_t frames = lfb_memsize/4096;
 			if ((lfb_memsize/4096)*4096!=lfb_memsize) frames++;
-			uint64_t addr = mmu_allocate_n_frames(frames) << 12;
+			uint64_t addr = mmu_allocate_n_frames_or_panic(frames) << 12;
 			lfb_vid_memory = mmu_map_from_physical(addr);
 			/* Clear it while we're here */
 			memset(lfb_vid_memory, 0, lfb_memsize);
@@ -560,56 +560,34 @@ void arch_enter_tasklet(void) {
 static spin_lock_t deadlock_lock = { 0 };
 void _spin_panic(const char * lock_name, spin_lock_t * target) {
 	arch_fatal_prepare();
-	while (__sync_lock_test_and_set(deadlock_lock.latch, 0x01));
+	spin_lock(deadlock_lock);
 	dprintf("core %d took over five seconds waiting to acquire %s (owner=%d in %s)\n",
 		this_core->cpu_id, lock_name, target->owner - 1, target->func);
 	//arch_dump_traceback();
-	__sync_lock_release(deadlock_lock.latch);
+	spin_unlock(deadlock_lock);
 	arch_fatal();
 }
 
-void arch_spin_lock_acquire(const char * name, spin_lock_t * target, const char * func) {
-	#if 0
-	uint64_t expire = arch_perf_timer() + 5000000UL * arch_cpu_mhz();
-	#endif
+unsigned long arch_spin_lock_acquire(spin_lock_t * target) {
+	unsigned long spins = 0;
+	uint32_t ticket = __atomic_fetch_add(&target->next, 1, __ATOMIC_RELAXED);
+	uint32_t serving = __atomic_load_n(&target->serving, __ATOMIC_ACQUIRE);
+	if (serving == ticket) return 0;
 
 	/* "loss of an exclusive monitor" is one of the things that causes an "event",
-	 * so we spin on wfe to try to load-acquire the latch */
-	asm volatile (
-		"sevl\n" /* And to avoid multiple jumps, we put the wfe first, so sevl will slide past the first one */
-		"1:\n"
-		"    wfe\n"
-#if 0
-	);
-
-	/* Yes, we can splice these assembly snippets with the clock check, this works fine.
-	 * If we've been trying to load the latch for five seconds, panic. */
-	if (arch_perf_timer() > expire) {
-		_spin_panic(name, target);
-	}
-
-	asm volatile (
-#endif
-		"2:\n"
-		"   ldaxr w2, [ %1 ]\n"     /* Acquire exclusive monitor and load latch value */
-		"   cbnz  w2, 1b\n"         /* If the latch value isn't 0, someone else owns the lock, go back to wfe and wait for them to release it */
-		"   stxr  w2, %0, [ %1 ]\n" /* Store our core number as the latch value. */
-		"   cbnz  w2, 2b\n"         /* If we failed to exclusively store, try to load again */
-		::"r"(this_core->cpu_id+1),"r"(target->latch) : "x2","cc","memory");
-
-	/* Set these for compatibility because there's at least one place we check them;
-	 * TODO: just use the latch value since we're setting it to the same thing anyway? */
-	target->owner = this_core->cpu_id + 1;
-
-	/* This is purely for debugging */
-	target->func  = func;
+	 * so we load-acquire the ticket being served with an exclusive load and wfe
+	 * until the holder's release store to it wakes us up. */
+	asm volatile ("sevl" ::: "memory"); /* so the first wfe slides past */
+	do {
+		asm volatile ("wfe" ::: "memory");
+		asm volatile ("ldaxr %w0, [ %1 ]" : "=r"(serving) : "r"(&target->serving) : "memory");
+		spins++;
+	} while (serving != ticket);
+
+	return spins;
 }
 
 void arch_spin_lock_release(spin_lock_t * target) {
-	/* Clear owner debug data */
-	target->owner = 0;
-	target->func  = NULL;
-
-	/* Release the exclusive monitor and clear the latch value */
-	__atomic_store_n(target->latch, 0, __ATOMIC_RELEASE);
+	/* Storing to the monitored word signals any cores waiting in wfe */
+	__atomic_store_n(&target->serving, target->serving + 1, __ATOMIC_RELEASE);
 }
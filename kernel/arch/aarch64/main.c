@@ -23,9 +23,11 @@
 #include <kernel/misc.h>
 #include <kernel/ptrace.h>
 #include <kernel/ksym.h>
+#include <kernel/profile.h>
 #include <kernel/syscall.h>
 #include <kernel/elf.h>
 #include <kernel/mman.h>
+#include <kernel/time.h>
 #include <bits/errno.h>
 
 #include <sys/ptrace.h>
@@ -103,6 +105,7 @@ static void arch_clock_initialize(uintptr_t rpi_tag) {
 
 	/* Get the "basis time" - the perf timestamp we got the wallclock time at */
 	basis_time = arch_perf_timer() / sys_timer_freq;
+	clock_page_update(100, sys_timer_freq, basis_time, arch_boot_time);
 
 	/* Report the reference clock speed */
 	dprintf("timer: Using %ld MHz as arch_perf_timer frequency.\n", arch_cpu_mhz());
@@ -138,6 +141,7 @@ int settimeofday(struct timeval * t, void *z) {
 	spin_lock(_time_set_lock);
 	uint64_t clock_time = now();
 	arch_boot_time += t->tv_sec - clock_time;
+	clock_page_update(100, sys_timer_freq, basis_time, arch_boot_time);
 	spin_unlock(_time_set_lock);
 
 	return 0;
@@ -163,15 +167,27 @@ void relative_time(unsigned long seconds, unsigned long subseconds, unsigned lon
 }
 
 #define TIMER_IRQ 27
-static void set_tick(void) {
-	asm volatile (
-		"mrs x0, CNTFRQ_EL0\n"
-		"mov x1, 100\n" // without this, one second
-		"udiv x0, x0, x1\n"
-		"msr CNTV_TVAL_EL0, x0\n"
-		"mov x0, 1\n"
-		"msr CNTV_CTL_EL0, x0\n"
-		:::"x0","x1");
+
+/**
+ * @brief Arm this core's virtual timer to fire once at @p deadline.
+ *
+ * @p deadline is in microseconds of perf timer time, as used by
+ * relative_time. UINT64_MAX leaves the timer enabled but masked.
+ */
+void arch_timer_oneshot(uint64_t deadline) {
+	uint64_t ctl = 1;
+	if (deadline == UINT64_MAX) {
+		ctl = 3;
+	} else {
+		unsigned long s, ss;
+		relative_time(0, 0, &s, &ss);
+		uint64_t now = s * 1000000UL + ss;
+		uint64_t count;
+		asm volatile ("isb\nmrs %0, CNTVCT_EL0" : "=r"(count));
+		if (deadline > now) count += (deadline - now) * sys_timer_freq / 100;
+		asm volatile ("msr CNTV_CVAL_EL0, %0" :: "r"(count));
+	}
+	asm volatile ("msr CNTV_CTL_EL0, %0\nisb" :: "r"(ctl));
 }
 
 void timer_start(void) {
@@ -179,7 +195,7 @@ void timer_start(void) {
 	asm volatile ("msr DAIFSet, #0b1111");
 
 	/* Enable the local timer */
-	set_tick();
+	sched_program_timer(1);
 
 	/* This is global, we only need to do this once... */
 	gic_regs[0] = 1;
@@ -371,10 +387,28 @@ static void spin(void) {
 	}
 }
 
+/**
+ * @brief Hand the profiler where this timer interrupt landed.
+ *
+ * @p r is NULL when we were woken from wfi in arch_pause, in which
+ * case we report our own frame so the sample lands in the idle loop.
+ */
+static void profile_tick(struct regs * r) {
+	if (!profile_running) return;
+	if (!r) {
+		profile_sample((uintptr_t)arch_pause, (uintptr_t)__builtin_frame_address(0), 0);
+		return;
+	}
+	uint64_t elr, spsr;
+	asm volatile ("mrs %0, ELR_EL1" : "=r"(elr));
+	asm volatile ("mrs %0, SPSR_EL1" : "=r"(spsr));
+	profile_sample(elr, r->x29, (spsr & 0xF) == 0);
+}
+
 #define EOI(x) do { \
 	gicc_regs[4] = (x); \
 } while (0)
-int aarch64_interrupt_dispatch(int from_wfi) {
+int aarch64_interrupt_dispatch(int from_wfi, struct regs * r) {
 	uint32_t iar = gicc_regs[3];
 	uint32_t irq = iar & 0x3FF;
 	/* Currently we aren't using the CPU value and I'm not sure we have any use for it, we know who we are? */
@@ -383,10 +417,11 @@ int aarch64_interrupt_dispatch(int from_wfi) {
 	switch (irq) {
 		case TIMER_IRQ:
 			update_clock();
-			set_tick();
+			profile_tick(r);
+			sched_program_timer(1);
 			EOI(iar);
 			if (from_wfi) break;
-			switch_task(1);
+			switch_task_preempt();
 			break;
 
 		case 1:
@@ -431,7 +466,7 @@ void aarch64_irq_enter(struct regs * r) {
 		this_core->current_process->time_switch = arch_perf_timer();
 	}
 
-	aarch64_interrupt_dispatch(0);
+	aarch64_interrupt_dispatch(0, r);
 
 	process_check_signals(r);
 }
@@ -499,7 +534,7 @@ void fpu_enable(void) {
 void arch_pause(void) {
 _try_again:
 	asm volatile ("wfi");
-	if (aarch64_interrupt_dispatch(1)) goto _try_again;
+	if (aarch64_interrupt_dispatch(1, NULL)) goto _try_again;
 }
 
 /**
@@ -16,6 +16,8 @@
 #include <kernel/misc.h>
 #include <kernel/mmu.h>
 #include <kernel/mman.h>
+#include <kernel/buddy.h>
+#include <kernel/pagecache.h>
 #include <sys/mman.h>
 
 static volatile uint32_t *frames;
@@ -87,8 +89,9 @@ void mmu_frame_set(uintptr_t frame_addr) {
 		uint64_t frame  = frame_addr >> 12;
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
-		__sync_or_and_fetch(&frames[index], ((uint32_t)1 << offset));
+		uint32_t old = __sync_fetch_and_or(&frames[index], ((uint32_t)1 << offset));
 		asm ("isb" ::: "memory");
+		if (!(old & ((uint32_t)1 << offset))) buddy_reserve(frame + (ram_starts_at >> 12));
 	}
 }
 
@@ -101,12 +104,25 @@ void mmu_frame_clear(uintptr_t frame_addr) {
 		uint64_t frame  = frame_addr >> PAGE_SHIFT;
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
-		__sync_and_and_fetch(&frames[index], ~((uint32_t)1 << offset));
+		uint32_t old = __sync_fetch_and_and(&frames[index], ~((uint32_t)1 << offset));
 		asm ("isb" ::: "memory");
+		if (old & ((uint32_t)1 << offset)) buddy_free_frame(frame + (ram_starts_at >> 12));
 		if (frame < lowest_available) lowest_available = frame;
 	}
 }
 
+/**
+ * @brief Claim a frame handed out by the buddy allocator; see the x86-64 version.
+ */
+static int mmu_frame_claim(uintptr_t frame) {
+	frame -= ram_starts_at >> 12;
+	uint64_t index  = INDEX_FROM_BIT(frame);
+	uint32_t offset = OFFSET_FROM_BIT(frame);
+	uint32_t old = __sync_fetch_and_or(&frames[index], ((uint32_t)1 << offset));
+	asm ("isb" ::: "memory");
+	return !(old & ((uint32_t)1 << offset));
+}
+
 int mmu_frame_test(uintptr_t frame_addr) {
 	if (frame_addr < ram_starts_at) return 1;
 	frame_addr -= ram_starts_at;
@@ -124,32 +140,55 @@ static spin_lock_t mmio_space_lock = { 0 };
 static spin_lock_t module_space_lock = { 0 };
 
 void mmu_frame_release(uintptr_t frame_addr) {
-	spin_lock(frame_alloc_lock);
 	mmu_frame_clear(frame_addr);
-	spin_unlock(frame_alloc_lock);
 }
 
 uintptr_t mmu_first_n_frames(int n) {
-	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
-		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (mmu_frame_test(i + ram_starts_at + PAGE_SIZE * j)) {
-				bad = j + 1;
+	if (!buddy_ready) {
+		for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
+			int bad = 0;
+			for (int j = 0; j < n; ++j) {
+				if (mmu_frame_test(i + ram_starts_at + PAGE_SIZE * j)) {
+					bad = j + 1;
+				}
+			}
+			if (!bad) {
+				for (int j = 0; j < n; ++j) mmu_frame_set(i + ram_starts_at + PAGE_SIZE * j);
+				return (i + ram_starts_at) / PAGE_SIZE;
 			}
 		}
-		if (!bad) {
-			return (i + ram_starts_at) / PAGE_SIZE;
-		}
+		return (uintptr_t)-1;
 	}
 
-	arch_fatal_prepare();
-	dprintf("Failed to allocate %d contiguous frames.\n", n);
-	arch_dump_traceback();
-	arch_fatal();
-	return (uintptr_t)-1;
+	while (1) {
+		uintptr_t index = buddy_alloc_contiguous(n);
+		if (index == BUDDY_NO_FRAME) {
+			if (pagecache_reclaim(64)) continue;
+			return (uintptr_t)-1;
+		}
+		int j;
+		for (j = 0; j < n; ++j) {
+			if (!mmu_frame_claim(index + j)) break;
+		}
+		if (j == n) return index;
+		/* Frames after j were never claimed, so they go straight back. */
+		for (int k = 0; k < j; ++k) mmu_frame_clear((index + k) << PAGE_SHIFT);
+		for (int k = j + 1; k < n; ++k) buddy_free_frame(index + k);
+	}
 }
 
 uintptr_t mmu_first_frame(void) {
+	if (buddy_ready) {
+		while (1) {
+			uintptr_t frame = buddy_alloc_frame();
+			if (frame == BUDDY_NO_FRAME) {
+				if (pagecache_reclaim(64)) continue;
+				return (uintptr_t)-1;
+			}
+			if (mmu_frame_claim(frame)) return frame;
+		}
+	}
+
 	uintptr_t i, j;
 	for (i = INDEX_FROM_BIT(lowest_available); i < INDEX_FROM_BIT(nframes); ++i) {
 		if (frames[i] != (uint32_t)-1) {
@@ -158,6 +197,7 @@ uintptr_t mmu_first_frame(void) {
 				if (!(frames[i] & testFrame)) {
 					uintptr_t out = (i << 5) + j;
 					lowest_available = out + 1;
+					__sync_or_and_fetch(&frames[i], testFrame);
 					return out + (ram_starts_at >> 12);
 				}
 			}
@@ -169,21 +209,28 @@ uintptr_t mmu_first_frame(void) {
 		return mmu_first_frame();
 	}
 
+	return (uintptr_t)-1;
+}
+
+static void mmu_out_of_memory(void) {
 	arch_fatal_prepare();
 	dprintf("Out of memory.\n");
 	arch_dump_traceback();
 	arch_fatal();
-	return (uintptr_t)-1;
 }
 
-void mmu_frame_allocate(union PML * page, unsigned int flags) {
+static uintptr_t mmu_first_frame_or_die(void) {
+	uintptr_t index = mmu_first_frame();
+	if (index == (uintptr_t)-1) mmu_out_of_memory();
+	return index;
+}
+
+int mmu_frame_allocate(union PML * page, unsigned int flags) {
 	/* If page is not set... */
 	if (page->bits.page == 0) {
-		spin_lock(frame_alloc_lock);
 		uintptr_t index = mmu_first_frame();
-		mmu_frame_set(index << PAGE_SHIFT);
+		if (index == (uintptr_t)-1) return -1;
 		page->bits.page     = index;
-		spin_unlock(frame_alloc_lock);
 	}
 
 	page->bits.table_page = 1;
@@ -215,6 +262,7 @@ void mmu_frame_allocate(union PML * page, unsigned int flags) {
 	page->bits.nx       = (flags & MMU_FLAG_NOEXECUTE) ? 1 : 0;
 	#endif
 
+	return 0;
 }
 
 void mmu_frame_map_address(union PML * page, unsigned int flags, uintptr_t physAddr) {
@@ -319,8 +367,9 @@ union PML * mmu_get_page_other_x(union PML * root, uintptr_t virtAddr, int flags
 	spin_lock(frame_alloc_lock);
 	if (!root[pml4_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t index = mmu_first_frame();
+		if (index == (uintptr_t)-1) goto _noentry;
+		uintptr_t newPage = index << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		root[pml4_entry].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -332,8 +381,9 @@ union PML * mmu_get_page_other_x(union PML * root, uintptr_t virtAddr, int flags
 	spin_lock(frame_alloc_lock);
 	if (!pdp[pdp_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t index = mmu_first_frame();
+		if (index == (uintptr_t)-1) goto _noentry;
+		uintptr_t newPage = index << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pdp[pdp_entry].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -350,8 +400,9 @@ union PML * mmu_get_page_other_x(union PML * root, uintptr_t virtAddr, int flags
 	spin_lock(frame_alloc_lock);
 	if (!pd[pd_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t index = mmu_first_frame();
+		if (index == (uintptr_t)-1) goto _noentry;
+		uintptr_t newPage = index << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pd[pd_entry].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -392,8 +443,7 @@ static int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uint
 	/* TODO cow bits */
 
 	char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
+	uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 	char * page_out = mmu_map_from_physical(newPage);
 	memcpy(page_out,page_in,PAGE_SIZE);
 	mmu_flush(page_out);
@@ -418,10 +468,7 @@ union PML * mmu_clone(union PML * from) {
 	if (!from) from = this_core->current_pml;
 
 	/* First get a page for ourselves. */
-	spin_lock(frame_alloc_lock);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
-	spin_unlock(frame_alloc_lock);
+	uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 	union PML * pml4_out = mmu_map_from_physical(newPage);
 
 	/* Zero bottom half */
@@ -434,10 +481,7 @@ union PML * mmu_clone(union PML * from) {
 	for (size_t i = 0; i < 256; ++i) {
 		if (from[i].bits.present) {
 			union PML * pdp_in = mmu_map_from_physical((uintptr_t)from[i].bits.page << PAGE_SHIFT);
-			spin_lock(frame_alloc_lock);
-			uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-			mmu_frame_set(newPage);
-			spin_unlock(frame_alloc_lock);
+			uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 			union PML * pdp_out = mmu_map_from_physical(newPage);
 			memset(pdp_out, 0, 512 * sizeof(union PML));
 			pml4_out[i].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -446,10 +490,7 @@ union PML * mmu_clone(union PML * from) {
 			for (size_t j = 0; j < 512; ++j) {
 				if (pdp_in[j].bits.present) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
-					spin_lock(frame_alloc_lock);
-					uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-					mmu_frame_set(newPage);
-					spin_unlock(frame_alloc_lock);
+					uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 					union PML * pd_out = mmu_map_from_physical(newPage);
 					memset(pd_out, 0, 512 * sizeof(union PML));
 					pdp_out[j].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -458,10 +499,7 @@ union PML * mmu_clone(union PML * from) {
 					for (size_t k = 0; k < 512; ++k) {
 						if (pd_in[k].bits.present) {
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
-							spin_lock(frame_alloc_lock);
-							uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-							mmu_frame_set(newPage);
-							spin_unlock(frame_alloc_lock);
+							uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 							union PML * pt_out = mmu_map_from_physical(newPage);
 							memset(pt_out, 0, 512 * sizeof(union PML));
 							pd_out[k].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -469,12 +507,17 @@ union PML * mmu_clone(union PML * from) {
 							/* Now, finally, copy pages */
 							for (size_t l = 0; l < 512; ++l) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
-								if (pt_in[l].bits.present) {
+								if (pt_in[l].bits.present || pt_in[l].bits.prot_none) {
 									if ((pt_in[l].bits.ap & 1) && !(pt_in[l].bits.mmap_shared)) {
 										copy_page_maybe(pt_in, pt_out, l, address);
+										if (pt_in[l].bits.prot_none) {
+											pt_out[l].bits.present = 0;
+											pt_out[l].bits.prot_none = 1;
+										}
 									} else {
 										/* If it's not an unshared user page, just copy directly */
 										pt_out[l].raw = pt_in[l].raw;
+										if (pt_in[l].bits.mmap_shared) pagecache_frame_ref(pt_in[l].bits.page);
 									}
 								} /* Else, mmap'd files? */
 							}
@@ -489,20 +532,20 @@ union PML * mmu_clone(union PML * from) {
 }
 
 uintptr_t mmu_allocate_a_frame(void) {
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_frame();
-	mmu_frame_set(index << PAGE_SHIFT);
-	spin_unlock(frame_alloc_lock);
-	return index;
+	return mmu_first_frame();
 }
 
 uintptr_t mmu_allocate_n_frames(int n) {
-	spin_lock(frame_alloc_lock);
+	return mmu_first_n_frames(n);
+}
+
+uintptr_t mmu_allocate_a_frame_or_panic(void) {
+	return mmu_first_frame_or_die();
+}
+
+uintptr_t mmu_allocate_n_frames_or_panic(int n) {
 	uintptr_t index = mmu_first_n_frames(n);
-	for (int i = 0; i < n; ++i) {
-		mmu_frame_set((index+i) << PAGE_SHIFT);
-	}
-	spin_unlock(frame_alloc_lock);
+	if (index == (uintptr_t)-1) mmu_out_of_memory();
 	return index;
 }
 
@@ -511,17 +554,7 @@ size_t mmu_total_memory(void) {
 }
 
 size_t mmu_used_memory(void) {
-	size_t ret = 0;
-	size_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
-			}
-		}
-	}
-	return ret * 4 - unavailable_memory;
+	return total_memory - buddy_free_count() * 4;
 }
 
 void mmu_free(union PML * from) {
@@ -544,9 +577,11 @@ void mmu_free(union PML * from) {
 							for (size_t l = 0; l < 512; ++l) {
 								//uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								/* Do not free shared mappings; SHM subsystem does that for SHM, devices don't need it. */
-								if (pt_in[l].bits.present && (pt_in[l].bits.ap & 1)) {
+								if ((pt_in[l].bits.present || pt_in[l].bits.prot_none) && (pt_in[l].bits.ap & 1)) {
 									if (!(pt_in[l].bits.mmap_shared)) { /* we use this bit for share */
 										mmu_frame_clear((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
+									} else {
+										pagecache_frame_unref(pt_in[l].bits.page);
 									}
 									pt_in[l].raw = 0;
 								}
@@ -585,14 +620,35 @@ void mmu_set_directory(union PML * new_pml) {
 		"msr TTBR0_EL1,%0\n"
 		"msr TTBR1_EL1,%0\n"
 		"isb sy\n"
-		"dsb ishst\n"
-		"tlbi vmalle1is\n"
-		"dsb ish\n"
+		"dsb nshst\n"
+		"tlbi vmalle1\n"   /* Only this core needs to forget the old directory */
+		"dsb nsh\n"
 		"isb\n" :: "r"(pml_phys) : "memory");
 }
 
+/**
+ * @brief Invalidate a page's TLB entries.
+ *
+ * Every core flushes its TLB when it loads a directory, so a user
+ * mapping only needs to be invalidated on the cores that have the
+ * current directory loaded right now. If that's just us, a local
+ * invalidation is enough; otherwise, and for kernel mappings, we
+ * broadcast it to the inner-shareable domain.
+ */
 void mmu_invalidate(uintptr_t addr) {
-	asm volatile ("dsb st\ntlbi vae1,%0\ndsb sy\nisb" :: "r"( ((uintptr_t)0xFFFF << 48) | (addr >> 12)) : "memory");
+	uintptr_t arg = ((uintptr_t)0xFFFF << 48) | ((addr >> 12) & 0xFFFFFFFFFFFUL);
+	int local = 0;
+
+	if (addr < 0xFFFF000000000000UL && this_core->current_process) {
+		asm volatile ("dmb ish" ::: "memory");
+		local = this_core->current_process->thread.page_directory->cpu_mask == (1U << this_core->cpu_id);
+	}
+
+	if (local) {
+		asm volatile ("dsb nshst\ntlbi vae1,%0\ndsb nsh\nisb" :: "r"(arg) : "memory");
+	} else {
+		asm volatile ("dsb ishst\ntlbi vae1is,%0\ndsb ish\nisb" :: "r"(arg) : "memory");
+	}
 }
 
 int mmu_get_page_deep(uintptr_t virtAddr, union PML ** pml4_out, union PML ** pdp_out, union PML ** pd_out, union PML ** pt_out) {
@@ -636,7 +692,7 @@ static int maybe_release_directory(union PML * parent, union PML * child) {
 
 	/* Is everything in the table free? */
 	for (int i = 0; i < 512; ++i) {
-		if (table[i].bits.present) return 0;
+		if (table[i].bits.present || table[i].bits.prot_none) return 0;
 	}
 
 	uintptr_t old_page = (parent->bits.page << PAGE_SHIFT);
@@ -656,11 +712,14 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 
 		spin_lock(frame_alloc_lock);
 
-		/* Free this page if it was present */
-		if (pt && pt->bits.present) {
+		/* Free this page if it was present, or hidden by PROT_NONE */
+		if (pt && (pt->bits.present || pt->bits.prot_none)) {
+			uintptr_t shared_frame = 0;
 			if (pt->bits.ap & 1) {
 				if (!(pt->bits.mmap_shared)) { /* we use this bit for share */
 					mmu_frame_clear((uintptr_t)pt->bits.page << PAGE_SHIFT);
+				} else {
+					shared_frame = pt->bits.page;
 				}
 				pt->raw = 0;
 			}
@@ -672,12 +731,66 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 			}
 
 			mmu_invalidate(a);
+			if (shared_frame) pagecache_frame_unref(shared_frame);
+		}
+
+		spin_unlock(frame_alloc_lock);
+	}
+}
+
+
+/**
+ * @brief Change the access bits of present user pages in the current address space.
+ *
+ * We don't do COW here, so read-only anonymous pages are never shared
+ * and can be made writable directly. Shared file and device pages are
+ * only writable if their mapping is MAP_SHARED.
+ *
+ * PROT_NONE hides pages by clearing their valid bit and marking them
+ * with prot_none; they keep their frames, and any other protection
+ * brings them back.
+ */
+void mmu_protect_user(uintptr_t addr, size_t size, int prot, int shared) {
+	for (uintptr_t a = addr; a < addr + size; a += PAGE_SIZE) {
+		union PML * pml4, * pdp, * pd, * pt;
+
+		if (mmu_get_page_deep(a, &pml4, &pdp, &pd, &pt)) continue;
+
+		spin_lock(frame_alloc_lock);
+
+		if (pt && prot == PROT_NONE) {
+			if (pt->bits.present && (pt->bits.ap & 1)) {
+				pt->bits.present = 0;
+				pt->bits.prot_none = 1;
+				mmu_invalidate(a);
+			}
+			spin_unlock(frame_alloc_lock);
+			continue;
+		}
+
+		if (pt && pt->bits.prot_none) {
+			pt->bits.prot_none = 0;
+			pt->bits.present = 1;
+		}
+
+		if (pt && pt->bits.present && (pt->bits.ap & 1)) {
+			int writable = (prot & PROT_WRITE) && (!pt->bits.mmap_shared || shared);
+			pt->bits.ap  = writable ? 1 : 3;
+			pt->bits.uxn = (prot & PROT_EXEC) ? 0 : 1;
+			mmu_invalidate(a);
 		}
 
 		spin_unlock(frame_alloc_lock);
 	}
 }
 
+/**
+ * @brief Large user pages are not supported here yet.
+ * @returns -1, so callers always fall back to small pages.
+ */
+int mmu_map_user_huge(union PML * root, uintptr_t virtAddr, uintptr_t physAddr, int flags) {
+	return -1;
+}
 
 static char * heapStart = NULL;
 extern char end[];
@@ -707,7 +820,7 @@ void * sbrk(size_t bytes) {
 
 	for (uintptr_t p = (uintptr_t)out; p < (uintptr_t)out + bytes; p += PAGE_SIZE) {
 		union PML * page = mmu_get_page(p, MMU_GET_MAKE);
-		mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_KERNEL);
+		if (!page || mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_KERNEL)) mmu_out_of_memory();
 	}
 
 	heapStart += bytes;
@@ -728,6 +841,7 @@ void * mmu_map_mmio_region(uintptr_t physical_address, size_t size) {
 	void * out = (void*)mmio_base_address;
 	for (size_t i = 0; i < size; i += PAGE_SIZE) {
 		union PML * p = mmu_get_page(mmio_base_address + i, MMU_GET_MAKE);
+		if (!p) mmu_out_of_memory();
 		mmu_frame_map_address(p, MMU_FLAG_KERNEL | MMU_FLAG_WRITABLE | MMU_FLAG_NOCACHE | MMU_FLAG_WRITETHROUGH, physical_address + i);
 	}
 	mmio_base_address += size;
@@ -747,7 +861,16 @@ void * mmu_map_module(size_t size) {
 	void * out = (void*)module_base_address;
 	for (size_t i = 0; i < size; i += PAGE_SIZE) {
 		union PML * p = mmu_get_page(module_base_address + i, MMU_GET_MAKE);
-		mmu_frame_allocate(p, MMU_FLAG_KERNEL | MMU_FLAG_WRITABLE);
+		if (!p || mmu_frame_allocate(p, MMU_FLAG_KERNEL | MMU_FLAG_WRITABLE)) {
+			for (size_t j = 0; j < i; j += PAGE_SIZE) {
+				union PML * q = mmu_get_page(module_base_address + j, 0);
+				mmu_frame_clear((uintptr_t)q->bits.page << PAGE_SHIFT);
+				q->raw = 0;
+				mmu_invalidate(module_base_address + j);
+			}
+			spin_unlock(module_space_lock);
+			return NULL;
+		}
 	}
 	module_base_address += size;
 	spin_unlock(module_space_lock);
@@ -905,4 +1028,6 @@ void mmu_init(uintptr_t memaddr, size_t memsize, uintptr_t firstFreePage, uintpt
 	if (module_base_address & PAGE_LOW_MASK) {
 		module_base_address = (module_base_address & PAGE_SIZE_MASK) + PAGE_SIZE;
 	}
+
+	buddy_init(ram_starts_at >> 12, nframes);
 }
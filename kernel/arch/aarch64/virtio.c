@@ -169,7 +169,7 @@ static void virtio_tablet_thread(void * data) {
 	int queue_size = common->queue_size;
 
 	/* get us one page */
-	size_t queue_phys = mmu_allocate_a_frame() << 12;
+	size_t queue_phys = mmu_allocate_a_frame_or_panic() << 12;
 	struct virtio_queue * queue = mmu_map_mmio_region(queue_phys, 4096);
 	asm volatile ("isb" ::: "memory");
 	memset(queue, 0, sizeof(struct virtio_queue));
@@ -181,7 +181,7 @@ static void virtio_tablet_thread(void * data) {
 	common->queue_used = (queue_phys) + offsetof(struct virtio_queue, used);
 	asm volatile ("isb" ::: "memory");
 
-	size_t buffers_base = mmu_allocate_a_frame() << 12;
+	size_t buffers_base = mmu_allocate_a_frame_or_panic() << 12;
 	volatile struct virtio_input_event * buffers = mmu_map_mmio_region(buffers_base, 4096);
 	mmu_get_page((uintptr_t)buffers, 0)->bits.attrindx = 2;
 
@@ -321,7 +321,7 @@ static void virtio_keyboard_thread(void * data) {
 	int queue_size = common->queue_size;
 
 	/* get us one page */
-	size_t queue_phys = mmu_allocate_a_frame() << 12;
+	size_t queue_phys = mmu_allocate_a_frame_or_panic() << 12;
 	struct virtio_queue * queue = mmu_map_mmio_region(queue_phys, 4096);
 	asm volatile ("isb" ::: "memory");
 	memset(queue, 0, sizeof(struct virtio_queue));
@@ -333,7 +333,7 @@ static void virtio_keyboard_thread(void * data) {
 	common->queue_used = (queue_phys) + offsetof(struct virtio_queue, used);
 	asm volatile ("isb" ::: "memory");
 
-	size_t buffers_base = mmu_allocate_a_frame() << 12;
+	size_t buffers_base = mmu_allocate_a_frame_or_panic() << 12;
 	volatile struct virtio_input_event * buffers = mmu_map_mmio_region(buffers_base, 4096);
 	mmu_get_page((uintptr_t)buffers, 0)->bits.attrindx = 2;
 
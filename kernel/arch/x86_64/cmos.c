@@ -17,6 +17,7 @@
 #include <kernel/printf.h>
 #include <kernel/string.h>
 #include <kernel/process.h>
+#include <kernel/time.h>
 #include <kernel/arch/x86_64/ports.h>
 #include <kernel/arch/x86_64/irq.h>
 #include <sys/time.h>
@@ -277,6 +278,7 @@ void arch_clock_initialize(void) {
 	tsc_mhz = (end - start) / 10000;
 	if (tsc_mhz == 0) tsc_mhz = 2000; /* uh oh */
 	tsc_basis_time = start / tsc_mhz;
+	clock_page_update(1, tsc_mhz, tsc_basis_time, arch_boot_time);
 
 	dprintf("tsc: TSC timed at %lu MHz..\n", tsc_mhz);
 	dprintf("tsc: Boot time is %lus.\n", arch_boot_time);
@@ -340,6 +342,7 @@ int settimeofday(struct timeval * t, void *z) {
 	spin_lock(_time_set_lock);
 	uint64_t clock_time = now();
 	arch_boot_time += t->tv_sec - clock_time;
+	clock_page_update(1, tsc_mhz, tsc_basis_time, arch_boot_time);
 	spin_unlock(_time_set_lock);
 
 	return 0;
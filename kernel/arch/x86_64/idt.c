@@ -26,6 +26,7 @@
 #include <kernel/mmu.h>
 #include <kernel/syscall.h>
 #include <kernel/mman.h>
+#include <kernel/profile.h>
 
 #include <sys/time.h>
 #include <sys/utsname.h>
@@ -504,10 +505,14 @@ static void _page_fault(struct regs * r) {
  * @param r Interrupt register context
  * @return Register state after resume from task task switch.
  */
+extern void arch_tlb_shootdown_handle(void);
+
 static void _local_timer(struct regs * r) {
 	extern void arch_update_clock(void);
 	arch_update_clock();
-	if (r->cs != 0x08) switch_task(1);
+	profile_sample(r->rip, r->rbp, r->cs != 0x08);
+	sched_program_timer(1);
+	if (r->cs != 0x08) switch_task_preempt();
 }
 
 /**
@@ -596,9 +601,9 @@ void isr_handler_inner(struct regs * r) {
 
 		/* Local interrupts that make it here. */
 		case 123: _local_timer(r); return;
+		case 124: arch_tlb_shootdown_handle(); return;
 
 		/* Other interrupts that don't make it here:
-		 *   124: TLB shootdown, we just reload CR3 in the handler.
 		 *   125: Fatal signal, jumps straight to a cli/hlt loop, though I think this just yields an NMI instead?
 		 *   126: Quiet wakeup, do we even use this anymore?
 		 */
@@ -606,7 +611,7 @@ void isr_handler_inner(struct regs * r) {
 		default: panic("Unexpected interrupt",r,0);
 	}
 
-	if (this_core->current_process == this_core->kernel_idle_task && process_queue && process_queue->head) {
+	if (this_core->current_process == this_core->kernel_idle_task && this_core->ready_queue.head) {
 		/* If this is kidle and we got here, instead of finishing the interrupt
 		 * we can just switch task and there will probably be something else
 		 * to run that was awoken by the interrupt. */
@@ -22,6 +22,7 @@
 #include <kernel/ksym.h>
 #include <kernel/misc.h>
 #include <kernel/version.h>
+#include <kernel/time.h>
 #include <kernel/elf.h>
 
 #include <kernel/arch/x86_64/ports.h>
@@ -34,6 +35,8 @@ extern void arch_clock_initialize(void);
 
 extern char end[];
 extern unsigned long tsc_mhz;
+extern unsigned long tsc_basis_time;
+extern unsigned long arch_boot_time;
 
 extern void gdt_install(void);
 extern void idt_install(void);
@@ -323,12 +326,13 @@ static void mount_ramdisk(uintptr_t addr, size_t len) {
 		uint32_t decompressedSize;
 		memcpy(&decompressedSize, mmu_map_from_physical(addr + len - sizeof(uint32_t)), sizeof(uint32_t));
 		size_t pageCount = (((size_t)decompressedSize + 0xFFF) & ~(0xFFF)) >> 12;
-		uintptr_t physicalAddress = mmu_allocate_n_frames(pageCount) << 12;
+		uintptr_t physicalIndex = mmu_allocate_n_frames(pageCount);
 
-		if (physicalAddress == (uintptr_t)-1) {
+		if (physicalIndex == (uintptr_t)-1) {
 			dprintf("gzip: failed to allocate pages\n");
 			return;
 		}
+		uintptr_t physicalAddress = physicalIndex << 12;
 		gzip_inputPtr = (void*)data;
 		gzip_outputPtr = mmu_map_from_physical(physicalAddress);
 		/* Do the deed */
@@ -557,6 +561,7 @@ static int kmain_rel(struct multiboot * mboot, uint32_t mboot_mag, void* esp, ui
 	/* Should we override the TSC timing? */
 	if (args_present("tsc_mhz")) {
 		tsc_mhz = atoi(args_value("tsc_mhz"));
+		clock_page_update(1, tsc_mhz, tsc_basis_time, arch_boot_time);
 	}
 
 	if (!args_present("debug")) {
@@ -18,13 +18,15 @@
 #include <kernel/misc.h>
 #include <kernel/mmu.h>
 #include <kernel/mman.h>
+#include <kernel/buddy.h>
+#include <kernel/pagecache.h>
 #include <kernel/arch/x86_64/pml.h>
 #include <sys/mman.h>
 
 extern void arch_tlb_shootdown(uintptr_t);
 
 /**
- * bitmap page allocator for 4KiB pages
+ * bitmap of 4KiB pages in use; free pages are handed out by the buddy allocator
  */
 static volatile uint32_t *frames;
 static size_t nframes;
@@ -57,7 +59,8 @@ static uint8_t * mem_refcounts = NULL;
 /**
  * @brief Mark a physical page frame as in use.
  *
- * Sets the bitmap allocator bit for a frame.
+ * Sets the bitmap allocator bit for a frame. If the frame was free,
+ * it is also taken out of the buddy allocator's free lists.
  *
  * @param frame_addr Address of the frame (not index!)
  */
@@ -67,8 +70,8 @@ void mmu_frame_set(uintptr_t frame_addr) {
 		uint64_t frame  = frame_addr >> 12;
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
-		frames[index]  |= ((uint32_t)1 << offset);
-		asm ("" ::: "memory");
+		uint32_t old = __atomic_fetch_or(&frames[index], ((uint32_t)1 << offset), __ATOMIC_SEQ_CST);
+		if (!(old & ((uint32_t)1 << offset))) buddy_reserve(frame);
 	}
 }
 
@@ -77,7 +80,8 @@ static uintptr_t lowest_available = 0;
 /**
  * @brief Mark a physical page frame as available.
  *
- * Clears the bitmap allocator bit for a frame.
+ * Clears the bitmap allocator bit for a frame and, if it was in use,
+ * hands it back to the buddy allocator.
  *
  * @param frame_addr Address of the frame (not index!)
  */
@@ -87,12 +91,28 @@ void mmu_frame_clear(uintptr_t frame_addr) {
 		uint64_t frame  = frame_addr >> PAGE_SHIFT;
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
-		frames[index]  &= ~((uint32_t)1 << offset);
-		asm ("" ::: "memory");
+		uint32_t old = __atomic_fetch_and(&frames[index], ~((uint32_t)1 << offset), __ATOMIC_SEQ_CST);
+		if (old & ((uint32_t)1 << offset)) buddy_free_frame(frame);
 		if (frame < lowest_available) lowest_available = frame;
 	}
 }
 
+/**
+ * @brief Claim a frame handed out by the buddy allocator.
+ *
+ * The buddy allocator only gives out frames that were free, but a frame
+ * can be claimed with mmu_frame_set while it is on its way out of a
+ * per-core cache, so the bitmap has the final say.
+ *
+ * @returns 1 if the frame is now ours, 0 if someone else already had it.
+ */
+static int mmu_frame_claim(uintptr_t frame) {
+	uint64_t index  = INDEX_FROM_BIT(frame);
+	uint32_t offset = OFFSET_FROM_BIT(frame);
+	uint32_t old = __atomic_fetch_or(&frames[index], ((uint32_t)1 << offset), __ATOMIC_SEQ_CST);
+	return !(old & ((uint32_t)1 << offset));
+}
+
 /**
  * @brief Determine if a physical page is available for use.
  *
@@ -108,46 +128,80 @@ int mmu_frame_test(uintptr_t frame_addr) {
 	return !!(frames[index] & ((uint32_t)1 << offset));
 }
 
+/* Protects mem_refcounts; allocating frames does not need it. */
 static spin_lock_t frame_alloc_lock = { 0 };
 static spin_lock_t kheap_lock = { 0 };
 static spin_lock_t mmio_space_lock = { 0 };
 static spin_lock_t module_space_lock = { 0 };
 
 void mmu_frame_release(uintptr_t frame_addr) {
-	spin_lock(frame_alloc_lock);
 	mmu_frame_clear(frame_addr);
-	spin_unlock(frame_alloc_lock);
 }
 
 /**
- * @brief Find the first range of @p n contiguous frames.
+ * @brief Allocate a range of @p n contiguous frames.
+ *
+ * The frames are marked as in use.
  *
- * If a large enough region could not be found, results are fatal.
+ * @returns the index of the first frame, or -1 if a large enough region could not be found.
  */
 uintptr_t mmu_first_n_frames(int n) {
-	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
-		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (mmu_frame_test(i + PAGE_SIZE * j)) {
-				bad = j + 1;
+	if (!buddy_ready) {
+		for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
+			int bad = 0;
+			for (int j = 0; j < n; ++j) {
+				if (mmu_frame_test(i + PAGE_SIZE * j)) {
+					bad = j + 1;
+				}
+			}
+			if (!bad) {
+				for (int j = 0; j < n; ++j) mmu_frame_set(i + PAGE_SIZE * j);
+				return i / PAGE_SIZE;
 			}
 		}
-		if (!bad) {
-			return i / PAGE_SIZE;
-		}
+		return (uintptr_t)-1;
 	}
 
-	arch_fatal_prepare();
-	dprintf("Failed to allocate %d contiguous frames.\n", n);
-	arch_dump_traceback();
-	arch_fatal();
-	return (uintptr_t)-1;
+	while (1) {
+		uintptr_t index = buddy_alloc_contiguous(n);
+		if (index == BUDDY_NO_FRAME) {
+			if (pagecache_reclaim(64)) continue;
+			return (uintptr_t)-1;
+		}
+		int j;
+		for (j = 0; j < n; ++j) {
+			if (!mmu_frame_claim(index + j)) break;
+		}
+		if (j == n) return index;
+		/* Frame j was claimed out from under us and stays with whoever has it.
+		 * The frames before it are ours to clear; the ones after were never
+		 * claimed, so their bits are clear and they go straight back. */
+		for (int k = 0; k < j; ++k) mmu_frame_clear((index + k) << PAGE_SHIFT);
+		for (int k = j + 1; k < n; ++k) buddy_free_frame(index + k);
+	}
 }
 
 /**
- * @brief Find the first available frame from the bitmap.
+ * @brief Allocate a frame.
+ *
+ * The frame is marked as in use. Before the buddy allocator is
+ * ready, this scans the bitmap for the first available frame.
+ *
+ * @returns a frame index, or -1 if we are out of memory.
  */
 uintptr_t mmu_first_frame(void) {
+	if (buddy_ready) {
+		while (1) {
+			uintptr_t frame = buddy_alloc_frame();
+			if (frame == BUDDY_NO_FRAME) {
+				/* Try to get something back from the page cache first. */
+				if (pagecache_reclaim(64)) continue;
+				return (uintptr_t)-1;
+			}
+			if (mmu_frame_claim(frame)) return frame;
+		}
+	}
+
 	uintptr_t i, j;
 	for (i = INDEX_FROM_BIT(lowest_available); i < INDEX_FROM_BIT(nframes); ++i) {
 		if (frames[i] != (uint32_t)-1) {
@@ -156,17 +210,33 @@ uintptr_t mmu_first_frame(void) {
 				if (!(frames[i] & testFrame)) {
 					uintptr_t out = (i << 5) + j;
 					lowest_available = out + 1;
+					frames[i] |= testFrame;
 					return out;
 				}
 			}
 		}
 	}
 
+	return (uintptr_t)-1;
+}
+
+static void mmu_out_of_memory(void) {
 	arch_fatal_prepare();
 	dprintf("Out of memory.\n");
 	arch_dump_traceback();
 	arch_fatal();
-	return (uintptr_t)-1;
+}
+
+/**
+ * @brief Allocate a frame for a structure the kernel can not do without.
+ *
+ * Used for page tables and for copies made while cloning an address
+ * space, where there is no way to back out of a failed allocation.
+ */
+static uintptr_t mmu_first_frame_or_die(void) {
+	uintptr_t index = mmu_first_frame();
+	if (index == (uintptr_t)-1) mmu_out_of_memory();
+	return index;
 }
 
 /**
@@ -174,14 +244,15 @@ uintptr_t mmu_first_frame(void) {
  *
  * Sets the page bits based on the the value of @p flags.
  * If @p page->bits.page is unset, a new frame will be allocated.
+ *
+ * @returns 0 on success, -1 if a frame was needed and none was available,
+ *          in which case the page is left untouched.
  */
-void mmu_frame_allocate(union PML * page, unsigned int flags) {
+int mmu_frame_allocate(union PML * page, unsigned int flags) {
 	if (page->bits.page == 0) {
-		spin_lock(frame_alloc_lock);
 		uintptr_t index = mmu_first_frame();
-		mmu_frame_set(index << PAGE_SHIFT);
+		if (index == (uintptr_t)-1) return -1;
 		page->bits.page     = index;
-		spin_unlock(frame_alloc_lock);
 	}
 	page->bits.size     = 0;
 	page->bits.present  = 1;
@@ -191,6 +262,7 @@ void mmu_frame_allocate(union PML * page, unsigned int flags) {
 	page->bits.writethrough  = (flags & MMU_FLAG_WRITETHROUGH)  ? 1 : 0;
 	page->bits.size     = (flags & MMU_FLAG_SPEC) ? 1 : 0;
 	page->bits.nx       = (flags & MMU_FLAG_NOEXECUTE) ? 1 : 0;
+	return 0;
 }
 
 /**
@@ -319,10 +391,9 @@ union PML * mmu_get_page_other_x(union PML * root, uintptr_t virtAddr, int flags
 	/* Get the PML4 entry for this address */
 	if (!root[pml4_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t index = mmu_first_frame();
+		if (index == (uintptr_t)-1) return NULL;
+		uintptr_t newPage = index << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		root[pml4_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -332,10 +403,9 @@ union PML * mmu_get_page_other_x(union PML * root, uintptr_t virtAddr, int flags
 
 	if (!pdp[pdp_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t index = mmu_first_frame();
+		if (index == (uintptr_t)-1) return NULL;
+		uintptr_t newPage = index << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pdp[pdp_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -350,10 +420,9 @@ union PML * mmu_get_page_other_x(union PML * root, uintptr_t virtAddr, int flags
 
 	if (!pd[pd_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t index = mmu_first_frame();
+		if (index == (uintptr_t)-1) return NULL;
+		uintptr_t newPage = index << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pd[pd_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -486,8 +555,7 @@ int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t a
 			pt_out[l].raw = pt_in[l].raw;
 		} else if (refcount_inc(pt_in[l].bits.page)) {
 			char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
-			uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-			mmu_frame_set(newPage);
+			uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 			char * page_out = mmu_map_from_physical(newPage);
 			memcpy(page_out,page_in,PAGE_SIZE);
 			assert(mem_refcounts[newPage >> PAGE_SHIFT] == 0);
@@ -511,8 +579,7 @@ int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t a
 	if (refcount_inc(pt_in[l].bits.page)) {
 		/* There are too many references to fit in our refcount table, so just make a new page. */
 		char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 		char * page_out = mmu_map_from_physical(newPage);
 		memcpy(page_out,page_in,PAGE_SIZE);
 		assert(mem_refcounts[newPage >> PAGE_SHIFT] == 0);
@@ -584,10 +651,7 @@ union PML * mmu_clone(union PML * from) {
 	if (!from) from = this_core->current_pml;
 
 	/* First get a page for ourselves. */
-	spin_lock(frame_alloc_lock);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
-	spin_unlock(frame_alloc_lock);
+	uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 	union PML * pml4_out = mmu_map_from_physical(newPage);
 
 	/* Zero bottom half */
@@ -600,10 +664,7 @@ union PML * mmu_clone(union PML * from) {
 	for (size_t i = 0; i < 256; ++i) {
 		if (from[i].bits.present) {
 			union PML * pdp_in = mmu_map_from_physical((uintptr_t)from[i].bits.page << PAGE_SHIFT);
-			spin_lock(frame_alloc_lock);
-			uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-			mmu_frame_set(newPage);
-			spin_unlock(frame_alloc_lock);
+			uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 			union PML * pdp_out = mmu_map_from_physical(newPage);
 			memset(pdp_out, 0, 512 * sizeof(union PML));
 			pml4_out[i].raw = (newPage) | USER_PML_ACCESS;
@@ -612,22 +673,19 @@ union PML * mmu_clone(union PML * from) {
 			for (size_t j = 0; j < 512; ++j) {
 				if (pdp_in[j].bits.present) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
-					spin_lock(frame_alloc_lock);
-					uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-					mmu_frame_set(newPage);
-					spin_unlock(frame_alloc_lock);
+					uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 					union PML * pd_out = mmu_map_from_physical(newPage);
 					memset(pd_out, 0, 512 * sizeof(union PML));
 					pdp_out[j].raw = (newPage) | USER_PML_ACCESS;
 
 					/* Now copy the PTs */
 					for (size_t k = 0; k < 512; ++k) {
-						if (pd_in[k].bits.present) {
+						if (pd_in[k].bits.present && pd_in[k].bits.size) {
+							/* Large pages are shared device memory, see mmu_map_user_huge */
+							pd_out[k].raw = pd_in[k].raw;
+						} else if (pd_in[k].bits.present) {
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
-							spin_lock(frame_alloc_lock);
-							uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-							mmu_frame_set(newPage);
-							spin_unlock(frame_alloc_lock);
+							uintptr_t newPage = mmu_first_frame_or_die() << PAGE_SHIFT;
 							union PML * pt_out = mmu_map_from_physical(newPage);
 							memset(pt_out, 0, 512 * sizeof(union PML));
 							pd_out[k].raw = (newPage) | USER_PML_ACCESS;
@@ -635,12 +693,17 @@ union PML * mmu_clone(union PML * from) {
 							/* Now, finally, copy pages */
 							for (size_t l = 0; l < 512; ++l) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
-								if (pt_in[l].bits.present) {
+								if (pt_in[l].bits.present || pt_in[l].bits.prot_none) {
 									if (pt_in[l].bits.user && !(pt_in[l].bits.mmap_shared)) {
 										copy_page_maybe(pt_in, pt_out, l, address);
+										if (pt_in[l].bits.prot_none) {
+											pt_out[l].bits.present = 0;
+											pt_out[l].bits.prot_none = 1;
+										}
 									} else {
 										/* If it's not a user page, just copy directly */
 										pt_out[l].raw = pt_in[l].raw;
+										if (pt_in[l].bits.mmap_shared) pagecache_frame_ref(pt_in[l].bits.page);
 									}
 								} /* Else, mmap'd files? */
 							}
@@ -657,28 +720,37 @@ union PML * mmu_clone(union PML * from) {
 /**
  * @brief Allocate one physical page.
  *
- * @returns a frame index, not an address
+ * @returns a frame index, not an address, or -1 if we are out of memory
  */
 uintptr_t mmu_allocate_a_frame(void) {
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_frame();
-	mmu_frame_set(index << PAGE_SHIFT);
-	spin_unlock(frame_alloc_lock);
-	return index;
+	return mmu_first_frame();
 }
 
 /**
  * @brief Allocate a number of contiguous physical pages.
  *
- * @returns a frame index, not an address
+ * @returns a frame index, not an address, or -1
  */
 uintptr_t mmu_allocate_n_frames(int n) {
-	spin_lock(frame_alloc_lock);
+	return mmu_first_n_frames(n);
+}
+
+/**
+ * @brief Allocate one physical page, or halt if there are none.
+ *
+ * For boot-time structures and drivers that have no way to report
+ * running out of memory.
+ */
+uintptr_t mmu_allocate_a_frame_or_panic(void) {
+	return mmu_first_frame_or_die();
+}
+
+/**
+ * @brief Allocate contiguous physical pages, or halt if there are none.
+ */
+uintptr_t mmu_allocate_n_frames_or_panic(int n) {
 	uintptr_t index = mmu_first_n_frames(n);
-	for (int i = 0; i < n; ++i) {
-		mmu_frame_set((index+i) << PAGE_SHIFT);
-	}
-	spin_unlock(frame_alloc_lock);
+	if (index == (uintptr_t)-1) mmu_out_of_memory();
 	return index;
 }
 
@@ -694,23 +766,13 @@ size_t mmu_total_memory(void) {
 /**
  * @brief Return the amount of used memory.
  *
- * Calculates the number of pages currently marked as allocated.
- * Multiplies it by 4 because pages are 4KiB.
+ * Everything usable that the buddy allocator does not have
+ * is in use. Multiplies it by 4 because pages are 4KiB.
  *
  * @returns the amount of memory in use in KiB.
  */
 size_t mmu_used_memory(void) {
-	size_t ret = 0;
-	size_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
-			}
-		}
-	}
-	return ret * 4 - unavailable_memory;
+	return total_memory - buddy_free_count() * 4;
 }
 
 /**
@@ -735,16 +797,21 @@ void mmu_free(union PML * from) {
 				if (pdp_in[j].bits.present) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
 					for (size_t k = 0; k < 512; ++k) {
-						if (pd_in[k].bits.present) {
+						if (pd_in[k].bits.present && pd_in[k].bits.size) {
+							/* Large pages are never backed by frames we own. */
+							pd_in[k].raw = 0;
+						} else if (pd_in[k].bits.present) {
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
 							for (size_t l = 0; l < 512; ++l) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								/* Do not free shared mappings; SHM subsystem does that for SHM, devices don't need it. */
-								if (pt_in[l].bits.present) {
+								if (pt_in[l].bits.present || pt_in[l].bits.prot_none) {
 									/* Free only user pages */
 									if (pt_in[l].bits.user) {
 										if (!(pt_in[l].bits.mmap_shared)) {
 											free_page_maybe(pt_in,l,address);
+										} else {
+											pagecache_frame_unref(pt_in[l].bits.page);
 										}
 										pt_in[l].raw = 0;
 									}
@@ -836,9 +903,11 @@ int mmu_get_page_deep(uintptr_t virtAddr, union PML ** pml4_out, union PML ** pd
 	union PML * pd = mmu_map_from_physical((uintptr_t)pdp[pdp_entry].bits.page << PAGE_SHIFT);
 	*pd_out = (union PML *)&pd[pd_entry];
 	if (!pd[pd_entry].bits.present) goto _noentry;
+	if (pd[pd_entry].bits.size) goto _large; /* *pt_out stays NULL */
 	union PML * pt = mmu_map_from_physical((uintptr_t)pd[pd_entry].bits.page << PAGE_SHIFT);
 	*pt_out = (union PML *)&pt[pt_entry];
 
+_large:
 	spin_unlock(frame_alloc_lock);
 	return 0;
 
@@ -853,7 +922,7 @@ static int maybe_release_directory(union PML * parent, union PML * child) {
 
 	/* Is everything in the table free? */
 	for (int i = 0; i < 512; ++i) {
-		if (table[i].bits.present) return 0;
+		if (table[i].bits.present || table[i].bits.prot_none) return 0;
 	}
 
 	uintptr_t old_page = (parent->bits.page << PAGE_SHIFT);
@@ -865,6 +934,22 @@ static int maybe_release_directory(union PML * parent, union PML * child) {
 	return 1;
 }
 
+/**
+ * @brief Drop a large user page, which may extend outside of the range
+ *        being worked on; whatever is still mapped there faults back in.
+ * @returns the last small page address covered by the large page.
+ */
+static uintptr_t drop_large_page(uintptr_t a, union PML * pml4, union PML * pdp, union PML * pd) {
+	if (pd->bits.user) {
+		pd->raw = 0;
+		mmu_invalidate(a);
+		if (maybe_release_directory(pdp, pd)) {
+			maybe_release_directory(pml4, pdp);
+		}
+	}
+	return (a | PD_MASK) & PAGE_SIZE_MASK;
+}
+
 void mmu_unmap_user(uintptr_t addr, size_t size) {
 	for (uintptr_t a = addr; a < addr + size; a += PAGE_SIZE) {
 		union PML * pml4, * pdp, * pd, * pt;
@@ -873,8 +958,17 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 
 		spin_lock(frame_alloc_lock);
 
-		if (pt && pt->bits.present && pt->bits.user) {
-			if (!(pt->bits.mmap_shared)) {
+		if (!pt) {
+			a = drop_large_page(a, pml4, pdp, pd);
+			spin_unlock(frame_alloc_lock);
+			continue;
+		}
+
+		if (pt && (pt->bits.present || pt->bits.prot_none) && pt->bits.user) {
+			uintptr_t shared_frame = 0;
+			if (pt->bits.mmap_shared) {
+				shared_frame = pt->bits.page;
+			} else {
 				if (pt->bits.writable) {
 					assert(mem_refcounts[pt->bits.page] == 0);
 					mmu_frame_clear((uintptr_t)pt->bits.page << PAGE_SHIFT);
@@ -893,12 +987,139 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 			}
 
 			mmu_invalidate(a);
+			if (shared_frame) pagecache_frame_unref(shared_frame);
+		}
+
+		spin_unlock(frame_alloc_lock);
+	}
+}
+
+
+/**
+ * @brief Change the access bits of present user pages in the current address space.
+ *
+ * Pages that were read-only only because of their protection are made
+ * writable directly if nobody else has them; pages still shared with
+ * another address space become pending COW pages instead, so the first
+ * write still gets a private copy. Shared file and device pages are
+ * only writable if their mapping is MAP_SHARED.
+ *
+ * Non-present pages pick up the new protection from their mapping when
+ * they fault in. PROT_NONE hides pages by clearing their present bit and
+ * marking them with prot_none; they keep their frames, and any other
+ * protection brings them back.
+ */
+void mmu_protect_user(uintptr_t addr, size_t size, int prot, int shared) {
+	for (uintptr_t a = addr; a < addr + size; a += PAGE_SIZE) {
+		union PML * pml4, * pdp, * pd, * pt;
+
+		if (mmu_get_page_deep(a, &pml4, &pdp, &pd, &pt)) continue;
+
+		spin_lock(frame_alloc_lock);
+
+		if (!pt) {
+			a = drop_large_page(a, pml4, pdp, pd);
+			spin_unlock(frame_alloc_lock);
+			continue;
+		}
+
+		if (prot == PROT_NONE) {
+			if (pt->bits.present && pt->bits.user) {
+				pt->bits.present = 0;
+				pt->bits.prot_none = 1;
+				mmu_invalidate(a);
+			}
+			spin_unlock(frame_alloc_lock);
+			continue;
+		}
+
+		if (pt->bits.prot_none) {
+			pt->bits.prot_none = 0;
+			pt->bits.present = 1;
+		}
+
+		if (pt->bits.present && pt->bits.user) {
+			if (pt->bits.mmap_shared) {
+				pt->bits.writable = (shared && (prot & PROT_WRITE)) ? 1 : 0;
+			} else if (!(prot & PROT_WRITE)) {
+				pt->bits.writable = 0;
+				pt->bits.cow_pending = 0;
+			} else if (!pt->bits.writable && !pt->bits.cow_pending) {
+				if (mem_refcounts[pt->bits.page] == 0) {
+					pt->bits.writable = 1;
+				} else {
+					pt->bits.cow_pending = 1;
+				}
+			}
+			pt->bits.nx = (prot & PROT_EXEC) ? 0 : 1;
+			mmu_invalidate(a);
 		}
 
 		spin_unlock(frame_alloc_lock);
 	}
 }
 
+/**
+ * @brief Map a 2MiB page of device memory into a user address space.
+ *
+ * Only for physically contiguous memory the frame allocator does not
+ * manage, like a framebuffer: the entry is marked shared, so it is
+ * never freed or copied-on-write, and clones get the same entry.
+ *
+ * @param virtAddr 2MiB-aligned user address.
+ * @param physAddr 2MiB-aligned physical address.
+ * @param flags MMU_FLAG_ bits, as for mmu_frame_allocate.
+ * @returns 0 if the page is mapped, including if it already was; -1 if the
+ *          range is already covered by a page table or we are out of memory,
+ *          in which case the caller should map small pages instead.
+ */
+int mmu_map_user_huge(union PML * root, uintptr_t virtAddr, uintptr_t physAddr, int flags) {
+	uintptr_t pageAddr = (virtAddr & CANONICAL_MASK) >> PAGE_SHIFT;
+	unsigned int pml4_entry = (pageAddr >> 27) & ENTRY_MASK;
+	unsigned int pdp_entry  = (pageAddr >> 18) & ENTRY_MASK;
+	unsigned int pd_entry   = (pageAddr >> 9)  & ENTRY_MASK;
+
+	if (!root[pml4_entry].bits.present) {
+		uintptr_t index = mmu_first_frame();
+		if (index == (uintptr_t)-1) return -1;
+		memset(mmu_map_from_physical(index << PAGE_SHIFT), 0, PAGE_SIZE);
+		root[pml4_entry].raw = (index << PAGE_SHIFT) | USER_PML_ACCESS;
+	}
+
+	union PML * pdp = mmu_map_from_physical((uintptr_t)root[pml4_entry].bits.page << PAGE_SHIFT);
+
+	if (!pdp[pdp_entry].bits.present) {
+		uintptr_t index = mmu_first_frame();
+		if (index == (uintptr_t)-1) return -1;
+		memset(mmu_map_from_physical(index << PAGE_SHIFT), 0, PAGE_SIZE);
+		pdp[pdp_entry].raw = (index << PAGE_SHIFT) | USER_PML_ACCESS;
+	}
+
+	if (pdp[pdp_entry].bits.size) return -1;
+
+	union PML * pd = mmu_map_from_physical((uintptr_t)pdp[pdp_entry].bits.page << PAGE_SHIFT);
+
+	if (pd[pd_entry].bits.present) {
+		/* The low bit of a large page's address is its PAT bit. */
+		if (pd[pd_entry].bits.size && (pd[pd_entry].bits.page & ~1U) == (physAddr >> PAGE_SHIFT)) return 0;
+		return -1;
+	}
+
+	union PML entry;
+	entry.raw = physAddr & ~PD_MASK;
+	entry.bits.present      = 1;
+	entry.bits.user         = 1;
+	entry.bits.size         = 1;
+	entry.bits.mmap_shared  = 1;
+	entry.bits.writable     = (flags & MMU_FLAG_WRITABLE) ? 1 : 0;
+	entry.bits.nocache      = (flags & MMU_FLAG_NOCACHE)  ? 1 : 0;
+	entry.bits.writethrough = (flags & MMU_FLAG_WRITETHROUGH) ? 1 : 0;
+	entry.bits.nx           = (flags & MMU_FLAG_NOEXECUTE) ? 1 : 0;
+	if (flags & MMU_FLAG_SPEC) entry.raw |= (1UL << PAGE_SHIFT);
+
+	pd[pd_entry].raw = entry.raw;
+	return 0;
+}
 
 static char * heapStart = NULL;
 extern char end[];
@@ -992,11 +1213,8 @@ void mmu_add_direct_map(uintptr_t addr) {
 	uintptr_t pml = addr >> 30;
 
 
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_frame();
-	mmu_frame_set(index << PAGE_SHIFT);
+	uintptr_t index = mmu_first_frame_or_die();
 	direct_map_pml[pml].raw = (index << PAGE_SHIFT) | KERNEL_PML_ACCESS;
-	spin_unlock(frame_alloc_lock);
 
 	union PML * pds = mmu_map_from_physical(index << PAGE_SHIFT);
 	for (uintptr_t j = 0; j < 512; ++j) {
@@ -1116,6 +1334,9 @@ void mmu_init(size_t memsize, uintptr_t firstFreePage) {
 	size_t size_of_refcounts = (nframes & PAGE_LOW_MASK) ? (nframes + PAGE_SIZE - (nframes & PAGE_LOW_MASK)) : nframes;
 	mem_refcounts = sbrk(size_of_refcounts);
 	memset(mem_refcounts, 0, size_of_refcounts);
+
+	/* Hand what is left over to the buddy allocator */
+	buddy_init(0, nframes);
 }
 
 /**
@@ -1159,8 +1380,9 @@ void * sbrk(size_t bytes) {
 	void * out = heapStart;
 
 	for (uintptr_t p = (uintptr_t)out; p < (uintptr_t)out + bytes; p += PAGE_SIZE) {
+		/* The heap has no way to fail an allocation. */
 		union PML * page = mmu_get_page(p, MMU_GET_MAKE);
-		mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_KERNEL);
+		if (!page || mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_KERNEL)) mmu_out_of_memory();
 	}
 
 	//memset(out, 0xAA, bytes);
@@ -1195,6 +1417,7 @@ void * mmu_map_mmio_region(uintptr_t physical_address, size_t size) {
 	void * out = (void*)mmio_base_address;
 	for (size_t i = 0; i < size; i += PAGE_SIZE) {
 		union PML * p = mmu_get_page(mmio_base_address + i, MMU_GET_MAKE);
+		if (!p) mmu_out_of_memory();
 		mmu_frame_map_address(p, MMU_FLAG_KERNEL | MMU_FLAG_WRITABLE | MMU_FLAG_NOCACHE | MMU_FLAG_WRITETHROUGH, physical_address + i);
 	}
 	mmio_base_address += size;
@@ -1212,7 +1435,7 @@ void * mmu_map_mmio_region(uintptr_t physical_address, size_t size) {
  * relocatable ELF object files and can stick them anywhere.
  *
  * @param size How much space to allocate, will be rounded up to page size.
- * @returns Start of the allocated address space.
+ * @returns Start of the allocated address space, or NULL if we ran out of memory.
  */
 void * mmu_map_module(size_t size) {
 	if (size & PAGE_LOW_MASK) {
@@ -1223,7 +1446,17 @@ void * mmu_map_module(size_t size) {
 	void * out = (void*)module_base_address;
 	for (size_t i = 0; i < size; i += PAGE_SIZE) {
 		union PML * p = mmu_get_page(module_base_address + i, MMU_GET_MAKE);
-		mmu_frame_allocate(p, MMU_FLAG_KERNEL | MMU_FLAG_WRITABLE);
+		if (!p || mmu_frame_allocate(p, MMU_FLAG_KERNEL | MMU_FLAG_WRITABLE)) {
+			/* Give back what we got so far. */
+			for (size_t j = 0; j < i; j += PAGE_SIZE) {
+				union PML * q = mmu_get_page(module_base_address + j, 0);
+				mmu_frame_clear((uintptr_t)q->bits.page << PAGE_SHIFT);
+				q->raw = 0;
+				mmu_invalidate(module_base_address + j);
+			}
+			spin_unlock(module_space_lock);
+			return NULL;
+		}
 	}
 	module_base_address += size;
 	spin_unlock(module_space_lock);
@@ -1279,7 +1512,7 @@ int mmu_copy_on_write(uintptr_t address) {
 	union PML * page = mmu_get_page(address,0);
 
 	/* Was this address pending a cow? */
-	if (!page->bits.cow_pending) {
+	if (!page || !page->bits.cow_pending) {
 		/* No, go back and trigger and a SIGSEGV */
 		return 1;
 	}
@@ -1301,7 +1534,12 @@ int mmu_copy_on_write(uintptr_t address) {
 	/* Allocate a new writable page */
 	uintptr_t faulting_frame = page->bits.page;
 	uintptr_t fresh_frame = mmu_first_frame();
-	mmu_frame_set(fresh_frame << PAGE_SHIFT);
+	if (fresh_frame == (uintptr_t)-1) {
+		/* Out of memory: put our reference back and let the fault kill the process. */
+		refcount_inc(faulting_frame);
+		spin_unlock(frame_alloc_lock);
+		return 1;
+	}
 
 	/* Copy the read-only page into the new writable page */
 	char * page_in  = mmu_map_from_physical(faulting_frame << PAGE_SHIFT);
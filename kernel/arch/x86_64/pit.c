@@ -54,7 +54,7 @@ int pit_interrupt(struct regs *r) {
 
 	if (r->cs == 0x08) return 1;
 
-	switch_task(1);
+	switch_task_preempt();
 	return 1;
 }
 
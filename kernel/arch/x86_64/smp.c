@@ -181,6 +181,9 @@ void load_processor_info(void) {
 	asm volatile ("wrmsr" : : "c"(0xC0000084), "d"(0), "a"(0x700));             /* SFMASK: Direction flag, interrupt flag, trap flag are all cleared */
 }
 
+static int lapic_tsc_deadline = 0;         /**< Whether the APIC timer can be armed with a TSC deadline. */
+static uint64_t lapic_ticks_per_ms = 0;    /**< APIC timer count rate, for when it can't. */
+
 static void lapic_timer_initialize(void) {
 	/* Enable our spurious vector register */
 	*((volatile uint32_t*)(lapic_final + 0x0F0)) = 0x127;
@@ -193,13 +196,49 @@ static void lapic_timer_initialize(void) {
 	while (*((volatile uint32_t*)(lapic_final + 0x390)));
 	uint64_t after = arch_perf_timer();
 
-	uint64_t ms = (after-before)/arch_cpu_mhz();
-	uint64_t target = 10000000000UL / ms;
+	uint64_t us = (after-before)/arch_cpu_mhz();
+	lapic_ticks_per_ms = 1000000000UL / us;
 
-	/* Enable our APIC timer to send periodic wakeup signals */
-	*((volatile uint32_t*)(lapic_final + 0x3e0)) = 1;
-	*((volatile uint32_t*)(lapic_final + 0x320)) = 0x7b | 0x20000;
-	*((volatile uint32_t*)(lapic_final + 0x380)) = target;
+	uint32_t ecx, _unused;
+	cpuid(0x1,_unused,_unused,ecx,_unused);
+	lapic_tsc_deadline = !!(ecx & (1 << 24));
+
+	/* From here on the timer only fires when the scheduler asks it to;
+	 * see arch_timer_oneshot. The fence orders the mode switch before
+	 * any write to the deadline MSR. */
+	*((volatile uint32_t*)(lapic_final + 0x320)) = 0x7b | (lapic_tsc_deadline ? 0x40000 : 0);
+	asm volatile ("mfence" ::: "memory");
+	sched_program_timer(1);
+}
+
+/**
+ * @brief Arm this core's APIC timer to fire once at @p deadline.
+ *
+ * @p deadline is in microseconds of TSC time, as used by relative_time.
+ * UINT64_MAX stops the timer. Without a TSC deadline mode we fall back
+ * to a one-shot count from the calibrated rate, which may come in a bit
+ * early; the scheduler just sets it again.
+ */
+void arch_timer_oneshot(uint64_t deadline) {
+	if (!lapic_final) return;
+
+	if (lapic_tsc_deadline) {
+		extern uint64_t tsc_basis_time;
+		uint64_t tsc = deadline == UINT64_MAX ? 0 : (deadline + tsc_basis_time) * arch_cpu_mhz();
+		asm volatile ("wrmsr" : : "c"(0x6E0), "d"((uint32_t)(tsc >> 32)), "a"((uint32_t)tsc));
+		return;
+	}
+
+	uint64_t count = 0;
+	if (deadline != UINT64_MAX) {
+		unsigned long s, ss;
+		relative_time(0, 0, &s, &ss);
+		uint64_t now = s * 1000000UL + ss;
+		count = deadline > now ? (deadline - now) * lapic_ticks_per_ms / 1000 : 0;
+		if (count < 1) count = 1;
+		if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+	}
+	*((volatile uint32_t*)(lapic_final + 0x380)) = count;
 }
 
 /**
@@ -407,10 +446,10 @@ _toomany:
 	if (cores <= 1) return;
 
 	/* Get a page we can backup the previous contents of the bootstrap target page to, as it probably has mmap crap in multiboot2 */
-	uintptr_t tmp_space = mmu_allocate_a_frame() << 12;
+	uintptr_t tmp_space = mmu_allocate_a_frame_or_panic() << 12;
 	memcpy(mmu_map_from_physical(tmp_space), mmu_map_from_physical(0x1000), 0x1000);
 
-	uintptr_t tmp_page = mmu_allocate_a_frame() << 12;
+	uintptr_t tmp_page = mmu_allocate_a_frame_or_panic() << 12;
 	mmu_populate_low(tmp_page);
 	_ap_entrypoint = (uintptr_t)&ap_main;
 
@@ -477,21 +516,83 @@ void arch_wakeup_others(void) {
 	lapic_send_ipi(0, 0x7E | (3 << 18));
 }
 
+/**
+ * @brief Queue a page for invalidation on another core.
+ *
+ * Addresses are stored with the low bit set so that page zero
+ * can be distinguished from an empty slot.
+ *
+ * @returns 1 if the core needs to be sent an IPI.
+ */
+static int tlb_shootdown_queue(struct ProcessorLocal * core, uintptr_t vaddr) {
+	int queued = 0;
+	for (int i = 0; i < TLB_SHOOTDOWN_SLOTS; ++i) {
+		if (core->tlb_pending[i] == (vaddr | 1)) { queued = 1; break; }
+		if (!core->tlb_pending[i] && __sync_bool_compare_and_swap(&core->tlb_pending[i], 0, vaddr | 1)) { queued = 1; break; }
+	}
+	if (!queued) core->tlb_flush_all = 1;
+	return !__sync_lock_test_and_set(&core->tlb_ipi_pending, 1);
+}
+
 /**
  * @brief Trigger a TLB shootdown on other cores.
  *
- * XXX This is really dumb; we just send an IPI to everyone else
- *     and they reload CR3...
+ * Only cores that have the current address space loaded can have
+ * cached a user mapping, so only they are interrupted; kernel mappings
+ * are shared by everyone. Addresses are batched in each target's
+ * mailbox, and a core that already has an IPI on the way is not sent
+ * another, so a run of invalidations costs each target one interrupt.
  *
- * @param vaddr Should have the address to flush, but not actually used.
+ * @param vaddr Virtual address to invalidate.
  */
 void arch_tlb_shootdown(uintptr_t vaddr) {
 	if (!lapic_final || processor_count < 2) return;
 
-	/*
-	 * We should be checking if this address can be sensibly
-	 * mapped somewhere else before IPIing everyone...
-	 */
+	vaddr &= ~0xFFFUL;
+
+	uint32_t targets;
+	if (vaddr >= 0xFFFF800000000000UL || !this_core->current_process) {
+		targets = (processor_count >= 32) ? 0xFFFFFFFF : ((1U << processor_count) - 1);
+	} else {
+		/* Make sure our page table update is visible before we check who to tell. */
+		__sync_synchronize();
+		targets = this_core->current_process->thread.page_directory->cpu_mask;
+	}
+	targets &= ~(1U << this_core->cpu_id);
+
+	for (int i = 0; i < processor_count; ++i) {
+		if (!(targets & (1U << i))) continue;
+		if (tlb_shootdown_queue(&processor_local_data[i], vaddr)) {
+			lapic_send_ipi(processor_local_data[i].lapic_id, 0x7C);
+		}
+	}
+}
+
+/**
+ * @brief Handle a TLB shootdown IPI.
+ *
+ * The pending flag is cleared before the mailbox is emptied, so anything
+ * queued after we look at it will come with a fresh IPI.
+ */
+void arch_tlb_shootdown_handle(void) {
+	struct ProcessorLocal * core = &processor_local_data[this_core->cpu_id];
+	__sync_lock_release(&core->tlb_ipi_pending);
+	__sync_synchronize();
+
+	int flush_all = __sync_lock_test_and_set(&core->tlb_flush_all, 0);
+
+	for (int i = 0; i < TLB_SHOOTDOWN_SLOTS; ++i) {
+		uintptr_t addr = core->tlb_pending[i];
+		if (!addr) continue;
+		addr = __sync_lock_test_and_set(&core->tlb_pending[i], 0);
+		if (addr && !flush_all) {
+			asm volatile ("invlpg (%0)" : : "r"(addr & ~1UL) : "memory");
+		}
+	}
 
-	lapic_send_ipi(0, 0x7C | (3 << 18));
+	if (flush_all) {
+		uintptr_t cr3;
+		asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+		asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+	}
 }
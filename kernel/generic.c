@@ -20,6 +20,7 @@
 #include <kernel/string.h>
 #include <kernel/printf.h>
 #include <kernel/misc.h>
+#include <kernel/spinlock.h>
 
 extern int system(const char * path, int argc, const char ** argv, const char ** envin);
 extern void tarfs_register_init(void);
@@ -32,11 +33,14 @@ extern void snd_install(void);
 extern void net_install(void);
 extern void console_initialize(void);
 extern void modules_install(void);
+extern void epoll_install(void);
 
 void generic_startup(void) {
 	args_parse(arch_get_cmdline());
+	lockstat_enabled = args_present("lockstat");
 	initialize_process_tree();
 	vfs_install();
+	epoll_install();
 	tarfs_register_init();
 	tmpfs_register_init();
 	map_vfs_directory("/dev");
@@ -0,0 +1,354 @@
+/**
+ * @file kernel/misc/buddy.c
+ * @brief Buddy allocator for physical page frames.
+ *
+ * Free frames are kept in power-of-two blocks on per-order free lists,
+ * so allocating or freeing a frame never has to scan for one. Freed
+ * blocks are merged with their buddy whenever both halves are free.
+ *
+ * Single frames, which is what nearly every caller wants, go through
+ * a small cache on each core that is refilled from and drained back
+ * to the buddy lists in batches, so most page faults never touch the
+ * shared lock at all.
+ *
+ * The architecture's frame bitmap remains the authority on whether a
+ * frame is in use: the MMU code marks frames it gets from us, tells us
+ * about frames it clears, and asks us to give up any free frame that
+ * someone claims directly with mmu_frame_set.
+ *
+ * Bookkeeping lives in arrays on the kernel heap rather than in the
+ * free frames themselves, as not all of physical memory is in the
+ * direct map yet when we are set up.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/spinlock.h>
+#include <kernel/process.h>
+#include <kernel/mmu.h>
+#include <kernel/buddy.h>
+
+#define NIL ((uint32_t)-1)
+
+#define FRAME_CACHES      32
+#define FRAME_CACHE_SIZE  64
+#define FRAME_CACHE_BATCH 32
+
+int buddy_ready = 0;
+
+static uintptr_t buddy_base;     /* frame index of the first frame we manage */
+static size_t    buddy_frames;   /* number of frames we manage */
+static uint8_t  *buddy_order;    /* order+1 for the first frame of a free block, else 0 */
+static uint32_t *buddy_next;
+static uint32_t *buddy_prev;
+static uint32_t  buddy_heads[BUDDY_MAX_ORDER+1];
+static size_t    buddy_blocks[BUDDY_MAX_ORDER+1];
+static spin_lock_t buddy_lock = { 0 };
+
+static struct frame_cache {
+	spin_lock_t lock;
+	int count;
+	uint32_t frames[FRAME_CACHE_SIZE];
+} frame_caches[FRAME_CACHES];
+
+static void buddy_push(uint32_t i, int order) {
+	buddy_order[i] = order + 1;
+	buddy_prev[i] = NIL;
+	buddy_next[i] = buddy_heads[order];
+	if (buddy_heads[order] != NIL) buddy_prev[buddy_heads[order]] = i;
+	buddy_heads[order] = i;
+	buddy_blocks[order]++;
+}
+
+static void buddy_unlink(uint32_t i, int order) {
+	buddy_order[i] = 0;
+	if (buddy_prev[i] != NIL) buddy_next[buddy_prev[i]] = buddy_next[i];
+	else buddy_heads[order] = buddy_next[i];
+	if (buddy_next[i] != NIL) buddy_prev[buddy_next[i]] = buddy_prev[i];
+	buddy_blocks[order]--;
+}
+
+/**
+ * @brief Return a block to the free lists, merging it with its buddies.
+ */
+static void buddy_free_locked(uint32_t i, int order) {
+	while (order < BUDDY_MAX_ORDER) {
+		uint32_t buddy = i ^ (1U << order);
+		if (buddy >= buddy_frames || buddy_order[buddy] != order + 1) break;
+		buddy_unlink(buddy, order);
+		i &= ~(1U << order);
+		order++;
+	}
+	buddy_push(i, order);
+}
+
+/**
+ * @brief Free the frames in [start,end) as the largest aligned blocks that fit.
+ */
+static void buddy_free_range_locked(uint32_t start, uint32_t end) {
+	while (start < end) {
+		int order = 0;
+		while (order < BUDDY_MAX_ORDER && !(start & (1U << order)) && start + (2U << order) <= end) order++;
+		buddy_free_locked(start, order);
+		start += 1U << order;
+	}
+}
+
+/**
+ * @brief Take a block of the given order, splitting a larger one if needed.
+ */
+static uint32_t buddy_alloc_locked(int order) {
+	int o = order;
+	while (o <= BUDDY_MAX_ORDER && buddy_heads[o] == NIL) o++;
+	if (o > BUDDY_MAX_ORDER) return NIL;
+
+	uint32_t i = buddy_heads[o];
+	buddy_unlink(i, o);
+	while (o > order) {
+		o--;
+		buddy_push(i + (1U << o), o);
+	}
+	return i;
+}
+
+/**
+ * @brief Take @p count consecutive maximum-order blocks.
+ *
+ * Requests larger than a single block are rare (the ramdisk, mostly)
+ * so we just look for runs starting at each free block.
+ */
+static uint32_t buddy_alloc_run_locked(size_t count) {
+	const uint32_t size = 1U << BUDDY_MAX_ORDER;
+	for (uint32_t i = buddy_heads[BUDDY_MAX_ORDER]; i != NIL; i = buddy_next[i]) {
+		size_t j;
+		for (j = 1; j < count; ++j) {
+			uint32_t next = i + j * size;
+			if (next >= buddy_frames || buddy_order[next] != BUDDY_MAX_ORDER + 1) break;
+		}
+		if (j == count) {
+			for (j = 0; j < count; ++j) buddy_unlink(i + j * size, BUDDY_MAX_ORDER);
+			return i;
+		}
+	}
+	return NIL;
+}
+
+/**
+ * @brief Push every frame in every per-core cache back to the buddy lists.
+ *
+ * Used when we are about to fail an allocation, so that frames sitting
+ * in another core's cache are not mistaken for memory we do not have.
+ */
+static void buddy_drain_caches(void) {
+	for (int c = 0; c < FRAME_CACHES; ++c) {
+		struct frame_cache * cache = &frame_caches[c];
+		if (!cache->count) continue;
+		spin_lock(cache->lock);
+		spin_lock(buddy_lock);
+		while (cache->count) buddy_free_locked(cache->frames[--cache->count], 0);
+		spin_unlock(buddy_lock);
+		spin_unlock(cache->lock);
+	}
+}
+
+static void * buddy_sbrk(size_t bytes) {
+	bytes = (bytes + 0xFFF) & ~0xFFFUL;
+	void * out = sbrk(0);
+	/* sbrk refuses single requests this large, but successive calls are contiguous */
+	while (bytes) {
+		size_t chunk = bytes > 0x1000000 ? 0x1000000 : bytes;
+		sbrk(chunk);
+		bytes -= chunk;
+	}
+	return out;
+}
+
+/**
+ * @brief Build the free lists from the frame bitmap.
+ *
+ * Called by the MMU once its bitmap is complete and the kernel heap
+ * is available. Until then, the MMU scans its bitmap directly.
+ *
+ * @param base  Frame index of the first frame of physical memory.
+ * @param count Number of frames.
+ */
+void buddy_init(uintptr_t base, size_t count) {
+	buddy_base   = base;
+	buddy_frames = count;
+	buddy_order  = buddy_sbrk(count);
+	buddy_next   = buddy_sbrk(count * sizeof(uint32_t));
+	buddy_prev   = buddy_sbrk(count * sizeof(uint32_t));
+	memset(buddy_order, 0, count);
+
+	for (int o = 0; o <= BUDDY_MAX_ORDER; ++o) {
+		buddy_heads[o] = NIL;
+		buddy_blocks[o] = 0;
+	}
+
+	/* The metadata allocations above may have taken frames, so only look now. */
+	for (size_t i = 0; i < count; ) {
+		if (mmu_frame_test((base + i) << 12)) {
+			i++;
+			continue;
+		}
+		size_t j = i + 1;
+		while (j < count && !mmu_frame_test((base + j) << 12)) j++;
+		buddy_free_range_locked(i, j);
+		i = j;
+	}
+
+	buddy_ready = 1;
+}
+
+/**
+ * @brief Allocate a single frame.
+ *
+ * The caller is responsible for marking the frame in its bitmap.
+ *
+ * @returns a frame index, or @c BUDDY_NO_FRAME if memory is exhausted.
+ */
+uintptr_t buddy_alloc_frame(void) {
+	struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		spin_lock(cache->lock);
+		if (!cache->count) {
+			spin_lock(buddy_lock);
+			while (cache->count < FRAME_CACHE_BATCH) {
+				uint32_t i = buddy_alloc_locked(0);
+				if (i == NIL) break;
+				cache->frames[cache->count++] = i;
+			}
+			spin_unlock(buddy_lock);
+		}
+		if (cache->count) {
+			uintptr_t out = buddy_base + cache->frames[--cache->count];
+			spin_unlock(cache->lock);
+			return out;
+		}
+		spin_unlock(cache->lock);
+		buddy_drain_caches();
+	}
+
+	return BUDDY_NO_FRAME;
+}
+
+/**
+ * @brief Return a single frame, which must already be clear in the bitmap.
+ */
+void buddy_free_frame(uintptr_t frame) {
+	if (!buddy_ready || frame < buddy_base || frame - buddy_base >= buddy_frames) return;
+
+	struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+	spin_lock(cache->lock);
+	if (cache->count == FRAME_CACHE_SIZE) {
+		spin_lock(buddy_lock);
+		while (cache->count > FRAME_CACHE_SIZE - FRAME_CACHE_BATCH) {
+			buddy_free_locked(cache->frames[--cache->count], 0);
+		}
+		spin_unlock(buddy_lock);
+	}
+	cache->frames[cache->count++] = frame - buddy_base;
+	spin_unlock(cache->lock);
+}
+
+/**
+ * @brief Allocate @p n physically contiguous frames.
+ *
+ * The block is rounded up to a power of two (or to a run of the largest
+ * blocks) and whatever is left over past @p n is freed again right away.
+ * The caller is responsible for marking the frames in its bitmap.
+ *
+ * @returns the index of the first frame, or @c BUDDY_NO_FRAME.
+ */
+uintptr_t buddy_alloc_contiguous(size_t n) {
+	if (!n) return BUDDY_NO_FRAME;
+
+	int order = 0;
+	while (order < BUDDY_MAX_ORDER && (1UL << order) < n) order++;
+	size_t run = (n + (1UL << BUDDY_MAX_ORDER) - 1) >> BUDDY_MAX_ORDER;
+
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		spin_lock(buddy_lock);
+		uint32_t i;
+		size_t size;
+		if ((1UL << order) >= n) {
+			i = buddy_alloc_locked(order);
+			size = 1UL << order;
+		} else {
+			i = buddy_alloc_run_locked(run);
+			size = run << BUDDY_MAX_ORDER;
+		}
+		if (i != NIL) {
+			buddy_free_range_locked(i + n, i + size);
+			spin_unlock(buddy_lock);
+			return buddy_base + i;
+		}
+		spin_unlock(buddy_lock);
+		buddy_drain_caches();
+	}
+
+	return BUDDY_NO_FRAME;
+}
+
+/**
+ * @brief Remove a specific frame from the free pool.
+ *
+ * Called when a free frame is claimed directly, such as by mapping a
+ * particular physical address. The frame is carved out of whichever
+ * free block or cache holds it.
+ */
+void buddy_reserve(uintptr_t frame) {
+	if (!buddy_ready || frame < buddy_base || frame - buddy_base >= buddy_frames) return;
+	uint32_t i = frame - buddy_base;
+
+	for (int c = 0; c < FRAME_CACHES; ++c) {
+		struct frame_cache * cache = &frame_caches[c];
+		if (!cache->count) continue;
+		spin_lock(cache->lock);
+		for (int j = 0; j < cache->count; ++j) {
+			if (cache->frames[j] == i) {
+				cache->frames[j] = cache->frames[--cache->count];
+				spin_unlock(cache->lock);
+				return;
+			}
+		}
+		spin_unlock(cache->lock);
+	}
+
+	spin_lock(buddy_lock);
+	for (int o = 0; o <= BUDDY_MAX_ORDER; ++o) {
+		uint32_t head = i & ~((1U << o) - 1);
+		if (buddy_order[head] != o + 1) continue;
+		buddy_unlink(head, o);
+		/* Split down to the frame, freeing the halves that don't contain it. */
+		while (o > 0) {
+			o--;
+			uint32_t half = head + (1U << o);
+			if (i >= half) {
+				buddy_push(head, o);
+				head = half;
+			} else {
+				buddy_push(half, o);
+			}
+		}
+		break;
+	}
+	spin_unlock(buddy_lock);
+}
+
+/**
+ * @brief Count free frames, including those held in per-core caches.
+ */
+size_t buddy_free_count(void) {
+	size_t out = 0;
+	for (int o = 0; o <= BUDDY_MAX_ORDER; ++o) out += buddy_blocks[o] << o;
+	for (int c = 0; c < FRAME_CACHES; ++c) out += frame_caches[c].count;
+	return out;
+}
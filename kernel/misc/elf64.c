@@ -26,6 +26,7 @@
 #include <kernel/hashmap.h>
 #include <kernel/mutex.h>
 #include <kernel/mman.h>
+#include <kernel/time.h>
 #include <sys/auxv.h>
 #include <sys/mman.h>
 
@@ -127,6 +128,11 @@ int elf_module(fs_node_t *file, int argc, char ** argv) {
 			/* First pass, allocate space. */
 			module_size = current_offset;
 			module_load_address = mmu_map_module(module_size);
+			if (!module_load_address) {
+				free(shdrs);
+				mutex_release(_modules_mutex);
+				return -ENOMEM;
+			}
 		}
 	}
 
@@ -257,7 +263,12 @@ _unmap_module:
 extern void process_acquire_big_lock(void);
 extern void process_release_big_lock(void);
 
-static uintptr_t load_from_file(fs_node_t * file, Elf64_Header * header, uintptr_t *base_out, int is_interp) {
+/**
+ * @brief Map the loadable segments of @p file into the current process.
+ *
+ * @returns 0, or the error from the first segment that could not be mapped.
+ */
+static long load_from_file(fs_node_t * file, Elf64_Header * header, uintptr_t *base_out, uintptr_t *phdr_out, int is_interp) {
 	uintptr_t base = 0;
 	uintptr_t phdr_vaddr = 0;
 
@@ -282,8 +293,12 @@ static uintptr_t load_from_file(fs_node_t * file, Elf64_Header * header, uintptr
 			if (phdr.p_flags & PF_X) prot |= PROT_EXEC;
 
 			if (size) {
-				mapped_to = do_mmap(base + addr, size, prot, MAP_PRIVATE | MAP_FIXED, file, offset);
-				if (phdr.p_flags & PF_W) {
+				/* Pages are faulted in from the file (or shared from the page cache) as they are used. */
+				long r = do_mmap(base + addr, size, prot, MAP_PRIVATE | MAP_FIXED, file, offset);
+				if (r < 0) return r;
+				mapped_to = r;
+				/* Only touch the last file page if the segment has a bss to clear; doing so gives us a private copy. */
+				if ((phdr.p_flags & PF_W) && phdr.p_memsz > phdr.p_filesz) {
 					uintptr_t pad = mapped_to + pageoffset + phdr.p_filesz;
 					if (pad & 0xFFF) {
 						size_t fill = 0x1000 - (pad & 0xFFF);
@@ -305,14 +320,16 @@ static uintptr_t load_from_file(fs_node_t * file, Elf64_Header * header, uintptr
 				uintptr_t start_page = (start + 0xFFF) & ~(0xFFF);
 				uintptr_t end_page   = (end + 0xFFF) & ~(0xFFF);
 				if (end_page > start_page) {
-					do_mmap(start_page, end_page - start_page, prot, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, NULL, 0);
+					long r = do_mmap(start_page, end_page - start_page, prot, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, NULL, 0);
+					if (r < 0) return r;
 				}
 			}
 		}
 	}
 
 	*base_out = base;
-	return phdr_vaddr;
+	if (phdr_out) *phdr_out = phdr_vaddr;
+	return 0;
 }
 
 int elf_exec(const char * path, fs_node_t * file, int argc, const char *const argv[], const char *const env[], int interp) {
@@ -347,6 +364,16 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 	for (int i = 0; i < header.e_phnum; ++i) {
 		Elf64_Phdr phdr;
 		read_fs(file, header.e_phoff + header.e_phentsize * i, sizeof(Elf64_Phdr), (uint8_t*)&phdr);
+		if (phdr.p_type == PT_LOAD) {
+			/* Turn away segments that could never be mapped while we can still say so. */
+			uintptr_t base = header.e_type == ET_DYN ? 0x20000000 : 0;
+			if (phdr.p_filesz > phdr.p_memsz || phdr.p_vaddr + phdr.p_memsz < phdr.p_vaddr ||
+			    base + phdr.p_vaddr + phdr.p_memsz > 0x800000000000UL - 512 * 0x400) {
+				if (interpreter) close_fs(interpreter);
+				close_fs(file);
+				return -ENOEXEC;
+			}
+		}
 		if (phdr.p_type == PT_INTERP) {
 			/* Must load interpreter */
 			if (phdr.p_filesz < 2 || phdr.p_filesz > 256) return -EINVAL;
@@ -387,13 +414,13 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 	process_close_fds((process_t *)this_core->current_process, PROC_FD_MODE_CLOEXEC);
 
 	process_acquire_big_lock();
-	mmu_set_directory(NULL);
+	process_set_directory(NULL);
 	page_directory_t * this_directory = this_core->current_process->thread.page_directory;
 	this_core->current_process->thread.page_directory = calloc(1, sizeof(page_directory_t));
 	this_core->current_process->thread.page_directory->refcount = 1;
 	spin_init(this_core->current_process->thread.page_directory->lock);
 	this_core->current_process->thread.page_directory->directory = mmu_clone(NULL);
-	mmu_set_directory(this_core->current_process->thread.page_directory->directory);
+	process_set_directory(this_core->current_process->thread.page_directory);
 	process_release_directory(this_directory);
 	process_release_big_lock();
 
@@ -406,18 +433,26 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 
 	/* Load binary */
 	uintptr_t base_addr;
-	uintptr_t phdr_vaddr = load_from_file(file, &header, &base_addr, 0);
+	uintptr_t phdr_vaddr;
+	long error = load_from_file(file, &header, &base_addr, &phdr_vaddr, 0);
 	uintptr_t entrypoint = header.e_entry + base_addr;
 	uintptr_t interp_base = 0;
 	close_fs(file);
 
 	/* We've loaded the binary, now let's load the interpreter! */
 	if (interpreter) {
-		load_from_file(interpreter, &interp_header, &interp_base, 1);
+		if (!error) error = load_from_file(interpreter, &interp_header, &interp_base, NULL, 1);
 		entrypoint = interp_base + interp_header.e_entry;
 		close_fs(interpreter);
 	}
 
+	if (error) {
+		/* The old image is already gone, so there is nothing to return the error to. */
+		dprintf("exec: %s: could not map a segment (error %ld)\n", path, -error);
+		task_exit(((128 + SIGKILL) << 8) | SIGKILL);
+		__builtin_unreachable();
+	}
+
 	extern uint32_t rand(void);
 
 	#if 0
@@ -436,6 +471,9 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 	do_mmap(userstack - stack_size, stack_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE|MAP_FIXED, NULL, 0);
 	this_core->current_process->image.userstack = userstack;
 
+	/* Map the clock page so libc can read the time without a system call */
+	uintptr_t clock_page = clock_page_map();
+
 #define PUSH(type,val) do { \
 	userstack -= sizeof(type); \
 	while (userstack & (sizeof(type)-1)) userstack--; \
@@ -497,6 +535,7 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 	push_auxv(AT_ENTRY,  base_addr + header.e_entry);
 	push_auxv(AT_BASE,   interp_base);
 	push_auxv(AT_PAGESZ, 4096);
+	if (clock_page) push_auxv(AT_CLOCKPAGE, clock_page);
 	if (at_execfn) push_auxv(AT_EXECFN, at_execfn);
 
 	PUSH(uintptr_t, 0); /* envp NULL */
@@ -11,6 +11,10 @@
 #include <stddef.h>
 #include <kernel/string.h>
 #include <kernel/list.h>
+#include <kernel/slab.h>
+
+static kmem_cache_t list_node_cache;
+static int list_node_cache_ready = 0;
 
 void list_destroy(list_t * list) {
 	/* Free all of the contents of a list */
@@ -52,7 +56,12 @@ void list_append(list_t * list, node_t * node) {
 
 node_t * list_insert(list_t * list, void * item) {
 	/* Insert an item into a list */
-	node_t * node = malloc(sizeof(node_t));
+	if (__builtin_expect(!list_node_cache_ready, 0)) {
+		/* The first list is built long before other cores are started. */
+		kmem_cache_init(&list_node_cache, "list_node", sizeof(node_t), sizeof(void*));
+		list_node_cache_ready = 1;
+	}
+	node_t * node = kmem_cache_alloc(&list_node_cache);
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
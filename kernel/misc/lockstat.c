@@ -0,0 +1,67 @@
+/**
+ * @file kernel/misc/lockstat.c
+ * @brief Spin lock contention statistics.
+ *
+ * When the kernel is booted with the @c lockstat argument, every
+ * spin_lock acquisition is accounted to its call site: how often it
+ * was taken, how often it had to wait, how long it waited for, and
+ * how long it was held. The results are available in /proc/lockstat.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/types.h>
+#include <kernel/spinlock.h>
+#include <kernel/lockstat.h>
+#include <kernel/time.h>
+
+int lockstat_enabled = 0;
+struct lockstat lockstat_sites[LOCKSTAT_SITES];
+
+/**
+ * @brief Find or claim the table entry for a call site.
+ *
+ * Entries are never released, so a lookup is a lock-free probe.
+ * If two cores race to claim a new site we may end up with a
+ * duplicate entry, which is harmless.
+ */
+static struct lockstat * lockstat_site(const char * name, const char * func) {
+	uintptr_t hash = ((uintptr_t)func >> 3) ^ ((uintptr_t)name >> 5);
+	for (size_t i = 0; i < LOCKSTAT_SITES; ++i) {
+		struct lockstat * site = &lockstat_sites[(hash + i) % LOCKSTAT_SITES];
+		if (site->func == func && site->name == name) return site;
+		if (!site->func && __sync_bool_compare_and_swap(&site->func, NULL, func)) {
+			site->name = name;
+			return site;
+		}
+	}
+	return NULL;
+}
+
+void lockstat_acquire(spin_lock_t * lock, const char * name, const char * func, unsigned long spins) {
+	struct lockstat * site = lockstat_site(name, func);
+	if (!site) return;
+
+	__atomic_fetch_add(&site->acquisitions, 1, __ATOMIC_RELAXED);
+	if (spins) {
+		__atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&site->spins, spins, __ATOMIC_RELAXED);
+	}
+
+	lock->acquired = arch_perf_timer();
+	lock->stat = site;
+}
+
+void lockstat_release(spin_lock_t * lock) {
+	struct lockstat * site = lock->stat;
+	uint64_t held = arch_perf_timer() - lock->acquired;
+	lock->stat = NULL;
+
+	__atomic_fetch_add(&site->hold_total, held, __ATOMIC_RELAXED);
+	uint64_t max = site->hold_max;
+	while (held > max && !__atomic_compare_exchange_n(&site->hold_max, &max, held, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
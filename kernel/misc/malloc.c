@@ -3,16 +3,21 @@
  * @brief klange's Slab Allocator
  *
  * This is one of the oldest parts of ToaruOS: the infamous heap allocator.
- * Used in userspace and the kernel alike, this is a straightforward "slab"-
- * style allocator. It has a handful of fixed sizes to stick small objects
- * in and keeps several together in a single page. It's surprisingly fast,
- * needs only an 'sbrk', makes only page-multiple calls to that sbrk, and
- * throwing a big lock around the whole thing seems to have worked just fine
- * for making it thread-safe in userspace applications (not necessarily
- * tested in the kernel).
+ * It started out shared between userspace and the kernel as a "slab"-style
+ * allocator with a handful of fixed sizes for small objects and a list of
+ * "big bins" for everything else, all under one big lock.
  *
- * FIXME The heap allocator has long been lacking an ability to merge large
- *       freed blocks. There's #if 0'd code dating back over a decade in here.
+ * In the kernel, the small sizes are now object caches (see slab.c) with
+ * per-core caches in front of them, so small allocations from different
+ * cores no longer contend with each other or with big allocations. Their
+ * pages come from the frame allocator rather than the heap, and are given
+ * back when they empty out.
+ *
+ * Big bins still come from 'sbrk', in page multiples, and are kept in a
+ * skip list ordered by size for best-fit lookups. Blocks are split when
+ * they are bigger than needed and merged with free neighbours when they
+ * are freed, so the heap no longer fragments into a pile of odd-sized
+ * blocks over a long uptime.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -36,6 +41,7 @@
 #include <kernel/spinlock.h>
 #include <kernel/mmu.h>
 #include <kernel/misc.h>
+#include <kernel/slab.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -75,19 +81,44 @@ static void __assert_fail(const char * f, int l, const char * stmt) {
 
 
 /* }}} */
-
 /*
  * Internal functions.
  */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size);
 static void * __attribute__ ((malloc)) klrealloc(void * ptr, uintptr_t size);
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size);
 static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
 static void klfree(void * ptr);
 
+/*
+ * Small sizes are object caches, one per bin, set up on first use.
+ */
+static kmem_cache_t kmalloc_caches[BIG_BIN];
+static char kmalloc_names[BIG_BIN][16];
+static int kmalloc_ready = 0;
+
+static void kmalloc_init(void) {
+	for (unsigned int i = 0; i < BIG_BIN; ++i) {
+		uintptr_t size = 1UL << (SMALLEST_BIN_LOG + i);
+		snprintf(kmalloc_names[i], 16, "kmalloc-%zu", (size_t)size);
+		kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], size, size < KMEM_SLAB_HEADER ? size : KMEM_SLAB_HEADER);
+	}
+	kmalloc_ready = 1;
+}
+
+static inline uintptr_t __attribute__ ((always_inline, pure)) klmalloc_bin_size(uintptr_t size);
+
+/* Protects the big bins. */
 static spin_lock_t mem_lock =  { 0 };
 
 void * __attribute__ ((malloc)) malloc(uintptr_t size) {
+	if (__builtin_expect(size == 0, 0)) return NULL;
+
+	unsigned int bucket_id = klmalloc_bin_size(size);
+	if (bucket_id < BIG_BIN) {
+		if (__builtin_expect(!kmalloc_ready, 0)) kmalloc_init();
+		return kmem_cache_alloc(&kmalloc_caches[bucket_id]);
+	}
+
 	spin_lock(mem_lock);
 	void * out = klmalloc(size);
 	spin_unlock(mem_lock);
@@ -95,6 +126,23 @@ void * __attribute__ ((malloc)) malloc(uintptr_t size) {
 }
 
 void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
+	if (__builtin_expect(ptr == NULL, 0)) return malloc(size);
+	if (__builtin_expect(size == 0, 0)) {
+		free(ptr);
+		return NULL;
+	}
+
+	kmem_cache_t * cache = kmem_cache_of(ptr);
+	if (cache) {
+		if (size <= cache->object_size) return ptr;
+		void * out = malloc(size);
+		if (out) {
+			memcpy(out, ptr, cache->object_size);
+			kmem_cache_free(cache, ptr);
+		}
+		return out;
+	}
+
 	spin_lock(mem_lock);
 	void * out = klrealloc(ptr, size);
 	spin_unlock(mem_lock);
@@ -102,9 +150,9 @@ void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
 }
 
 void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
-	spin_lock(mem_lock);
-	void * out = klcalloc(nmemb, size);
-	spin_unlock(mem_lock);
+	if (size && nmemb > UINTPTR_MAX / size) return NULL;
+	void * out = malloc(nmemb * size);
+	if (out) memset(out, 0x00, nmemb * size);
 	return out;
 }
 
@@ -116,13 +164,18 @@ void * __attribute__ ((malloc)) valloc(uintptr_t size) {
 }
 
 void free(void * ptr) {
-	spin_lock(mem_lock);
 #ifndef __aarch64__
 	if (ptr < (void*)0xffffff0000000000) {
 		printf("Invalid free detected (%p)\n", ptr);
 		while (1) {};
 	}
 #endif
+	kmem_cache_t * cache = kmem_cache_of(ptr);
+	if (cache) {
+		kmem_cache_free(cache, ptr);
+		return;
+	}
+	spin_lock(mem_lock);
 	klfree(ptr);
 	spin_unlock(mem_lock);
 }
@@ -173,6 +226,10 @@ typedef struct _klmalloc_bin_header {
  * A big bin header is basically the same as a regular bin header
  * only with a pointer to the previous (physically) instead of
  * a "next" and with a list of forward headers.
+ *
+ * Big bins are kept on a list in address order through next and
+ * prev. The heap only grows upwards, so a block's neighbours on
+ * that list are the only candidates for merging with it.
  */
 typedef struct _klmalloc_big_bin_header {
 	struct _klmalloc_big_bin_header * next;
@@ -183,18 +240,9 @@ typedef struct _klmalloc_big_bin_header {
 	struct _klmalloc_big_bin_header * forward[SKIP_MAX_LEVEL+1];
 } klmalloc_big_bin_header;
 
-
-/*
- * List of pages in a bin.
- */
-typedef struct _klmalloc_bin_header_head {
-	klmalloc_bin_header * first;
-} klmalloc_bin_header_head;
-
 /*
- * Array of available bins.
+ * Big bins are located in a skip list.
  */
-static klmalloc_bin_header_head klmalloc_bin_head[NUM_BINS - 1];	/* Small bins */
 static struct _klmalloc_big_bins {
 	klmalloc_big_bin_header head;
 	int level;
@@ -202,43 +250,7 @@ static struct _klmalloc_big_bins {
 static klmalloc_big_bin_header * klmalloc_newest_big = NULL;		/* Newest big bin */
 
 /* }}} Bin management */
-/* Doubly-Linked List {{{ */
-
-/*
- * Remove an entry from a page list.
- * Decouples the element from its
- * position in the list by linking
- * its neighbors to eachother.
- */
-static inline void __attribute__ ((always_inline)) klmalloc_list_decouple(klmalloc_bin_header_head *head, klmalloc_bin_header *node) {
-	klmalloc_bin_header *next	= node->next;
-	head->first = next;
-	node->next = NULL;
-}
-
-/*
- * Insert an entry into a page list.
- * The new entry is placed at the front
- * of the list and the existing border
- * elements are updated to point back
- * to it (our list is doubly linked).
- */
-static inline void __attribute__ ((always_inline)) klmalloc_list_insert(klmalloc_bin_header_head *head, klmalloc_bin_header *node) {
-	node->next = head->first;
-	head->first = node;
-}
-
-/*
- * Get the head of a page list.
- * Because redundant function calls
- * are really great, and just in case
- * we change the list implementation.
- */
-static inline klmalloc_bin_header * __attribute__ ((always_inline)) klmalloc_list_head(klmalloc_bin_header_head *head) {
-	return head->first;
-}
 
-/* }}} Lists */
 /* Skip List {{{ */
 
 /*
@@ -282,6 +294,15 @@ static inline int __attribute__ ((pure, always_inline)) klmalloc_random_level(vo
 	return level;
 }
 
+/*
+ * Nodes are ordered by size, and by address among
+ * nodes of the same size, so that any node can be
+ * found again for deletion.
+ */
+static inline int __attribute__ ((always_inline)) klmalloc_skip_before(klmalloc_big_bin_header * a, klmalloc_big_bin_header * b) {
+	return a->size < b->size || (a->size == b->size && (uintptr_t)a < (uintptr_t)b);
+}
+
 /*
  * Find best fit for a given value.
  */
@@ -338,11 +359,11 @@ static void klmalloc_skip_list_insert(klmalloc_big_bin_header * value) {
 
 	/*
 	 * Loop through the skiplist to find the right place
-	 * to insert the node (where ->forward[] > value)
+	 * to insert the node (where ->forward[] comes after value)
 	 */
 	int i;
 	for (i = klmalloc_big_bins.level; i >= 0; --i) {
-		while (node->forward[i] && node->forward[i]->size < value->size) {
+		while (node->forward[i] && klmalloc_skip_before(node->forward[i], value)) {
 			node = node->forward[i];
 			if (node)
 				assert((node->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
@@ -413,7 +434,7 @@ static void klmalloc_skip_list_delete(klmalloc_big_bin_header * value) {
 	 */
 	int i;
 	for (i = klmalloc_big_bins.level; i >= 0; --i) {
-		while (node->forward[i] && node->forward[i]->size < value->size) {
+		while (node->forward[i] && klmalloc_skip_before(node->forward[i], value)) {
 			node = node->forward[i];
 			if (node)
 				assert((node->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
@@ -421,17 +442,7 @@ static void klmalloc_skip_list_delete(klmalloc_big_bin_header * value) {
 		update[i] = node;
 	}
 	node = node->forward[0];
-	while (node != value) {
-		node = node->forward[0];
-	}
 
-	if (node != value) {
-		node = klmalloc_big_bins.head.forward[0];
-		while (node->forward[0] && node->forward[0] != value) {
-			node = node->forward[0];
-		}
-		node = node->forward[0];
-	}
 	/*
 	 * If we found the node, delete it;
 	 * otherwise, we do nothing.
@@ -518,170 +529,102 @@ static inline int __attribute__ ((always_inline)) klmalloc_stack_empty(klmalloc_
 }
 
 /* }}} Stack */
-
 /* malloc() {{{ */
-static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
-	/*
-	 * C standard implementation:
-	 * If size is zero, we can choose do a number of things.
-	 * This implementation will return a NULL pointer.
-	 */
-	if (__builtin_expect(size == 0, 0))
-		return NULL;
 
+/*
+ * Split the tail off a big bin we are about to hand out,
+ * if there are whole pages past what was asked for, and
+ * free it as a bin of its own.
+ */
+static void klmalloc_big_split(klmalloc_big_bin_header * bin_header, uintptr_t size) {
+	uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
+	uintptr_t old_size = bin_header->size;
+	if (old_size + sizeof(klmalloc_big_bin_header) <= pages * PAGE_SIZE) return;
+
+	bin_header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
+
+	klmalloc_big_bin_header * header_new = (klmalloc_big_bin_header *)((uintptr_t)bin_header + pages * PAGE_SIZE);
+	memset(header_new, 0, sizeof(klmalloc_big_bin_header));
+	header_new->bin_magic = BIN_MAGIC;
+	header_new->size = old_size - pages * PAGE_SIZE;
+	assert((header_new->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+
+	header_new->prev = bin_header;
+	header_new->next = bin_header->next;
+	if (bin_header->next) {
+		bin_header->next->prev = header_new;
+	}
+	bin_header->next = header_new;
+	if (klmalloc_newest_big == bin_header) {
+		klmalloc_newest_big = header_new;
+	}
+
+	klfree((void *)((uintptr_t)header_new + sizeof(klmalloc_big_bin_header)));
+}
+
+static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 	/*
-	 * Find the appropriate bin for the requested
-	 * allocation and start looking through that list.
+	 * Find a best fit from the big bins.
 	 */
-	unsigned int bucket_id = klmalloc_bin_size(size);
-
-	if (bucket_id < BIG_BIN) {
+	klmalloc_big_bin_header * bin_header = klmalloc_skip_list_findbest(size);
+	if (bin_header) {
+		assert(bin_header->size >= size);
 		/*
-		 * Small bins.
+		 * If we found one, delete it from the skip list
 		 */
-		klmalloc_bin_header * bin_header = klmalloc_list_head(&klmalloc_bin_head[bucket_id]);
-		if (!bin_header) {
-			/*
-			 * Grow the heap for the new bin.
-			 */
-			bin_header = (klmalloc_bin_header*)sbrk(PAGE_SIZE);
-			bin_header->bin_magic = BIN_MAGIC;
-			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
-
-			/*
-			 * Set the head of the stack.
-			 */
-			bin_header->head = (void*)((uintptr_t)bin_header + sizeof(klmalloc_bin_header));
-			/*
-			 * Insert the new bin at the front of
-			 * the list of bins for this size.
-			 */
-			klmalloc_list_insert(&klmalloc_bin_head[bucket_id], bin_header);
-			/*
-			 * Initialize the stack inside the bin.
-			 * The stack is initially full, with each
-			 * entry pointing to the next until the end
-			 * which points to NULL.
-			 */
-			uintptr_t adj = SMALLEST_BIN_LOG + bucket_id;
-			uintptr_t i, available = ((PAGE_SIZE - sizeof(klmalloc_bin_header)) >> adj) - 1;
-
-			uintptr_t **base = bin_header->head;
-			for (i = 0; i < available; ++i) {
-				/*
-				 * Our available memory is made into a stack, with each
-				 * piece of memory turned into a pointer to the next
-				 * available piece. When we want to get a new piece
-				 * of memory from this block, we just pop off a free
-				 * spot and give its address.
-				 */
-				base[i << bucket_id] = (uintptr_t *)&base[(i + 1) << bucket_id];
-			}
-			base[available << bucket_id] = NULL;
-			bin_header->size = bucket_id;
-		} else {
-			assert(bin_header->bin_magic == BIN_MAGIC);
-		}
-		uintptr_t ** item = klmalloc_stack_pop(bin_header);
-		if (klmalloc_stack_empty(bin_header)) {
-			klmalloc_list_decouple(&(klmalloc_bin_head[bucket_id]),bin_header);
-		}
-		return item;
-	} else {
+		klmalloc_skip_list_delete(bin_header);
 		/*
-		 * Big bins.
+		 * Retreive the head of the block.
 		 */
-		klmalloc_big_bin_header * bin_header = klmalloc_skip_list_findbest(size);
-		if (bin_header) {
-			assert(bin_header->size >= size);
-			/*
-			 * If we found one, delete it from the skip list
-			 */
-			klmalloc_skip_list_delete(bin_header);
-			/*
-			 * Retreive the head of the block.
-			 */
-			uintptr_t ** item = klmalloc_stack_pop((klmalloc_bin_header *)bin_header);
-#if 0
-			/*
-			 * Resize block, if necessary
-			 */
-			assert(bin_header->head == NULL);
-			uintptr_t old_size = bin_header->size;
-			//uintptr_t rsize = size;
-			/*
-			 * Round the requeste size to our full required size.
-			 */
-			size = ((size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1) * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
-			assert((size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-			if (bin_header->size > size * 2) {
-				assert(old_size != size);
-				/*
-				 * If we have extra space, start splitting.
-				 */
-				bin_header->size = size;
-				assert(sbrk(0) >= bin_header->size + (uintptr_t)bin_header);
-				/*
-				 * Make a new block at the end of the needed space.
-				 */
-				klmalloc_big_bin_header * header_new = (klmalloc_big_bin_header *)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header) + size);
-				assert((uintptr_t)header_new % PAGE_SIZE == 0);
-				memset(header_new, 0, sizeof(klmalloc_big_bin_header) + sizeof(void *));
-				header_new->prev = bin_header;
-				if (bin_header->next) {
-					bin_header->next->prev = header_new;
-				}
-				header_new->next = bin_header->next;
-				bin_header->next = header_new;
-				if (klmalloc_newest_big == bin_header) {
-					klmalloc_newest_big = header_new;
-				}
-				header_new->size = old_size - (size + sizeof(klmalloc_big_bin_header));
-				assert(((uintptr_t)header_new->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-				fprintf(stderr, "Splitting %p [now %zx] at %p [%zx] from [%zx,%zx].\n", (void*)bin_header, bin_header->size, (void*)header_new, header_new->size, old_size, size);
-				/*
-				 * Free the new block.
-				 */
-				klfree((void *)((uintptr_t)header_new + sizeof(klmalloc_big_bin_header)));
-			}
-#endif
-			return item;
-		} else {
-			/*
-			 * Round requested size to a set of pages, plus the header size.
-			 */
-			uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
-			bin_header = (klmalloc_big_bin_header*)sbrk(PAGE_SIZE * pages);
-			bin_header->bin_magic = BIN_MAGIC;
-			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
-			/*
-			 * Give the header the remaining space.
-			 */
-			bin_header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
-			assert((bin_header->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-			/*
-			 * Link the block in physical memory.
-			 */
-			bin_header->prev = klmalloc_newest_big;
-			if (bin_header->prev) {
-				bin_header->prev->next = bin_header;
-			}
-			klmalloc_newest_big = bin_header;
-			bin_header->next = NULL;
-			/*
-			 * Return the head of the block.
-			 */
-			bin_header->head = NULL;
-			return (void*)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header));
-		}
+		uintptr_t ** item = klmalloc_stack_pop((klmalloc_bin_header *)bin_header);
+		/*
+		 * And give back whatever we don't need.
+		 */
+		klmalloc_big_split(bin_header, size);
+		return item;
 	}
+
+	/*
+	 * Round requested size to a set of pages, plus the header size.
+	 */
+	uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
+	bin_header = (klmalloc_big_bin_header*)sbrk(PAGE_SIZE * pages);
+	bin_header->bin_magic = BIN_MAGIC;
+	assert((uintptr_t)bin_header % PAGE_SIZE == 0);
+
+	/*
+	 * Give the header the remaining space.
+	 */
+	bin_header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
+	assert((bin_header->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+
+	/*
+	 * Link the block in physical memory.
+	 */
+	bin_header->prev = klmalloc_newest_big;
+	if (bin_header->prev) {
+		bin_header->prev->next = bin_header;
+	}
+	klmalloc_newest_big = bin_header;
+	bin_header->next = NULL;
+
+	/*
+	 * Return the head of the block.
+	 */
+	bin_header->head = NULL;
+	return (void*)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header));
 }
 /* }}} */
 /* free() {{{ */
+
+/*
+ * Are these two big bins next to each other in memory?
+ */
+static inline int __attribute__ ((always_inline)) klmalloc_big_adjacent(klmalloc_big_bin_header * a, klmalloc_big_bin_header * b) {
+	return (uintptr_t)a + sizeof(klmalloc_big_bin_header) + a->size == (uintptr_t)b;
+}
+
 static void klfree(void *ptr) {
-	/*
-	 * C standard implementation: Do nothing when NULL is passed to free.
-	 */
 	if (__builtin_expect(ptr == NULL, 0)) {
 		return;
 	}
@@ -700,11 +643,8 @@ static void klfree(void *ptr) {
 	 * Get our pointer to the head of this block by
 	 * page aligning it.
 	 */
-	klmalloc_bin_header * header = (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
-	assert((uintptr_t)header % PAGE_SIZE == 0);
-
-	if (header->bin_magic != BIN_MAGIC)
-		return;
+	klmalloc_big_bin_header * bheader = (klmalloc_big_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
+	assert((uintptr_t)bheader % PAGE_SIZE == 0);
 
 	/*
 	 * For small bins, the bin number is stored in the size
@@ -712,109 +652,64 @@ static void klfree(void *ptr) {
 	 * available in the bin is stored in this field. It's
 	 * easy to tell which is which, though.
 	 */
-	uintptr_t bucket_id = header->size;
-	if (bucket_id > (uintptr_t)NUM_BINS) {
-		bucket_id = BIG_BIN;
-		klmalloc_big_bin_header *bheader = (klmalloc_big_bin_header*)header;
-		
-		assert(bheader);
-		assert(bheader->head == NULL);
+	if (bheader->bin_magic != BIN_MAGIC)
+		return;
+	assert(bheader->size > NUM_BINS);
+	assert(bheader->head == NULL);
+	assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+
+	/*
+	 * Coalesce the block after us into us, if it is free.
+	 */
+	klmalloc_big_bin_header * next = bheader->next;
+	if (next && next->head && klmalloc_big_adjacent(bheader, next)) {
+		klmalloc_skip_list_delete(next);
+		bheader->size += sizeof(klmalloc_big_bin_header) + next->size;
 		assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-		/*
-		 * Coalesce forward blocks into us.
-		 */
-#if 0
-		if (bheader != klmalloc_newest_big) {
-			/*
-			 * If we are not the newest big bin, there is most definitely
-			 * something in front of us that we can read.
-			 */
-			assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-			klmalloc_big_bin_header * next = (void *)((uintptr_t)bheader + sizeof(klmalloc_big_bin_header) + bheader->size);
-			assert((uintptr_t)next % PAGE_SIZE == 0);
-			if (next == bheader->next && next->head) { //next->size > NUM_BINS && next->head) {
-				/*
-				 * If that something is an available big bin, we can
-				 * coalesce it into us to form one larger bin.
-				 */
-
-				uintptr_t old_size = bheader->size;
-
-				klmalloc_skip_list_delete(next);
-				bheader->size = (uintptr_t)bheader->size + (uintptr_t)sizeof(klmalloc_big_bin_header) + next->size;
-				assert((bheader->size + sizeof(klmalloc_big_bin_header))  % PAGE_SIZE == 0);
-
-				if (next == klmalloc_newest_big) {
-					/*
-					 * If the guy in front of us was the newest,
-					 * we are now the newest (as we are him).
-					 */
-					klmalloc_newest_big = bheader;
-				} else {
-					if (next->next) {
-						next->next->prev = bheader;
-					}
-				}
-				fprintf(stderr,"Coelesced (forwards)  %p [%zx] <- %p [%zx] = %zx\n", (void*)bheader, old_size, (void*)next, next->size, bheader->size);
-			}
+		bheader->next = next->next;
+		if (next->next) {
+			next->next->prev = bheader;
 		}
-#endif
-		/*
-		 * Coalesce backwards
-		 */
-#if 0
-		if (bheader->prev && bheader->prev->head) {
-			/*
-			 * If there is something behind us, it is available, and there is nothing between
-			 * it and us, we can coalesce ourselves into it to form a big block.
-			 */
-			if ((uintptr_t)bheader->prev + (bheader->prev->size + sizeof(klmalloc_big_bin_header)) == (uintptr_t)bheader) {
-
-				uintptr_t old_size = bheader->prev->size;
-
-				klmalloc_skip_list_delete(bheader->prev);
-				bheader->prev->size = (uintptr_t)bheader->prev->size + (uintptr_t)bheader->size + sizeof(klmalloc_big_bin_header);
-				assert((bheader->prev->size + sizeof(klmalloc_big_bin_header))  % PAGE_SIZE == 0);
-				klmalloc_skip_list_insert(bheader->prev);
-				if (klmalloc_newest_big == bheader) {
-					klmalloc_newest_big = bheader->prev;
-				} else {
-					if (bheader->next) {
-						bheader->next->prev = bheader->prev;
-					}
-				}
-				fprintf(stderr,"Coelesced (backwards) %p [%zx] <- %p [%zx] = %zx\n", (void*)bheader->prev, old_size, (void*)bheader, bheader->size, bheader->size);
-				/*
-				 * If we coalesced backwards, we are done.
-				 */
-				return;
-			}
+		if (klmalloc_newest_big == next) {
+			klmalloc_newest_big = bheader;
 		}
-#endif
-		/*
-		 * Push new space back into the stack.
-		 */
-		klmalloc_stack_push((klmalloc_bin_header *)bheader, (void *)((uintptr_t)bheader + sizeof(klmalloc_big_bin_header)));
-		assert(bheader->head != NULL);
-		/*
-		 * Insert the block into list of available slabs.
-		 */
-		klmalloc_skip_list_insert(bheader);
-	} else {
+		next->bin_magic = 0;
+	}
 
-		/*
-		 * If the stack is empty, we are freeing
-		 * a block from a previously full bin.
-		 * Return it to the busy bins list.
-		 */
-		if (klmalloc_stack_empty(header)) {
-			klmalloc_list_insert(&klmalloc_bin_head[bucket_id], header);
+	/*
+	 * And us into the block before us, if that is free.
+	 */
+	klmalloc_big_bin_header * prev = bheader->prev;
+	if (prev && prev->head && klmalloc_big_adjacent(prev, bheader)) {
+		klmalloc_skip_list_delete(prev);
+		prev->size += sizeof(klmalloc_big_bin_header) + bheader->size;
+		assert((prev->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+		prev->next = bheader->next;
+		if (bheader->next) {
+			bheader->next->prev = prev;
 		}
+		if (klmalloc_newest_big == bheader) {
+			klmalloc_newest_big = prev;
+		}
+		bheader->bin_magic = 0;
 		/*
-		 * Push new space back into the stack.
+		 * prev is already free, so its stack is in order;
+		 * it just needs to go back in the skip list at its new size.
 		 */
-		klmalloc_stack_push(header, ptr);
+		klmalloc_skip_list_insert(prev);
+		return;
 	}
+
+	/*
+	 * Push new space back into the stack.
+	 */
+	klmalloc_stack_push((klmalloc_bin_header *)bheader, (void *)((uintptr_t)bheader + sizeof(klmalloc_big_bin_header)));
+	assert(bheader->head != NULL);
+
+	/*
+	 * Insert the block into list of available slabs.
+	 */
+	klmalloc_skip_list_insert(bheader);
 }
 /* }}} */
 /* valloc() {{{ */
@@ -834,53 +729,21 @@ static void * __attribute__ ((malloc)) klvalloc(uintptr_t size) {
 /* realloc() {{{ */
 static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	/*
-	 * C standard implementation: When NULL is passed to realloc,
-	 * simply malloc the requested size and return a pointer to that.
+	 * Free the old block and copy the data
+	 * to the new block.
 	 */
-	if (__builtin_expect(ptr == NULL, 0))
-		return klmalloc(size);
-
-	/*
-	 * C standard implementation: For a size of zero, free the
-	 * pointer and return NULL, allocating no new memory.
-	 */
-	if (__builtin_expect(size == 0, 0))
-	{
-		free(ptr);
-		return NULL;
-	}
-
-	/*
-	 * Find the bin for the given pointer
-	 * by aligning it to a page.
-	 */
-	klmalloc_bin_header * header_old = (void *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
+	klmalloc_big_bin_header * header_old = (void *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
 	if (header_old->bin_magic != BIN_MAGIC) {
 		assert(0 && "Bad magic on realloc.");
 		return NULL;
 	}
 
-	uintptr_t old_size = header_old->size;
-	if (old_size < (uintptr_t)BIG_BIN) {
-		/*
-		 * If we are copying from a small bin,
-		 * we need to get the size of the bin
-		 * from its id.
-		 */
-		old_size = (1UL << (SMALLEST_BIN_LOG + old_size));
-	}
-
 	/*
-	 * (This will only happen for a big bin, mathematically speaking)
 	 * If we still have room in our bin for the additonal space,
 	 * we don't need to do anything.
 	 */
+	uintptr_t old_size = header_old->size;
 	if (old_size >= size) {
-
-		/*
-		 * TODO: Break apart blocks here, which is far more important
-		 *       than breaking them up on allocations.
-		 */
 		return ptr;
 	}
 
@@ -909,22 +772,21 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	return NULL;
 }
 /* }}} */
-/* calloc() {{{ */
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size) {
-	/*
-	 * Allocate memory and zero it before returning
-	 * a pointer to the newly allocated memory.
-	 * 
-	 * Implemented by way of a simple malloc followed
-	 * by a memset to 0x00 across the length of the
-	 * requested memory chunk.
-	 */
+/* Statistics {{{ */
 
-	void *ptr = klmalloc(nmemb * size);
-	if (__builtin_expect(ptr != NULL, 1))
-		memset(ptr,0x00,nmemb * size);
-	return ptr;
+/*
+ * Summarize the big bins for /proc/slabinfo.
+ */
+void kmalloc_heap_info(size_t * blocks, size_t * free_blocks, size_t * free_bytes, size_t * largest) {
+	*blocks = *free_blocks = *free_bytes = *largest = 0;
+	spin_lock(mem_lock);
+	for (klmalloc_big_bin_header * node = klmalloc_newest_big; node; node = node->prev) {
+		(*blocks)++;
+		if (!node->head) continue;
+		(*free_blocks)++;
+		*free_bytes += node->size;
+		if (node->size > *largest) *largest = node->size;
+	}
+	spin_unlock(mem_lock);
 }
 /* }}} */
-
-
@@ -0,0 +1,185 @@
+/**
+ * @file kernel/misc/profile.c
+ * @brief Sampling profiler.
+ *
+ * While the profiler is running, every core's timer interrupt fires at
+ * least every PROFILE_INTERVAL and records where it interrupted and a
+ * short frame-pointer backtrace into a ring owned by that core. Writing
+ * "start", "stop" or "clear" to /proc/profile controls it, and reading
+ * it drains the rings. apps/perf turns the results into reports.
+ *
+ * Backtraces only go as far as frame pointers do, and only within the
+ * side of the address space the sample was taken in.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/mmu.h>
+#include <kernel/profile.h>
+
+volatile int profile_running = 0;
+struct profile_ring profile_rings[PROFILE_CPUS];
+
+/* Taken by readers only; the timer interrupt never waits on it. */
+static spin_lock_t profile_lock = { 0 };
+
+/**
+ * @brief Check a frame record can be read without faulting.
+ *
+ * We are in an interrupt handler, so we can't take page faults,
+ * and this has to be cheap, so it only checks the page tables of
+ * the address space we interrupted.
+ */
+static int frame_readable(uintptr_t bp, int user) {
+	if (!bp || (bp & (sizeof(uintptr_t) - 1))) return 0;
+	if (user ? (bp >= 0x800000000000 - 2 * sizeof(uintptr_t)) : (bp < 0xffff800000000000)) return 0;
+
+	for (uintptr_t addr = bp; addr < bp + 2 * sizeof(uintptr_t); addr += sizeof(uintptr_t)) {
+		union PML * page = mmu_get_page_other(this_core->current_pml, addr);
+		if (!page || !page->bits.present) return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Record a sample on the current core.
+ *
+ * Called from timer interrupts with the interrupted instruction and
+ * frame pointers.
+ *
+ * @param ip   Interrupted instruction pointer
+ * @param bp   Interrupted frame pointer
+ * @param user Whether we interrupted userspace
+ */
+void profile_sample(uintptr_t ip, uintptr_t bp, int user) {
+	if (!profile_running) return;
+
+	struct profile_ring * ring = &profile_rings[this_core->cpu_id];
+	if (!ring->samples) return;
+
+	struct profile_sample * sample = &ring->samples[ring->head % PROFILE_SAMPLES];
+	volatile process_t * proc = this_core->current_process;
+	sample->pid  = proc ? proc->tgid : 0;
+	sample->tid  = proc ? proc->id : 0;
+	sample->user = !!user;
+	sample->ip[0] = ip;
+
+	int depth = 1;
+	while (depth < PROFILE_DEPTH && frame_readable(bp, user)) {
+		uintptr_t next = ((uintptr_t*)bp)[0];
+		uintptr_t ret  = ((uintptr_t*)bp)[1];
+		if (!ret) break;
+		sample->ip[depth++] = ret;
+		/* Frames only ever get older going up the stack. */
+		if (next <= bp) break;
+		bp = next;
+	}
+	sample->depth = depth;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Start sampling on every core.
+ *
+ * The rings are allocated the first time this is called and kept
+ * for later runs.
+ *
+ * @returns 0 on success, -ENOMEM if the rings could not be allocated.
+ */
+int profile_start(void) {
+	spin_lock(profile_lock);
+	for (int i = 0; i < processor_count && i < PROFILE_CPUS; ++i) {
+		if (profile_rings[i].samples) continue;
+		profile_rings[i].samples = calloc(PROFILE_SAMPLES, sizeof(struct profile_sample));
+		if (!profile_rings[i].samples) {
+			spin_unlock(profile_lock);
+			return -ENOMEM;
+		}
+	}
+	spin_unlock(profile_lock);
+
+	__atomic_store_n(&profile_running, 1, __ATOMIC_RELEASE);
+
+	/* Idle cores have no tick; wake them so they pick one up. */
+	arch_wakeup_others();
+	return 0;
+}
+
+/**
+ * @brief Stop sampling. Anything already recorded can still be read.
+ */
+void profile_stop(void) {
+	__atomic_store_n(&profile_running, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Throw away unread samples.
+ */
+void profile_clear(void) {
+	spin_lock(profile_lock);
+	for (int i = 0; i < PROFILE_CPUS; ++i) {
+		profile_rings[i].tail = profile_rings[i].head;
+		profile_rings[i].lost = 0;
+	}
+	spin_unlock(profile_lock);
+}
+
+/**
+ * @brief Read the oldest unread sample from a core's ring.
+ *
+ * The owning core may lap us while we copy a sample out, so we check
+ * the head again afterwards and count the sample as lost if its slot
+ * could have been reused.
+ *
+ * @returns 1 if @p out was filled in, 0 if there was nothing to read.
+ */
+int profile_next(int cpu, struct profile_sample * out) {
+	struct profile_ring * ring = &profile_rings[cpu];
+	if (!ring->samples) return 0;
+
+	int found = 0;
+	spin_lock(profile_lock);
+	while (!found) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->tail == head) break;
+		if (head - ring->tail > PROFILE_SAMPLES) {
+			ring->lost += head - ring->tail - PROFILE_SAMPLES;
+			ring->tail  = head - PROFILE_SAMPLES;
+		}
+
+		memcpy(out, &ring->samples[ring->tail % PROFILE_SAMPLES], sizeof(struct profile_sample));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head - ring->tail >= PROFILE_SAMPLES) {
+			ring->lost++;
+		} else {
+			found = 1;
+		}
+		ring->tail++;
+	}
+	spin_unlock(profile_lock);
+	return found;
+}
+
+/**
+ * @brief Fetch and reset the count of samples a core has overwritten
+ *        before they were read.
+ */
+uint64_t profile_lost(int cpu) {
+	spin_lock(profile_lock);
+	uint64_t lost = profile_rings[cpu].lost;
+	profile_rings[cpu].lost = 0;
+	spin_unlock(profile_lock);
+	return lost;
+}
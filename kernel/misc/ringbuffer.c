@@ -64,10 +64,10 @@ static inline void ring_buffer_increment_write(ring_buffer_t * ring_buffer) {
 	}
 }
 
-void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer) {
-	if (ring_buffer->alert_waiters) {
-		while (ring_buffer->alert_waiters->head) {
-			node_t * node = list_dequeue(ring_buffer->alert_waiters);
+static void ring_buffer_alert_list(ring_buffer_t * ring_buffer, list_t * waiters) {
+	if (waiters) {
+		while (waiters->head) {
+			node_t * node = list_dequeue(waiters);
 			process_t * p = node->value;
 			process_alert_node(p, ring_buffer);
 			free(node);
@@ -75,15 +75,34 @@ void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer) {
 	}
 }
 
-void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process) {
-	if (!ring_buffer->alert_waiters) {
-		ring_buffer->alert_waiters = list_create("ringbuffer alerts", ring_buffer);
+static void ring_buffer_wait_list(ring_buffer_t * ring_buffer, list_t ** waiters, void * process) {
+	if (!*waiters) {
+		*waiters = list_create("ringbuffer alerts", ring_buffer);
 	}
 
-	if (!list_find(ring_buffer->alert_waiters, process)) {
-		list_insert(ring_buffer->alert_waiters, process);
+	if (!list_find(*waiters, process)) {
+		list_insert(*waiters, process);
 	}
-	list_insert(((process_t *)process)->node_waits, ring_buffer);
+	process_node_wait(process, ring_buffer);
+}
+
+void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer) {
+	ring_buffer_alert_list(ring_buffer, ring_buffer->alert_waiters);
+}
+
+void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process) {
+	ring_buffer_wait_list(ring_buffer, &ring_buffer->alert_waiters, process);
+}
+
+/**
+ * @brief Alert those waiting for there to be room to write.
+ */
+void ring_buffer_alert_writers(ring_buffer_t * ring_buffer) {
+	ring_buffer_alert_list(ring_buffer, ring_buffer->alert_writers);
+}
+
+void ring_buffer_select_wait_write(ring_buffer_t * ring_buffer, void * process) {
+	ring_buffer_wait_list(ring_buffer, &ring_buffer->alert_writers, process);
 }
 
 void ring_buffer_discard(ring_buffer_t * ring_buffer) {
@@ -116,6 +135,7 @@ ssize_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buf
 		}
 	}
 	wakeup_queue(ring_buffer->wait_queue_writers);
+	ring_buffer_alert_writers(ring_buffer);
 	return collected;
 }
 
@@ -157,15 +177,19 @@ ssize_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * bu
 ring_buffer_t * ring_buffer_create(size_t size) {
 	ring_buffer_t * out = malloc(sizeof(ring_buffer_t));
 
-	if (size == 4096) {
-		out->buffer = mmu_map_from_physical(mmu_allocate_a_frame() << 12);
+	uintptr_t frame = size == 4096 ? mmu_allocate_a_frame() : (uintptr_t)-1;
+	if (frame != (uintptr_t)-1) {
+		out->buffer = mmu_map_from_physical(frame << 12);
+		out->frame  = 1;
 	} else {
 		out->buffer     = malloc(size);
+		out->frame      = 0;
 	}
 	out->write_ptr  = 0;
 	out->read_ptr   = 0;
 	out->size       = size;
 	out->alert_waiters = NULL;
+	out->alert_writers = NULL;
 
 	spin_init(out->lock);
 
@@ -180,7 +204,7 @@ ring_buffer_t * ring_buffer_create(size_t size) {
 }
 
 void ring_buffer_destroy(ring_buffer_t * ring_buffer) {
-	if (ring_buffer->size == 4096) {
+	if (ring_buffer->frame) {
 		mmu_frame_release((uintptr_t)ring_buffer->buffer & 0xFFFFFFFFF);
 	} else {
 		free(ring_buffer->buffer);
@@ -189,6 +213,7 @@ void ring_buffer_destroy(ring_buffer_t * ring_buffer) {
 	wakeup_queue(ring_buffer->wait_queue_writers);
 	wakeup_queue(ring_buffer->wait_queue_readers);
 	ring_buffer_alert_waiters(ring_buffer);
+	ring_buffer_alert_writers(ring_buffer);
 
 	list_free(ring_buffer->wait_queue_writers);
 	list_free(ring_buffer->wait_queue_readers);
@@ -200,6 +225,11 @@ void ring_buffer_destroy(ring_buffer_t * ring_buffer) {
 		list_free(ring_buffer->alert_waiters);
 		free(ring_buffer->alert_waiters);
 	}
+
+	if (ring_buffer->alert_writers) {
+		list_free(ring_buffer->alert_writers);
+		free(ring_buffer->alert_writers);
+	}
 }
 
 void ring_buffer_interrupt(ring_buffer_t * ring_buffer) {
@@ -0,0 +1,289 @@
+/**
+ * @file kernel/misc/slab.c
+ * @brief Object caches for fixed-size kernel allocations.
+ *
+ * Each cache hands out objects of one size from single-page slabs
+ * taken straight from the frame allocator (through the direct map),
+ * so they never fragment the kernel heap. Slabs whose objects are
+ * all free are given back, keeping one around per cache.
+ *
+ * As with the frame allocator, every core has a small cache of free
+ * objects in front of the shared slabs, refilled and drained in
+ * batches, so the common case only takes a lock nobody else wants.
+ *
+ * The kernel heap's small size classes are caches like any other,
+ * and free() recognizes objects from any cache, so code can move a
+ * hot allocation to its own cache without changing how it is freed.
+ * Usage for every cache is in /proc/slabinfo.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/spinlock.h>
+#include <kernel/process.h>
+#include <kernel/mmu.h>
+#include <kernel/slab.h>
+
+#define KMEM_SLAB_MAGIC 0x51AB51AB
+
+/**
+ * Slab header, at the start of the slab's page.
+ *
+ * @c magic is at the same offset as the heap's bin magic,
+ * so free() can tell which of the two a page belongs to.
+ */
+struct kmem_slab {
+	struct kmem_slab * next;
+	struct kmem_slab * prev;
+	void * free;
+	uintptr_t magic;
+	kmem_cache_t * cache;
+	uintptr_t frame;
+	size_t inuse;
+};
+
+_Static_assert(sizeof(struct kmem_slab) <= KMEM_SLAB_HEADER, "slab header too big");
+
+static kmem_cache_t * kmem_caches = NULL;
+static spin_lock_t kmem_caches_lock = { 0 };
+static size_t kmem_pages = 0;
+
+/**
+ * @brief Set up a cache in storage provided by the caller.
+ *
+ * Used directly for caches that have to exist before the heap does.
+ */
+void kmem_cache_init(kmem_cache_t * cache, const char * name, size_t size, size_t align) {
+	if (align < sizeof(void*)) align = sizeof(void*);
+	memset(cache, 0, sizeof(kmem_cache_t));
+	cache->name = name;
+	cache->object_size = size;
+	cache->size = (size + align - 1) & ~(align - 1);
+	cache->per_slab = KMEM_MAX_OBJECT / cache->size;
+
+	spin_lock(kmem_caches_lock);
+	cache->next = kmem_caches;
+	kmem_caches = cache;
+	spin_unlock(kmem_caches_lock);
+}
+
+/**
+ * @brief Create a cache for objects of @p size bytes.
+ *
+ * @param align Alignment for objects, at least pointer-sized. Objects
+ *              are never aligned beyond the slab header's 64 bytes.
+ * @returns the new cache, or NULL if @p size does not fit in a slab.
+ */
+kmem_cache_t * kmem_cache_create(const char * name, size_t size, size_t align) {
+	if (!size || size > KMEM_MAX_OBJECT) return NULL;
+	kmem_cache_t * cache = malloc(sizeof(kmem_cache_t));
+	kmem_cache_init(cache, name, size, align);
+	return cache;
+}
+
+static void kmem_slab_insert(kmem_cache_t * cache, struct kmem_slab * slab) {
+	slab->prev = NULL;
+	slab->next = cache->partial;
+	if (slab->next) slab->next->prev = slab;
+	cache->partial = slab;
+}
+
+static void kmem_slab_unlink(kmem_cache_t * cache, struct kmem_slab * slab) {
+	if (slab->prev) slab->prev->next = slab->next;
+	else cache->partial = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->next = NULL;
+	slab->prev = NULL;
+}
+
+/**
+ * @brief Get a fresh slab from the frame allocator.
+ *
+ * Must not be called with the cache locked: when memory is short,
+ * the frame allocator may reclaim page cache entries, and freeing
+ * those can land back in this cache.
+ */
+static struct kmem_slab * kmem_slab_new(kmem_cache_t * cache) {
+	uintptr_t index = mmu_first_frame();
+	if (index == (uintptr_t)-1) return NULL;
+
+	struct kmem_slab * slab = mmu_map_from_physical(index << 12);
+	slab->next = NULL;
+	slab->prev = NULL;
+	slab->magic = KMEM_SLAB_MAGIC;
+	slab->cache = cache;
+	slab->frame = index << 12;
+	slab->inuse = 0;
+
+	char * base = (char*)slab + KMEM_SLAB_HEADER;
+	for (size_t i = 0; i < cache->per_slab; ++i) {
+		*(void**)(base + i * cache->size) = (i + 1 < cache->per_slab) ? base + (i + 1) * cache->size : NULL;
+	}
+	slab->free = base;
+
+	__atomic_add_fetch(&kmem_pages, 1, __ATOMIC_RELAXED);
+	return slab;
+}
+
+/**
+ * @brief Take up to @p count objects from the cache's slabs.
+ * @returns how many we got, which is only 0 if we are out of memory.
+ */
+static int kmem_cache_take(kmem_cache_t * cache, void ** out, int count) {
+	int got = 0;
+
+	spin_lock(cache->lock);
+	while (got < count) {
+		struct kmem_slab * slab = cache->partial;
+		if (!slab) {
+			spin_unlock(cache->lock);
+			slab = kmem_slab_new(cache);
+			spin_lock(cache->lock);
+			if (!slab) break;
+			kmem_slab_insert(cache, slab);
+			cache->slabs++;
+			cache->empty++;
+			cache->free += cache->per_slab;
+			continue;
+		}
+
+		if (!slab->inuse) cache->empty--;
+		while (got < count && slab->free) {
+			void ** obj = slab->free;
+			slab->free = *obj;
+			slab->inuse++;
+			out[got++] = obj;
+		}
+		if (!slab->free) kmem_slab_unlink(cache, slab);
+	}
+	cache->free -= got;
+	spin_unlock(cache->lock);
+
+	return got;
+}
+
+/**
+ * @brief Return objects to their slabs.
+ *
+ * Empty slabs past the first are given back to the frame allocator.
+ */
+static void kmem_cache_put(kmem_cache_t * cache, void ** objs, int count) {
+	spin_lock(cache->lock);
+	for (int i = 0; i < count; ++i) {
+		struct kmem_slab * slab = (struct kmem_slab *)((uintptr_t)objs[i] & ~0xFFFUL);
+		if (!slab->free) kmem_slab_insert(cache, slab);
+		*(void**)objs[i] = slab->free;
+		slab->free = objs[i];
+		slab->inuse--;
+		cache->free++;
+
+		if (!slab->inuse) {
+			if (cache->empty) {
+				kmem_slab_unlink(cache, slab);
+				cache->slabs--;
+				cache->free -= cache->per_slab;
+				slab->magic = 0;
+				__atomic_sub_fetch(&kmem_pages, 1, __ATOMIC_RELAXED);
+				mmu_frame_release(slab->frame);
+			} else {
+				cache->empty++;
+			}
+		}
+	}
+	spin_unlock(cache->lock);
+}
+
+/**
+ * @brief Allocate an object.
+ *
+ * Objects are not cleared.
+ */
+void * kmem_cache_alloc(kmem_cache_t * cache) {
+	struct kmem_cpu_cache * cpu = &cache->cpu[this_core->cpu_id];
+
+	spin_lock(cpu->lock);
+	if (cpu->count) {
+		void * out = cpu->objects[--cpu->count];
+		cpu->allocs++;
+		spin_unlock(cpu->lock);
+		return out;
+	}
+	spin_unlock(cpu->lock);
+
+	/* Refill without holding our core's cache, see kmem_slab_new */
+	void * batch[KMEM_CPU_BATCH];
+	int got = kmem_cache_take(cache, batch, KMEM_CPU_BATCH);
+	if (!got) return NULL;
+	void * out = batch[--got];
+
+	/* We may have moved to another core in the meantime; that's fine. */
+	cpu = &cache->cpu[this_core->cpu_id];
+	spin_lock(cpu->lock);
+	cpu->allocs++;
+	while (got && cpu->count < KMEM_CPU_OBJECTS) {
+		cpu->objects[cpu->count++] = batch[--got];
+	}
+	spin_unlock(cpu->lock);
+
+	if (got) kmem_cache_put(cache, batch, got);
+	return out;
+}
+
+/**
+ * @brief Free an object.
+ *
+ * @param cache The object's cache, or NULL to look it up.
+ */
+void kmem_cache_free(kmem_cache_t * cache, void * obj) {
+	if (!obj) return;
+	if (!cache) cache = kmem_cache_of(obj);
+	if (!cache) return;
+
+	struct kmem_cpu_cache * cpu = &cache->cpu[this_core->cpu_id];
+	void * batch[KMEM_CPU_BATCH];
+	int drained = 0;
+
+	spin_lock(cpu->lock);
+	if (cpu->count == KMEM_CPU_OBJECTS) {
+		while (drained < KMEM_CPU_BATCH) batch[drained++] = cpu->objects[--cpu->count];
+	}
+	cpu->objects[cpu->count++] = obj;
+	cpu->frees++;
+	spin_unlock(cpu->lock);
+
+	if (drained) kmem_cache_put(cache, batch, drained);
+}
+
+/**
+ * @brief Find the cache an object came from.
+ * @returns the cache, or NULL if @p obj is not a cache object.
+ */
+kmem_cache_t * kmem_cache_of(void * obj) {
+	/* Objects are never at the start of a page, but valloc'd heap blocks are. */
+	if (!((uintptr_t)obj & 0xFFF)) return NULL;
+	struct kmem_slab * slab = (struct kmem_slab *)((uintptr_t)obj & ~0xFFFUL);
+	if (slab->magic != KMEM_SLAB_MAGIC) return NULL;
+	return slab->cache;
+}
+
+/**
+ * @brief Head of the list of all caches, for /proc/slabinfo.
+ *
+ * Caches are never destroyed, so the list can be walked without a lock.
+ */
+kmem_cache_t * kmem_cache_list(void) {
+	return kmem_caches;
+}
+
+/**
+ * @brief Pages held by all caches, in use or not.
+ */
+size_t kmem_cache_pages(void) {
+	return kmem_pages;
+}
@@ -0,0 +1,133 @@
+/**
+ * @file kernel/misc/trace.c
+ * @brief Kernel event tracing.
+ *
+ * The TRACE() tracepoints scattered through the scheduler, system call,
+ * fault, block and network paths append fixed-size binary records to a
+ * ring owned by the core they run on. Records are timestamped with
+ * arch_perf_timer() and written without locks: an interrupt handler on
+ * the same core can trace in the middle of another tracepoint, so
+ * slots are claimed with an atomic increment and each record carries
+ * a sequence number that is written last.
+ *
+ * Writing "start", "stop" or "clear" to /proc/trace controls tracing,
+ * and reading it returns everything still in the rings. apps/ktrace
+ * turns that into a timeline.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
+
+struct trace_ring {
+	struct trace_event * events;
+	volatile uint64_t head;
+	uint64_t tail;
+};
+
+volatile int trace_enabled = 0;
+static struct trace_ring trace_rings[TRACE_CPUS];
+static spin_lock_t trace_lock = { 0 };
+
+void trace_record(int type, uint64_t a, uint64_t b) {
+	struct trace_ring * ring = &trace_rings[this_core->cpu_id];
+	if (!ring->events) return;
+
+	uint64_t index = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	struct trace_event * event = &ring->events[index % TRACE_EVENTS];
+
+	/* Readers that copied this slot before we finish will see seq change. */
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	volatile process_t * proc = this_core->current_process;
+	event->time = arch_perf_timer();
+	event->type = type;
+	event->cpu  = this_core->cpu_id;
+	event->pid  = proc ? proc->tgid : 0;
+	event->tid  = proc ? proc->id : 0;
+	event->a    = a;
+	event->b    = b;
+
+	__atomic_store_n(&event->seq, (uint32_t)(index + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Start tracing on every core.
+ *
+ * The rings are allocated the first time this is called and
+ * kept for later runs.
+ */
+int trace_start(void) {
+	spin_lock(trace_lock);
+	for (int i = 0; i < processor_count && i < TRACE_CPUS; ++i) {
+		if (trace_rings[i].events) continue;
+		trace_rings[i].events = calloc(TRACE_EVENTS, sizeof(struct trace_event));
+		if (!trace_rings[i].events) {
+			spin_unlock(trace_lock);
+			return -ENOMEM;
+		}
+	}
+	spin_unlock(trace_lock);
+
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void trace_stop(void) {
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Forget everything recorded so far.
+ */
+void trace_clear(void) {
+	spin_lock(trace_lock);
+	for (int i = 0; i < TRACE_CPUS; ++i) {
+		trace_rings[i].tail = trace_rings[i].head;
+	}
+	spin_unlock(trace_lock);
+}
+
+/**
+ * @brief Get the range of record indexes that may still be in a ring.
+ *
+ * @param lost Set to how many records since the last clear have
+ *             already been overwritten.
+ */
+void trace_bounds(int cpu, uint64_t * start, uint64_t * end, uint64_t * lost) {
+	struct trace_ring * ring = &trace_rings[cpu];
+	spin_lock(trace_lock);
+	uint64_t head = ring->events ? __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) : 0;
+	uint64_t tail = ring->events ? ring->tail : 0;
+	spin_unlock(trace_lock);
+
+	*start = (head - tail > TRACE_EVENTS) ? head - TRACE_EVENTS : tail;
+	*end   = head;
+	*lost  = *start - tail;
+}
+
+/**
+ * @brief Copy out record @p index from a core's ring.
+ *
+ * @returns 1 on success, 0 if the record was overwritten or was
+ *          still being written when we looked.
+ */
+int trace_copy(int cpu, uint64_t index, struct trace_event * out) {
+	struct trace_event * event = &trace_rings[cpu].events[index % TRACE_EVENTS];
+	uint32_t seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+	if (seq != (uint32_t)(index + 1)) return 0;
+	memcpy(out, event, sizeof(struct trace_event));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == seq;
+}
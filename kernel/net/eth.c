@@ -18,6 +18,7 @@
 #include <kernel/net/netif.h>
 #include <kernel/net/eth.h>
 #include <kernel/net/ipv4.h>
+#include <kernel/trace.h>
 #include <bits/errno.h>
 
 #include <sys/socket.h>
@@ -40,6 +41,8 @@ void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size
 		return;
 	}
 
+	TRACE(TRACE_NET_RX, size, ntohs(frame->type));
+
 	spin_lock(net_raw_sockets_lock);
 	foreach(node, net_raw_sockets_list) {
 		sock_t * sock = node->value;
@@ -75,6 +78,7 @@ void net_eth_send(struct EthernetDevice * nic, size_t len, void* data, uint16_t
 	memcpy(packet->destination, dest, 6);
 	memcpy(packet->source, nic->mac, 6);
 	packet->type = htons(type);
+	TRACE(TRACE_NET_TX, total_size, type);
 	write_fs(nic->device_node, 0, total_size, (uint8_t*)packet);
 	free(packet);
 }
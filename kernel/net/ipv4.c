@@ -181,9 +181,9 @@ static void procfs_net_icmp_func(fs_node_t * node) {
 	}
 }
 
-static struct procfs_entry procfs_net_udp  = { 0, "udp",  procfs_net_udp_func,  0 };
-static struct procfs_entry procfs_net_tcp  = { 0, "tcp",  procfs_net_tcp_func,  0 };
-static struct procfs_entry procfs_net_icmp = { 0, "icmp", procfs_net_icmp_func, 0 };
+static struct procfs_entry procfs_net_udp  = { 0, "udp",  procfs_net_udp_func,  0, NULL };
+static struct procfs_entry procfs_net_tcp  = { 0, "tcp",  procfs_net_tcp_func,  0, NULL };
+static struct procfs_entry procfs_net_icmp = { 0, "icmp", procfs_net_icmp_func, 0, NULL };
 
 void ipv4_install(void) {
 	udp_sockets = hashmap_create_int(10);
@@ -1072,16 +1072,10 @@ static long sock_tcp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 		size_into += size_to_send;
 
 		if (size_remaining) {
-			/* Keep us away from the BSP... */
-			if (processor_count > 1) {
-				if (this_core->cpu_id == 0) {
-					delay_yield(0);
-				}
-			} else {
-				if (arch_perf_timer() - last > 10000UL * arch_cpu_mhz()) {
-					delay_yield(0);
-					last = arch_perf_timer();
-				}
+			/* Give everyone else a turn during long sends. */
+			if (arch_perf_timer() - last > 10000UL * arch_cpu_mhz()) {
+				delay_yield(0);
+				last = arch_perf_timer();
 			}
 		}
 	}
@@ -70,7 +70,7 @@ static void procfs_net_pex_func(fs_node_t * node) {
 	}
 }
 
-static struct procfs_entry procfs_net_pex  = { 0, "pex",  procfs_net_pex_func,  0 };
+static struct procfs_entry procfs_net_pex  = { 0, "pex",  procfs_net_pex_func,  0, NULL };
 
 void pex_sock_install(void) {
 	pex_servers = hashmap_create(10);
@@ -91,7 +91,7 @@ int sock_generic_wait(fs_node_t *node, void * process) {
 	if (!list_find(sock->alert_wait, process)) {
 		list_insert(sock->alert_wait, process);
 	}
-	list_insert(((process_t *)process)->node_waits, sock);
+	process_node_wait(process, sock);
 	spin_unlock(sock->alert_lock);
 	return 0;
 }
@@ -0,0 +1,198 @@
+/**
+ * @file  kernel/sys/futex.c
+ * @brief Fast userspace mutexes.
+ *
+ * Userspace locks keep their state in an aligned 32-bit word and
+ * only enter the kernel when they need to sleep or to wake a sleeper.
+ * Sleepers are kept in a small hash table of wait lists, keyed by
+ * the physical address of the word, so threads sharing an address
+ * space and processes sharing memory both find each other.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/printf.h>
+#include <kernel/time.h>
+#include <kernel/spinlock.h>
+#include <kernel/process.h>
+#include <kernel/list.h>
+#include <kernel/mmu.h>
+#include <kernel/futex.h>
+#include <sys/futex.h>
+
+#define FUTEX_BUCKETS 64
+
+/**
+ * @brief A thread waiting on a futex.
+ *
+ * Lives on the waiting thread's kernel stack for the duration of the
+ * wait. The thread sleeps on its own private @c queue so that a wake
+ * can target it exactly, while @c node links it into a hash bucket.
+ */
+struct futex_waiter {
+	uintptr_t key;
+	volatile int woken;
+	list_t queue;
+	node_t node;
+};
+
+static struct futex_bucket {
+	spin_lock_t lock;
+	list_t waiters;
+} futex_table[FUTEX_BUCKETS];
+
+static struct futex_bucket * futex_bucket(uintptr_t key) {
+	return &futex_table[(key >> 2) % FUTEX_BUCKETS];
+}
+
+/**
+ * @brief Find the key for a futex word.
+ *
+ * The word is validated as writable, which also breaks any copy-on-write
+ * sharing, so the physical address stays stable while anyone waits on it.
+ */
+static long futex_key(volatile uint32_t * uaddr, uintptr_t * key) {
+	if ((uintptr_t)uaddr & 3) return -EINVAL;
+	if (!mmu_validate_user_pointer((void*)uaddr, sizeof(uint32_t), MMU_PTR_WRITE)) return -EFAULT;
+	uintptr_t phys = mmu_map_to_physical(this_core->current_process->thread.page_directory->directory, (uintptr_t)uaddr);
+	if ((intptr_t)phys < 0) return -EFAULT;
+	*key = phys;
+	return 0;
+}
+
+/**
+ * @brief Wake a waiter. The bucket lock must be held.
+ */
+static void futex_wake_one(struct futex_bucket * bucket, struct futex_waiter * waiter) {
+	list_delete(&bucket->waiters, &waiter->node);
+	waiter->woken = 1;
+	wakeup_queue_one(&waiter->queue);
+}
+
+long futex_wait(volatile uint32_t * uaddr, uint32_t val, const struct timespec * timeout) {
+	uintptr_t key;
+	long result = futex_key(uaddr, &key);
+	if (result) return result;
+
+	unsigned long s = 0, ss = 0;
+	if (timeout) {
+		if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000L) return -EINVAL;
+		relative_time(timeout->tv_sec, timeout->tv_nsec / 1000, &s, &ss);
+	}
+
+	struct futex_bucket * bucket = futex_bucket(key);
+	struct futex_waiter waiter = {0};
+	waiter.key = key;
+	waiter.node.value = &waiter;
+
+	spin_lock(bucket->lock);
+
+	/* Checked under the bucket lock, so a waker that changes the word
+	 * before calling futex_wake can not slip by us. */
+	if (*uaddr != val) {
+		spin_unlock(bucket->lock);
+		return -EAGAIN;
+	}
+
+	list_append(&bucket->waiters, &waiter.node);
+
+	int slept = timeout ?
+		sleep_on_unlocking_timeout(&waiter.queue, &bucket->lock, s, ss) :
+		sleep_on_unlocking(&waiter.queue, &bucket->lock);
+
+	/* We may have been requeued onto another futex while asleep. */
+	while (1) {
+		bucket = futex_bucket(waiter.key);
+		spin_lock(bucket->lock);
+		if (bucket == futex_bucket(waiter.key)) break;
+		spin_unlock(bucket->lock);
+	}
+
+	if (waiter.woken) {
+		result = 0;
+	} else {
+		list_delete(&bucket->waiters, &waiter.node);
+		result = slept < 0 ? -ETIMEDOUT : -EINTR;
+	}
+	spin_unlock(bucket->lock);
+
+	return result;
+}
+
+long futex_wake(volatile uint32_t * uaddr, int count) {
+	uintptr_t key;
+	long result = futex_key(uaddr, &key);
+	if (result) return result;
+
+	struct futex_bucket * bucket = futex_bucket(key);
+	int woken = 0;
+
+	spin_lock(bucket->lock);
+	node_t * node = bucket->waiters.head;
+	while (node && woken < count) {
+		node_t * next = node->next;
+		struct futex_waiter * waiter = node->value;
+		if (waiter->key == key) {
+			futex_wake_one(bucket, waiter);
+			woken++;
+		}
+		node = next;
+	}
+	spin_unlock(bucket->lock);
+
+	return woken;
+}
+
+long futex_requeue(volatile uint32_t * uaddr, int count, int requeue, volatile uint32_t * uaddr2) {
+	uintptr_t key, key2;
+	long result = futex_key(uaddr, &key);
+	if (result) return result;
+	result = futex_key(uaddr2, &key2);
+	if (result) return result;
+
+	struct futex_bucket * bucket  = futex_bucket(key);
+	struct futex_bucket * bucket2 = futex_bucket(key2);
+	int woken = 0;
+	int moved = 0;
+
+	/* Take both bucket locks in address order. */
+	if (bucket < bucket2) {
+		spin_lock(bucket->lock);
+		spin_lock(bucket2->lock);
+	} else if (bucket > bucket2) {
+		spin_lock(bucket2->lock);
+		spin_lock(bucket->lock);
+	} else {
+		spin_lock(bucket->lock);
+	}
+
+	node_t * node = bucket->waiters.head;
+	while (node && (woken < count || moved < requeue)) {
+		node_t * next = node->next;
+		struct futex_waiter * waiter = node->value;
+		if (waiter->key == key) {
+			if (woken < count) {
+				futex_wake_one(bucket, waiter);
+				woken++;
+			} else {
+				waiter->key = key2;
+				if (bucket != bucket2) {
+					list_delete(&bucket->waiters, &waiter->node);
+					list_append(&bucket2->waiters, &waiter->node);
+				}
+				moved++;
+			}
+		}
+		node = next;
+	}
+
+	spin_unlock(bucket->lock);
+	if (bucket != bucket2) spin_unlock(bucket2->lock);
+
+	return woken;
+}
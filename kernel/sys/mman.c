@@ -15,93 +15,396 @@
 #include <kernel/mmu.h>
 #include <kernel/string.h>
 #include <kernel/mman.h>
+#include <kernel/pagecache.h>
+#include <kernel/trace.h>
 
-extern void mmu_unmap_user(uintptr_t addr, size_t size);
+/* How far ahead to map after a fault in a MADV_SEQUENTIAL file mapping, in pages */
+#define SEQUENTIAL_WINDOW 16
 
-extern union PML * mmu_get_page_other_x(union PML * root, uintptr_t virtAddr, int flags);
+/* Faults fill in the rest of an aligned block of this many pages, see mmap_fault_around */
+#define FAULT_AROUND 16
 
-enum fault_response mmap_fault_other(process_t * proc, uintptr_t addr, enum fault_code flags) {
-	enum fault_response out = FAULT_RESPONSE_NO_MAPPING;
+#define HUGE_PAGE_SIZE 0x200000UL
 
-	spin_lock(proc->image.lock);
-	int fail_on_retry = 0;
+/*
+ * Mappings never overlap, so finding the one that holds an address only
+ * needs them ordered by base; they are kept in an AVL tree for lookups
+ * alongside the sorted list that everything else walks. Bases can be
+ * changed in place, as long as that doesn't move a mapping past its
+ * neighbours, which trimming and merging never do.
+ */
+static int map_height(memmap_t * node) {
+	return node ? node->height : 0;
+}
 
-_retry: (void)0;
-	for (memmap_t * maps = proc->thread.page_directory->mappings; maps; maps = maps->next) {
-		if (addr >= maps->base && addr < maps->base + maps->length) {
-			if (maps->prot == PROT_NONE) goto _fault_bad;
-
-			/* Check if memory access would violate known mapping conditions. */
-			if ((flags & FAULT_CODE_WRITE) && !(maps->prot & PROT_WRITE)) { out = FAULT_RESPONSE_BAD_WRITE; goto _fault_bad; }
-			if ((flags & FAULT_CODE_READ) && !(maps->prot & PROT_READ))   { out = FAULT_RESPONSE_BAD_READ;  goto _fault_bad; }
-			if ((flags & FAULT_CODE_INSTR) && !(maps->prot & PROT_EXEC))  { out = FAULT_RESPONSE_BAD_INSTR; goto _fault_bad; }
-
-			size_t align_down = addr & ~0xFFF;
-			size_t map_offset = align_down - maps->base;
-			size_t map_fsoff  = maps->offset + map_offset;
-
-			int mmu_flags = 0;
-			if (maps->prot & PROT_WRITE) mmu_flags |= MMU_FLAG_WRITABLE;
-			if (!(maps->prot & PROT_EXEC)) mmu_flags |= MMU_FLAG_NOEXECUTE;
-
-			union PML * page = mmu_get_page_other_x(proc->thread.page_directory->directory, align_down, MMU_GET_MAKE);
-
-			if (maps->file && maps->file->fault_map) {
-				int ret = maps->file->fault_map(maps->file, page, map_fsoff, flags, maps->flags, maps->prot, &mmu_flags);
-
-				if (ret == 0) {
-					/* fault_map did something with the page, we should finish allocating it
-					 * with the modified flags and return successfully. */
-					mmu_frame_allocate(page, mmu_flags);
-					if (proc == (process_t*)this_core->current_process) {
-						mmu_invalidate(align_down);
-						if (maps->prot & PROT_EXEC) arch_clear_icache(align_down, align_down + 0x1000);
-					}
-					spin_unlock(proc->image.lock);
-					return FAULT_RESPONSE_RESUME;
-				} else if (ret > 1) {
-					goto _fault_bad;
-				}
+static void map_update(memmap_t * node) {
+	int l = map_height(node->left);
+	int r = map_height(node->right);
+	node->height = (l > r ? l : r) + 1;
+}
 
-				/* Fault was deferred to normal code path. */
-			}
+static memmap_t * map_rotate_right(memmap_t * node) {
+	memmap_t * left = node->left;
+	node->left = left->right;
+	left->right = node;
+	map_update(node);
+	map_update(left);
+	return left;
+}
 
-			/* May have a shared CoW mapping, remove it.*/
-			if ((flags & FAULT_CODE_WRITE) && maps->file) {
-				if (page->bits.present && page->bits.page && (page->bits.mmap_shared & 1)) {
-					page->bits.page = 0;
-					page->bits.mmap_shared = 0;
-				}
-			}
+static memmap_t * map_rotate_left(memmap_t * node) {
+	memmap_t * right = node->right;
+	node->right = right->left;
+	right->left = node;
+	map_update(node);
+	map_update(right);
+	return right;
+}
 
-			mmu_frame_allocate(page, mmu_flags);
+static memmap_t * map_balance(memmap_t * node) {
+	map_update(node);
+	int balance = map_height(node->left) - map_height(node->right);
+	if (balance > 1) {
+		if (map_height(node->left->left) < map_height(node->left->right)) node->left = map_rotate_left(node->left);
+		return map_rotate_right(node);
+	}
+	if (balance < -1) {
+		if (map_height(node->right->right) < map_height(node->right->left)) node->right = map_rotate_right(node->right);
+		return map_rotate_left(node);
+	}
+	return node;
+}
 
-			char * page_back = mmu_map_from_physical((uintptr_t)page->bits.page << 12);
-			if (maps->file) {
-				ssize_t r = read_fs(maps->file, map_fsoff, 0x1000, (void*)page_back);
-				if (r >= 0 && r < 0x1000) {
-					memset((void*)(page_back + r), 0, 0x1000 - r);
-				}
-			} else {
-				memset((void*)(page_back), 0, 0x1000);
-			}
-			mmu_flush(page_back);
-			spin_unlock(proc->image.lock);
+static memmap_t * map_tree_insert(memmap_t * root, memmap_t * node) {
+	if (!root) {
+		node->left = NULL;
+		node->right = NULL;
+		node->height = 1;
+		return node;
+	}
+	if (node->base < root->base) root->left = map_tree_insert(root->left, node);
+	else root->right = map_tree_insert(root->right, node);
+	return map_balance(root);
+}
+
+static memmap_t * map_tree_remove_min(memmap_t * root, memmap_t ** min) {
+	if (!root->left) {
+		*min = root;
+		return root->right;
+	}
+	root->left = map_tree_remove_min(root->left, min);
+	return map_balance(root);
+}
 
+static memmap_t * map_tree_remove(memmap_t * root, memmap_t * node) {
+	if (!root) return NULL;
+	if (node->base < root->base) {
+		root->left = map_tree_remove(root->left, node);
+	} else if (node->base > root->base) {
+		root->right = map_tree_remove(root->right, node);
+	} else {
+		if (!root->right) return root->left;
+		memmap_t * min;
+		memmap_t * right = map_tree_remove_min(root->right, &min);
+		min->left = root->left;
+		min->right = right;
+		return map_balance(min);
+	}
+	return map_balance(root);
+}
+
+/**
+ * @brief Find the first mapping that ends after @p addr.
+ *
+ * That's the mapping holding @p addr if there is one, and otherwise
+ * the next one up, which makes it the place to start walking the
+ * list for anything that works on a range.
+ */
+static memmap_t * mmap_first_after(page_directory_t * dir, uintptr_t addr) {
+	memmap_t * best = NULL;
+	for (memmap_t * node = dir->map_tree; node; ) {
+		if (node->base + node->length > addr) {
+			best = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return best;
+}
+
+/**
+ * @brief Find the mapping holding @p addr.
+ * @returns the mapping, or NULL if @p addr is not mapped.
+ */
+memmap_t * mmap_find(page_directory_t * dir, uintptr_t addr) {
+	memmap_t * maps = mmap_first_after(dir, addr);
+	return (maps && maps->base <= addr) ? maps : NULL;
+}
+
+/**
+ * @brief Put a new mapping in the list after @p prev, or first, and in the tree.
+ */
+static void link_mapping(page_directory_t * dir, memmap_t * prev, memmap_t * maps) {
+	maps->owner = dir;
+	maps->prev = prev;
+	maps->next = prev ? prev->next : dir->mappings;
+	if (maps->next) maps->next->prev = maps;
+	if (prev) prev->next = maps;
+	else dir->mappings = maps;
+	dir->map_tree = map_tree_insert(dir->map_tree, maps);
+}
+
+/**
+ * @brief Take a mapping out of the list and the tree and free it.
+ */
+static void unlink_mapping(page_directory_t * dir, memmap_t * maps) {
+	dir->map_tree = map_tree_remove(dir->map_tree, maps);
+	if (maps->prev) maps->prev->next = maps->next;
+	else dir->mappings = maps->next;
+	if (maps->next) maps->next->prev = maps->prev;
+	if (maps->file) close_fs(maps->file);
+	free(maps);
+}
+
+/**
+ * @brief Try to map the 2MiB block around @p addr with one large page.
+ *
+ * Only for shared mappings of devices that promise physically contiguous
+ * memory (FS_CONTIGUOUS). We ask the device for the first and last pages
+ * of the block to check that it really is one aligned physical block.
+ *
+ * @returns 0 if the block was mapped, non-zero to fall back to small pages.
+ */
+static int mmap_fault_huge(process_t * proc, memmap_t * maps, uintptr_t addr, enum fault_code flags, int mmu_flags) {
+	uintptr_t block = addr & ~(HUGE_PAGE_SIZE - 1);
+	if (block < maps->base || block + HUGE_PAGE_SIZE > maps->base + maps->length) return 1;
+
+	off_t first = maps->offset + (block - maps->base);
+	union PML probe = {0};
+	if (maps->file->fault_map(maps->file, &probe, first, flags, maps->flags, maps->prot, &mmu_flags)) return 1;
+	uintptr_t phys = (uintptr_t)probe.bits.page << 12;
+	if (phys & (HUGE_PAGE_SIZE - 1)) return 1;
+
+	int last_flags = mmu_flags;
+	probe.raw = 0;
+	if (maps->file->fault_map(maps->file, &probe, first + HUGE_PAGE_SIZE - 0x1000, flags, maps->flags, maps->prot, &last_flags)) return 1;
+	if (((uintptr_t)probe.bits.page << 12) != phys + HUGE_PAGE_SIZE - 0x1000) return 1;
+
+	if (mmu_map_user_huge(proc->thread.page_directory->directory, block, phys, mmu_flags)) return 1;
+	if (proc == (process_t*)this_core->current_process) mmu_invalidate(block);
+	return 0;
+}
+
+static int mmap_wants_huge(memmap_t * maps) {
+	return maps->file && maps->file->fault_map && (maps->file->flags & FS_CONTIGUOUS) && (maps->flags & MAP_SHARED);
+}
+
+/**
+ * @brief Fill in the page table entry @p page for @p addr in a mapping.
+ *
+ * The caller holds the image lock and has already checked @p flags
+ * against the mapping's protection.
+ *
+ * @param fresh The entry is known not to be present, so there is nothing
+ *              in any TLB to invalidate; used when filling in neighbours.
+ * @param major Set if we had to read the file to fill the page.
+ */
+static enum fault_response mmap_fault_fill(process_t * proc, memmap_t * maps, union PML * page, uintptr_t addr, enum fault_code flags, int fresh, int * major) {
+	size_t align_down = addr & ~0xFFF;
+	size_t map_offset = align_down - maps->base;
+	size_t map_fsoff  = maps->offset + map_offset;
+
+	int mmu_flags = 0;
+	if (maps->prot & PROT_WRITE) mmu_flags |= MMU_FLAG_WRITABLE;
+	if (!(maps->prot & PROT_EXEC)) mmu_flags |= MMU_FLAG_NOEXECUTE;
+
+	if (maps->file && (maps->file->fault_map || (maps->file->flags & FS_CACHED))) {
+		int ret = maps->file->fault_map ?
+			maps->file->fault_map(maps->file, page, map_fsoff, flags, maps->flags, maps->prot, &mmu_flags) :
+			pagecache_fault_map(maps->file, page, map_fsoff, flags, maps->flags, maps->prot, &mmu_flags);
+
+		if (ret == 0) {
+			/* fault_map did something with the page, we should finish allocating it
+			 * with the modified flags and return successfully. */
+			mmu_frame_allocate(page, mmu_flags);
+			if (proc == (process_t*)this_core->current_process) {
+				if (!fresh) mmu_invalidate(align_down);
+				if (maps->prot & PROT_EXEC) arch_clear_icache(align_down, align_down + 0x1000);
+			}
 			return FAULT_RESPONSE_RESUME;
+		} else if (ret > 1) {
+			return FAULT_RESPONSE_NO_MAPPING;
+		}
+
+		/* Fault was deferred to normal code path. */
+	}
+
+	/* May have a shared CoW mapping, remove it.*/
+	uintptr_t shared_frame = 0;
+	if ((flags & FAULT_CODE_WRITE) && maps->file) {
+		if (page->bits.present && page->bits.page && (page->bits.mmap_shared & 1)) {
+			shared_frame = page->bits.page;
+			page->bits.page = 0;
+			page->bits.mmap_shared = 0;
+		}
+	}
+
+	if (mmu_frame_allocate(page, mmu_flags)) {
+		if (shared_frame) {
+			page->bits.page = shared_frame;
+			page->bits.mmap_shared = 1;
+		}
+		return FAULT_RESPONSE_NO_MAPPING;
+	}
+
+	char * page_back = mmu_map_from_physical((uintptr_t)page->bits.page << 12);
+	if (maps->file) {
+		ssize_t r = read_fs(maps->file, map_fsoff, 0x1000, (void*)page_back);
+		if (r >= 0 && r < 0x1000) {
+			memset((void*)(page_back + r), 0, 0x1000 - r);
+		}
+		if (major) *major = 1;
+	} else {
+		memset((void*)(page_back), 0, 0x1000);
+	}
+	mmu_flush(page_back);
+	if (shared_frame) {
+		/* Nobody may still be looking at the old page when we let go of it. */
+		if (proc == (process_t*)this_core->current_process) mmu_invalidate(align_down);
+		pagecache_frame_unref(shared_frame);
+	}
+
+	return FAULT_RESPONSE_RESUME;
+}
+
+/**
+ * @brief Fill in one page of a mapping.
+ */
+static enum fault_response mmap_fault_page(process_t * proc, memmap_t * maps, uintptr_t addr, enum fault_code flags, int * major) {
+	if (mmap_wants_huge(maps)) {
+		int mmu_flags = 0;
+		if (maps->prot & PROT_WRITE) mmu_flags |= MMU_FLAG_WRITABLE;
+		if (!(maps->prot & PROT_EXEC)) mmu_flags |= MMU_FLAG_NOEXECUTE;
+		if (!mmap_fault_huge(proc, maps, addr, flags, mmu_flags)) return FAULT_RESPONSE_RESUME;
+	}
+
+	union PML * page = mmu_get_page_other_x(proc->thread.page_directory->directory, addr & ~0xFFF, MMU_GET_MAKE);
+	if (!page) return FAULT_RESPONSE_NO_MAPPING;
+
+	return mmap_fault_fill(proc, maps, page, addr, flags, 0, major);
+}
+
+static int page_is_present(process_t * proc, uintptr_t addr) {
+	union PML * page = mmu_get_page_other(proc->thread.page_directory->directory, addr);
+	return page ? page->bits.present : (mmu_map_to_physical(proc->thread.page_directory->directory, addr) < (uintptr_t)-10);
+}
+
+/**
+ * @brief Fill in every page of a mapping from @p start to @p end that is not there yet.
+ *
+ * Works a page table at a time, so each table is only looked up once.
+ * Pages are filled in as if read: file pages come from the page cache
+ * where they can, and anonymous pages are zeroed.
+ */
+static void mmap_populate_locked(process_t * proc, memmap_t * maps, uintptr_t start, uintptr_t end) {
+	if (start < maps->base) start = maps->base;
+	if (end > maps->base + maps->length) end = maps->base + maps->length;
+	if (maps->prot == PROT_NONE) return;
+
+	if (mmap_wants_huge(maps)) {
+		for (uintptr_t addr = start; addr < end; addr += 0x1000) {
+			if (page_is_present(proc, addr)) continue;
+			if (mmap_fault_page(proc, maps, addr, FAULT_CODE_READ, NULL) != FAULT_RESPONSE_RESUME) return;
+		}
+		return;
+	}
+
+	for (uintptr_t addr = start; addr < end; ) {
+		uintptr_t table_end = (addr | (HUGE_PAGE_SIZE - 1)) + 1;
+		if (table_end > end) table_end = end;
+
+		union PML * page = mmu_get_page_other_x(proc->thread.page_directory->directory, addr, MMU_GET_MAKE);
+		if (!page) return;
+
+		for (; addr < table_end; addr += 0x1000, page++) {
+			if (page->bits.present) continue;
+			if (mmap_fault_fill(proc, maps, page, addr, FAULT_CODE_READ, 1, NULL) != FAULT_RESPONSE_RESUME) return;
 		}
 	}
+}
 
-	if (!fail_on_retry && addr < proc->image.userstack && addr >= proc->image.userstack - 0x10000) {
+/**
+ * @brief Fill in the neighbours of a page that was just faulted in.
+ *
+ * Pages of cached files around the fault are mapped from the page
+ * cache, which is cheap if they are already cached and saves a fault
+ * each if they get used. Anonymous pages cost memory, so they are only filled in
+ * ahead of a fault that continues a run of present pages, as when
+ * something writes its way through a fresh buffer. MADV_RANDOM turns
+ * this off, and MADV_SEQUENTIAL reads further ahead in files, with
+ * the window after the one it maps read in the background.
+ */
+static void mmap_fault_around(process_t * proc, memmap_t * maps, uintptr_t addr) {
+	if (maps->advice == MADV_RANDOM) return;
+
+	uintptr_t page = addr & ~0xFFF;
+	uintptr_t block = page & ~(FAULT_AROUND * 0x1000 - 1);
+
+	if (maps->file && maps->advice == MADV_SEQUENTIAL) {
+		mmap_populate_locked(proc, maps, page + 0x1000, page + 0x1000 + SEQUENTIAL_WINDOW * 0x1000);
+		/* Have the window after that on its way in for the next fault. */
+		uintptr_t next = page + 0x1000 + SEQUENTIAL_WINDOW * 0x1000;
+		if (!maps->file->fault_map && (maps->file->flags & FS_CACHED) && next < maps->base + maps->length) {
+			pagecache_readahead(maps->file, maps->offset + (next - maps->base), SEQUENTIAL_WINDOW * 0x1000);
+		}
+	} else if (maps->file && !maps->file->fault_map && (maps->file->flags & FS_CACHED)) {
+		mmap_populate_locked(proc, maps, block, block + FAULT_AROUND * 0x1000);
+	} else if (!maps->file && page > maps->base && page_is_present(proc, page - 0x1000)) {
+		mmap_populate_locked(proc, maps, page + 0x1000, block + FAULT_AROUND * 0x1000);
+	}
+}
+
+/**
+ * @brief Add a mapping, replacing anything already there; the image lock must be held.
+ */
+static void insert_mapping(process_t * proc, uintptr_t addr, intptr_t length, int prot, int flags, fs_node_t * node, off_t offset);
+
+enum fault_response mmap_fault_other(process_t * proc, uintptr_t addr, enum fault_code flags) {
+	enum fault_response out = FAULT_RESPONSE_NO_MAPPING;
+
+	TRACE(TRACE_FAULT_ENTER, addr, flags);
+	spin_lock(proc->image.lock);
+
+	memmap_t * maps = mmap_find(proc->thread.page_directory, addr);
+
+	if (!maps && addr < proc->image.userstack && addr >= proc->image.userstack - 0x10000) {
 		size_t align_down = addr & ~0xFFF;
-		do_mmap(align_down, proc->image.userstack - align_down, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE|MAP_FIXED, NULL, 0);
+		insert_mapping(proc, align_down, proc->image.userstack - align_down, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, NULL, 0);
 		proc->image.userstack = align_down;
-		fail_on_retry = 1;
-		goto _retry;
+		maps = mmap_find(proc->thread.page_directory, addr);
+	}
+
+	if (!maps) goto _fault_bad;
+	if (maps->prot == PROT_NONE) goto _fault_bad;
+
+	/* Check if memory access would violate known mapping conditions. */
+	if ((flags & FAULT_CODE_WRITE) && !(maps->prot & PROT_WRITE)) { out = FAULT_RESPONSE_BAD_WRITE; goto _fault_bad; }
+	if ((flags & FAULT_CODE_READ) && !(maps->prot & PROT_READ))   { out = FAULT_RESPONSE_BAD_READ;  goto _fault_bad; }
+	if ((flags & FAULT_CODE_INSTR) && !(maps->prot & PROT_EXEC))  { out = FAULT_RESPONSE_BAD_INSTR; goto _fault_bad; }
+
+	int major = 0;
+	out = mmap_fault_page(proc, maps, addr, flags, &major);
+
+	if (out == FAULT_RESPONSE_RESUME) {
+		if (major) proc->faults_major++;
+		else proc->faults_minor++;
+		mmap_fault_around(proc, maps, addr);
 	}
 
 _fault_bad:
 	spin_unlock(proc->image.lock);
+	TRACE(TRACE_FAULT_EXIT, addr, out);
 	return out;
 }
 
@@ -117,53 +420,53 @@ static int map_overlaps(memmap_t * map, uintptr_t addr, intptr_t length) {
 	return (map->base < addr + length && addr < map->base + map->length);
 }
 
+/**
+ * @brief Cut a mapping in two at @p at, which must be inside it.
+ * @returns the new mapping for the part from @p at on.
+ */
+static memmap_t * split_mapping(memmap_t * maps, uintptr_t at) {
+	memmap_t * split = calloc(1, sizeof(memmap_t));
+
+	size_t into = at - maps->base;
+	split->base   = at;
+	split->length = maps->length - into;
+	split->prot = maps->prot;
+	split->flags = maps->flags;
+	split->advice = maps->advice;
+	split->file = maps->file;
+	if (maps->file) {
+		split->offset = maps->offset + into;
+		open_fs(split->file, 0);
+	}
+
+	maps->length = into;
+	link_mapping(maps->owner, maps, split);
+
+	return split;
+}
+
 static void unmap_segments_locked(uintptr_t addr, intptr_t length, process_t * proc) {
-	memmap_t * prev = NULL;
+	page_directory_t * dir = proc->thread.page_directory;
 	memmap_t * next = NULL;
-	for (memmap_t * maps = proc->thread.page_directory->mappings; maps; maps = next) {
+	for (memmap_t * maps = mmap_first_after(dir, addr); maps && maps->base < addr + length; maps = next) {
 		next = maps->next;
-		if (map_overlaps(maps, addr, length)) {
-			uintptr_t nend = addr + length;
-			uintptr_t oend = maps->base + maps->length;
-
-			if (addr <= maps->base && nend >= oend) {
-				if (!prev) this_core->current_process->thread.page_directory->mappings = maps->next;
-				else prev->next = maps->next;
-				if (maps->next) maps->next->prev = maps->prev;
-				if (maps->file) close_fs(maps->file);
-				free(maps);
-				continue;
-			} else if (addr <= maps->base && nend < oend) {
-				size_t into = nend - maps->base;
-				if (maps->file) maps->offset = maps->offset + into;
-				maps->base = nend;
-				maps->length = oend - nend;
-			} else if (addr > maps->base && nend >= oend) {
-				maps->length = addr - maps->base;
-			} else if (addr > maps->base && nend < oend) {
-				maps->length = addr - maps->base;
-				memmap_t * split = calloc(1, sizeof(memmap_t));
-
-				size_t into = nend - maps->base;
-				split->base   = nend;
-				split->length = oend - nend;
-				split->owner = maps->owner;
-				split->prot = maps->prot;
-				split->flags = maps->flags;
-				split->file = maps->file;
-				if (maps->file) {
-					split->offset = maps->offset + into;
-					open_fs(split->file, 0);
-				}
-
-				split->next = maps->next;
-				if (split->next) split->next->prev = split;
-				split->prev = maps;
-				maps->next = split;
-			}
+		uintptr_t nend = addr + length;
+		uintptr_t oend = maps->base + maps->length;
+
+		if (addr <= maps->base && nend >= oend) {
+			unlink_mapping(dir, maps);
+		} else if (addr <= maps->base && nend < oend) {
+			size_t into = nend - maps->base;
+			if (maps->file) maps->offset = maps->offset + into;
+			maps->base = nend;
+			maps->length = oend - nend;
+		} else if (addr > maps->base && nend >= oend) {
+			maps->length = addr - maps->base;
+		} else if (addr > maps->base && nend < oend) {
+			split_mapping(maps, nend);
+			maps->length = addr - maps->base;
+			break;
 		}
-
-		prev = maps;
 	}
 	mmu_unmap_user(addr, length);
 }
@@ -176,6 +479,125 @@ long mmap_unmap(uintptr_t addr, size_t length) {
 	return 0;
 }
 
+/**
+ * @brief Change the protection of a range of mappings.
+ *
+ * The whole range must be mapped. Mappings are split where the range
+ * starts and ends inside them, and pages already present get their
+ * access bits changed in place; anything else picks up the new
+ * protection when it faults in.
+ *
+ * Pages in a range made PROT_NONE are hidden but keep their contents,
+ * which come back when access is restored.
+ */
+long mmap_protect(uintptr_t addr, size_t length, int prot) {
+	process_t * proc = this_core->current_process->process;
+
+	if (addr & 0xFFF) return -EINVAL;
+	if (prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) return -EINVAL;
+	if (length == 0) return 0;
+	length = (length + 0xFFF) & ~0xFFFUL;
+	if (addr >= 0x800000000000UL || length > 0x800000000000UL - addr) return -ENOMEM;
+
+	uintptr_t end = addr + length;
+
+	spin_lock(proc->image.lock);
+
+	memmap_t * first = mmap_first_after(proc->thread.page_directory, addr);
+
+	/* Everything has to be mapped, and shared files need somewhere to put writes. */
+	uintptr_t covered = addr;
+	for (memmap_t * maps = first; maps && covered < end; maps = maps->next) {
+		if (maps->base > covered) break;
+		if ((prot & PROT_WRITE) && (maps->flags & MAP_SHARED) && maps->file &&
+			(!maps->file->fault_map || !(maps->file->mask & 0222))) {
+			spin_unlock(proc->image.lock);
+			return -EACCES;
+		}
+		covered = maps->base + maps->length;
+	}
+	if (covered < end) {
+		spin_unlock(proc->image.lock);
+		return -ENOMEM;
+	}
+
+	for (memmap_t * maps = first; maps && maps->base < end; maps = maps->next) {
+		if (maps->base < addr) {
+			maps = split_mapping(maps, addr);
+		}
+		if (maps->base + maps->length > end) {
+			split_mapping(maps, end);
+		}
+		maps->prot = prot;
+		mmu_protect_user(maps->base, maps->length, prot, !!(maps->flags & MAP_SHARED));
+	}
+
+	/* Instruction caches have to see what was written while the pages were
+	 * still writable. Pages that aren't there yet get this when they fault in. */
+	if (prot & PROT_EXEC) {
+		for (uintptr_t a = addr; a < end; a += 0x1000) {
+			union PML * page = mmu_get_page_other(proc->thread.page_directory->directory, a);
+			if (page && page->bits.present) arch_clear_icache(a, a + 0x1000);
+		}
+	}
+
+	spin_unlock(proc->image.lock);
+	return 0;
+}
+
+/**
+ * @brief Take advice on how a range of mappings will be used.
+ *
+ * MADV_DONTNEED throws away what is mapped, so anonymous memory comes back
+ * as zeroes and file mappings are read again. MADV_WILLNEED reads in file
+ * mappings right away. MADV_SEQUENTIAL maps further ahead on every fault
+ * in a file mapping, and MADV_RANDOM maps only the page that faulted.
+ *
+ * As on Linux, a range with holes in it gets -ENOMEM, but the advice is
+ * still applied to the parts of it that are mapped.
+ */
+long mmap_advise(uintptr_t addr, size_t length, int advice) {
+	process_t * proc = this_core->current_process->process;
+
+	if (addr & 0xFFF) return -EINVAL;
+	if (advice < MADV_NORMAL || advice > MADV_DONTNEED) return -EINVAL;
+	if (length == 0) return 0;
+	length = (length + 0xFFF) & ~0xFFFUL;
+	if (addr >= 0x800000000000UL || length > 0x800000000000UL - addr) return -ENOMEM;
+
+	uintptr_t end = addr + length;
+	uintptr_t reached = addr; /* everything below this is mapped */
+	int gaps = 0;
+
+	spin_lock(proc->image.lock);
+	for (memmap_t * maps = mmap_first_after(proc->thread.page_directory, addr); maps && maps->base < end; maps = maps->next) {
+		if (maps->base > reached) gaps = 1;
+
+		uintptr_t start = maps->base < addr ? addr : maps->base;
+		uintptr_t stop  = maps->base + maps->length > end ? end : maps->base + maps->length;
+
+		switch (advice) {
+			case MADV_DONTNEED:
+				mmu_unmap_user(start, stop - start);
+				break;
+			case MADV_WILLNEED:
+				if (maps->file) mmap_populate_locked(proc, maps, start, stop);
+				break;
+			default:
+				if (maps->advice == advice) break;
+				if (maps->base < start) maps = split_mapping(maps, start);
+				if (maps->base + maps->length > stop) split_mapping(maps, stop);
+				maps->advice = advice;
+				break;
+		}
+
+		reached = stop;
+	}
+	spin_unlock(proc->image.lock);
+
+	return (gaps || reached < end) ? -ENOMEM : 0;
+}
+
 static void sanity_check(union PML * page) {
 #if defined(__x86_64__)
 	if (page->bits.cow_pending) {
@@ -187,36 +609,30 @@ static void sanity_check(union PML * page) {
 #endif
 }
 
-static void insert_mapping(uintptr_t addr, intptr_t length, int prot, int flags, fs_node_t * node, off_t offset) {
-	process_t * proc = this_core->current_process->process;
+static void insert_mapping(process_t * proc, uintptr_t addr, intptr_t length, int prot, int flags, fs_node_t * node, off_t offset) {
+	page_directory_t * dir = proc->thread.page_directory;
 	unmap_segments_locked(addr, length, proc);
 
-	flags &= ~(MAP_FIXED);
+	flags &= ~(MAP_FIXED | MAP_POPULATE);
 
-	memmap_t * prev = NULL;
-	memmap_t * next = this_core->current_process->thread.page_directory->mappings;
-	for (memmap_t * maps = this_core->current_process->thread.page_directory->mappings; maps; maps = maps->next) {
-		if (maps->base > addr) break;
-		next = maps->next;
-		prev = maps;
+	memmap_t * next = mmap_first_after(dir, addr);
+	memmap_t * prev = next ? next->prev : NULL;
+	if (!next) {
+		/* Everything is below us; find the last mapping. */
+		for (memmap_t * last = dir->map_tree; last; last = last->right) prev = last;
 	}
 
-	if (prev && prev->base + prev->length == addr && prev->flags == flags && prev->prot == prot && prev->file == node && (!node || (prev->offset + length == offset))) {
+	/* Mappings with advice keep it to themselves, so they are never merged. */
+	if (prev && prev->advice == MADV_NORMAL && prev->base + prev->length == addr && prev->flags == flags && prev->prot == prot && prev->file == node && (!node || (prev->offset + prev->length == offset))) {
 		/* merge backwards */
 		prev->length += length;
 
-		if (next && next->base == addr + length && next->flags == flags && next->prot == prot && next->file == node && (!node || (prev->offset + prev->length == next->offset))) {
+		if (next && next->advice == MADV_NORMAL && next->base == addr + length && next->flags == flags && next->prot == prot && next->file == node && (!node || (prev->offset + prev->length == next->offset))) {
 			/* Also merge forward */
 			prev->length += next->length;
-			prev->next = next->next;
-			if (next->next) {
-				next->next->prev = prev;
-			}
-
-			if (next->file) close_fs(next->file);
-			free(next);
+			unlink_mapping(dir, next);
 		}
-	} else if (next && next->base == addr + length && next->flags == flags && next->prot == prot && next->file == node && (!node || (offset + length == next->offset))) {
+	} else if (next && next->advice == MADV_NORMAL && next->base == addr + length && next->flags == flags && next->prot == prot && next->file == node && (!node || (offset + length == next->offset))) {
 		/* Merge only forward */
 		next->base = addr;
 		next->length += length;
@@ -233,40 +649,33 @@ static void insert_mapping(uintptr_t addr, intptr_t length, int prot, int flags,
 			open_fs(node, 0);
 		}
 
-		new_mapping->owner = this_core->current_process->thread.page_directory;
-
-		if (!prev) {
-			this_core->current_process->thread.page_directory->mappings = new_mapping;
-		} else {
-			prev->next = new_mapping;
-			new_mapping->prev = prev;
-		}
-		new_mapping->next = next;
-		if (next) next->prev = new_mapping;
+		link_mapping(dir, prev, new_mapping);
 	}
 }
 
-static uintptr_t find_good_spot(process_t * proc, size_t length) {
+static uintptr_t find_good_spot(process_t * proc, size_t length, size_t align) {
 	/* First try for a perfect fit */
 	for (memmap_t * maps = proc->thread.page_directory->mappings; maps; maps = maps->next) {
 		memmap_t * next = maps->next;
-		if (next && next->base == maps->base + maps->length + length) {
-			return maps->base + maps->length;
+		uintptr_t addr = (maps->base + maps->length + align - 1) & ~(align - 1);
+		if (next && next->base == addr + length) {
+			return addr;
 		}
 	}
 	/* Then try for... a fit. */
 	for (memmap_t * maps = proc->thread.page_directory->mappings; maps; maps = maps->next) {
 		memmap_t * next = maps->next;
-		if (next && next->base >= maps->base + maps->length + length) {
-			return maps->base + maps->length;
+		uintptr_t addr = (maps->base + maps->length + align - 1) & ~(align - 1);
+		if (next && next->base >= addr + length) {
+			return addr;
 		}
 	}
 	/* Then go back to the end-of-heap pointer. */
-	uintptr_t addr = proc->image.heap;
+	uintptr_t addr = (proc->image.heap + align - 1) & ~(align - 1);
 
 	for (memmap_t * maps = proc->thread.page_directory->mappings; maps; maps = maps->next) {
 		if (map_overlaps(maps, addr, length)) {
-			addr = maps->base + maps->length;
+			addr = (maps->base + maps->length + align - 1) & ~(align - 1);
 			continue;
 		}
 	}
@@ -296,7 +705,10 @@ long do_mmap(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * fil
 	if (file) {
 		if (flags & MAP_ANONYMOUS) return -EINVAL;
 		if (offset & 0xFFF) return -EINVAL;
-		if ((flags & MAP_SHARED) && !file->fault_map) return -EINVAL;
+		if ((flags & MAP_SHARED) && !file->fault_map) {
+			/* Cached files can be shared, but only for reading. */
+			if (!(file->flags & FS_CACHED) || (prot & PROT_WRITE)) return -EINVAL;
+		}
 	} else {
 		if (!(flags & MAP_ANONYMOUS)) return -EINVAL;
 		if (flags & MAP_SHARED) return -ENOTSUP;
@@ -304,18 +716,51 @@ long do_mmap(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * fil
 		offset = 0;
 	}
 
+	/* Give large device mappings a chance at large pages. */
+	size_t align = 0x1000;
+	if (file && (file->flags & FS_CONTIGUOUS) && length >= HUGE_PAGE_SIZE) align = HUGE_PAGE_SIZE;
+
 	spin_lock(proc->image.lock);
-	if (!(flags & MAP_FIXED)) addr = find_good_spot(proc, length);
-	insert_mapping(addr, length, prot, flags, file, offset);
+	if (!(flags & MAP_FIXED)) addr = find_good_spot(proc, length, align);
+	insert_mapping(proc, addr, length, prot, flags, file, offset);
+
+	/* The new region may have been merged with its neighbours, which is fine. */
+	if (flags & MAP_POPULATE) {
+		for (memmap_t * maps = mmap_find(proc->thread.page_directory, addr); maps && maps->base < addr + length; maps = maps->next) {
+			mmap_populate_locked(proc, maps, addr, addr + length);
+		}
+	}
 	spin_unlock(proc->image.lock);
 	return addr;
 }
 
+/**
+ * @brief Give a forked process copies of its parent's mappings.
+ */
+void mmap_clone_mappings(page_directory_t * to, page_directory_t * from) {
+	memmap_t * prev = NULL;
+	for (memmap_t * maps = from->mappings; maps; maps = maps->next) {
+		memmap_t * nmap = calloc(1, sizeof(memmap_t));
+		nmap->base = maps->base;
+		nmap->length = maps->length;
+		nmap->flags = maps->flags;
+		nmap->prot = maps->prot;
+		nmap->advice = maps->advice;
+		nmap->file = maps->file;
+		nmap->offset = maps->offset;
+
+		if (nmap->file) open_fs(nmap->file, 0);
+
+		link_mapping(to, prev, nmap);
+		prev = nmap;
+	}
+}
+
 static void count_pt(uintptr_t addr_base, memmap_t * maps, union PML * pt, size_t * anon, size_t * file, size_t * shm) {
 	for (size_t l = 0; l < 512; ++l) {
 		uintptr_t addr = addr_base + (l << 12);
 		while (maps && maps->base + maps->length <= addr) maps = maps->next;
-		if (pt[l].bits.present) {
+		if (pt[l].bits.present || pt[l].bits.prot_none) {
 			if (maps && addr >= maps->base && addr < maps->base + maps->length) {
 				if (maps->flags & MAP_SHARED) {
 					(*shm) += 1;
@@ -332,6 +777,13 @@ static void count_pt(uintptr_t addr_base, memmap_t * maps, union PML * pt, size_
 static void count_pd(uintptr_t addr_base, memmap_t * maps, union PML * pd, size_t * anon, size_t * file, size_t * shm) {
 	for (size_t k = 0; k < 512; ++k) {
 		uintptr_t addr = addr_base + (k << (9 + 12));
+#if defined(__x86_64__)
+		if (pd[k].bits.present && pd[k].bits.size) {
+			/* Large pages are only used for shared device memory. */
+			(*shm) += 512;
+			continue;
+		}
+#endif
 		if (pd[k].bits.present) count_pt(addr, maps, mmu_map_from_physical((uintptr_t)pd[k].bits.page << 12), anon, file, shm);
 	}
 }
@@ -39,8 +39,13 @@
 #include <kernel/pty.h>
 #include <kernel/ptrace.h>
 #include <kernel/args.h>
+#include <kernel/epoll.h>
+#include <kernel/mman.h>
+#include <kernel/profile.h>
+#include <kernel/trace.h>
 #include <sys/wait.h>
 #include <sys/signal_defs.h>
+#include <bits/sched.h>
 
 /* FIXME: This only needs the size of the regs struct... */
 #if defined(__x86_64__)
@@ -53,8 +58,6 @@
 
 tree_t * process_tree;  /* Stores the parent-child process relationships; the root of this graph is 'init'. */
 list_t * process_list;  /* Stores all existing processes. Mostly used for sanity checking or for places where iterating over all processes is useful. */
-list_t * process_queue; /* Scheduler ready queue. This the round-robin source. The head is the next process to run. */
-list_t * sleep_queue;   /* Ordered list of processes waiting to be awoken by timeouts. The head is the earliest thread to awaken. */
 list_t * reap_queue;    /* Processes that could not be cleaned up and need to be deleted. */
 
 struct ProcessorLocal processor_local_data[32] = {0};
@@ -63,11 +66,18 @@ int processor_count = 1;
 /* The following locks protect access to the process tree, scheduler queue,
  * sleeping, and the very special wait queue... */
 static spin_lock_t tree_lock = { 0 };
-static spin_lock_t process_queue_lock = { 0 };
 static spin_lock_t wait_lock_tmp = { 0 };
 static spin_lock_t sleep_lock = { 0 };
 static spin_lock_t reap_lock = { 0 };
 
+/* Processes in a timed sleep have their sleep_node owned by this placeholder;
+ * the timers themselves live in the per-core timer heaps. */
+static list_t timed_sleep_owner = { .name = "timed sleep" };
+
+static void sched_account(volatile process_t * proc, uint64_t delta);
+static void timer_cancel(sleeper_t * timer);
+static void timer_arm(sleeper_t * timer, unsigned long seconds, unsigned long subseconds);
+
 /**
  * Update both the total time and the system time when switching to a new thread
  * or exiting the current thread.
@@ -76,6 +86,7 @@ void update_process_times(void) {
 	uint64_t pTime = arch_perf_timer();
 	if (this_core->current_process->time_in && this_core->current_process->time_in < pTime) {
 		this_core->current_process->time_total +=  pTime - this_core->current_process->time_in;
+		sched_account(this_core->current_process, pTime - this_core->current_process->time_in);
 	}
 	this_core->current_process->time_in = 0;
 
@@ -133,11 +144,13 @@ void switch_next(void) {
 		this_core->current_process = next_ready_process();
 	} while (this_core->current_process->flags & PROC_FLAG_FINISHED);
 
+	TRACE(TRACE_SWITCH, this_core->previous_process ? this_core->previous_process->id : 0, this_core->current_process->id);
+
 	this_core->current_process->time_in = arch_perf_timer();
 	this_core->current_process->time_switch = this_core->current_process->time_in;
 
 	/* Restore paging and task switch context. */
-	mmu_set_directory(this_core->current_process->thread.page_directory->directory);
+	process_set_directory(this_core->current_process->thread.page_directory);
 	arch_set_kernel_stack(this_core->current_process->image.stack);
 
 	if (this_core->current_process->flags & PROC_FLAG_FINISHED) {
@@ -152,6 +165,9 @@ void switch_next(void) {
 	/* Mark the process as running and started. */
 	__sync_or_and_fetch(&this_core->current_process->flags, PROC_FLAG_STARTED);
 
+	/* Start or stop the tick, depending on whether we are going idle. */
+	sched_program_timer(0);
+
 	asm volatile ("" ::: "memory");
 
 	/* Jump to next */
@@ -207,6 +223,8 @@ void switch_task(uint8_t reschedule) {
 	 *      thread into a schedule queue previously but a different core
 	 *      picks it up before we saved the thread context or the FPU state... */
 	if (reschedule) {
+		/* Charge for this timeslice now so we land in the right place in the queue. */
+		update_process_times();
 		make_process_ready((process_t*)this_core->current_process);
 	}
 
@@ -214,6 +232,21 @@ void switch_task(uint8_t reschedule) {
 	switch_next();
 }
 
+/**
+ * @brief Yield the processor from a preemption source.
+ *
+ * Called by timer interrupts when they land in userspace. SCHED_FIFO
+ * processes are only preempted when a higher priority realtime
+ * process is waiting; everything else yields its timeslice.
+ */
+void switch_task_preempt(void) {
+	if (this_core->current_process->sched_policy == SCHED_FIFO) {
+		node_t * head = this_core->rt_queue.head;
+		if (!head || ((process_t *)head->value)->sched_priority <= this_core->current_process->sched_priority) return;
+	}
+	switch_task(1);
+}
+
 /**
  * @brief Initial scheduler datastructures.
  *
@@ -223,8 +256,11 @@ void switch_task(uint8_t reschedule) {
 void initialize_process_tree(void) {
 	process_tree = tree_create();
 	process_list = list_create("global process list",NULL);
-	process_queue = list_create("global scheduler queue",NULL);
-	sleep_queue = list_create("global timed sleep queue",NULL);
+	for (int i = 0; i < 32; ++i) {
+		processor_local_data[i].ready_queue.name = "core scheduler queue";
+		processor_local_data[i].rt_queue.name = "core realtime queue";
+		processor_local_data[i].timer_next = UINT64_MAX;
+	}
 	reap_queue = list_create("processes awaiting later cleanup",NULL);
 
 	/* TODO: PID bitset? */
@@ -413,6 +449,7 @@ void process_release_directory(page_directory_t * dir) {
 				map = next;
 			}
 			dir->mappings = NULL;
+			dir->map_tree = NULL;
 		}
 		free(dir);
 	} else {
@@ -420,6 +457,27 @@ void process_release_directory(page_directory_t * dir) {
 	}
 }
 
+/**
+ * @brief Load a page directory on this core.
+ *
+ * Keeps the directory's @c cpu_mask up to date so TLB shootdowns
+ * can be sent only to the cores that might have cached its mappings.
+ *
+ * @param dir Directory to load, or NULL for the kernel directory.
+ */
+void process_set_directory(page_directory_t * dir) {
+	struct ProcessorLocal * core = &processor_local_data[this_core->cpu_id];
+	uint32_t bit = 1U << core->cpu_id;
+
+	if (core->current_directory != dir) {
+		if (core->current_directory) __sync_and_and_fetch(&core->current_directory->cpu_mask, ~bit);
+		if (dir) __sync_or_and_fetch(&dir->cpu_mask, bit);
+		core->current_directory = dir;
+	}
+
+	mmu_set_directory(dir ? dir->directory : NULL);
+}
+
 process_t * spawn_kidle(int bsp) {
 	process_t * idle = calloc(1,sizeof(process_t));
 	idle->process = idle;
@@ -496,8 +554,6 @@ process_t * spawn_init(void) {
 	init->sleep_node.next = NULL;
 	init->sleep_node.value = init;
 
-	init->timed_sleep_node = NULL;
-
 	init->thread.page_directory = calloc(1, sizeof(page_directory_t));
 	init->thread.page_directory->refcount = 1;
 	init->thread.page_directory->directory = this_core->current_pml;
@@ -525,6 +581,12 @@ process_t * spawn_process(volatile process_t * parent, int flags, int close_at_f
 	proc->job         = parent->job;
 	proc->session     = parent->session;
 
+	proc->sched_policy   = parent->sched_policy;
+	proc->sched_priority = parent->sched_priority;
+	proc->nice           = parent->nice;
+	proc->cpu_mask       = parent->cpu_mask;
+	proc->vruntime       = parent->vruntime;
+
 	if (parent->supplementary_group_count) {
 		proc->supplementary_group_count = parent->supplementary_group_count;
 		proc->supplementary_group_list = malloc(sizeof(gid_t) * proc->supplementary_group_count);
@@ -576,6 +638,8 @@ process_t * spawn_process(volatile process_t * parent, int flags, int close_at_f
 
 	proc->sched_node.value = proc;
 	proc->sleep_node.value = proc;
+	proc->owner = this_core->cpu_id;
+	proc->sched_cpu = this_core->cpu_id;
 
 	gettimeofday(&proc->start, NULL);
 	tree_node_t * entry = tree_node_create(proc);
@@ -701,6 +765,168 @@ void process_delete(process_t * proc) {
 	process_reap_later(proc);
 }
 
+/**
+ * @brief How often a busy core looks at its neighbors' queues, in microseconds.
+ */
+#define SCHED_BALANCE_INTERVAL 10000
+
+/**
+ * @brief How far behind a core's min_vruntime a waking process may be, in microseconds.
+ *
+ * Processes that sleep for a long time would otherwise come back with
+ * enough credit to monopolize their core until they caught up.
+ */
+#define SCHED_WAKEUP_CREDIT 20000
+
+/**
+ * @brief Length of a timeslice on a busy core, in microseconds.
+ */
+#define SCHED_TICK 10000
+
+/**
+ * @brief How often the BSP still wakes up when idle, in microseconds.
+ *
+ * Idle cores otherwise only wake for their own timers, but someone has
+ * to keep the per-process usage statistics moving.
+ */
+#define SCHED_IDLE_TICK 250000
+
+/**
+ * @brief Relative weights of the nice levels for SCHED_OTHER.
+ *
+ * Each step is roughly 1.25x the next, so a process one nice level
+ * lower gets about 10% more of the processor than its competitor.
+ * Nice 0 is 1024.
+ */
+static const unsigned int sched_nice_weights[40] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */  9548,  7620,  6100,  4904,  3906,
+	/*  -5 */  3121,  2501,  1991,  1586,  1277,
+	/*   0 */  1024,   820,   655,   526,   423,
+	/*   5 */   335,   272,   215,   172,   137,
+	/*  10 */   110,    87,    70,    56,    45,
+	/*  15 */    36,    29,    23,    18,    15,
+};
+
+/**
+ * @brief Charge a process for time spent running.
+ *
+ * Realtime processes are not charged; their order is fixed by priority.
+ */
+static void sched_account(volatile process_t * proc, uint64_t delta) {
+	if (proc->sched_policy != SCHED_OTHER) return;
+	proc->vruntime += delta * 1024 / sched_nice_weights[proc->nice + 20];
+}
+
+/**
+ * @brief Whether @p proc's affinity lets it run on @p cpu.
+ */
+static inline int sched_allowed(volatile process_t * proc, int cpu) {
+	return !proc->cpu_mask || (proc->cpu_mask & (1UL << cpu));
+}
+
+/**
+ * @brief The core @p proc may run on with the fewest processes queued.
+ */
+static int sched_least_busy(volatile process_t * proc) {
+	int best = -1;
+	size_t depth = 0;
+	for (int i = 0; i < processor_count; ++i) {
+		if (!sched_allowed(proc, i)) continue;
+		size_t this_depth = processor_local_data[i].ready_queue.length + processor_local_data[i].rt_queue.length;
+		if (best < 0 || this_depth < depth) {
+			best = i;
+			depth = this_depth;
+		}
+	}
+	return best < 0 ? this_core->cpu_id : best;
+}
+
+/**
+ * @brief Pick the ready queue a process should be placed on.
+ *
+ * Processes go back to the core they last ran on so they stay
+ * cache-warm, unless that core is already noticeably busier than
+ * the core doing the wakeup, in which case the waker takes it.
+ * Processes that may not run on either go to the least busy core
+ * they are allowed on.
+ */
+static int sched_pick_core(volatile process_t * proc) {
+	int local = this_core->cpu_id;
+	int target = proc->owner;
+	if (target < 0 || target >= processor_count || !sched_allowed(proc, target)) {
+		return sched_allowed(proc, local) ? local : sched_least_busy(proc);
+	}
+	if (target != local && sched_allowed(proc, local) &&
+	    processor_local_data[target].ready_queue.length > processor_local_data[local].ready_queue.length + 1) {
+		return local;
+	}
+	return target;
+}
+
+/**
+ * @brief Move a process's vruntime onto the base of core @p to.
+ *
+ * This only tracks which queue the vruntime is relative to; @c owner
+ * stays the core that last ran the process, which next_ready_process
+ * relies on to avoid running it while that core is still switching
+ * away from it.
+ */
+static void sched_migrate(volatile process_t * proc, int to) {
+	int from = proc->sched_cpu;
+	proc->sched_cpu = to;
+	if (from == to || from < 0 || from >= processor_count) return;
+	uint64_t src = processor_local_data[from].min_vruntime;
+	uint64_t dst = processor_local_data[to].min_vruntime;
+	proc->vruntime = (proc->vruntime > src ? proc->vruntime - src : 0) + dst;
+}
+
+/**
+ * @brief Place a process in the appropriate queue for a core.
+ *
+ * SCHED_OTHER processes are kept in vruntime order. Realtime
+ * processes are kept in priority order, and go behind any others
+ * of the same priority.
+ *
+ * The caller must have claimed @c sched_queued for the process.
+ */
+static void sched_enqueue(int cpu, volatile process_t * proc) {
+	struct ProcessorLocal * core = &processor_local_data[cpu];
+	node_t * node = (node_t*)&proc->sched_node;
+	node_t * before = NULL;
+
+	spin_lock(core->ready_lock);
+	sched_migrate(proc, cpu);
+
+	if (proc->sched_policy == SCHED_OTHER) {
+		uint64_t credit = SCHED_WAKEUP_CREDIT * arch_cpu_mhz();
+		if (core->min_vruntime > credit && proc->vruntime < core->min_vruntime - credit) {
+			proc->vruntime = core->min_vruntime - credit;
+		}
+		foreach(np, &core->ready_queue) {
+			if (((process_t *)np->value)->vruntime > proc->vruntime) {
+				before = np;
+				break;
+			}
+		}
+		if (before) list_append_before(&core->ready_queue, before, node);
+		else list_append(&core->ready_queue, node);
+	} else {
+		foreach(np, &core->rt_queue) {
+			if (((process_t *)np->value)->sched_priority < proc->sched_priority) {
+				before = np;
+				break;
+			}
+		}
+		if (before) list_append_before(&core->rt_queue, before, node);
+		else list_append(&core->rt_queue, node);
+	}
+
+	core->sched_enqueued++;
+	spin_unlock(core->ready_lock);
+}
+
 /**
  * @brief Place an available process in the ready queue.
  *
@@ -716,77 +942,166 @@ void make_process_ready(volatile process_t * proc) {
 	int sleep_lock_is_mine = sleep_lock.owner == (this_core->cpu_id + 1);
 	if (!sleep_lock_is_mine) spin_lock(sleep_lock);
 	if (proc->sleep_node.owner != NULL) {
-		if (proc->sleep_node.owner == sleep_queue) {
-			/* The sleep queue is slightly special... */
-			if (proc->timed_sleep_node) {
-				list_delete(sleep_queue, proc->timed_sleep_node);
-				proc->sleep_node.owner = NULL;
-				free(proc->timed_sleep_node->value);
-			}
+		if (proc->sleep_node.owner == &timed_sleep_owner) {
+			/* Timed sleeps aren't in a list, the timer is cancelled below. */
+			proc->sleep_node.owner = NULL;
 		} else {
 			/* This was blocked on a semaphore we can interrupt. */
 			__sync_or_and_fetch(&proc->flags, PROC_FLAG_SLEEP_INT);
 			list_delete((list_t*)proc->sleep_node.owner, (node_t*)&proc->sleep_node);
 		}
 	}
+	/* However a timed sleep ended, its timer is no longer needed. */
+	if (!proc->timer.is_fswait) timer_cancel((sleeper_t *)&proc->timer);
 	if (!sleep_lock_is_mine) spin_unlock(sleep_lock);
 
-	spin_lock(process_queue_lock);
-	if (proc->sched_node.owner) {
-		/* There's only one ready queue, so this means the process was already ready, which
-		 * is indicative of a bug somewhere as we shouldn't be added processes to the ready
+	if (!__sync_bool_compare_and_swap(&proc->sched_queued, 0, 1)) {
+		/* The process is already in a ready queue, which is indicative of
+		 * a bug somewhere as we shouldn't be adding processes to the ready
 		 * queue multiple times. */
-		spin_unlock(process_queue_lock);
 		return;
 	}
 
-	list_append(process_queue, (node_t*)&proc->sched_node);
-	spin_unlock(process_queue_lock);
+	int core = sched_pick_core(proc);
+	sched_enqueue(core, proc);
+	TRACE(TRACE_WAKEUP, proc->id, core);
 
 	arch_wakeup_others();
 }
 
 /**
- * @brief Pop the next available process from the queue.
+ * @brief Take a process from one of a core's queues if it isn't still
+ *        running and is allowed to run on @p cpu.
+ */
+static node_t * sched_steal_from(list_t * queue, int cpu) {
+	foreachr(np, queue) {
+		process_t * candidate = np->value;
+		if (candidate->flags & PROC_FLAG_RUNNING) continue;
+		if (!sched_allowed(candidate, cpu)) continue;
+		list_delete(queue, np);
+		return np;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Take a process from the busiest other core's ready queues.
  *
- * Gets the next available process from the round-robin scheduling
- * queue. If there is no process to run, the idle task is returned.
+ * Only cores holding at least @p threshold more processes than
+ * our own are considered. Realtime processes are taken first.
+ * Processes still marked as running are skipped, as the core that
+ * owns them is in the middle of switching away and will pick them
+ * up itself.
  *
- * TODO This needs more locking for SMP...
+ * The returned node has been removed from its queue, but the process
+ * is still marked as queued; the caller either runs it or places it
+ * on its own queue.
+ */
+static node_t * sched_steal(struct ProcessorLocal * core, size_t threshold) {
+	struct ProcessorLocal * victim = NULL;
+	size_t busiest = core->ready_queue.length + core->rt_queue.length + threshold - 1;
+
+	for (int i = 0; i < processor_count; ++i) {
+		if (&processor_local_data[i] == core) continue;
+		size_t depth = processor_local_data[i].ready_queue.length + processor_local_data[i].rt_queue.length;
+		if (depth > busiest) {
+			busiest = depth;
+			victim = &processor_local_data[i];
+		}
+	}
+
+	if (!victim) return NULL;
+
+	spin_lock(victim->ready_lock);
+	node_t * out = sched_steal_from(&victim->rt_queue, core->cpu_id);
+	if (!out) out = sched_steal_from(&victim->ready_queue, core->cpu_id);
+	if (out) victim->sched_stolen++;
+	spin_unlock(victim->ready_lock);
+
+	if (out) {
+		sched_migrate(out->value, core->cpu_id);
+		core->sched_steals++;
+	}
+	return out;
+}
+
+/**
+ * @brief Periodically even out queue depths between cores.
+ *
+ * If some other core's queues are at least two processes deeper than
+ * ours, move one of its processes over to our queue.
+ */
+static void sched_balance(struct ProcessorLocal * core) {
+	uint64_t now = arch_perf_timer();
+	if (now - core->sched_last_balance < SCHED_BALANCE_INTERVAL * arch_cpu_mhz()) return;
+	core->sched_last_balance = now;
+
+	node_t * np = sched_steal(core, 2);
+	if (np) sched_enqueue(core->cpu_id, np->value);
+}
+
+/**
+ * @brief Pop the next available process from the queue.
+ *
+ * Gets the highest-priority realtime process on this core, or the
+ * weighted-fair process that has had the least time so far. If
+ * both queues are empty, a process is stolen from the busiest other
+ * core. If there is still nothing to run, the idle task is returned.
  */
 volatile process_t * next_ready_process(void) {
-	spin_lock(process_queue_lock);
+	struct ProcessorLocal * core = &processor_local_data[this_core->cpu_id];
+
+	if (processor_count > 1) sched_balance(core);
 
-	if (!process_queue->head) {
-		if (process_queue->length) {
+	node_t * np;
+	volatile process_t * next;
+
+	while (1) {
+		spin_lock(core->ready_lock);
+
+		if ((!core->ready_queue.head && core->ready_queue.length) || (!core->rt_queue.head && core->rt_queue.length)) {
 			arch_fatal_prepare();
 			printf("Queue has a length but head is NULL\n");
 			arch_dump_traceback();
 			arch_fatal();
 		}
-		spin_unlock(process_queue_lock);
-		return this_core->kernel_idle_task;
-	}
 
-	node_t * np = list_dequeue(process_queue);
+		np = list_dequeue(&core->rt_queue);
+		if (!np) np = list_dequeue(&core->ready_queue);
+		spin_unlock(core->ready_lock);
 
-	if ((uintptr_t)np < 0xFFFFff0000000000UL || (uintptr_t)np > 0xFFFFfff000000000UL) {
-		arch_fatal_prepare();
-		printf("Suspicious pointer in queue: %#zx\n", (uintptr_t)np);
-		arch_dump_traceback();
-		arch_fatal();
+		if (!np && processor_count > 1) np = sched_steal(core, 1);
+		if (!np) return this_core->kernel_idle_task;
+
+		if ((uintptr_t)np < 0xFFFFff0000000000UL || (uintptr_t)np > 0xFFFFfff000000000UL) {
+			arch_fatal_prepare();
+			printf("Suspicious pointer in queue: %#zx\n", (uintptr_t)np);
+			arch_dump_traceback();
+			arch_fatal();
+		}
+		next = np->value;
+
+		if ((next->flags & PROC_FLAG_RUNNING) && (next->owner != this_core->cpu_id)) {
+			/* We pulled a process too soon; send it back to the core that is
+			 * still switching away from it and look for something else. */
+			sched_enqueue(next->owner, next);
+			continue;
+		}
+
+		if (!sched_allowed(next, this_core->cpu_id)) {
+			/* Its affinity changed while it was waiting here. */
+			sched_enqueue(sched_least_busy(next), next);
+			continue;
+		}
+
+		break;
 	}
-	volatile process_t * next = np->value;
 
-	if ((next->flags & PROC_FLAG_RUNNING) && (next->owner != this_core->cpu_id)) {
-		/* We pulled a process too soon, switch to idle for a bit so the
-		 * core that marked this process as ready can finish switching away from it. */
-		list_append(process_queue, (node_t*)&next->sched_node);
-		spin_unlock(process_queue_lock);
-		return this_core->kernel_idle_task;
+	if (next->sched_policy == SCHED_OTHER && next->vruntime > core->min_vruntime) {
+		core->min_vruntime = next->vruntime;
 	}
 
-	spin_unlock(process_queue_lock);
+	__sync_lock_release(&next->sched_queued);
 
 	if (!(next->flags & PROC_FLAG_FINISHED)) {
 		__sync_or_and_fetch(&next->flags, PROC_FLAG_RUNNING);
@@ -797,6 +1112,34 @@ volatile process_t * next_ready_process(void) {
 	return next;
 }
 
+static uint64_t sched_online_mask(void) {
+	return (1UL << processor_count) - 1;
+}
+
+/**
+ * @brief Restrict the cores @p proc may run on.
+ *
+ * Bits for cores that don't exist are ignored. If the process is
+ * queued or running somewhere it is no longer allowed, it moves the
+ * next time it is scheduled.
+ *
+ * @returns 0, or -EINVAL if @p mask names no cores we have.
+ */
+int sched_set_affinity(volatile process_t * proc, uint64_t mask) {
+	uint64_t online = sched_online_mask();
+	mask &= online;
+	if (!mask) return -EINVAL;
+	proc->cpu_mask = (mask == online) ? 0 : mask;
+	return 0;
+}
+
+/**
+ * @brief The cores @p proc may run on.
+ */
+uint64_t sched_get_affinity(volatile process_t * proc) {
+	return proc->cpu_mask ? proc->cpu_mask : sched_online_mask();
+}
+
 /**
  * @brief Signal a semaphore.
  *
@@ -907,6 +1250,35 @@ int sleep_on_unlocking(list_t * queue, spin_lock_t * release) {
 	return !!(this_core->current_process->flags & PROC_FLAG_SLEEP_INT);
 }
 
+/**
+ * @brief Sleep on a queue, with a timeout.
+ *
+ * As with @ref sleep_on_unlocking, but the sleep is also ended once
+ * the absolute time given by @p seconds and @p subseconds passes.
+ *
+ * @returns 0 if woken from the queue, 1 if interrupted, -1 if the timeout expired.
+ */
+int sleep_on_unlocking_timeout(list_t * queue, spin_lock_t * release, unsigned long seconds, unsigned long subseconds) {
+	process_t * process = (process_t *)this_core->current_process;
+	__sync_and_and_fetch(&process->flags, ~(PROC_FLAG_SLEEP_INT));
+
+	spin_lock(sleep_lock);
+	spin_lock(wait_lock_tmp);
+	list_append(queue, (node_t*)&process->sleep_node);
+	spin_unlock(wait_lock_tmp);
+	process->timer.process = process;
+	process->timer.is_fswait = 0;
+	timer_arm(&process->timer, seconds, subseconds);
+	spin_unlock(sleep_lock);
+
+	spin_unlock(*release);
+
+	switch_task(0);
+
+	if (!(process->flags & PROC_FLAG_SLEEP_INT)) return 0;
+	return process->timer.is_fswait == -1 ? -1 : 1;
+}
+
 /**
  * @brief Indicates whether a process is ready to be run but not currently running.
  */
@@ -916,37 +1288,185 @@ int process_is_ready(process_t * proc) {
 
 int process_alert_node_locked(process_t * process, void * value);
 
+/**
+ * @brief Expiry of a timer as a single comparable value.
+ */
+static inline uint64_t timer_key(sleeper_t * timer) {
+	return timer->end_tick * 1000000UL + timer->end_subtick;
+}
+
+static void timer_heap_swap(struct ProcessorLocal * core, size_t a, size_t b) {
+	sleeper_t * tmp = core->timer_heap[a];
+	core->timer_heap[a] = core->timer_heap[b];
+	core->timer_heap[b] = tmp;
+	core->timer_heap[a]->heap_index = a;
+	core->timer_heap[b]->heap_index = b;
+}
+
+static void timer_sift_up(struct ProcessorLocal * core, size_t i) {
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (timer_key(core->timer_heap[parent]) <= timer_key(core->timer_heap[i])) break;
+		timer_heap_swap(core, parent, i);
+		i = parent;
+	}
+}
+
+static void timer_sift_down(struct ProcessorLocal * core, size_t i) {
+	while (1) {
+		size_t least = i;
+		size_t left = i * 2 + 1;
+		size_t right = left + 1;
+		if (left < core->timer_count && timer_key(core->timer_heap[left]) < timer_key(core->timer_heap[least])) least = left;
+		if (right < core->timer_count && timer_key(core->timer_heap[right]) < timer_key(core->timer_heap[least])) least = right;
+		if (least == i) break;
+		timer_heap_swap(core, least, i);
+		i = least;
+	}
+}
+
+static void timer_update_next(struct ProcessorLocal * core) {
+	core->timer_next = core->timer_count ? timer_key(core->timer_heap[0]) : UINT64_MAX;
+}
+
+/**
+ * @brief Remove the timer at @p index from a core's heap.
+ *
+ * The core's timer_lock must be held.
+ */
+static void timer_remove_locked(struct ProcessorLocal * core, size_t index) {
+	sleeper_t * timer = core->timer_heap[index];
+	core->timer_count--;
+	if (index != core->timer_count) {
+		core->timer_heap[index] = core->timer_heap[core->timer_count];
+		core->timer_heap[index]->heap_index = index;
+		timer_sift_down(core, index);
+		timer_sift_up(core, index);
+	}
+	timer->core = 0;
+	timer_update_next(core);
+}
+
+/**
+ * @brief Disarm a timer, if it is armed.
+ *
+ * Timers are only armed, expired, or cancelled with the sleep_lock held,
+ * so the timer can not move between heaps while we are looking at it.
+ */
+static void timer_cancel(sleeper_t * timer) {
+	if (!timer->core) return;
+	struct ProcessorLocal * core = &processor_local_data[timer->core - 1];
+	spin_lock(core->timer_lock);
+	timer_remove_locked(core, timer->heap_index);
+	spin_unlock(core->timer_lock);
+}
+
+/**
+ * @brief Arm a process's timer on the current core.
+ *
+ * Must be called with the sleep_lock held.
+ */
+static void timer_arm(sleeper_t * timer, unsigned long seconds, unsigned long subseconds) {
+	struct ProcessorLocal * core = &processor_local_data[this_core->cpu_id];
+
+	timer_cancel(timer);
+	timer->end_tick = seconds;
+	timer->end_subtick = subseconds;
+
+	spin_lock(core->timer_lock);
+	if (core->timer_count == core->timer_capacity) {
+		core->timer_capacity = core->timer_capacity ? core->timer_capacity * 2 : 64;
+		core->timer_heap = realloc(core->timer_heap, sizeof(sleeper_t *) * core->timer_capacity);
+	}
+	timer->core = core->cpu_id + 1;
+	timer->heap_index = core->timer_count;
+	core->timer_heap[core->timer_count++] = timer;
+	timer_sift_up(core, timer->heap_index);
+	timer_update_next(core);
+	spin_unlock(core->timer_lock);
+}
+
+/**
+ * @brief Current time in the units timer_key uses.
+ */
+static uint64_t timer_now(void) {
+	unsigned long seconds, subseconds;
+	relative_time(0, 0, &seconds, &subseconds);
+	return seconds * 1000000UL + subseconds;
+}
+
+/**
+ * @brief Arm this core's one-shot timer for whatever is due next.
+ *
+ * That is the earliest timer in the core's heap, or the end of the
+ * timeslice if something other than the idle task is running. Idle
+ * cores have no tick at all, apart from a slow one on the BSP.
+ *
+ * The hardware is only touched if the new deadline is sooner than the
+ * one already set, or the old one has passed; a tick left over from
+ * before going idle just costs one spurious wakeup.
+ *
+ * @param expired Set by timer interrupt handlers, as the deadline
+ *                they were called for is gone.
+ */
+void sched_program_timer(int expired) {
+	struct ProcessorLocal * core = &processor_local_data[this_core->cpu_id];
+	uint64_t now = timer_now();
+	uint64_t next = core->timer_next;
+
+	if (this_core->current_process != this_core->kernel_idle_task) {
+		if (now + SCHED_TICK < next) next = now + SCHED_TICK;
+	} else if (core->cpu_id == 0) {
+		if (now + SCHED_IDLE_TICK < next) next = now + SCHED_IDLE_TICK;
+	}
+
+	/* The profiler needs ticks whether or not we are busy. */
+	if (profile_running && now + PROFILE_INTERVAL < next) next = now + PROFILE_INTERVAL;
+
+	if (expired || next < core->timer_deadline || core->timer_deadline <= now) {
+		core->timer_deadline = next;
+		arch_timer_oneshot(next);
+	}
+}
+
 /**
  * @brief Wake up processes that were sleeping on timers.
  *
- * Reschedule all processes whose timed waits have expired as of
- * the time indicated by @p seconds and @p subseconds. If the sleep
- * was part of an fswait system call timing out, the call is marked
- * as timed out before the process is rescheduled.
+ * Reschedule all processes whose timed waits on this core have
+ * expired as of the time indicated by @p seconds and @p subseconds.
+ * If the sleep was part of an fswait system call timing out, the call
+ * is marked as timed out before the process is rescheduled.
+ *
+ * This is called on every timer interrupt, so if nothing has expired
+ * we return without taking any locks.
  */
 void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
+	struct ProcessorLocal * core = &processor_local_data[this_core->cpu_id];
+	uint64_t now = seconds * 1000000UL + subseconds;
+
+	if (core->timer_next > now) return;
+
 	spin_lock(sleep_lock);
-	if (sleep_queue->length) {
-		sleeper_t * proc = ((sleeper_t *)sleep_queue->head->value);
-		while (proc && (proc->end_tick < seconds || (proc->end_tick == seconds && proc->end_subtick <= subseconds))) {
-
-			if (proc->is_fswait) {
-				proc->is_fswait = -1;
-				process_alert_node_locked(proc->process,proc);
-			} else {
-				process_t * process = proc->process;
-				process->sleep_node.owner = NULL;
-				process->timed_sleep_node = NULL;
-				if (!process_is_ready(process)) {
-					make_process_ready(process);
-				}
-			}
-			free(proc);
-			free(list_dequeue(sleep_queue));
-			if (sleep_queue->length) {
-				proc = ((sleeper_t *)sleep_queue->head->value);
-			} else {
-				break;
+	while (1) {
+		spin_lock(core->timer_lock);
+		if (!core->timer_count || timer_key(core->timer_heap[0]) > now) {
+			spin_unlock(core->timer_lock);
+			break;
+		}
+		sleeper_t * timer = core->timer_heap[0];
+		timer_remove_locked(core, 0);
+		spin_unlock(core->timer_lock);
+
+		if (timer->is_fswait) {
+			process_alert_node_locked(timer->process, timer);
+		} else {
+			process_t * process = timer->process;
+			/* Mark the timer as expired; a timeout on a wait queue is left
+			 * for make_process_ready to unlink and mark as interrupted. */
+			timer->is_fswait = -1;
+			if (process->sleep_node.owner == &timed_sleep_owner) process->sleep_node.owner = NULL;
+			if (!process_is_ready(process)) {
+				make_process_ready(process);
 			}
 		}
 	}
@@ -967,26 +1487,10 @@ void sleep_until(process_t * process, unsigned long seconds, unsigned long subse
 		/* Can't sleep, sleeping already */
 		return;
 	}
-	process->sleep_node.owner = sleep_queue;
-
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (!candidate) {
-			printf("null candidate?\n");
-			continue;
-		}
-		if (candidate->end_tick > seconds || (candidate->end_tick == seconds && candidate->end_subtick > subseconds)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = seconds;
-	proc->end_subtick = subseconds;
-	proc->is_fswait = 0;
-	process->timed_sleep_node = list_insert_after(sleep_queue, before, proc);
+	process->sleep_node.owner = &timed_sleep_owner;
+	process->timer.process = process;
+	process->timer.is_fswait = 0;
+	timer_arm(&process->timer, seconds, subseconds);
 	spin_unlock(sleep_lock);
 }
 
@@ -1143,21 +1647,10 @@ int process_timeout_sleep(process_t * process, int timeout) {
 	unsigned long s, ss;
 	relative_time(0, timeout * 1000, &s, &ss);
 
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (candidate->end_tick > s || (candidate->end_tick == s && candidate->end_subtick > ss)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = s;
-	proc->end_subtick = ss;
-	proc->is_fswait = 1;
-	list_insert(((process_t *)process)->node_waits, proc);
-	process->timeout_node = list_insert_after(sleep_queue, before, proc);
+	process->timer.process = process;
+	process->timer.is_fswait = 1;
+	list_insert(((process_t *)process)->node_waits, &process->timer);
+	timer_arm(&process->timer, s, ss);
 
 	return 0;
 }
@@ -1183,7 +1676,17 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 		return index;
 	}
 
-	n = nodes;
+	return process_sleep_on_nodes(process, nodes, timeout);
+}
+
+/**
+ * @brief Sleep until one of @p nodes alerts us, without checking them first.
+ *
+ * @returns the index of the alert, which is past the end of @p nodes
+ *          for a timeout, or -EINTR.
+ */
+int process_sleep_on_nodes(process_t * process, fs_node_t * nodes[], int timeout) {
+	fs_node_t ** n = nodes;
 
 	spin_lock(sleep_lock);
 	spin_lock(process->sched_lock);
@@ -1199,8 +1702,6 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 
 	if (timeout > 0) {
 		process_timeout_sleep(process, timeout);
-	} else {
-		process->timeout_node = NULL;
 	}
 
 	process->awoken_index = -1;
@@ -1221,15 +1722,7 @@ int process_awaken_from_fswait(process_t * process, int index) {
 	free(process->node_waits);
 	process->node_waits = NULL;
 
-	if (process->timeout_node && process->timeout_node->owner == sleep_queue) {
-		sleeper_t * proc = process->timeout_node->value;
-		if (proc->is_fswait != -1) {
-			list_delete(sleep_queue, process->timeout_node);
-			free(process->timeout_node->value);
-			free(process->timeout_node);
-		}
-	}
-	process->timeout_node = NULL;
+	timer_cancel(&process->timer);
 
 	make_process_ready(process);
 	spin_unlock(process->sched_lock);
@@ -1247,9 +1740,24 @@ void process_awaken_signal(process_t * process) {
 	spin_unlock(sleep_lock);
 }
 
+/**
+ * @brief Record that a node will alert @p waiter with @p value.
+ *
+ * Called by selectwait implementations after adding @p waiter to the
+ * node's own list of waiters. Waiters are usually processes sleeping
+ * in process_wait_nodes, but may also be epoll entries, which have
+ * no list of their own to add to.
+ */
+void process_node_wait(void * waiter, void * value) {
+	if (epoll_is_watch(waiter)) return;
+	list_insert(((process_t *)waiter)->node_waits, value);
+}
+
 int process_alert_node_locked(process_t * process, void * value) {
 	must_have_lock(sleep_lock);
 
+	if (epoll_alert_locked(process, value)) return 0;
+
 	if (!is_valid_process(process)) {
 		if (args_present("debug")) {
 			dprintf("core %d (pid=%d %s) attempted to alert invalid process %#zx\n",
@@ -1313,6 +1821,11 @@ void task_exit(long retval) {
 		if (children) free(children);
 	}
 
+	/* Make sure no timer outlives us */
+	spin_lock(sleep_lock);
+	timer_cancel((sleeper_t *)&this_core->current_process->timer);
+	spin_unlock(sleep_lock);
+
 	/* free whatever we can */
 	list_free(this_core->current_process->wait_queue);
 	free(this_core->current_process->wait_queue);
@@ -1403,28 +1916,7 @@ pid_t fork(void) {
 	new_proc->thread.page_directory->refcount = 1;
 	new_proc->thread.page_directory->directory = directory;
 
-	memmap_t * prev = NULL;
-	for (memmap_t * maps = parent->thread.page_directory->mappings; maps; maps = maps->next) {
-		memmap_t * nmap = calloc(1, sizeof(memmap_t));
-		nmap->base = maps->base;
-		nmap->length = maps->length;
-		nmap->flags = maps->flags;
-		nmap->prot = maps->prot;
-		nmap->file = maps->file;
-		nmap->offset = maps->offset;
-		nmap->owner = new_proc->thread.page_directory;
-
-		if (nmap->file) open_fs(nmap->file, 0);
-
-		if (!prev) {
-			new_proc->thread.page_directory->mappings = nmap;
-		} else {
-			prev->next = nmap;
-			nmap->prev = prev;
-		}
-
-		prev = nmap;
-	}
+	mmap_clone_mappings(new_proc->thread.page_directory, parent->thread.page_directory);
 
 	spin_init(new_proc->thread.page_directory->lock);
 
@@ -1552,6 +2044,8 @@ process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * na
 
 	proc->sched_node.value = proc;
 	proc->sleep_node.value = proc;
+	proc->owner = this_core->cpu_id;
+	proc->sched_cpu = this_core->cpu_id;
 
 	gettimeofday(&proc->start, NULL);
 	tree_node_t * entry = tree_node_create(proc);
@@ -18,6 +18,9 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <sys/futex.h>
+#include <poll.h>
+#include <bits/sched.h>
 #include <kernel/printf.h>
 #include <kernel/process.h>
 #include <kernel/string.h>
@@ -32,6 +35,10 @@
 #include <kernel/misc.h>
 #include <kernel/ptrace.h>
 #include <kernel/mman.h>
+#include <kernel/futex.h>
+#include <kernel/epoll.h>
+#include <kernel/trace.h>
+#include <kernel/pagecache.h>
 #include <kernel/net/netif.h>
 
 static char   hostname[256];
@@ -944,6 +951,34 @@ long sys_sleep(unsigned long seconds, unsigned long subseconds) {
 	return sys_sleepabs(s, ss);
 }
 
+/**
+ * @brief Sleep for a time in nanoseconds, to the nearest microsecond.
+ *
+ * If the sleep is cut short, the time left is stored in @p rem.
+ */
+long sys_nanosleep(const struct timespec * req, struct timespec * rem) {
+	PTRCHECK(req,sizeof(struct timespec),0);
+	if (rem) PTRCHECK(rem,sizeof(struct timespec),MMU_PTR_WRITE);
+	if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L) return -EINVAL;
+
+	unsigned long s, ss;
+	relative_time(req->tv_sec, (req->tv_nsec + 999) / 1000, &s, &ss);
+	sleep_until((process_t *)this_core->current_process, s, ss);
+	switch_task(0);
+
+	unsigned long now_s, now_ss;
+	relative_time(0, 0, &now_s, &now_ss);
+	uint64_t end = s * 1000000UL + ss;
+	uint64_t now = now_s * 1000000UL + now_ss;
+	if (now >= end) return 0;
+
+	if (rem) {
+		rem->tv_sec = (end - now) / 1000000UL;
+		rem->tv_nsec = (end - now) % 1000000UL * 1000;
+	}
+	return -EINTR;
+}
+
 long sys_pipe2(int pipes[2], int flag) {
 	if (flag & ~(O_NONBLOCK | O_CLOEXEC | O_CLOFORK)) return -EINVAL;
 	PTRCHECK(pipes, sizeof(int) * 2, MMU_PTR_WRITE);
@@ -1201,6 +1236,279 @@ long sys_getrusage(int who, struct rusage *buf) {
 	return 0;
 }
 
+/**
+ * @brief Whether the current process may change the scheduling of @p proc.
+ */
+static int sched_may_modify(process_t * proc) {
+	return this_core->current_process->user == USER_ROOT_UID ||
+	       this_core->current_process->user == proc->user ||
+	       this_core->current_process->real_user == proc->user;
+}
+
+/**
+ * @brief Collect the threads selected by a getpriority/setpriority target.
+ */
+static long priority_targets(int which, id_t who, pid_t ** pids) {
+	*pids = NULL;
+	switch (which) {
+		case PRIO_PROCESS:
+			if (!who) who = this_core->current_process->id;
+			if (!process_from_pid(who)) return 0;
+			*pids = malloc(sizeof(pid_t));
+			(*pids)[0] = who;
+			return 1;
+		case PRIO_PGRP:
+			if (!who) who = this_core->current_process->job;
+			return process_collect_by(offsetof(process_t,job), sizeof(pid_t), &who, pids, 1);
+		case PRIO_USER:
+			if (!who) who = this_core->current_process->user;
+			return process_collect_by(offsetof(process_t,user), sizeof(uid_t), &who, pids, 1);
+		default:
+			return -EINVAL;
+	}
+}
+
+long sys_getpriority(int which, id_t who) {
+	pid_t * pids;
+	long count = priority_targets(which, who, &pids);
+	if (count < 0) return count;
+
+	int best = PRIO_MAX;
+	for (long i = 0; i < count; ++i) {
+		process_t * proc = process_from_pid(pids[i]);
+		if (proc && proc->nice < best) best = proc->nice;
+	}
+	if (pids) free(pids);
+
+	if (best == PRIO_MAX) return -ESRCH;
+
+	/* Biased so that valid values are never mistaken for errors; libc undoes this. */
+	return PRIO_MAX - best;
+}
+
+long sys_setpriority(int which, id_t who, int value) {
+	if (value < PRIO_MIN) value = PRIO_MIN;
+	if (value > PRIO_MAX - 1) value = PRIO_MAX - 1;
+
+	pid_t * pids;
+	long count = priority_targets(which, who, &pids);
+	if (count < 0) return count;
+
+	long result = -ESRCH;
+	for (long i = 0; i < count; ++i) {
+		process_t * proc = process_from_pid(pids[i]);
+		if (!proc) continue;
+		if (!sched_may_modify(proc)) {
+			result = -EPERM;
+			continue;
+		}
+		if (value < proc->nice && this_core->current_process->user != USER_ROOT_UID) {
+			result = -EACCES;
+			continue;
+		}
+		proc->nice = value;
+		if (result == -ESRCH) result = 0;
+	}
+	if (pids) free(pids);
+
+	return result;
+}
+
+long sys_sched_getscheduler(pid_t pid) {
+	process_t * proc = pid == 0 ? (process_t*)this_core->current_process : process_from_pid(pid);
+	if (!proc) return -ESRCH;
+	return proc->sched_policy;
+}
+
+long sys_sched_setscheduler(pid_t pid, int policy, const struct sched_param * param) {
+	PTRCHECK(param,sizeof(struct sched_param),0);
+
+	process_t * proc = pid == 0 ? (process_t*)this_core->current_process : process_from_pid(pid);
+	if (!proc) return -ESRCH;
+
+	switch (policy) {
+		case SCHED_OTHER:
+			if (param->sched_priority != 0) return -EINVAL;
+			break;
+		case SCHED_FIFO:
+		case SCHED_RR:
+			if (param->sched_priority < SCHED_PRIORITY_MIN || param->sched_priority > SCHED_PRIORITY_MAX) return -EINVAL;
+			if (this_core->current_process->user != USER_ROOT_UID) return -EPERM;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (!sched_may_modify(proc)) return -EPERM;
+
+	proc->sched_policy = policy;
+	proc->sched_priority = param->sched_priority;
+
+	return 0;
+}
+
+long sys_sched_getparam(pid_t pid, struct sched_param * param) {
+	PTRCHECK(param,sizeof(struct sched_param),MMU_PTR_WRITE);
+
+	process_t * proc = pid == 0 ? (process_t*)this_core->current_process : process_from_pid(pid);
+	if (!proc) return -ESRCH;
+
+	param->sched_priority = proc->sched_priority;
+	return 0;
+}
+
+long sys_sched_setaffinity(pid_t pid, size_t cpusetsize, const uint64_t * mask) {
+	if (cpusetsize < sizeof(uint64_t)) return -EINVAL;
+	PTRCHECK(mask,sizeof(uint64_t),0);
+
+	process_t * proc = pid == 0 ? (process_t*)this_core->current_process : process_from_pid(pid);
+	if (!proc) return -ESRCH;
+	if (!sched_may_modify(proc)) return -EPERM;
+
+	long result = sched_set_affinity(proc, *mask);
+	if (result) return result;
+
+	/* Get off this core right away if we aren't allowed here any more. */
+	if (proc == this_core->current_process && !(sched_get_affinity(proc) & (1UL << this_core->cpu_id))) {
+		switch_task(1);
+	}
+
+	return 0;
+}
+
+long sys_sched_getaffinity(pid_t pid, size_t cpusetsize, uint64_t * mask) {
+	if (cpusetsize < sizeof(uint64_t)) return -EINVAL;
+	PTRCHECK(mask,sizeof(uint64_t),MMU_PTR_WRITE);
+
+	process_t * proc = pid == 0 ? (process_t*)this_core->current_process : process_from_pid(pid);
+	if (!proc) return -ESRCH;
+
+	*mask = sched_get_affinity(proc);
+	return sizeof(uint64_t);
+}
+
+long sys_futex(volatile uint32_t * uaddr, int op, uint32_t val, const struct timespec * timeout, volatile uint32_t * uaddr2) {
+	switch (op) {
+		case FUTEX_WAIT:
+			if (timeout) PTRCHECK(timeout,sizeof(struct timespec),0);
+			return futex_wait(uaddr, val, timeout);
+		case FUTEX_WAKE:
+			return futex_wake(uaddr, val);
+		case FUTEX_REQUEUE:
+			return futex_requeue(uaddr, val, (int)(uintptr_t)timeout, uaddr2);
+		default:
+			return -ENOSYS;
+	}
+}
+
+long sys_epoll_create(int flags) {
+	if (flags & ~EPOLL_CLOEXEC) return -EINVAL;
+	fs_node_t * node = epoll_create_node();
+	open_fs(node, 0);
+	int mode = PROC_FD_MODE__RW;
+	if (flags & EPOLL_CLOEXEC) mode |= PROC_FD_MODE_CLOEXEC;
+	return process_append_fd((process_t *)this_core->current_process, node, mode);
+}
+
+long sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event * event) {
+	if (!FD_CHECK(epfd) || !FD_CHECK(fd)) return -EBADF;
+	struct epoll_event ev = {0};
+	if (op != EPOLL_CTL_DEL) {
+		PTRCHECK(event,sizeof(struct epoll_event),0);
+		ev = *event;
+	}
+	return epoll_ctl_node(FD_ENTRY(epfd), op, fd, FD_ENTRY(fd), &ev);
+}
+
+long sys_epoll_wait(int epfd, struct epoll_event * events, int maxevents, int timeout) {
+	if (!FD_CHECK(epfd)) return -EBADF;
+	if (maxevents <= 0) return -EINVAL;
+	PTRCHECK(events,sizeof(struct epoll_event) * (size_t)maxevents,MMU_PTR_WRITE);
+	return epoll_wait_node(FD_ENTRY(epfd), events, maxevents, timeout);
+}
+
+#define POLL_MAX_FDS 65536
+
+/**
+ * @brief Fill in revents for each entry, and count those with any.
+ *
+ * Readiness for reading or writing only counts on descriptors that
+ * were opened for it; hangups and errors are always reported.
+ */
+static int poll_check(struct pollfd * fds, nfds_t nfds) {
+	int count = 0;
+	for (nfds_t i = 0; i < nfds; ++i) {
+		fds[i].revents = 0;
+		if (fds[i].fd < 0) continue;
+		if (!FD_CHECK(fds[i].fd)) {
+			fds[i].revents = POLLNVAL;
+			count++;
+			continue;
+		}
+
+		int wanted = POLLHUP | POLLERR;
+		if (FD_MODE(fds[i].fd) & PROC_FD_MODE_READ)  wanted |= fds[i].events & POLLIN;
+		if (FD_MODE(fds[i].fd) & PROC_FD_MODE_WRITE) wanted |= fds[i].events & POLLOUT;
+
+		fds[i].revents = pollcheck_fs(FD_ENTRY(fds[i].fd)) & wanted;
+		if (fds[i].revents) count++;
+	}
+	return count;
+}
+
+long sys_poll(struct pollfd * ufds, nfds_t nfds, int timeout) {
+	/* Same file any number of times is fine, but not without bound. */
+	if (nfds > POLL_MAX_FDS) return -EINVAL;
+	PTRCHECK(ufds,sizeof(struct pollfd) * (size_t)nfds,MMU_PTR_WRITE);
+
+	/* Work on a copy, so we can't fault on the caller's buffer while checking files */
+	struct pollfd * fds = malloc(sizeof(struct pollfd) * (nfds ? nfds : 1));
+	memcpy(fds, ufds, sizeof(struct pollfd) * nfds);
+
+	unsigned long s = 0, ss = 0;
+	if (timeout > 0) relative_time(0, (unsigned long)timeout * 1000, &s, &ss);
+
+	fs_node_t ** nodes = malloc(sizeof(fs_node_t *) * (nfds + 1));
+	long result;
+
+	while (1) {
+		result = poll_check(fds, nfds);
+		if (result || !timeout) break;
+
+		int wait = -1;
+		if (timeout > 0) {
+			unsigned long ns, nss;
+			relative_time(0, 0, &ns, &nss);
+			if (ns > s || (ns == s && nss >= ss)) break;
+			wait = (s - ns) * 1000 + ((long)ss - (long)nss) / 1000;
+			if (wait < 1) wait = 1;
+		}
+
+		/* Only files that can alert us are worth sleeping on. */
+		int count = 0;
+		for (nfds_t i = 0; i < nfds; ++i) {
+			if (fds[i].fd < 0) continue;
+			fs_node_t * node = FD_ENTRY(fds[i].fd);
+			if (node->selectwait) nodes[count++] = node;
+		}
+		nodes[count] = NULL;
+
+		int index = process_sleep_on_nodes((process_t *)this_core->current_process, nodes, wait);
+		if (index < 0) {
+			result = index;
+			break;
+		}
+	}
+
+	if (result >= 0) {
+		for (nfds_t i = 0; i < nfds; ++i) ufds[i].revents = fds[i].revents;
+	}
+
+	free(nodes);
+	free(fds);
+	return result;
+}
+
 long sys_sbrk(ssize_t size) {
 	return mmap_sbrk(size);
 }
@@ -1233,6 +1541,43 @@ long sys_munmap(uintptr_t addr, size_t length) {
 	return mmap_unmap(addr, length);
 }
 
+long sys_mprotect(uintptr_t addr, size_t length, int prot) {
+	return mmap_protect(addr, length, prot);
+}
+
+long sys_madvise(uintptr_t addr, size_t length, int advice) {
+	return mmap_advise(addr, length, advice);
+}
+
+long sys_fadvise(int fd, off_t offset, off_t len, int advice) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if ((FD_ENTRY(fd)->flags & FS_PIPE) || (FD_ENTRY(fd)->flags & FS_CHARDEVICE) || (FD_ENTRY(fd)->flags & FS_SOCKET)) return -ESPIPE;
+	if (offset < 0 || len < 0) return -EINVAL;
+
+	fs_node_t * node = FD_ENTRY(fd);
+
+	switch (advice) {
+		case POSIX_FADV_NORMAL:
+		case POSIX_FADV_RANDOM:
+		case POSIX_FADV_SEQUENTIAL:
+			/* Applies to the whole open file; the range doesn't matter. */
+			node->readahead.advice = advice;
+			node->readahead.window = 0;
+			return 0;
+		case POSIX_FADV_WILLNEED:
+			if (!len) len = (off_t)node->length > offset ? (off_t)node->length - offset : 0;
+			pagecache_readahead(node, offset, len);
+			return 0;
+		case POSIX_FADV_DONTNEED:
+			if (node->flags & FS_CACHED) pagecache_evict(node, offset, len);
+			return 0;
+		case POSIX_FADV_NOREUSE:
+			return 0;
+		default:
+			return -EINVAL;
+	}
+}
+
 long sys_nproc(void) {
 	return processor_count;
 }
@@ -1352,6 +1697,22 @@ static scall_func syscalls[] = {
 	[SYS_SETTLSBASE]   = (scall_func)(uintptr_t)sys_set_tls_base,
 	[SYS_INSMOD]       = (scall_func)(uintptr_t)sys_insmod,
 	[SYS_GETSID]       = (scall_func)(uintptr_t)sys_getsid,
+	[SYS_GETPRIORITY]  = (scall_func)(uintptr_t)sys_getpriority,
+	[SYS_SETPRIORITY]  = (scall_func)(uintptr_t)sys_setpriority,
+	[SYS_SCHED_GETSCHEDULER] = (scall_func)(uintptr_t)sys_sched_getscheduler,
+	[SYS_SCHED_SETSCHEDULER] = (scall_func)(uintptr_t)sys_sched_setscheduler,
+	[SYS_SCHED_GETPARAM]     = (scall_func)(uintptr_t)sys_sched_getparam,
+	[SYS_FUTEX]              = (scall_func)(uintptr_t)sys_futex,
+	[SYS_EPOLL_CREATE]       = (scall_func)(uintptr_t)sys_epoll_create,
+	[SYS_EPOLL_CTL]          = (scall_func)(uintptr_t)sys_epoll_ctl,
+	[SYS_EPOLL_WAIT]         = (scall_func)(uintptr_t)sys_epoll_wait,
+	[SYS_MPROTECT]           = (scall_func)(uintptr_t)sys_mprotect,
+	[SYS_MADVISE]            = (scall_func)(uintptr_t)sys_madvise,
+	[SYS_SCHED_SETAFFINITY]  = (scall_func)(uintptr_t)sys_sched_setaffinity,
+	[SYS_SCHED_GETAFFINITY]  = (scall_func)(uintptr_t)sys_sched_getaffinity,
+	[SYS_NANOSLEEP]          = (scall_func)(uintptr_t)sys_nanosleep,
+	[SYS_FADVISE]            = (scall_func)(uintptr_t)sys_fadvise,
+	[SYS_POLL]               = (scall_func)(uintptr_t)sys_poll,
 
 	[SYS_SOCKET]       = (scall_func)(uintptr_t)net_socket,
 	[SYS_SETSOCKOPT]   = (scall_func)(uintptr_t)net_setsockopt,
@@ -1373,6 +1734,8 @@ void syscall_handler(struct regs * r) {
 
 	this_core->current_process->syscall_registers = r;
 
+	TRACE(TRACE_SYSCALL_ENTER, arch_syscall_number(r), arch_syscall_arg0(r));
+
 	if (this_core->current_process->flags & PROC_FLAG_TRACE_SYSCALLS) {
 		ptrace_signal(SIGTRAP, PTRACE_EVENT_SYSCALL_ENTER);
 	}
@@ -1394,6 +1757,7 @@ void syscall_handler(struct regs * r) {
 	}
 
 _finish_syscall:
+	TRACE(TRACE_SYSCALL_EXIT, arch_syscall_number(r), result);
 	arch_syscall_return(r, result);
 
 	if (this_core->current_process->flags & PROC_FLAG_TRACE_SYSCALLS) {
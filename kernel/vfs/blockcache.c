@@ -0,0 +1,537 @@
+/**
+ * @file  kernel/vfs/blockcache.c
+ * @brief Write-back cache of disk blocks shared by block drivers.
+ *
+ * Block device drivers register with blockcache_create() and pass
+ * their read and write calls through blockcache_read() and
+ * blockcache_write(). Blocks are 4KiB, live in one frame each, and
+ * are found by hashing the device and block number.
+ *
+ * Clean blocks sit on an LRU list and the least recently used one is
+ * taken when the cache is full. Dirty blocks sit on a second list in
+ * the order they were first written, and are written back in runs of
+ * neighbouring blocks by a flusher thread once they are a few seconds
+ * old, when the cache needs room, or when the device is synced.
+ *
+ * Long whole-block transfers of blocks that aren't cached go straight
+ * between the device and the caller, so streaming through a disk
+ * doesn't push everything else out of the cache.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/process.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/time.h>
+#include <kernel/blockcache.h>
+#include <sys/ioctl.h>
+
+#define BLOCKCACHE_BUCKETS 4096
+#define BLOCKCACHE_MAX     4096   /* blocks, shared by every device */
+#define BLOCKCACHE_DIRECT  16     /* uncached runs at least this long bypass the cache */
+#define BLOCKCACHE_RUN     64     /* most blocks handed to a driver at once */
+#define BLOCKCACHE_AGE     5      /* seconds a block may stay dirty */
+
+struct blockcache_entry {
+	struct blockcache * cache;
+	uint64_t block;
+	uint8_t * data;
+	int dirty;
+	int pins;         /* readers and writers copying, or a writeback in progress */
+	uint64_t dirtied;
+	struct blockcache_entry * hash_next;
+	node_t list;      /* on blockcache_clean or blockcache_dirty, unless being written back */
+};
+
+/* A run of blocks being written straight to the device. */
+struct blockcache_inflight {
+	uint64_t block;
+	size_t count;
+	struct blockcache_inflight * next;
+};
+
+static struct blockcache_entry * blockcache_table[BLOCKCACHE_BUCKETS];
+static struct blockcache_entry * blockcache_spare = NULL;
+static list_t blockcache_clean = {0};
+static list_t blockcache_dirty = {0};
+static struct blockcache * blockcache_devices = NULL;
+static spin_lock_t blockcache_lock = { 0 };
+static int blockcache_flusher = 0;
+
+/* Bumped around every write that bypasses the cache, so a block read
+ * from the device while one started is read again. A read that overlaps
+ * one still in progress is caught by blockcache_inflight_locked. */
+static uint64_t blockcache_generation = 0;
+static size_t blockcache_count = 0;
+
+static unsigned int blockcache_hash(struct blockcache * cache, uint64_t block) {
+	return (((uintptr_t)cache >> 6) * 131 + block) % BLOCKCACHE_BUCKETS;
+}
+
+static int blockcache_inflight_locked(struct blockcache * cache, uint64_t block) {
+	for (struct blockcache_inflight * run = cache->inflight; run; run = run->next) {
+		if (block >= run->block && block - run->block < run->count) return 1;
+	}
+	return 0;
+}
+
+static struct blockcache_entry * blockcache_lookup(struct blockcache * cache, uint64_t block) {
+	for (struct blockcache_entry * entry = blockcache_table[blockcache_hash(cache, block)]; entry; entry = entry->hash_next) {
+		if (entry->cache == cache && entry->block == block) return entry;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Take an unpinned block out of the cache, dropping its contents.
+ *
+ * The entry is the caller's to reuse or put on the spare list.
+ */
+static void blockcache_forget_locked(struct blockcache_entry * entry) {
+	struct blockcache_entry ** p = &blockcache_table[blockcache_hash(entry->cache, entry->block)];
+	while (*p && *p != entry) p = &(*p)->hash_next;
+	if (*p) *p = entry->hash_next;
+	if (entry->list.owner) list_delete(entry->list.owner, &entry->list);
+	if (entry->dirty) entry->cache->dirty--;
+	entry->cache->cached--;
+	entry->dirty = 0;
+}
+
+static void blockcache_dirty_locked(struct blockcache_entry * entry) {
+	if (entry->dirty) return;
+	if (entry->list.owner) list_delete(entry->list.owner, &entry->list);
+	entry->dirty = 1;
+	entry->dirtied = now();
+	entry->cache->dirty++;
+	list_append(&blockcache_dirty, &entry->list);
+}
+
+static void blockcache_put(struct blockcache_entry * entry) {
+	spin_lock(blockcache_lock);
+	entry->pins--;
+	spin_unlock(blockcache_lock);
+}
+
+/**
+ * @brief Write back dirty blocks, oldest first.
+ *
+ * @param only   Only write blocks belonging to this device, or NULL.
+ * @param before Only write blocks first dirtied before this time.
+ * @param limit  Stop after this many runs.
+ * @returns the number of blocks written, or a negative errno if the
+ *          device failed; the blocks are left dirty in that case.
+ */
+static long blockcache_writeback(struct blockcache * only, uint64_t before, size_t limit) {
+	struct blockcache_entry * run[BLOCKCACHE_RUN];
+	uint8_t * bounce = NULL;
+	long written = 0;
+
+	spin_lock(blockcache_lock);
+	node_t * node = blockcache_dirty.head;
+	while (node && limit) {
+		struct blockcache_entry * entry = node->value;
+		if (entry->pins || (only && entry->cache != only)) {
+			node = node->next;
+			continue;
+		}
+		if (entry->dirtied >= before) break;
+
+		/* Pick up dirty neighbours so the driver sees one long write. */
+		struct blockcache * cache = entry->cache;
+		size_t count = 0;
+		while (count < BLOCKCACHE_RUN) {
+			struct blockcache_entry * next = count ? blockcache_lookup(cache, entry->block + count) : entry;
+			if (!next || !next->dirty || next->pins) break;
+			list_delete(&blockcache_dirty, &next->list);
+			next->dirty = 0;
+			next->pins++;
+			run[count++] = next;
+		}
+		cache->dirty   -= count;
+		cache->writing += count;
+		spin_unlock(blockcache_lock);
+
+		/* Writers may still copy into these while we do this; they
+		 * will mark them dirty again, so nothing is lost. */
+		uint8_t * data = run[0]->data;
+		if (count > 1) {
+			if (!bounce) bounce = malloc(BLOCKCACHE_BLOCK * BLOCKCACHE_RUN);
+			for (size_t i = 0; i < count; ++i) {
+				memcpy(bounce + i * BLOCKCACHE_BLOCK, run[i]->data, BLOCKCACHE_BLOCK);
+			}
+			data = bounce;
+		}
+		int status = cache->write(cache->device, entry->block, count, data);
+
+		spin_lock(blockcache_lock);
+		for (size_t i = 0; i < count; ++i) {
+			run[i]->pins--;
+			if (status < 0) blockcache_dirty_locked(run[i]);
+			else if (!run[i]->dirty) list_append(&blockcache_clean, &run[i]->list);
+		}
+		cache->writing -= count;
+		if (status < 0) {
+			written = status;
+			break;
+		}
+		cache->stats.writebacks += count;
+		written += count;
+		limit--;
+		node = blockcache_dirty.head;
+	}
+	spin_unlock(blockcache_lock);
+
+	if (bounce) free(bounce);
+	return written;
+}
+
+/**
+ * @brief Get an unused entry, making room in the cache if it is full.
+ */
+static struct blockcache_entry * blockcache_new(void) {
+	while (1) {
+		spin_lock(blockcache_lock);
+		if (blockcache_spare) {
+			struct blockcache_entry * entry = blockcache_spare;
+			blockcache_spare = entry->hash_next;
+			spin_unlock(blockcache_lock);
+			return entry;
+		}
+
+		if (blockcache_count < BLOCKCACHE_MAX) {
+			blockcache_count++;
+			spin_unlock(blockcache_lock);
+			uintptr_t frame = mmu_allocate_a_frame();
+			if (frame != (uintptr_t)-1) {
+				struct blockcache_entry * entry = calloc(1, sizeof(struct blockcache_entry));
+				entry->data = mmu_map_from_physical(frame << 12);
+				entry->list.value = entry;
+				return entry;
+			}
+			spin_lock(blockcache_lock);
+			blockcache_count--;
+		}
+
+		for (node_t * node = blockcache_clean.head; node; node = node->next) {
+			struct blockcache_entry * entry = node->value;
+			if (entry->pins) continue;
+			entry->cache->stats.evictions++;
+			blockcache_forget_locked(entry);
+			spin_unlock(blockcache_lock);
+			return entry;
+		}
+		int empty = !blockcache_count;
+		spin_unlock(blockcache_lock);
+
+		if (empty) return NULL;
+
+		/* Everything is dirty or in use; clean something and try again. */
+		if (blockcache_writeback(NULL, UINT64_MAX, 1) <= 0) switch_task(1);
+	}
+}
+
+/**
+ * @brief Find a block, reading it in if it isn't cached.
+ *
+ * @param source If not NULL, the block's new contents; the device is
+ *               not read if the block has to be brought in.
+ * @returns 0 with @p out pinned, or a negative errno.
+ */
+static int blockcache_get(struct blockcache * cache, uint64_t block, const uint8_t * source, struct blockcache_entry ** out) {
+	spin_lock(blockcache_lock);
+	struct blockcache_entry * entry = blockcache_lookup(cache, block);
+	if (entry) {
+		entry->pins++;
+		if (entry->list.owner == &blockcache_clean) {
+			list_delete(&blockcache_clean, &entry->list);
+			list_append(&blockcache_clean, &entry->list);
+		}
+		cache->stats.hits++;
+		spin_unlock(blockcache_lock);
+		*out = entry;
+		return 0;
+	}
+	if (!source) cache->stats.misses++;
+	spin_unlock(blockcache_lock);
+
+	struct blockcache_entry * fresh = blockcache_new();
+	if (!fresh) return -ENOMEM;
+
+	while (1) {
+		spin_lock(blockcache_lock);
+		if (!source && blockcache_inflight_locked(cache, block)) {
+			/* The device is being written under us; wait for it. */
+			spin_unlock(blockcache_lock);
+			switch_task(1);
+			continue;
+		}
+		uint64_t generation = blockcache_generation;
+		spin_unlock(blockcache_lock);
+
+		/* Read with no locks held; the driver may sleep. */
+		if (source) {
+			memcpy(fresh->data, source, BLOCKCACHE_BLOCK);
+		} else {
+			int status = cache->read(cache->device, block, 1, fresh->data);
+			if (status < 0) {
+				spin_lock(blockcache_lock);
+				fresh->hash_next = blockcache_spare;
+				blockcache_spare = fresh;
+				spin_unlock(blockcache_lock);
+				return status;
+			}
+		}
+
+		spin_lock(blockcache_lock);
+		if (source || (generation == blockcache_generation && !blockcache_inflight_locked(cache, block))) break;
+		spin_unlock(blockcache_lock);
+	}
+
+	entry = blockcache_lookup(cache, block);
+	if (entry) {
+		/* Someone else brought it in while we were. */
+		entry->pins++;
+		fresh->hash_next = blockcache_spare;
+		blockcache_spare = fresh;
+		spin_unlock(blockcache_lock);
+		*out = entry;
+		return 0;
+	}
+
+	unsigned int bucket = blockcache_hash(cache, block);
+	fresh->cache = cache;
+	fresh->block = block;
+	fresh->dirty = 0;
+	fresh->pins  = 1;
+	fresh->hash_next = blockcache_table[bucket];
+	blockcache_table[bucket] = fresh;
+	list_append(&blockcache_clean, &fresh->list);
+	cache->cached++;
+	spin_unlock(blockcache_lock);
+
+	*out = fresh;
+	return 0;
+}
+
+/**
+ * @brief Count how many blocks from @p block on are not cached.
+ */
+static size_t blockcache_missing(struct blockcache * cache, uint64_t block, size_t max) {
+	size_t count = 0;
+	spin_lock(blockcache_lock);
+	while (count < max && !blockcache_lookup(cache, block + count)) count++;
+	spin_unlock(blockcache_lock);
+	return count;
+}
+
+/**
+ * @brief Drop cached copies of blocks about to be overwritten directly.
+ *
+ * @p run is linked onto the cache's in-flight list first, so nothing
+ * read from the device can be cached for those blocks until
+ * blockcache_written takes it off again.
+ */
+static void blockcache_invalidate(struct blockcache * cache, struct blockcache_inflight * run) {
+	uint64_t block = run->block;
+	size_t count = run->count;
+	spin_lock(blockcache_lock);
+	blockcache_generation++;
+	run->next = cache->inflight;
+	cache->inflight = run;
+	for (size_t i = 0; i < count; ++i) {
+		struct blockcache_entry * entry;
+		while ((entry = blockcache_lookup(cache, block + i)) && entry->pins) {
+			/* Being copied or written back; let that finish first. */
+			spin_unlock(blockcache_lock);
+			switch_task(1);
+			spin_lock(blockcache_lock);
+		}
+		if (entry) {
+			blockcache_forget_locked(entry);
+			entry->hash_next = blockcache_spare;
+			blockcache_spare = entry;
+		}
+	}
+	spin_unlock(blockcache_lock);
+}
+
+/**
+ * @brief Finish a direct write started with blockcache_invalidate.
+ */
+static void blockcache_written(struct blockcache * cache, struct blockcache_inflight * run, int status) {
+	spin_lock(blockcache_lock);
+	struct blockcache_inflight ** link = &cache->inflight;
+	while (*link != run) link = &(*link)->next;
+	*link = run->next;
+	blockcache_generation++;
+	if (status >= 0) cache->stats.direct += run->count;
+	spin_unlock(blockcache_lock);
+}
+
+ssize_t blockcache_read(struct blockcache * cache, off_t offset, size_t size, uint8_t * buffer) {
+	ssize_t total = 0;
+	if (offset < 0) return -EINVAL;
+
+	while (size) {
+		uint64_t block = offset / BLOCKCACHE_BLOCK;
+		size_t in = offset % BLOCKCACHE_BLOCK;
+		size_t count;
+
+		size_t whole = size / BLOCKCACHE_BLOCK;
+		size_t run = (!in && whole >= BLOCKCACHE_DIRECT) ? blockcache_missing(cache, block, whole < BLOCKCACHE_RUN ? whole : BLOCKCACHE_RUN) : 0;
+
+		if (run >= BLOCKCACHE_DIRECT) {
+			int status = cache->read(cache->device, block, run, buffer);
+			if (status < 0) return total ? total : status;
+			spin_lock(blockcache_lock);
+			cache->stats.direct += run;
+			spin_unlock(blockcache_lock);
+			count = run * BLOCKCACHE_BLOCK;
+		} else {
+			struct blockcache_entry * entry;
+			int status = blockcache_get(cache, block, NULL, &entry);
+			if (status < 0) return total ? total : status;
+			count = BLOCKCACHE_BLOCK - in;
+			if (count > size) count = size;
+			memcpy(buffer, entry->data + in, count);
+			blockcache_put(entry);
+		}
+
+		buffer += count;
+		offset += count;
+		size   -= count;
+		total  += count;
+	}
+
+	return total;
+}
+
+ssize_t blockcache_write(struct blockcache * cache, off_t offset, size_t size, const uint8_t * buffer) {
+	ssize_t total = 0;
+	if (offset < 0) return -EINVAL;
+
+	while (size) {
+		uint64_t block = offset / BLOCKCACHE_BLOCK;
+		size_t in = offset % BLOCKCACHE_BLOCK;
+		size_t count;
+
+		size_t whole = size / BLOCKCACHE_BLOCK;
+		if (!in && whole >= BLOCKCACHE_DIRECT) {
+			struct blockcache_inflight run = { block, whole < BLOCKCACHE_RUN ? whole : BLOCKCACHE_RUN, NULL };
+			blockcache_invalidate(cache, &run);
+			int status = cache->write(cache->device, block, run.count, (uint8_t*)buffer);
+			blockcache_written(cache, &run, status);
+			if (status < 0) return total ? total : status;
+			count = run.count * BLOCKCACHE_BLOCK;
+		} else {
+			count = BLOCKCACHE_BLOCK - in;
+			if (count > size) count = size;
+			struct blockcache_entry * entry;
+			int status = blockcache_get(cache, block, count == BLOCKCACHE_BLOCK ? buffer : NULL, &entry);
+			if (status < 0) return total ? total : status;
+			memcpy(entry->data + in, buffer, count);
+			spin_lock(blockcache_lock);
+			blockcache_dirty_locked(entry);
+			cache->stats.writes++;
+			entry->pins--;
+			spin_unlock(blockcache_lock);
+		}
+
+		buffer += count;
+		offset += count;
+		size   -= count;
+		total  += count;
+	}
+
+	/* Don't let one writer fill the whole cache with dirty blocks. */
+	while (blockcache_dirty.length > BLOCKCACHE_MAX / 2) {
+		if (blockcache_writeback(NULL, UINT64_MAX, 1) <= 0) break;
+	}
+
+	return total;
+}
+
+/**
+ * @brief Write back every dirty block belonging to a device.
+ *
+ * Waits for writebacks the flusher already had in progress, too.
+ * Does not ask the device to flush its own cache.
+ */
+int blockcache_sync(struct blockcache * cache) {
+	while (1) {
+		long status = blockcache_writeback(cache, UINT64_MAX, SIZE_MAX);
+		if (status < 0) return status;
+		spin_lock(blockcache_lock);
+		int done = !cache->dirty && !cache->writing;
+		spin_unlock(blockcache_lock);
+		if (done) return 0;
+		switch_task(1);
+	}
+}
+
+int blockcache_ioctl(struct blockcache * cache, unsigned long request, void * argp) {
+	switch (request) {
+		case IOCTLBLOCKSTATS: {
+			uint64_t * args = argp;
+			spin_lock(blockcache_lock);
+			args[0] = cache->stats.hits;
+			args[1] = cache->stats.misses;
+			args[2] = cache->stats.evictions;
+			args[3] = cache->stats.writes;
+			spin_unlock(blockcache_lock);
+			return 0;
+		}
+		default:
+			return -ENOTTY;
+	}
+}
+
+static void blockcache_flush_thread(void * arg) {
+	while (1) {
+		unsigned long s, ss;
+		relative_time(1, 0, &s, &ss);
+		sleep_until((process_t *)this_core->current_process, s, ss);
+		switch_task(0);
+
+		blockcache_writeback(NULL, now() - BLOCKCACHE_AGE + 1, SIZE_MAX);
+	}
+}
+
+/**
+ * @brief Start caching blocks for a device.
+ *
+ * @param name   Shown in /proc/blockcache; usually the device's path.
+ * @param device Passed back to @p read and @p write.
+ */
+struct blockcache * blockcache_create(const char * name, void * device, blockcache_io_t read, blockcache_io_t write) {
+	struct blockcache * cache = calloc(1, sizeof(struct blockcache));
+	snprintf(cache->name, sizeof(cache->name), "%s", name);
+	cache->device = device;
+	cache->read   = read;
+	cache->write  = write;
+
+	spin_lock(blockcache_lock);
+	cache->next = blockcache_devices;
+	blockcache_devices = cache;
+	int start = !blockcache_flusher;
+	blockcache_flusher = 1;
+	spin_unlock(blockcache_lock);
+
+	if (start) spawn_worker_thread(blockcache_flush_thread, "[blockcache]", NULL);
+
+	return cache;
+}
+
+struct blockcache * blockcache_list(void) {
+	return blockcache_devices;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file  kernel/vfs/clockpage.c
+ * @brief Read-only clock page shared with userspace.
+ *
+ * The platform clock code publishes its counter scale, boot time and
+ * basis here whenever they change, and every new process gets the
+ * page mapped read-only so libc can work out the time on its own.
+ * See bits/clockpage.h for how the fields are used.
+ *
+ * The page lives in the kernel image so the platform can fill it in
+ * while calibrating, before we have a frame allocator.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/mman.h>
+#include <kernel/time.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <bits/clockpage.h>
+#include <sys/mman.h>
+
+static union {
+	struct clock_page page;
+	char padding[4096];
+} clock __attribute__((aligned(4096)));
+
+static spin_lock_t clock_page_lock = { 0 };
+
+/**
+ * @brief Publish new clock parameters.
+ *
+ * Readers that see @c seq change underneath them will retry, so the
+ * fields only need to be consistent once it is even again.
+ */
+void clock_page_update(uint32_t scale, uint64_t mhz, uint64_t basis, uint64_t boot_time) {
+	spin_lock(clock_page_lock);
+	clock.page.seq++;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	clock.page.scale = scale;
+	clock.page.mhz = mhz;
+	clock.page.basis = basis;
+	clock.page.boot_time = boot_time;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	clock.page.seq++;
+	spin_unlock(clock_page_lock);
+}
+
+static int fault_map_clock(fs_node_t * node, union PML * page, off_t offset, int fault_flags, int map_flags, int prot, int *mmu_flags) {
+	if (offset != 0) return 2;
+	if (prot & PROT_WRITE) return 2;
+	page->bits.mmap_shared = 1;
+	page->bits.page = mmu_map_to_physical(this_core->current_pml, (uintptr_t)&clock) >> 12;
+	(*mmu_flags) &= ~(MMU_FLAG_WRITABLE);
+	return 0;
+}
+
+static fs_node_t clock_page_node = {
+	.name = "clock",
+	.mask = 0444,
+	.flags = FS_BLOCKDEVICE,
+	.refcount = -1,
+	.fault_map = fault_map_clock,
+};
+
+/**
+ * @brief Map the clock page into the current process.
+ *
+ * @returns the address it was mapped at, or 0 if the clock
+ *          has not been set up yet.
+ */
+uintptr_t clock_page_map(void) {
+	if (!clock.page.mhz) return 0;
+	long addr = do_mmap(0, 4096, PROT_READ, MAP_SHARED | MAP_POPULATE, &clock_page_node, 0);
+	return addr < 0 ? 0 : (uintptr_t)addr;
+}
@@ -0,0 +1,444 @@
+/**
+ * @file  kernel/vfs/epoll.c
+ * @brief Persistent event interest sets.
+ *
+ * fswait has to check every file it is given and register with each
+ * of them again on every call, and then reports only one of them.
+ * An epoll set instead remembers the files it is interested in. Each
+ * entry registers with its file through the usual selectwait method,
+ * standing in for a process, and when the file alerts it the entry
+ * goes on the set's ready list. A wait only looks at the entries on
+ * that list, re-registers those that fired, and reports everything
+ * that is still ready at once.
+ *
+ * Level-triggered entries stay on the ready list for as long as their
+ * file is ready; edge-triggered entries are reported once per alert.
+ * What is ready comes from pollcheck_fs, the same check poll uses.
+ *
+ * A set is itself a file that can be passed to fswait or added to
+ * another set.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/time.h>
+#include <kernel/spinlock.h>
+#include <kernel/process.h>
+#include <kernel/list.h>
+#include <kernel/hashmap.h>
+#include <kernel/slab.h>
+#include <kernel/vfs.h>
+#include <kernel/epoll.h>
+#include <poll.h>
+
+struct epoll;
+
+/**
+ * @brief An entry in an interest set.
+ *
+ * @c queued is 1 while the entry is on the ready list and 2 while a
+ * wait has taken it off to look at it; an alert that arrives in the
+ * latter case sets @c again so the wait puts it back.
+ */
+struct epoll_watch {
+	struct epoll * ep;
+	fs_node_t * node;
+	int fd;
+	uint32_t events;
+	epoll_data_t data;
+	int armed;
+	int queued;
+	int again;
+	struct epoll_watch * next_ready;
+};
+
+struct epoll {
+	spin_lock_t lock;     /* ready list, entry states, waiters */
+	spin_lock_t ctl_lock; /* interest set; held across changes and waits */
+	hashmap_t * interest; /* fd -> struct epoll_watch */
+	size_t count;
+	struct epoll_watch * ready;
+	struct epoll_watch * ready_tail;
+	list_t * waiters;
+};
+
+static kmem_cache_t * epoll_watch_cache = NULL;
+
+/**
+ * Entries that still exist. Files may hold on to an entry and alert it
+ * long after it was removed, so alerts check here before using one.
+ * Alerts hold this lock while they touch an entry's set.
+ */
+static hashmap_t * epoll_watches = NULL;
+static spin_lock_t epoll_watches_lock = { 0 };
+
+void epoll_install(void) {
+	epoll_watch_cache = kmem_cache_create("epoll_watch", sizeof(struct epoll_watch), sizeof(void*));
+	epoll_watches = hashmap_create_int(509);
+}
+
+static void epoll_ready_push(struct epoll * ep, struct epoll_watch * w) {
+	w->next_ready = NULL;
+	if (ep->ready_tail) ep->ready_tail->next_ready = w;
+	else ep->ready = w;
+	ep->ready_tail = w;
+}
+
+static void epoll_ready_remove(struct epoll * ep, struct epoll_watch * w) {
+	struct epoll_watch * prev = NULL;
+	for (struct epoll_watch * x = ep->ready; x; prev = x, x = x->next_ready) {
+		if (x != w) continue;
+		if (prev) prev->next_ready = w->next_ready;
+		else ep->ready = w->next_ready;
+		if (ep->ready_tail == w) ep->ready_tail = prev;
+		return;
+	}
+}
+
+/**
+ * @brief Put an entry on the ready list and take the set's waiters.
+ *
+ * Must be called with @c ep->lock held. The caller alerts the returned
+ * waiters, if any, once it has let go of its locks.
+ */
+static list_t * epoll_queue(struct epoll * ep, struct epoll_watch * w) {
+	w->armed = 0;
+	if (w->queued == 2) {
+		w->again = 1;
+	} else if (!w->queued) {
+		w->queued = 1;
+		epoll_ready_push(ep, w);
+	}
+	list_t * waiters = ep->waiters;
+	ep->waiters = NULL;
+	return waiters;
+}
+
+static void epoll_wake(list_t * waiters, struct epoll * ep, int locked) {
+	if (!waiters) return;
+	foreach(node, waiters) {
+		if (locked) process_alert_node_locked(node->value, ep);
+		else process_alert_node(node->value, ep);
+	}
+	list_free(waiters);
+	free(waiters);
+}
+
+/**
+ * @brief Whether @p waiter, given to a selectwait method, is one of our entries.
+ */
+int epoll_is_watch(void * waiter) {
+	return epoll_watch_cache && kmem_cache_of(waiter) == epoll_watch_cache;
+}
+
+/**
+ * @brief Handle a file alerting one of our entries.
+ *
+ * Called from process_alert_node with the sleep lock held.
+ *
+ * @returns 1 if @p waiter was an entry, live or not, and 0 if it is
+ *          a process that should be alerted as usual.
+ */
+int epoll_alert_locked(void * waiter, void * value) {
+	if (!epoll_is_watch(waiter)) return 0;
+
+	struct epoll * ep = NULL;
+	list_t * waiters = NULL;
+
+	spin_lock(epoll_watches_lock);
+	struct epoll_watch * w = hashmap_get(epoll_watches, waiter);
+	if (w) {
+		ep = w->ep;
+		spin_lock(ep->lock);
+		waiters = epoll_queue(ep, w);
+		spin_unlock(ep->lock);
+	}
+	spin_unlock(epoll_watches_lock);
+
+	/* The set may be gone by now, but we only need its address. */
+	epoll_wake(waiters, ep, 1);
+	return 1;
+}
+
+static int epoll_check(fs_node_t * node) {
+	struct epoll * ep = node->device;
+	return ep->ready ? 0 : 1;
+}
+
+static int epoll_select_wait(fs_node_t * node, void * process) {
+	struct epoll * ep = node->device;
+
+	spin_lock(ep->lock);
+	if (!ep->waiters) {
+		ep->waiters = list_create("epoll waiters", ep);
+	}
+	if (!list_find(ep->waiters, process)) {
+		list_insert(ep->waiters, process);
+	}
+	spin_unlock(ep->lock);
+
+	process_node_wait(process, ep);
+	return 0;
+}
+
+static void epoll_close(fs_node_t * node) {
+	struct epoll * ep = node->device;
+	list_t * watches = hashmap_values(ep->interest);
+
+	spin_lock(epoll_watches_lock);
+	foreach(n, watches) {
+		hashmap_remove(epoll_watches, n->value);
+	}
+	spin_unlock(epoll_watches_lock);
+
+	/* Nothing can reach the entries now. */
+	foreach(n, watches) {
+		struct epoll_watch * w = n->value;
+		close_fs_nested(w->node);
+		kmem_cache_free(epoll_watch_cache, w);
+	}
+	list_free(watches);
+	free(watches);
+
+	hashmap_free(ep->interest);
+	free(ep->interest);
+	if (ep->waiters) {
+		list_free(ep->waiters);
+		free(ep->waiters);
+	}
+	free(ep);
+}
+
+/**
+ * @brief Make a new, empty set.
+ */
+fs_node_t * epoll_create_node(void) {
+	struct epoll * ep = malloc(sizeof(struct epoll));
+	memset(ep, 0, sizeof(struct epoll));
+	ep->interest = hashmap_create_int(64);
+
+	fs_node_t * fnode = vfs_node_alloc();
+	snprintf(fnode->name, 100, "[epoll]");
+	fnode->mask  = 0600;
+	fnode->flags = FS_PIPE;
+	fnode->device = ep;
+	fnode->close = epoll_close;
+	fnode->selectcheck = epoll_check;
+	fnode->selectwait  = epoll_select_wait;
+	fnode->atime = now();
+	fnode->mtime = fnode->atime;
+	fnode->ctime = fnode->atime;
+
+	return fnode;
+}
+
+/**
+ * @brief Add, change, or remove the entry for @p fd.
+ *
+ * New and changed entries start out on the ready list so the next wait
+ * checks them and registers them with their file.
+ *
+ * @param target The node @p fd refers to.
+ */
+long epoll_ctl_node(fs_node_t * node, int op, int fd, fs_node_t * target, struct epoll_event * event) {
+	if (node->close != epoll_close) return -EINVAL;
+	if (target == node) return -EINVAL;
+	struct epoll * ep = node->device;
+	void * key = (void*)(uintptr_t)fd;
+
+	list_t * waiters = NULL;
+	struct epoll_watch * w;
+
+	spin_lock(ep->ctl_lock);
+	switch (op) {
+		case EPOLL_CTL_ADD:
+			if ((!target->selectcheck && !target->pollcheck) || !target->selectwait) {
+				spin_unlock(ep->ctl_lock);
+				return -EPERM;
+			}
+			if (hashmap_has(ep->interest, key)) {
+				spin_unlock(ep->ctl_lock);
+				return -EEXIST;
+			}
+			w = kmem_cache_alloc(epoll_watch_cache);
+			memset(w, 0, sizeof(struct epoll_watch));
+			w->ep = ep;
+			w->node = clone_fs(target);
+			w->fd = fd;
+			w->events = event->events;
+			w->data = event->data;
+			hashmap_set(ep->interest, key, w);
+			ep->count++;
+
+			spin_lock(epoll_watches_lock);
+			hashmap_set(epoll_watches, w, w);
+			spin_unlock(epoll_watches_lock);
+
+			spin_lock(ep->lock);
+			waiters = epoll_queue(ep, w);
+			spin_unlock(ep->lock);
+			break;
+
+		case EPOLL_CTL_MOD:
+			w = hashmap_get(ep->interest, key);
+			if (!w) {
+				spin_unlock(ep->ctl_lock);
+				return -ENOENT;
+			}
+			spin_lock(ep->lock);
+			w->events = event->events;
+			w->data = event->data;
+			/* Still registered with the file; only the check is needed. */
+			int armed = w->armed;
+			waiters = epoll_queue(ep, w);
+			w->armed = armed;
+			spin_unlock(ep->lock);
+			break;
+
+		case EPOLL_CTL_DEL:
+			w = hashmap_remove(ep->interest, key);
+			if (!w) {
+				spin_unlock(ep->ctl_lock);
+				return -ENOENT;
+			}
+			ep->count--;
+
+			spin_lock(epoll_watches_lock);
+			hashmap_remove(epoll_watches, w);
+			spin_lock(ep->lock);
+			if (w->queued) epoll_ready_remove(ep, w);
+			spin_unlock(ep->lock);
+			spin_unlock(epoll_watches_lock);
+
+			spin_unlock(ep->ctl_lock);
+			close_fs(w->node);
+			kmem_cache_free(epoll_watch_cache, w);
+			return 0;
+
+		default:
+			spin_unlock(ep->ctl_lock);
+			return -EINVAL;
+	}
+	spin_unlock(ep->ctl_lock);
+
+	epoll_wake(waiters, ep, 0);
+	return 0;
+}
+
+/**
+ * @brief Report entries on the ready list that really are ready.
+ *
+ * Entries that fired are registered with their file again before
+ * their file is checked, so an alert in between is not lost.
+ */
+static int epoll_collect(struct epoll * ep, struct epoll_event * out, int maxevents) {
+	int count = 0;
+
+	spin_lock(ep->ctl_lock);
+
+	spin_lock(ep->lock);
+	struct epoll_watch * w = ep->ready;
+	ep->ready = NULL;
+	ep->ready_tail = NULL;
+	for (struct epoll_watch * x = w; x; x = x->next_ready) x->queued = 2;
+	spin_unlock(ep->lock);
+
+	while (w) {
+		struct epoll_watch * next = w->next_ready;
+		int keep = 1;
+
+		if (count < maxevents) {
+			spin_lock(ep->lock);
+			int rearm = !w->armed;
+			w->armed = 1;
+			spin_unlock(ep->lock);
+			if (rearm) selectwait_fs(w->node, w);
+
+			uint32_t revents = 0;
+			int status = pollcheck_fs(w->node);
+			if (status & POLLIN)  revents |= EPOLLIN;
+			if (status & POLLOUT) revents |= EPOLLOUT;
+			if (status & POLLERR) revents |= EPOLLERR;
+			if (status & POLLHUP) revents |= EPOLLHUP;
+			revents &= w->events | EPOLLERR | EPOLLHUP;
+
+			if (revents) {
+				out[count].events = revents;
+				out[count].data = w->data;
+				count++;
+				keep = !(w->events & EPOLLET);
+			} else {
+				keep = 0;
+			}
+		}
+
+		spin_lock(ep->lock);
+		if (keep || w->again) {
+			w->again = 0;
+			w->queued = 1;
+			epoll_ready_push(ep, w);
+		} else {
+			w->queued = 0;
+		}
+		spin_unlock(ep->lock);
+
+		w = next;
+	}
+
+	spin_unlock(ep->ctl_lock);
+	return count;
+}
+
+/**
+ * @brief Wait for entries in the set to become ready.
+ *
+ * @param events    Where to put ready events; must already be validated.
+ * @param timeout   In milliseconds; 0 to not wait, or -1 to wait forever.
+ * @returns the number of events, or -EINTR.
+ */
+long epoll_wait_node(fs_node_t * node, struct epoll_event * events, int maxevents, int timeout) {
+	if (node->close != epoll_close) return -EINVAL;
+	struct epoll * ep = node->device;
+
+	/* Events are gathered here first, as we can not fault on the caller's buffer with locks held. */
+	size_t batch = ep->count < (size_t)maxevents ? ep->count : (size_t)maxevents;
+	if (!batch) batch = 1;
+	struct epoll_event * out = malloc(sizeof(struct epoll_event) * batch);
+
+	unsigned long s = 0, ss = 0;
+	if (timeout > 0) relative_time(0, (unsigned long)timeout * 1000, &s, &ss);
+
+	fs_node_t * nodes[] = { node, NULL };
+	long result;
+
+	while (1) {
+		result = epoll_collect(ep, out, batch);
+		if (result || !timeout) break;
+
+		int wait = -1;
+		if (timeout > 0) {
+			unsigned long ns, nss;
+			relative_time(0, 0, &ns, &nss);
+			if (ns > s || (ns == s && nss >= ss)) break;
+			wait = (s - ns) * 1000 + ((long)ss - (long)nss) / 1000;
+			if (wait < 1) wait = 1;
+		}
+
+		int index = process_wait_nodes((process_t *)this_core->current_process, nodes, wait);
+		if (index < 0) {
+			result = index;
+			break;
+		}
+	}
+
+	if (result > 0) memcpy(events, out, sizeof(struct epoll_event) * result);
+	free(out);
+	return result;
+}
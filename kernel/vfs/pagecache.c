@@ -0,0 +1,703 @@
+/**
+ * @file  kernel/vfs/pagecache.c
+ * @brief Cache of file contents in page-sized frames.
+ *
+ * Files from filesystems that set @c FS_CACHED have their contents
+ * kept here, one frame per 4KiB page, keyed by the device identifier,
+ * inode, and page index. Reads through read_fs are served from the
+ * cache, and read-only file mappings map the cached frames directly,
+ * so every process using the same library or font shares one copy.
+ *
+ * Writes and truncations through the VFS update the cache as they
+ * happen, so filesystems don't need to know about it.
+ *
+ * Pages that are not mapped anywhere sit on an LRU list and are given
+ * back when free memory runs low or when the frame allocator comes up
+ * empty.
+ *
+ * Each open file remembers where its last read ended. Reads that carry
+ * on from there are treated as a stream, and a worker thread reads
+ * ahead of them in the background, doubling how far ahead it goes with
+ * each read up to READAHEAD_MAX pages; a read anywhere else closes the
+ * window again. posix_fadvise() can force either behaviour.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/process.h>
+#include <kernel/mmu.h>
+#include <kernel/mman.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/buddy.h>
+#include <kernel/pagecache.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define PAGECACHE_BUCKETS 4096
+#define PAGE_SIZE 4096
+
+#define READAHEAD_MIN   4     /* pages read ahead once a file looks sequential */
+#define READAHEAD_MAX   64    /* the window stops doubling here, or twice this with POSIX_FADV_SEQUENTIAL */
+#define READAHEAD_RUN   64    /* most pages handed to the filesystem in one read */
+#define READAHEAD_QUEUE 32    /* requests waiting for the worker before more are dropped */
+
+struct pagecache_page {
+	dev_t dev;
+	uint64_t ino;
+	uint64_t index;
+	uintptr_t frame;
+	size_t valid;     /* bytes of file data in the page; the rest is zero */
+	int refs;         /* mappings, plus readers currently copying from it */
+	int dead;         /* no longer findable; free the frame when refs drops to 0 */
+	struct pagecache_page * hash_next;
+	struct pagecache_page * frame_next;
+	node_t lru;
+};
+
+static struct pagecache_page * pagecache_table[PAGECACHE_BUCKETS];
+static struct pagecache_page * pagecache_frames[PAGECACHE_BUCKETS];
+static struct pagecache_page * pagecache_spare = NULL;
+static list_t pagecache_lru = {0};
+static spin_lock_t pagecache_lock = { 0 };
+
+/* Bumped by every write or truncation, so a page read from the
+ * filesystem while one was in progress is not cached stale. */
+static uint64_t pagecache_generation = 0;
+static size_t pagecache_pages = 0;
+
+struct readahead_request {
+	fs_node_t * node;
+	uint64_t index;
+	size_t count;
+	node_t list;
+};
+
+/* Requests for the readahead thread, which sleeps on readahead_idle
+ * while there are none; all protected by pagecache_lock. */
+static list_t readahead_requests = {0};
+static list_t readahead_idle = {0};
+static int readahead_thread = 0;
+
+/* The pages the readahead thread is reading right now, so readers who
+ * need one of them wait on readahead_done instead of reading it again. */
+static struct {
+	dev_t dev;
+	uint64_t ino;
+	uint64_t start;
+	uint64_t end;
+} readahead_busy;
+static list_t readahead_done = {0};
+
+static unsigned int pagecache_hash(dev_t dev, uint64_t ino, uint64_t index) {
+	return (((uint64_t)dev * 31 + ino) * 131 + index) % PAGECACHE_BUCKETS;
+}
+
+static struct pagecache_page * pagecache_lookup(dev_t dev, uint64_t ino, uint64_t index) {
+	for (struct pagecache_page * page = pagecache_table[pagecache_hash(dev, ino, index)]; page; page = page->hash_next) {
+		if (page->dev == dev && page->ino == ino && page->index == index) return page;
+	}
+	return NULL;
+}
+
+static struct pagecache_page * pagecache_lookup_frame(uintptr_t frame) {
+	for (struct pagecache_page * page = pagecache_frames[frame % PAGECACHE_BUCKETS]; page; page = page->frame_next) {
+		if (page->frame == frame) return page;
+	}
+	return NULL;
+}
+
+static int pagecache_busy(dev_t dev, uint64_t ino, uint64_t index) {
+	return readahead_busy.dev == dev && readahead_busy.ino == ino &&
+		index >= readahead_busy.start && index < readahead_busy.end;
+}
+
+static void pagecache_unhash(struct pagecache_page * page) {
+	struct pagecache_page ** p = &pagecache_table[pagecache_hash(page->dev, page->ino, page->index)];
+	while (*p && *p != page) p = &(*p)->hash_next;
+	if (*p) *p = page->hash_next;
+	if (page->lru.owner) list_delete(&pagecache_lru, &page->lru);
+	page->dead = 1;
+}
+
+/**
+ * @brief Forget a page entirely. Its frame is the caller's to release.
+ */
+static uintptr_t pagecache_drop(struct pagecache_page * page) {
+	if (!page->dead) pagecache_unhash(page);
+	struct pagecache_page ** p = &pagecache_frames[page->frame % PAGECACHE_BUCKETS];
+	while (*p && *p != page) p = &(*p)->frame_next;
+	if (*p) *p = page->frame_next;
+	uintptr_t frame = page->frame;
+	page->hash_next = pagecache_spare;
+	pagecache_spare = page;
+	pagecache_pages--;
+	return frame;
+}
+
+/**
+ * @brief Drop a reference; the page lock must be held.
+ * @returns a frame to release after unlocking, or 0.
+ */
+static uintptr_t pagecache_put_locked(struct pagecache_page * page) {
+	page->refs--;
+	if (!page->refs && page->dead) return pagecache_drop(page);
+	return 0;
+}
+
+static void pagecache_put(struct pagecache_page * page) {
+	spin_lock(pagecache_lock);
+	uintptr_t frame = pagecache_put_locked(page);
+	spin_unlock(pagecache_lock);
+	if (frame) mmu_frame_release(frame << 12);
+}
+
+/**
+ * @brief Find or read in a page of a file, holding a reference to it.
+ *
+ * @returns 1 with @p out set, 0 if the page is past the end of the file,
+ *          or a negative error.
+ */
+static long pagecache_get(fs_node_t * node, uint64_t index, struct pagecache_page ** out) {
+	dev_t dev = fs_device_identifier(node);
+	uint64_t ino = node->inode;
+
+	spin_lock(pagecache_lock);
+	struct pagecache_page * page;
+	while (!(page = pagecache_lookup(dev, ino, index)) && pagecache_busy(dev, ino, index)) {
+		/* Already on its way in; if we're interrupted, just read it ourselves. */
+		int interrupted = sleep_on_unlocking(&readahead_done, &pagecache_lock);
+		spin_lock(pagecache_lock);
+		if (interrupted) break;
+	}
+	if (page) {
+		page->refs++;
+		list_delete(&pagecache_lru, &page->lru);
+		list_append(&pagecache_lru, &page->lru);
+		spin_unlock(pagecache_lock);
+		*out = page;
+		return 1;
+	}
+	uint64_t generation = pagecache_generation;
+	struct pagecache_page * fresh = pagecache_spare;
+	if (fresh) pagecache_spare = fresh->hash_next;
+	spin_unlock(pagecache_lock);
+
+	/* Read the page with no locks held; the filesystem may sleep. */
+	uintptr_t frame = mmu_allocate_a_frame();
+	if (frame == (uintptr_t)-1) {
+		if (fresh) {
+			spin_lock(pagecache_lock);
+			fresh->hash_next = pagecache_spare;
+			pagecache_spare = fresh;
+			spin_unlock(pagecache_lock);
+		}
+		return -ENOMEM;
+	}
+	uint8_t * data = mmu_map_from_physical(frame << 12);
+	ssize_t r = node->read(node, index * PAGE_SIZE, PAGE_SIZE, data);
+	if (r <= 0) {
+		mmu_frame_release(frame << 12);
+		if (fresh) {
+			spin_lock(pagecache_lock);
+			fresh->hash_next = pagecache_spare;
+			pagecache_spare = fresh;
+			spin_unlock(pagecache_lock);
+		}
+		return r;
+	}
+	if (r < PAGE_SIZE) memset(data + r, 0, PAGE_SIZE - r);
+	if (!fresh) fresh = malloc(sizeof(struct pagecache_page));
+
+	spin_lock(pagecache_lock);
+	page = pagecache_lookup(dev, ino, index);
+	if (page) {
+		/* Someone else read it in while we were. */
+		page->refs++;
+		fresh->hash_next = pagecache_spare;
+		pagecache_spare = fresh;
+		spin_unlock(pagecache_lock);
+		mmu_frame_release(frame << 12);
+		*out = page;
+		return 1;
+	}
+
+	memset(fresh, 0, sizeof(struct pagecache_page));
+	fresh->dev   = dev;
+	fresh->ino   = ino;
+	fresh->index = index;
+	fresh->frame = frame;
+	fresh->valid = r;
+	fresh->refs  = 1;
+	fresh->lru.value = fresh;
+	fresh->frame_next = pagecache_frames[frame % PAGECACHE_BUCKETS];
+	pagecache_frames[frame % PAGECACHE_BUCKETS] = fresh;
+	pagecache_pages++;
+
+	if (generation == pagecache_generation) {
+		unsigned int bucket = pagecache_hash(dev, ino, index);
+		fresh->hash_next = pagecache_table[bucket];
+		pagecache_table[bucket] = fresh;
+		list_append(&pagecache_lru, &fresh->lru);
+	} else {
+		/* A write raced us; use what we read this once, but don't keep it. */
+		fresh->dead = 1;
+	}
+	spin_unlock(pagecache_lock);
+
+	/* Keep a little headroom for everyone else. */
+	if (buddy_ready && buddy_free_count() < mmu_total_memory() / 4 / 32) {
+		pagecache_reclaim(32);
+	}
+
+	*out = fresh;
+	return 1;
+}
+
+/**
+ * @brief Cache a page that was read before anyone asked for it.
+ *
+ * The page goes on the LRU list with no references.
+ *
+ * @returns 0 if the page was cached or already was, or a negative error
+ *          if there was no memory or a write raced the read.
+ */
+static int pagecache_insert(dev_t dev, uint64_t ino, uint64_t index, const uint8_t * data, size_t valid, uint64_t generation) {
+	uintptr_t frame = mmu_allocate_a_frame();
+	if (frame == (uintptr_t)-1) return -ENOMEM;
+	uint8_t * dest = mmu_map_from_physical(frame << 12);
+	memcpy(dest, data, valid);
+	if (valid < PAGE_SIZE) memset(dest + valid, 0, PAGE_SIZE - valid);
+
+	spin_lock(pagecache_lock);
+	struct pagecache_page * fresh = pagecache_spare;
+	if (fresh) pagecache_spare = fresh->hash_next;
+	spin_unlock(pagecache_lock);
+	if (!fresh) fresh = malloc(sizeof(struct pagecache_page));
+
+	spin_lock(pagecache_lock);
+	if (generation != pagecache_generation || pagecache_lookup(dev, ino, index)) {
+		int status = generation != pagecache_generation ? -EAGAIN : 0;
+		fresh->hash_next = pagecache_spare;
+		pagecache_spare = fresh;
+		spin_unlock(pagecache_lock);
+		mmu_frame_release(frame << 12);
+		return status;
+	}
+
+	memset(fresh, 0, sizeof(struct pagecache_page));
+	fresh->dev   = dev;
+	fresh->ino   = ino;
+	fresh->index = index;
+	fresh->frame = frame;
+	fresh->valid = valid;
+	fresh->lru.value = fresh;
+	fresh->frame_next = pagecache_frames[frame % PAGECACHE_BUCKETS];
+	pagecache_frames[frame % PAGECACHE_BUCKETS] = fresh;
+	unsigned int bucket = pagecache_hash(dev, ino, index);
+	fresh->hash_next = pagecache_table[bucket];
+	pagecache_table[bucket] = fresh;
+	list_append(&pagecache_lru, &fresh->lru);
+	pagecache_pages++;
+	spin_unlock(pagecache_lock);
+	return 0;
+}
+
+/**
+ * @brief Read in the pages of [index, index+count) that aren't cached yet.
+ *
+ * Each stretch of missing pages is handed to the filesystem as one
+ * read, so it can do the same with the disk. Stops at the end of the
+ * file, and gives up rather than push other files out of the cache
+ * when memory is short; anything it skips is read a page at a time
+ * when it's actually needed.
+ *
+ * @param async Set by the readahead thread, which marks what it is
+ *              reading so that pagecache_get waits for it.
+ */
+static void pagecache_fill(fs_node_t * node, uint64_t index, size_t count, int async) {
+	dev_t dev = fs_device_identifier(node);
+	uint64_t ino = node->inode;
+	uint64_t end = index + count;
+	uint8_t * buffer = NULL;
+
+	while (index < end) {
+		if (buddy_ready && buddy_free_count() < mmu_total_memory() / 4 / 32) break;
+
+		spin_lock(pagecache_lock);
+		while (index < end && (pagecache_lookup(dev, ino, index) || pagecache_busy(dev, ino, index))) index++;
+		size_t run = 0;
+		while (index + run < end && run < READAHEAD_RUN &&
+			!pagecache_lookup(dev, ino, index + run) && !pagecache_busy(dev, ino, index + run)) run++;
+		if (run && async) {
+			readahead_busy.dev   = dev;
+			readahead_busy.ino   = ino;
+			readahead_busy.start = index;
+			readahead_busy.end   = index + run;
+		}
+		uint64_t generation = pagecache_generation;
+		spin_unlock(pagecache_lock);
+		if (!run) break;
+
+		if (!buffer) buffer = malloc((count < READAHEAD_RUN ? count : READAHEAD_RUN) * PAGE_SIZE);
+		ssize_t r = node->read(node, index * PAGE_SIZE, run * PAGE_SIZE, buffer);
+
+		int status = 0;
+		for (size_t i = 0; r > 0 && i * PAGE_SIZE < (size_t)r && !status; ++i) {
+			size_t valid = (size_t)r - i * PAGE_SIZE;
+			if (valid > PAGE_SIZE) valid = PAGE_SIZE;
+			status = pagecache_insert(dev, ino, index + i, buffer + i * PAGE_SIZE, valid, generation);
+		}
+
+		if (async) {
+			spin_lock(pagecache_lock);
+			readahead_busy.end = readahead_busy.start;
+			spin_unlock(pagecache_lock);
+			wakeup_queue(&readahead_done);
+		}
+
+		/* Short reads mean we hit the end of the file. */
+		if (status || r < (ssize_t)(run * PAGE_SIZE)) break;
+		index += run;
+	}
+
+	free(buffer);
+}
+
+static void pagecache_readahead_thread(void * arg) {
+	while (1) {
+		spin_lock(pagecache_lock);
+		while (!readahead_requests.head) {
+			sleep_on_unlocking(&readahead_idle, &pagecache_lock);
+			spin_lock(pagecache_lock);
+		}
+		struct readahead_request * request = readahead_requests.head->value;
+		list_delete(&readahead_requests, &request->list);
+		spin_unlock(pagecache_lock);
+
+		pagecache_fill(request->node, request->index, request->count, 1);
+		close_fs(request->node);
+		free(request);
+	}
+}
+
+/**
+ * @brief Have the readahead thread read in some pages of a file.
+ *
+ * This is only a hint: if the thread is too far behind, it is dropped.
+ *
+ * @returns 0 if the request was queued, -EAGAIN if it was dropped.
+ */
+static int pagecache_readahead_pages(fs_node_t * node, uint64_t index, size_t count) {
+	struct readahead_request * request = malloc(sizeof(struct readahead_request));
+	request->node  = clone_fs(node);
+	request->index = index;
+	request->count = count;
+	request->list.value = request;
+
+	spin_lock(pagecache_lock);
+	if (readahead_requests.length >= READAHEAD_QUEUE) {
+		spin_unlock(pagecache_lock);
+		close_fs(request->node);
+		free(request);
+		return -EAGAIN;
+	}
+	list_append(&readahead_requests, &request->list);
+	int start = !readahead_thread;
+	readahead_thread = 1;
+	spin_unlock(pagecache_lock);
+
+	if (start) spawn_worker_thread(pagecache_readahead_thread, "[readahead]", NULL);
+	else wakeup_queue(&readahead_idle);
+	return 0;
+}
+
+/**
+ * @brief Read in [offset, offset+size) of a cached file in the background.
+ *
+ * Nothing past the end of the file is asked for, and once the thread
+ * stops taking requests the rest of the range is let go.
+ */
+void pagecache_readahead(fs_node_t * node, off_t offset, size_t size) {
+	if (!(node->flags & FS_CACHED) || offset < 0 || !size) return;
+	uint64_t length = node->length;
+	if ((uint64_t)offset >= length) return;
+	if (size > length - offset) size = length - offset;
+	uint64_t first = offset / PAGE_SIZE;
+	uint64_t end   = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+	while (first < end) {
+		size_t count = end - first > READAHEAD_RUN ? READAHEAD_RUN : end - first;
+		if (pagecache_readahead_pages(node, first, count) < 0) break;
+		first += count;
+	}
+}
+
+/**
+ * @brief Note a read of @p node and keep ahead of it if it's streaming.
+ *
+ * A read that starts where the last one ended, or in the page it ended
+ * in, doubles the window; anything else closes it. More is asked for
+ * once the reader is halfway through what was already read ahead, so
+ * the next batch is on its way before the reader gets there.
+ */
+static void pagecache_readahead_track(fs_node_t * node, off_t offset, size_t size) {
+	struct fs_readahead * ra = &node->readahead;
+	uint64_t first = offset / PAGE_SIZE;
+	uint64_t end   = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint64_t start = 0, count = 0;
+
+	spin_lock(pagecache_lock);
+	if (ra->advice == POSIX_FADV_RANDOM) {
+		ra->window = 0;
+	} else if (first == ra->next || first + 1 == ra->next) {
+		uint32_t max = ra->advice == POSIX_FADV_SEQUENTIAL ? READAHEAD_MAX * 2 : READAHEAD_MAX;
+		if (ra->advice == POSIX_FADV_SEQUENTIAL) ra->window = max;
+		else if (!ra->window) ra->window = READAHEAD_MIN;
+		else if (ra->window < max) ra->window *= 2;
+	} else {
+		ra->window = 0;
+		ra->ahead  = 0;
+	}
+	ra->next = end;
+
+	if (ra->window) {
+		if (ra->ahead < end) ra->ahead = end;
+		if (ra->ahead - end < ra->window / 2) {
+			start = ra->ahead;
+			count = end + ra->window - ra->ahead;
+			ra->ahead = end + ra->window;
+		}
+	}
+	spin_unlock(pagecache_lock);
+
+	if (count) pagecache_readahead(node, start * PAGE_SIZE, count * PAGE_SIZE);
+}
+
+/**
+ * @brief Drop cached pages of [offset, offset+size) that nothing has mapped.
+ *
+ * A @p size of 0 means through the end of the file.
+ */
+void pagecache_evict(fs_node_t * node, off_t offset, size_t size) {
+	dev_t dev = fs_device_identifier(node);
+	uint64_t ino = node->inode;
+	uint64_t first = offset / PAGE_SIZE;
+	uint64_t end   = size ? (offset + size + PAGE_SIZE - 1) / PAGE_SIZE : UINT64_MAX;
+	uintptr_t frames[64];
+	int count;
+
+	do {
+		count = 0;
+		spin_lock(pagecache_lock);
+		for (int i = 0; i < PAGECACHE_BUCKETS && count < 64; ++i) {
+			struct pagecache_page * next;
+			for (struct pagecache_page * page = pagecache_table[i]; page && count < 64; page = next) {
+				next = page->hash_next;
+				if (page->dev != dev || page->ino != ino || page->refs) continue;
+				if (page->index < first || page->index >= end) continue;
+				frames[count++] = pagecache_drop(page);
+			}
+		}
+		spin_unlock(pagecache_lock);
+		for (int i = 0; i < count; ++i) mmu_frame_release(frames[i] << 12);
+	} while (count == 64);
+}
+
+/**
+ * @brief read_fs for cached files.
+ *
+ * A read that misses is filled in with one request to the filesystem
+ * for all of the pages it needs, rather than one per page.
+ */
+ssize_t pagecache_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	ssize_t total = 0;
+	if (offset < 0) return -EINVAL;
+	if (!size) return 0;
+
+	pagecache_readahead_track(node, offset, size);
+
+	uint64_t first = offset / PAGE_SIZE;
+	uint64_t end   = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (end - first > 1) pagecache_fill(node, first, end - first, 0);
+
+	while (size) {
+		struct pagecache_page * page;
+		long r = pagecache_get(node, offset / PAGE_SIZE, &page);
+		if (r <= 0) return total ? total : r;
+
+		size_t in = offset % PAGE_SIZE;
+		if (in >= page->valid) {
+			pagecache_put(page);
+			break;
+		}
+		size_t count = page->valid - in;
+		if (count > size) count = size;
+		memcpy(buffer, (uint8_t*)mmu_map_from_physical(page->frame << 12) + in, count);
+		int eof = page->valid < PAGE_SIZE;
+		pagecache_put(page);
+
+		buffer += count;
+		offset += count;
+		size   -= count;
+		total  += count;
+		if (eof) break;
+	}
+
+	return total;
+}
+
+/**
+ * @brief Apply a completed write to any cached pages it covered.
+ */
+void pagecache_write(fs_node_t * node, off_t offset, size_t size, const uint8_t * buffer) {
+	dev_t dev = fs_device_identifier(node);
+	uint64_t ino = node->inode;
+	if (!size) return;
+
+	spin_lock(pagecache_lock);
+	pagecache_generation++;
+	for (uint64_t index = offset / PAGE_SIZE; index <= (offset + size - 1) / PAGE_SIZE; ++index) {
+		struct pagecache_page * page = pagecache_lookup(dev, ino, index);
+		if (!page) continue;
+		page->refs++;
+		spin_unlock(pagecache_lock);
+
+		/* buffer may be in userspace, so copy without the lock */
+		off_t start = index * PAGE_SIZE;
+		size_t in   = offset > start ? (size_t)(offset - start) : 0;
+		size_t end  = (offset + size) - start < PAGE_SIZE ? (offset + size) - start : PAGE_SIZE;
+		memcpy((uint8_t*)mmu_map_from_physical(page->frame << 12) + in, buffer + (start + in - offset), end - in);
+
+		spin_lock(pagecache_lock);
+		if (end > page->valid) page->valid = end;
+		uintptr_t frame = pagecache_put_locked(page);
+		if (frame) {
+			spin_unlock(pagecache_lock);
+			mmu_frame_release(frame << 12);
+			spin_lock(pagecache_lock);
+		}
+	}
+	spin_unlock(pagecache_lock);
+}
+
+/**
+ * @brief Drop cached pages past @p size, and trim the one it lands in.
+ */
+void pagecache_truncate(fs_node_t * node, size_t size) {
+	dev_t dev = fs_device_identifier(node);
+	uint64_t ino = node->inode;
+	uintptr_t frames[64];
+	int count;
+
+	do {
+		count = 0;
+		spin_lock(pagecache_lock);
+		pagecache_generation++;
+		for (int i = 0; i < PAGECACHE_BUCKETS && count < 64; ++i) {
+			struct pagecache_page * next;
+			for (struct pagecache_page * page = pagecache_table[i]; page && count < 64; page = next) {
+				next = page->hash_next;
+				if (page->dev != dev || page->ino != ino) continue;
+				if (page->index * PAGE_SIZE >= size) {
+					if (page->refs) pagecache_unhash(page);
+					else frames[count++] = pagecache_drop(page);
+				} else if ((page->index + 1) * PAGE_SIZE > size) {
+					size_t keep = size - page->index * PAGE_SIZE;
+					if (page->valid > keep) {
+						memset((uint8_t*)mmu_map_from_physical(page->frame << 12) + keep, 0, page->valid - keep);
+						page->valid = keep;
+					}
+				}
+			}
+		}
+		spin_unlock(pagecache_lock);
+		for (int i = 0; i < count; ++i) mmu_frame_release(frames[i] << 12);
+	} while (count == 64);
+}
+
+/**
+ * @brief fault_map for cached files.
+ *
+ * Read faults map the cached frame read-only and marked as shared, so
+ * it is neither freed nor copied-on-write with the address space; a
+ * later write to a private mapping is handled by the normal fault path,
+ * which replaces the shared page with a private copy.
+ */
+int pagecache_fault_map(fs_node_t * node, union PML * page, off_t offset, int fault_flags, int map_flags, int prot, int * mmu_flags) {
+	/* We have nowhere to write shared changes back to. */
+	if ((map_flags & MAP_SHARED) && (prot & PROT_WRITE)) return 2;
+	if (fault_flags & FAULT_CODE_WRITE) return 1;
+
+	struct pagecache_page * cached;
+	if (pagecache_get(node, offset / PAGE_SIZE, &cached) <= 0) return 1;
+
+	/* The reference we got is now the mapping's. */
+	page->bits.page = cached->frame;
+	page->bits.mmap_shared = 1;
+	(*mmu_flags) &= ~(MMU_FLAG_WRITABLE);
+	return 0;
+}
+
+/**
+ * @brief A mapping of @p frame was copied to another address space.
+ */
+void pagecache_frame_ref(uintptr_t frame) {
+	spin_lock(pagecache_lock);
+	struct pagecache_page * page = pagecache_lookup_frame(frame);
+	if (page) page->refs++;
+	spin_unlock(pagecache_lock);
+}
+
+/**
+ * @brief A mapping of @p frame went away.
+ *
+ * Called for every shared page that is unmapped; frames that
+ * do not belong to the cache are ignored.
+ */
+void pagecache_frame_unref(uintptr_t frame) {
+	spin_lock(pagecache_lock);
+	struct pagecache_page * page = pagecache_lookup_frame(frame);
+	uintptr_t release = page ? pagecache_put_locked(page) : 0;
+	spin_unlock(pagecache_lock);
+	if (release) mmu_frame_release(release << 12);
+}
+
+/**
+ * @brief Give up to @p count unmapped pages back to the frame allocator,
+ *        least recently used first.
+ *
+ * @returns how many frames were released.
+ */
+size_t pagecache_reclaim(size_t count) {
+	uintptr_t frames[64];
+	size_t released = 0;
+	if (count > 64) count = 64;
+
+	spin_lock(pagecache_lock);
+	node_t * next;
+	for (node_t * node = pagecache_lru.head; node && released < count; node = next) {
+		next = node->next;
+		struct pagecache_page * page = node->value;
+		if (page->refs) continue;
+		frames[released++] = pagecache_drop(page);
+	}
+	spin_unlock(pagecache_lock);
+
+	for (size_t i = 0; i < released; ++i) mmu_frame_release(frames[i] << 12);
+	return released;
+}
+
+/**
+ * @returns the number of pages in the cache.
+ */
+size_t pagecache_size(void) {
+	return pagecache_pages;
+}
@@ -230,7 +230,7 @@ static int pipe_wait(fs_node_t * node, void * process) {
 	spin_unlock(pipe->alert_lock);
 
 	spin_lock(pipe->wait_lock);
-	list_insert(((process_t *)process)->node_waits, pipe);
+	process_node_wait(process, pipe);
 	spin_unlock(pipe->wait_lock);
 
 	return 0;
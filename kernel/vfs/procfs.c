@@ -21,6 +21,7 @@
  */
 #include <stdint.h>
 #include <stddef.h>
+#include <bits/errno.h>
 #include <kernel/string.h>
 #include <kernel/printf.h>
 #include <kernel/vfs.h>
@@ -35,6 +36,12 @@
 #include <kernel/misc.h>
 #include <kernel/module.h>
 #include <kernel/ksym.h>
+#include <kernel/lockstat.h>
+#include <kernel/slab.h>
+#include <kernel/pagecache.h>
+#include <kernel/profile.h>
+#include <kernel/trace.h>
+#include <kernel/blockcache.h>
 #include <sys/mman.h>
 
 #define PROCFS_STANDARD_ENTRIES (sizeof(std_entries) / sizeof(struct procfs_entry))
@@ -48,7 +55,7 @@ static ssize_t procfs_entry_read(fs_node_t * node, off_t offset, size_t size, ui
 	return size;
 }
 
-static fs_node_t * procfs_generic_create(const char * name, procfs_populate_t read_func, int flags);
+static fs_node_t * procfs_generic_create(const char * name, procfs_populate_t read_func, int flags, procfs_write_t write_func);
 
 /**
  * Dynamic reallocating printf thingy
@@ -75,13 +82,35 @@ int procfs_printf(fs_node_t * node, const char * fmt, ...) {
 	return out;
 }
 
+/**
+ * Append raw bytes, for entries that produce binary data.
+ */
+static void procfs_append(fs_node_t * node, const void * data, size_t size) {
+	procfs_entry_t * entry = (void*)node;
+
+	if (entry->used + size > entry->avail) {
+		while (entry->used + size > entry->avail) entry->avail = entry->avail ? entry->avail * 2 : 4096;
+		entry->buf = realloc(entry->buf, entry->avail);
+	}
+
+	memcpy(entry->buf + entry->used, data, size);
+	entry->used += size;
+}
+
 
 static void procfs_entry_open(fs_node_t * node, unsigned int flags) {
 	procfs_entry_t * entry = (void*)node;
+	/* Don't generate contents for files that are only being written to. */
+	if ((flags & O_ACCMODE) == O_WRONLY) return;
 	entry->func(node);
 	node->length = entry->used;
 }
 
+static ssize_t procfs_entry_write(fs_node_t * node, off_t offset, size_t size, uint8_t *buffer) {
+	procfs_entry_t * entry = (void*)node;
+	return entry->write(node, (const char *)buffer, size);
+}
+
 static void procfs_entry_close(fs_node_t * node) {
 	procfs_entry_t * entry = (void*)node;
 	if (entry->avail) free(entry->buf);
@@ -148,7 +177,7 @@ static fs_node_t * finddir_procfs_subdir(fs_node_t * node, const char * name) {
 		foreach(node, self->files) {
 			struct procfs_entry * e = node->value;
 			if (!strcmp(name, e->name)) {
-				fs_node_t * out = procfs_generic_create(e->name, e->func, e->flags);
+				fs_node_t * out = procfs_generic_create(e->name, e->func, e->flags, e->write);
 				return out;
 			}
 		}
@@ -157,7 +186,7 @@ static fs_node_t * finddir_procfs_subdir(fs_node_t * node, const char * name) {
 	return NULL;
 }
 
-static fs_node_t * procfs_generic_create(const char * name, procfs_populate_t read_func, int flags) {
+static fs_node_t * procfs_generic_create(const char * name, procfs_populate_t read_func, int flags, procfs_write_t write_func) {
 	procfs_entry_t * entry = calloc(1, sizeof(procfs_entry_t));
 	entry->fnode.inode = 0;
 	strcpy(entry->fnode.name, name);
@@ -182,6 +211,11 @@ static fs_node_t * procfs_generic_create(const char * name, procfs_populate_t re
 	} else {
 		entry->fnode.flags   = FS_FILE;
 		entry->fnode.read    = procfs_entry_read;
+		if (write_func) {
+			entry->write = write_func;
+			entry->fnode.write = procfs_entry_write;
+			entry->fnode.mask  = 0644;
+		}
 	}
 
 	entry->fnode.open    = procfs_entry_open;
@@ -282,6 +316,9 @@ static void proc_status_func(fs_node_t *node) {
 	char tty_name[101] = {0};
 	process_get_tty(proc, 100, tty_name);
 
+	/* Faults are counted for the whole process; kernel tasklets have no process. */
+	process_t * faults = proc->process ? proc->process : proc;
+
 	sigset_t ignored = 0;
 	sigset_t caught = 0;
 	for (int i = 1; i < NUMSIGNALS; ++i) {
@@ -324,6 +361,12 @@ static void proc_status_func(fs_node_t *node) {
 			"SigIgn:\t%016zx\n"
 			"SigCgt:\t%016zx\n"
 			"Tty:\t%s\n"
+			"Nice:\t%d\n"
+			"SchedPolicy:\t%d\n"
+			"SchedPriority:\t%d\n"
+			"CpusAllowed:\t%#lx\n"
+			"MinFlt:\t%zu\n"
+			"MajFlt:\t%zu\n"
 			,
 			name,
 			state,
@@ -353,7 +396,13 @@ static void proc_status_func(fs_node_t *node) {
 			proc->blocked_signals,
 			ignored,
 			caught,
-			tty_name
+			tty_name,
+			proc->nice,
+			proc->sched_policy,
+			proc->sched_priority,
+			sched_get_affinity(proc),
+			faults->faults_minor,
+			faults->faults_major
 			);
 
 	process_release_big_lock();
@@ -383,10 +432,10 @@ static void proc_maps_func(fs_node_t *node) {
 
 
 static struct procfs_entry procdir_entries[] = {
-	{1, "cmdline", proc_cmdline_func, 0},
-	{2, "status",  proc_status_func, 0},
-	{3, "cwd",     proc_cwd_func, FS_SYMLINK},
-	{4, "maps",    proc_maps_func, 0},
+	{1, "cmdline", proc_cmdline_func, 0, NULL},
+	{2, "status",  proc_status_func, 0, NULL},
+	{3, "cwd",     proc_cwd_func, FS_SYMLINK, NULL},
+	{4, "maps",    proc_maps_func, 0, NULL},
 };
 
 static int readdir_procfs_procdir(fs_node_t *node, uint64_t index, struct dirent * out) {
@@ -420,7 +469,7 @@ static fs_node_t * finddir_procfs_procdir(fs_node_t * node, const char * name) {
 
 	for (unsigned int i = 0; i < PROCFS_PROCDIR_ENTRIES; ++i) {
 		if (!strcmp(name, procdir_entries[i].name)) {
-			fs_node_t * out = procfs_generic_create(procdir_entries[i].name, procdir_entries[i].func, procdir_entries[i].flags);
+			fs_node_t * out = procfs_generic_create(procdir_entries[i].name, procdir_entries[i].func, procdir_entries[i].flags, procdir_entries[i].write);
 			out->inode = node->inode;
 			return out;
 		}
@@ -432,8 +481,7 @@ static fs_node_t * finddir_procfs_procdir(fs_node_t * node, const char * name) {
 
 static fs_node_t * procfs_procdir_create(process_t * process) {
 	pid_t pid = process->id;
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
-	memset(fnode, 0x00, sizeof(fs_node_t));
+	fs_node_t * fnode = vfs_node_alloc();
 	fnode->inode = pid;
 	snprintf(fnode->name, 100, "%d", pid);
 	fnode->uid = 0;
@@ -499,12 +547,16 @@ static void meminfo_func(fs_node_t *node) {
 	size_t total = mmu_total_memory();
 	size_t free  = total - mmu_used_memory();
 	size_t kheap = ((uintptr_t)sbrk(0) - 0xffffff0000000000UL) / 1024;
+	size_t cached = pagecache_size() * 4;
+	size_t slab = kmem_cache_pages() * 4;
 
 	procfs_printf(node,
 		"MemTotal: %zu kB\n"
 		"MemFree: %zu kB\n"
 		"KHeapUse: %zu kB\n"
-		, total, free, kheap);
+		"Cached: %zu kB\n"
+		"Slab: %zu kB\n"
+		, total, free, kheap, cached, slab);
 }
 
 #ifdef __x86_64__
@@ -715,6 +767,141 @@ static void idle_func(fs_node_t *node) {
 	}
 }
 
+static void lockstat_func(fs_node_t *node) {
+	if (!lockstat_enabled) {
+		procfs_printf(node, "lockstat is disabled; boot with 'lockstat' to enable it\n");
+		return;
+	}
+
+	uint64_t mhz = arch_cpu_mhz();
+	procfs_printf(node, "%-28s %-28s %10s %10s %12s %8s %8s\n",
+		"lock", "function", "acquired", "contended", "spins", "avg(us)", "max(us)");
+	for (size_t i = 0; i < LOCKSTAT_SITES; ++i) {
+		struct lockstat * site = &lockstat_sites[i];
+		if (!site->name || !site->acquisitions) continue;
+		procfs_printf(node, "%-28s %-28s %10lu %10lu %12lu %8lu %8lu\n",
+			site->name, site->func,
+			site->acquisitions,
+			site->contended,
+			site->spins,
+			site->hold_total / site->acquisitions / mhz,
+			site->hold_max / mhz);
+	}
+}
+
+static void slabinfo_func(fs_node_t *node) {
+	procfs_printf(node, "%-16s %8s %8s %8s %8s %8s %12s %12s\n",
+		"cache", "active", "objects", "objsize", "perslab", "slabs", "allocs", "frees");
+	for (kmem_cache_t * cache = kmem_cache_list(); cache; cache = cache->next) {
+		/* Counters are read without locks, so this is only a snapshot. */
+		size_t cached = 0;
+		uint64_t allocs = 0, frees = 0;
+		for (int i = 0; i < KMEM_CPUS; ++i) {
+			cached += cache->cpu[i].count;
+			allocs += cache->cpu[i].allocs;
+			frees  += cache->cpu[i].frees;
+		}
+		size_t objects = cache->slabs * cache->per_slab;
+		size_t idle = cache->free + cached;
+		procfs_printf(node, "%-16s %8zu %8zu %8zu %8zu %8zu %12lu %12lu\n",
+			cache->name,
+			objects > idle ? objects - idle : 0,
+			objects,
+			cache->object_size,
+			cache->per_slab,
+			cache->slabs,
+			allocs, frees);
+	}
+
+	size_t blocks, free_blocks, free_bytes, largest;
+	kmalloc_heap_info(&blocks, &free_blocks, &free_bytes, &largest);
+	procfs_printf(node, "heap: %zu blocks, %zu free (%zu kB, largest %zu kB)\n",
+		blocks, free_blocks, free_bytes / 1024, largest / 1024);
+}
+
+static void schedstat_func(fs_node_t *node) {
+	for (int i = 0; i < processor_count; ++i) {
+		procfs_printf(node, "%d: depth %zu enqueued %lu steals %lu stolen %lu\n",
+			i,
+			processor_local_data[i].ready_queue.length,
+			processor_local_data[i].sched_enqueued,
+			processor_local_data[i].sched_steals,
+			processor_local_data[i].sched_stolen
+		);
+	}
+}
+
+static void profile_func(fs_node_t *node) {
+	/* Samples are full of kernel addresses, so they're for root only. */
+	if (this_core->current_process->user != USER_ROOT_UID) return;
+
+	struct profile_sample sample;
+	for (int cpu = 0; cpu < processor_count && cpu < PROFILE_CPUS; ++cpu) {
+		while (profile_next(cpu, &sample)) {
+			procfs_printf(node, "%d %d %d %c", cpu, sample.pid, sample.tid, sample.user ? 'u' : 'k');
+			for (int i = 0; i < sample.depth; ++i) {
+				procfs_printf(node, " %zx", sample.ip[i]);
+			}
+			procfs_printf(node, "\n");
+		}
+		uint64_t lost = profile_lost(cpu);
+		if (lost) procfs_printf(node, "# cpu %d lost %lu\n", cpu, lost);
+	}
+}
+
+static ssize_t profile_write(fs_node_t *node, const char * buf, size_t size) {
+	if (size >= 5 && !memcmp(buf, "start", 5)) {
+		int status = profile_start();
+		return status ? status : (ssize_t)size;
+	} else if (size >= 4 && !memcmp(buf, "stop", 4)) {
+		profile_stop();
+		return size;
+	} else if (size >= 5 && !memcmp(buf, "clear", 5)) {
+		profile_clear();
+		return size;
+	}
+	return -EINVAL;
+}
+
+static void trace_func(fs_node_t *node) {
+	if (this_core->current_process->user != USER_ROOT_UID) return;
+
+	struct trace_header header = { TRACE_MAGIC, sizeof(struct trace_event), arch_cpu_mhz(), 0, 0 };
+	procfs_append(node, &header, sizeof(header));
+
+	for (int cpu = 0; cpu < processor_count && cpu < TRACE_CPUS; ++cpu) {
+		uint64_t start, end, lost;
+		trace_bounds(cpu, &start, &end, &lost);
+		header.lost += lost;
+		for (uint64_t i = start; i < end; ++i) {
+			struct trace_event event;
+			if (trace_copy(cpu, i, &event)) {
+				procfs_append(node, &event, sizeof(event));
+				header.count++;
+			} else {
+				header.lost++;
+			}
+		}
+	}
+
+	/* Now that we know how many there were, fix up the header. */
+	memcpy(((procfs_entry_t*)node)->buf, &header, sizeof(header));
+}
+
+static ssize_t trace_write(fs_node_t *node, const char * buf, size_t size) {
+	if (size >= 5 && !memcmp(buf, "start", 5)) {
+		int status = trace_start();
+		return status ? status : (ssize_t)size;
+	} else if (size >= 4 && !memcmp(buf, "stop", 4)) {
+		trace_stop();
+		return size;
+	} else if (size >= 5 && !memcmp(buf, "clear", 5)) {
+		trace_clear();
+		return size;
+	}
+	return -EINVAL;
+}
+
 static void kallsyms_func(fs_node_t *fnode) {
 	/* This doesn't include module symbols at the moment... */
 	list_t * syms = ksym_list();
@@ -731,24 +918,48 @@ static void self_func(fs_node_t *fnode) {
 	procfs_printf(fnode, "%d", this_core->current_process->id);
 }
 
+static void blockcache_func(fs_node_t *node) {
+	procfs_printf(node, "%-16s %10s %10s %10s %10s %10s %10s %8s %8s\n",
+		"device", "hits", "misses", "evictions", "writes", "writebacks", "direct", "cached", "dirty");
+	for (struct blockcache * cache = blockcache_list(); cache; cache = cache->next) {
+		/* Counters are read without the lock, so this is only a snapshot. */
+		procfs_printf(node, "%-16s %10lu %10lu %10lu %10lu %10lu %10lu %8zu %8zu\n",
+			cache->name,
+			cache->stats.hits,
+			cache->stats.misses,
+			cache->stats.evictions,
+			cache->stats.writes,
+			cache->stats.writebacks,
+			cache->stats.direct,
+			cache->cached,
+			cache->dirty);
+	}
+}
+
 static struct procfs_entry std_entries[] = {
-	{-1, "cpuinfo",  cpuinfo_func, 0},
-	{-2, "meminfo",  meminfo_func, 0},
-	{-3, "uptime",   uptime_func, 0},
-	{-4, "cmdline",  cmdline_func, 0},
-	{-5, "version",  version_func, 0},
-	{-6, "compiler", compiler_func, 0},
-	{-7, "mounts",   mounts_func, 0},
-	{-8, "modules",  modules_func, 0},
-	{-9, "filesystems", filesystems_func, 0},
-	{-10,"loader",   loader_func, 0},
-	{-11,"idle",     idle_func, 0},
-	{-12,"kallsyms", kallsyms_func, 0},
-	{-13,"pci",      pci_func, 0},
-	{-14,"self",     self_func, FS_SYMLINK},
+	{-1, "cpuinfo",  cpuinfo_func, 0, NULL},
+	{-2, "meminfo",  meminfo_func, 0, NULL},
+	{-3, "uptime",   uptime_func, 0, NULL},
+	{-4, "cmdline",  cmdline_func, 0, NULL},
+	{-5, "version",  version_func, 0, NULL},
+	{-6, "compiler", compiler_func, 0, NULL},
+	{-7, "mounts",   mounts_func, 0, NULL},
+	{-8, "modules",  modules_func, 0, NULL},
+	{-9, "filesystems", filesystems_func, 0, NULL},
+	{-10,"loader",   loader_func, 0, NULL},
+	{-11,"idle",     idle_func, 0, NULL},
+	{-12,"kallsyms", kallsyms_func, 0, NULL},
+	{-13,"pci",      pci_func, 0, NULL},
+	{-14,"self",     self_func, FS_SYMLINK, NULL},
+	{-15,"schedstat", schedstat_func, 0, NULL},
+	{-16,"lockstat", lockstat_func, 0, NULL},
+	{-17,"slabinfo", slabinfo_func, 0, NULL},
+	{-18,"profile",  profile_func, 0, profile_write},
+	{-19,"trace",    trace_func, 0, trace_write},
+	{-20,"blockcache", blockcache_func, 0, NULL},
 #ifdef __x86_64__
-	{-15,"irq",      irq_func, 0},
-	{-16,"pat",      pat_func, 0},
+	{-21,"irq",      irq_func, 0, NULL},
+	{-22,"pat",      pat_func, 0, NULL},
 #endif
 };
 
@@ -852,7 +1063,7 @@ static fs_node_t * finddir_procfs_root(fs_node_t * node, const char * name) {
 
 	for (unsigned int i = 0; i < PROCFS_STANDARD_ENTRIES; ++i) {
 		if (!strcmp(name, std_entries[i].name)) {
-			fs_node_t * out = procfs_generic_create(std_entries[i].name, std_entries[i].func, std_entries[i].flags);
+			fs_node_t * out = procfs_generic_create(std_entries[i].name, std_entries[i].func, std_entries[i].flags, std_entries[i].write);
 			return out;
 		}
 	}
@@ -861,7 +1072,7 @@ static fs_node_t * finddir_procfs_root(fs_node_t * node, const char * name) {
 		foreach(node, extended_entries) {
 			struct procfs_entry * e = node->value;
 			if (!strcmp(name, e->name)) {
-				fs_node_t * out = procfs_generic_create(e->name, e->func, e->flags);
+				fs_node_t * out = procfs_generic_create(e->name, e->func, e->flags, e->write);
 				return out;
 			}
 		}
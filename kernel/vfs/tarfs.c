@@ -362,8 +362,7 @@ static ssize_t readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
 }
 
 static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset) {
-	fs_node_t * fs = malloc(sizeof(fs_node_t));
-	memset(fs, 0, sizeof(fs_node_t));
+	fs_node_t * fs = vfs_node_alloc();
 	fs->device = self;
 	fs->inode  = offset;
 	fs->impl   = 0;
@@ -388,7 +387,7 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 		fs->flags = FS_SYMLINK;
 		fs->readlink = readlink_tarfs;
 	} else {
-		fs->flags = FS_FILE;
+		fs->flags = FS_FILE | FS_CACHED;
 		fs->read = read_tarfs;
 	}
 	free(file);
@@ -148,6 +148,7 @@ static char * tmpfs_file_getset_block(struct tmpfs_file * t, size_t blockid, int
 		}
 		while (blockid >= t->block_count) {
 			uintptr_t index = mmu_allocate_a_frame();
+			if (index == (uintptr_t)-1) return NULL;
 			tmpfs_total_blocks++;
 			if (create == 2) {
 				memset((char*)mmu_map_from_physical(index << 12), 0, BLOCKSIZE);
@@ -233,10 +234,17 @@ static ssize_t write_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *
 	t->mtime = t->atime;
 
 	uint64_t end;
+	end = offset + size;
+
+	/* Make sure we have every block we need before we change anything. */
+	if (size && !tmpfs_file_getset_block(t, (end - 1) / BLOCKSIZE, 1)) {
+		spin_unlock(t->lock);
+		return -ENOSPC;
+	}
+
 	if ((size_t)offset + size > t->length) {
 		t->length = offset + size;
 	}
-	end = offset + size;
 	uint64_t start_block  = offset / BLOCKSIZE;
 	uint64_t end_block    = end / BLOCKSIZE;
 	uint64_t end_size     = end - end_block * BLOCKSIZE;
@@ -306,9 +314,10 @@ static int truncate_tmpfs(fs_node_t * node, size_t size) {
 	if (size > t->length) {
 		if (old_end_block == new_end_block) {
 			char *buf = tmpfs_file_getset_block(t, old_end_block, old_end_size ? 0 : 2);
+			if (!buf) goto _nospace;
 			memset(buf + old_end_size, 0, new_end_size - old_end_size);
 		} else {
-			tmpfs_file_getset_block(t, new_end_block, 2);
+			if (!tmpfs_file_getset_block(t, new_end_block, 2)) goto _nospace;
 			char *buf = tmpfs_file_getset_block(t, old_end_block, 0);
 			memset(buf + old_end_size, 0, BLOCKSIZE - old_end_size);
 		}
@@ -343,6 +352,10 @@ _exit_truncate:
 	t->mtime = node->atime;
 	spin_unlock(t->lock);
 	return 0;
+
+_nospace:
+	spin_unlock(t->lock);
+	return -ENOSPC;
 }
 
 static void open_tmpfs(fs_node_t * node, unsigned int flags) {
@@ -383,9 +396,8 @@ static int fault_map_tmpfs(fs_node_t * node, union PML * page, off_t offset, int
 }
 
 static fs_node_t * tmpfs_from_file(struct tmpfs_file * t) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = vfs_node_alloc();
 	spin_lock(t->lock);
-	memset(fnode, 0x00, sizeof(fs_node_t));
 	strcpy(fnode->name, t->name);
 	fnode->impl = (uintptr_t)t;
 	fnode->inode = t->ino;
@@ -781,9 +793,8 @@ static ssize_t get_size_tmpfsdir(fs_node_t * node) {
 }
 
 static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = vfs_node_alloc();
 	spin_lock(d->lock);
-	memset(fnode, 0x00, sizeof(fs_node_t));
 	strcpy(fnode->name, "tmp");
 	fnode->mount = d->mount;
 	fnode->device = d->mount;
@@ -865,7 +876,8 @@ static struct procfs_entry tmpfs_entry = {
 	0,
 	"tmpfs",
 	tmpfs_func,
-	0
+	0,
+	NULL
 };
 
 void tmpfs_register_init(void) {
@@ -21,6 +21,7 @@
 
 #include <sys/signal_defs.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 
 #define UNIX_PIPE_BUFFER 65536
 
@@ -63,6 +64,7 @@ static void close_read_pipe(fs_node_t * node) {
 	self->read_closed = 1;
 	if (!self->write_closed) {
 		ring_buffer_interrupt(self->buffer);
+		ring_buffer_alert_writers(self->buffer);
 		spin_unlock(self->buffer->lock);
 	} else {
 		close_complete(self);
@@ -100,6 +102,26 @@ static int wait_pipe(fs_node_t * node, void * process) {
 	return 0;
 }
 
+static int poll_read_pipe(fs_node_t * node) {
+	struct unix_pipe * self = node->device;
+	int events = 0;
+	if (ring_buffer_unread(self->buffer) > 0) events |= POLLIN;
+	if (self->write_closed) events |= POLLHUP;
+	return events;
+}
+
+static int poll_write_pipe(fs_node_t * node) {
+	struct unix_pipe * self = node->device;
+	if (self->read_closed) return POLLERR;
+	return ring_buffer_available(self->buffer) > 0 ? POLLOUT : 0;
+}
+
+static int wait_write_pipe(fs_node_t * node, void * process) {
+	struct unix_pipe * self = node->device;
+	ring_buffer_select_wait_write(self->buffer, process);
+	return 0;
+}
+
 
 int make_unix_pipe(fs_node_t ** pipes) {
 	size_t size = UNIX_PIPE_BUFFER;
@@ -132,6 +154,11 @@ int make_unix_pipe(fs_node_t ** pipes) {
 	/* Read end can wait */
 	pipes[0]->selectcheck = check_pipe;
 	pipes[0]->selectwait = wait_pipe;
+	pipes[0]->pollcheck = poll_read_pipe;
+
+	/* Write end can only be polled, for room to write */
+	pipes[1]->selectwait = wait_write_pipe;
+	pipes[1]->pollcheck = poll_write_pipe;
 
 	struct unix_pipe * internals = malloc(sizeof(struct unix_pipe));
 	internals->read_end = pipes[0];
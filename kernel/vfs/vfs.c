@@ -24,11 +24,14 @@
 #include <kernel/vfs.h>
 #include <kernel/time.h>
 #include <kernel/process.h>
+#include <kernel/pagecache.h>
+#include <poll.h>
 
 #include <kernel/list.h>
 #include <kernel/hashmap.h>
 #include <kernel/tree.h>
 #include <kernel/spinlock.h>
+#include <kernel/slab.h>
 
 #define MAX_SYMLINK_DEPTH 8
 #define MAX_SYMLINK_SIZE 4096
@@ -38,6 +41,8 @@ fs_node_t * fs_root = NULL; /* Pointer to the root mount fs_node (must be some f
 
 hashmap_t * fs_types = NULL;
 
+static kmem_cache_t * fs_node_cache = NULL;
+
 #define MIN(l,r) ((l) < (r) ? (l) : (r))
 #define MAX(l,r) ((l) > (r) ? (l) : (r))
 
@@ -134,8 +139,7 @@ static int readdir_mapper(fs_node_t *node, unsigned long index, struct dirent *
 }
 
 static fs_node_t * vfs_mapper(void) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
-	memset(fnode, 0x00, sizeof(fs_node_t));
+	fs_node_t * fnode = vfs_node_alloc();
 	fnode->mask    = 0555;
 	fnode->flags   = FS_DIRECTORY;
 	fnode->readdir = readdir_mapper;
@@ -158,6 +162,33 @@ int selectcheck_fs(fs_node_t * node) {
 	return -EINVAL;
 }
 
+/**
+ * @brief Check which of POLLIN, POLLOUT, POLLHUP and POLLERR hold for this file.
+ *
+ * Files that can't say for themselves are judged by selectcheck, and
+ * are taken to be writable if they can be written to at all, as are
+ * files that never block, like regular files.
+ */
+int pollcheck_fs(fs_node_t * node) {
+	if (!node) return POLLNVAL;
+
+	if (node->pollcheck) {
+		return node->pollcheck(node);
+	}
+
+	int events = node->write ? POLLOUT : 0;
+
+	if (node->selectcheck) {
+		int status = node->selectcheck(node);
+		if (status == 0) events |= POLLIN;
+		else if (status < 0) events |= POLLERR;
+	} else if (node->read) {
+		events |= POLLIN;
+	}
+
+	return events;
+}
+
 /**
  * @brief Inform a node that it should alert the current_process.
  */
@@ -183,6 +214,7 @@ int selectwait_fs(fs_node_t * node, void * process) {
 ssize_t read_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	if (!node) return -ENOENT;
 	if (node->read) {
+		if (node->flags & FS_CACHED) return pagecache_read(node, offset, size, buffer);
 		return node->read(node, offset, size, buffer);
 	} else {
 		if (node->flags & FS_DIRECTORY) return -EISDIR;
@@ -202,7 +234,9 @@ ssize_t read_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	if (!node) return -ENOENT;
 	if (node->write) {
-		return node->write(node, offset, size, buffer);
+		ssize_t written = node->write(node, offset, size, buffer);
+		if (written > 0 && (node->flags & FS_CACHED)) pagecache_write(node, offset, written, buffer);
+		return written;
 	} else {
 		if (node->flags & FS_DIRECTORY) return -EISDIR;
 		return -EROFS;
@@ -218,7 +252,9 @@ int truncate_fs(fs_node_t * node, size_t size) {
 	if (!node) return -ENOENT;
 
 	if (node->truncate) {
-		return node->truncate(node, size);
+		int ret = node->truncate(node, size);
+		if (!ret && (node->flags & FS_CACHED)) pagecache_truncate(node, size);
+		return ret;
 	}
 
 	return -EINVAL;
@@ -255,22 +291,8 @@ void open_fs(fs_node_t *node, unsigned int flags) {
 	}
 }
 
-/**
- * @brief Close a file system node
- *
- * @param node Node to close
- */
-void close_fs(fs_node_t *node) {
-	//assert(node != fs_root && "Attempted to close the filesystem root. kablooey");
-
-	if (!node) {
-		debug_print(WARNING, "Double close? This isn't an fs_node.");
-		return;
-	}
-
-	spin_lock(tmp_refcount_lock);
+static void close_fs_locked(fs_node_t *node) {
 	if (node->refcount < 0) {
-		spin_unlock(tmp_refcount_lock);
 		return;
 	}
 
@@ -284,9 +306,37 @@ void close_fs(fs_node_t *node) {
 
 		free(node);
 	}
+}
+
+/**
+ * @brief Close a file system node
+ *
+ * @param node Node to close
+ */
+void close_fs(fs_node_t *node) {
+	//assert(node != fs_root && "Attempted to close the filesystem root. kablooey");
+
+	if (!node) {
+		debug_print(WARNING, "Double close? This isn't an fs_node.");
+		return;
+	}
+
+	spin_lock(tmp_refcount_lock);
+	close_fs_locked(node);
 	spin_unlock(tmp_refcount_lock);
 }
 
+/**
+ * @brief Close a node from within another node's close method.
+ *
+ * close methods are called with the refcount lock held, so a node
+ * that holds references to other nodes drops them with this instead.
+ */
+void close_fs_nested(fs_node_t *node) {
+	if (!node) return;
+	close_fs_locked(node);
+}
+
 /**
  * @brief Change permissions for a file system node.
  *
@@ -435,7 +485,15 @@ int unlink_fs(const char * name) {
 	const char * src = fs_basename(name);
 	if (!*src || *src == '/') return close_fs(parent), -EINVAL;
 
+	/* The inode number may be reused, so forget anything we cached for it. */
+	fs_node_t * child = finddir_fs(parent, src);
+	if (child) open_fs(child, 0);
+
 	int ret = parent->unlink(parent, src);
+	if (child) {
+		if (!ret && (child->flags & FS_CACHED)) pagecache_truncate(child, 0);
+		close_fs(child);
+	}
 	close_fs(parent);
 	return ret;
 }
@@ -475,6 +533,19 @@ ssize_t readlink_fs(fs_node_t *node, char * buf, size_t size) {
 	return node->readlink(node, buf, size);
 }
 
+/**
+ * @brief Allocate a cleared node.
+ *
+ * Filesystems make a new node for every lookup, and close_fs frees
+ * it again shortly after, so nodes get their own object cache.
+ * Nodes from here are released with free() like any other.
+ */
+fs_node_t *vfs_node_alloc(void) {
+	fs_node_t * node = kmem_cache_alloc(fs_node_cache);
+	if (node) memset(node, 0, sizeof(fs_node_t));
+	return node;
+}
+
 fs_node_t *clone_fs(fs_node_t *source) {
 	if (!source) return NULL;
 
@@ -587,6 +658,8 @@ char *canonicalize_path(const char *cwd, const char *input) {
 }
 
 void vfs_install(void) {
+	fs_node_cache = kmem_cache_create("fs_node", sizeof(fs_node_t), sizeof(void*));
+
 	/* Initialize the mountpoint tree */
 	fs_tree = tree_create();
 
@@ -158,7 +158,7 @@ static fs_node_t * lfb_video_device_create(void /* TODO */) {
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	snprintf(fnode->name, 100, "fb0"); /* TODO */
 	fnode->length  = 0;
-	fnode->flags   = FS_BLOCKDEVICE; /* Framebuffers are block devices */
+	fnode->flags   = FS_BLOCKDEVICE | FS_CONTIGUOUS; /* Framebuffers are block devices */
 	fnode->mask    = 0660; /* Only accessible to root user/group */
 	fnode->ioctl   = ioctl_vid; /* control function defined above */
 	fnode->fault_map = fault_map_vid;
@@ -189,7 +189,8 @@ static struct procfs_entry framebuffer_entry = {
 	0,
 	"framebuffer",
 	framebuffer_func,
-	0
+	0,
+	NULL
 };
 
 /* Install framebuffer device */
@@ -12,9 +12,14 @@
  * already loaded alongside it.
  *
  * The symbol resolution, while better than it was previously, is
- * still not completely correct. We don't do lazy relocations in any
- * capacity, @c dlopen does not support flags to control visibility,
- * and it's likely that some relocation types aren't supported.
+ * still not completely correct. @c dlopen does not support flags to
+ * control visibility, and it's likely that some relocation types
+ * aren't supported.
+ *
+ * PLT relocations are bound lazily on first call, unless LD_BIND_NOW
+ * is set or the object asks for immediate binding. Symbols are looked
+ * up through DT_GNU_HASH tables when an object has one, falling back
+ * to the SysV DT_HASH table otherwise.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -33,6 +38,7 @@
 #include <sys/reboot.h>
 #include <sys/auxv.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <va_list.h>
 #include <kernel/elf.h>
 
@@ -62,6 +68,7 @@ struct DlLib {
 	Elf64_Sym    * syms;      /* Start of symbol table. */
 	const char   * strings;   /* Start of string table. */
 	Elf64_Word   * hash;      /* Pointer to SysV symbol hashmap. */
+	Elf64_Word   * gnu_hash;  /* Pointer to GNU symbol hashmap, if there is one. */
 	struct DlLib * next;      /* Next app/library in chain. */
 	uintptr_t    base;        /* Loaded base address. */
 	uintptr_t    dyn[32];     /* Direct map of DT tags to values. */
@@ -69,6 +76,7 @@ struct DlLib {
 	size_t       tlssize;     /* How much space is reserved for static TLS. */
 	bool         relocated;   /* Whether this library has had relocations applied already. */
 	bool         constructed; /* Whether this library's constructors have been called. */
+	bool         bind_now;    /* Whether this library asked for PLT relocations to be bound at load time. */
 	char *       exe_path;    /* Full path of a library resolved in @c find_lib. */
 
 	struct DlLib **dependencies; /* Allocated array of dependencies. */
@@ -94,6 +102,8 @@ static bool is_runtime = false;            /* Whether we've finished loading and
 static bool target_is_suid = false;        /* Whether the auxv indicate a set-user-id or set-group-id binary ("secure mode"). */
 static char ** __envp = NULL;              /* Environment for use with @c simple_getenv. */
 static bool __trace_ld = false;            /* Whether LD_DEBUG was set. */
+static bool __stats_ld = false;            /* Whether LD_DEBUG=statistics was set. */
+static bool __bind_now = false;            /* Whether LD_BIND_NOW was set. */
 static char * __ld_error = NULL;           /* Last error for @c dlerror. */
 static bool __ldso_reported = false;       /* Whether ldd has reported libc.so yet. */
 static bool __libc_in_chain = false;       /* if the libc is in all_libraries linked list */
@@ -105,6 +115,17 @@ _hidden char * __ld_inhibit_rpath = NULL;  /* --inhibit-rpath= */
 
 static DEFN_SYSCALL1(_exit,SYS_EXT,int);
 
+/* Counters for LD_DEBUG=statistics */
+static struct {
+	size_t relocations;   /* Relocations applied at load time. */
+	size_t relative;      /* ... of which were relative and needed no lookup. */
+	size_t lookups;       /* Symbol lookups performed. */
+	size_t lazy;          /* PLT relocations deferred until first call. */
+	size_t lazy_bound;    /* ... of which have since been bound. */
+	struct timeval start; /* When we started loading. */
+	uint64_t reloc_time;  /* Microseconds spent in @c relocate */
+} ld_stats;
+
 /**
  * @brief Simple memcpy.
  *
@@ -227,8 +248,7 @@ static void simple_relocs(uintptr_t rel, uintptr_t size, uintptr_t base, Elf64_S
  * @brief Calculate SysV symbol hash.
  *
  * This was copied from some Solaris docs.
- * Our binaries and libraries dont't currently have
- * GNU hashes, so we only support the SysV ones.
+ * Only used for objects that don't have a GNU hash table.
  *
  * @param _name Symbol name to hash.
  * @returns Hash value.
@@ -264,6 +284,127 @@ static Elf64_Sym * elf_sym_lookup(Elf64_Word *table, const char *strtab, Elf64_S
 	return NULL;
 }
 
+/**
+ * @brief Calculate GNU symbol hash.
+ *
+ * This is the DJB hash, as used by DT_GNU_HASH tables.
+ *
+ * @param _name Symbol name to hash.
+ * @returns Hash value.
+ */
+static Elf64_Word gnu_hash(const char *_name) {
+	const unsigned char *name = (void*)_name;
+	Elf64_Word h = 5381;
+	while (*name) h = (h << 5) + h + *name++;
+	return h;
+}
+
+/**
+ * @brief Lookup a symbol by name in a GNU hash table.
+ *
+ * The table starts with a bloom filter that lets us rule out most
+ * libraries without touching their buckets or string tables at all.
+ * Chains are sorted by bucket and the low bit of each hash value
+ * marks the end of a chain, so we only compare names whose full
+ * hash matches.
+ *
+ * @param table GNU hash table.
+ * @param strtab String table.
+ * @param symtab Symbol table.
+ * @param name Symbol to look for.
+ * @param h GNU hash of symbol name.
+ * @returns Pointer into @p symtab or NULL if not found.
+ */
+static Elf64_Sym * gnu_sym_lookup(Elf64_Word *table, const char *strtab, Elf64_Sym *symtab, const char *name, Elf64_Word h) {
+	Elf64_Word nbuckets    = table[0];
+	Elf64_Word symoffset   = table[1];
+	Elf64_Word bloom_size  = table[2];
+	Elf64_Word bloom_shift = table[3];
+	uint64_t   *bloom      = (uint64_t*)&table[4];
+	Elf64_Word *buckets    = (Elf64_Word*)&bloom[bloom_size];
+	Elf64_Word *chain      = &buckets[nbuckets];
+
+	uint64_t word = bloom[(h / 64) % bloom_size];
+	uint64_t mask = (1UL << (h % 64)) | (1UL << ((h >> bloom_shift) % 64));
+	if ((word & mask) != mask) return NULL;
+
+	Elf64_Word i = buckets[h % nbuckets];
+	if (i < symoffset) return NULL;
+
+	while (1) {
+		Elf64_Word h2 = chain[i - symoffset];
+		if ((h | 1) == (h2 | 1) && !strcmp(strtab + symtab[i].st_name, name)) return symtab + i;
+		if (h2 & 1) return NULL;
+		i++;
+	}
+}
+
+/**
+ * @brief Count the symbols in a library's dynamic symbol table.
+ *
+ * The SysV hash table tells us directly. The GNU one only covers
+ * exported symbols, which are at the end of the table, so we find
+ * the last chain and walk to its end.
+ */
+static size_t sym_count(struct DlLib * lib) {
+	if (lib->hash) return lib->hash[1];
+	if (!lib->gnu_hash) return 0;
+
+	Elf64_Word *table      = lib->gnu_hash;
+	Elf64_Word nbuckets    = table[0];
+	Elf64_Word symoffset   = table[1];
+	Elf64_Word *buckets    = (Elf64_Word*)&((uint64_t*)&table[4])[table[2]];
+	Elf64_Word *chain      = &buckets[nbuckets];
+
+	Elf64_Word last = 0;
+	for (Elf64_Word i = 0; i < nbuckets; ++i) {
+		if (buckets[i] > last) last = buckets[i];
+	}
+	if (last < symoffset) return symoffset;
+	while (!(chain[last - symoffset] & 1)) last++;
+	return last + 1;
+}
+
+/**
+ * @brief Find the first definition of a symbol in a chain of libraries.
+ *
+ * Uses each library's GNU hash table if it has one, otherwise its SysV
+ * one; each kind of hash is only calculated once, and only if needed.
+ *
+ * @param lib   First library to search.
+ * @param name  Symbol to look for.
+ * @param inlib Set to the library the symbol was found in.
+ * @returns Pointer into the symbol table of @p inlib, or NULL.
+ */
+static Elf64_Sym * find_symbol(struct DlLib * lib, const char * name, struct DlLib ** inlib) {
+	Elf64_Word ghash = gnu_hash(name);
+	Elf64_Word shash = 0;
+	bool have_shash = false;
+
+	ld_stats.lookups++;
+
+	for (; lib; lib = lib->next) {
+		Elf64_Sym * maybe;
+		if (lib->gnu_hash) {
+			maybe = gnu_sym_lookup(lib->gnu_hash, lib->strings, lib->syms, name, ghash);
+		} else if (lib->hash) {
+			if (!have_shash) {
+				shash = elf_hash(name);
+				have_shash = true;
+			}
+			maybe = elf_sym_lookup(lib->hash, lib->strings, lib->syms, name, shash);
+		} else {
+			continue;
+		}
+		if (maybe && maybe->st_shndx != SHN_UNDEF) {
+			*inlib = lib;
+			return maybe;
+		}
+	}
+
+	return NULL;
+}
+
 static int __dl_dprintf(const char * fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
@@ -316,11 +457,201 @@ static inline int is_tlsoff(int type) {
 #endif
 }
 
+/**
+ * @brief Is this a PLT relocation for this arch?
+ */
+static inline int is_jump_slot(int type) {
+#if defined(__aarch64__)
+	return type == R_AARCH64_JUMP_SLOT;
+#elif defined(__x86_64__)
+	return type == R_X86_64_JUMP_SLOT;
+#else
+# error "Unknown arch"
+#endif
+}
+
+/**
+ * @brief Is this a relative relocation for this arch?
+ */
+static inline int is_relative(int type) {
+#if defined(__aarch64__)
+	return type == R_AARCH64_RELATIVE;
+#elif defined(__x86_64__)
+	return type == R_X86_64_RELATIVE;
+#else
+# error "Unknown arch"
+#endif
+}
+
+/**
+ * @brief Lazy binding trampoline.
+ *
+ * PLT entries for unbound functions end up here through the PLT's
+ * first entry, which has pushed the DlLib object we stored in the
+ * second word of the GOT and something that identifies the slot.
+ * We save the argument registers, bind the slot, and then tail
+ * call the real function as if the PLT had jumped straight to it.
+ */
+_hidden void __dl_runtime_resolve(void);
+_hidden uintptr_t __dl_lazy_bind(struct DlLib * lib, size_t index);
+
+#if defined(__x86_64__)
+/* [rsp] is the DlLib, [rsp+8] the JMPREL index, then the caller's return address */
+__asm__ (
+	".text\n"
+	".globl __dl_runtime_resolve\n"
+	".hidden __dl_runtime_resolve\n"
+	".type __dl_runtime_resolve, @function\n"
+	".align 16\n"
+	"__dl_runtime_resolve:\n"
+	"	push %rax\n"
+	"	push %rcx\n"
+	"	push %rdx\n"
+	"	push %rsi\n"
+	"	push %rdi\n"
+	"	push %r8\n"
+	"	push %r9\n"
+	"	sub $128, %rsp\n"
+	"	movdqu %xmm0, 0(%rsp)\n"
+	"	movdqu %xmm1, 16(%rsp)\n"
+	"	movdqu %xmm2, 32(%rsp)\n"
+	"	movdqu %xmm3, 48(%rsp)\n"
+	"	movdqu %xmm4, 64(%rsp)\n"
+	"	movdqu %xmm5, 80(%rsp)\n"
+	"	movdqu %xmm6, 96(%rsp)\n"
+	"	movdqu %xmm7, 112(%rsp)\n"
+	"	mov 184(%rsp), %rdi\n"
+	"	mov 192(%rsp), %rsi\n"
+	"	call __dl_lazy_bind\n"
+	"	mov %rax, %r11\n"
+	"	movdqu 0(%rsp), %xmm0\n"
+	"	movdqu 16(%rsp), %xmm1\n"
+	"	movdqu 32(%rsp), %xmm2\n"
+	"	movdqu 48(%rsp), %xmm3\n"
+	"	movdqu 64(%rsp), %xmm4\n"
+	"	movdqu 80(%rsp), %xmm5\n"
+	"	movdqu 96(%rsp), %xmm6\n"
+	"	movdqu 112(%rsp), %xmm7\n"
+	"	add $128, %rsp\n"
+	"	pop %r9\n"
+	"	pop %r8\n"
+	"	pop %rdi\n"
+	"	pop %rsi\n"
+	"	pop %rdx\n"
+	"	pop %rcx\n"
+	"	pop %rax\n"
+	"	add $16, %rsp\n"
+	"	jmp *%r11\n"
+	".size __dl_runtime_resolve, .-__dl_runtime_resolve\n"
+);
+#elif defined(__aarch64__)
+/* [sp] is the address of the GOT slot, [sp+8] the caller's x30, and x16 points at GOT[2] */
+__asm__ (
+	".text\n"
+	".globl __dl_runtime_resolve\n"
+	".hidden __dl_runtime_resolve\n"
+	".type __dl_runtime_resolve, %function\n"
+	".align 4\n"
+	"__dl_runtime_resolve:\n"
+	"	sub sp, sp, #208\n"
+	"	stp x0, x1, [sp, #0]\n"
+	"	stp x2, x3, [sp, #16]\n"
+	"	stp x4, x5, [sp, #32]\n"
+	"	stp x6, x7, [sp, #48]\n"
+	"	str x8, [sp, #64]\n"
+	"	stp q0, q1, [sp, #80]\n"
+	"	stp q2, q3, [sp, #112]\n"
+	"	stp q4, q5, [sp, #144]\n"
+	"	stp q6, q7, [sp, #176]\n"
+	"	ldr x0, [x16, #-8]\n"
+	"	ldr x1, [sp, #208]\n"
+	"	sub x1, x1, x16\n"
+	"	sub x1, x1, #8\n"
+	"	lsr x1, x1, #3\n"
+	"	bl __dl_lazy_bind\n"
+	"	mov x17, x0\n"
+	"	ldp x0, x1, [sp, #0]\n"
+	"	ldp x2, x3, [sp, #16]\n"
+	"	ldp x4, x5, [sp, #32]\n"
+	"	ldp x6, x7, [sp, #48]\n"
+	"	ldr x8, [sp, #64]\n"
+	"	ldp q0, q1, [sp, #80]\n"
+	"	ldp q2, q3, [sp, #112]\n"
+	"	ldp q4, q5, [sp, #144]\n"
+	"	ldp q6, q7, [sp, #176]\n"
+	"	add sp, sp, #208\n"
+	"	ldp x16, x30, [sp], #16\n"
+	"	br x17\n"
+	".size __dl_runtime_resolve, .-__dl_runtime_resolve\n"
+);
+#else
+# error "Unknown arch"
+#endif
+
+/**
+ * @brief Bind a PLT slot on its first call.
+ *
+ * Called from @ref __dl_runtime_resolve with the index of the
+ * JMPREL entry for the slot. Resolves the symbol the same way
+ * @ref relocate would have and writes it into the GOT so later
+ * calls go straight to it.
+ *
+ * @param lib   Library whose PLT was called.
+ * @param index Index into the library's JMPREL table.
+ * @returns Address of the resolved function.
+ */
+_hidden uintptr_t __dl_lazy_bind(struct DlLib * lib, size_t index) {
+	Elf64_Rela * table = (Elf64_Rela *)(lib->base + lib->dyn[DT_JMPREL]);
+	size_t count = lib->dyn[DT_PLTRELSZ] / sizeof(Elf64_Rela);
+
+	/* The GOT and JMPREL orders should match, but check anyway. */
+	if (index >= count || !is_jump_slot(ELF64_R_TYPE(table[index].r_info))) {
+		__dl_dprintf("ld.so: %s: bad lazy relocation index %zu\n", lib->name, index);
+		syscall__exit(127);
+	}
+
+	Elf64_Rela * rel = &table[index];
+	const char * name = lib->strings + lib->syms[ELF64_R_SYM(rel->r_info)].st_name;
+
+	struct DlLib * inlib = NULL;
+	Elf64_Sym * resolved = find_symbol(all_libraries, name, &inlib);
+
+	if (!resolved) {
+		__dl_dprintf("ld.so: %s: symbol lookup error: undefined symbol '%s'\n", lib->name, name);
+		syscall__exit(127);
+	}
+
+	uintptr_t x = inlib->base + resolved->st_value;
+
+	if (unlikely(__trace_ld)) {
+		__dl_dprintf("ld.so: %s: Bound symbol '%s' as %#zx\n", lib->name, name, x);
+	}
+
+	__atomic_store_n((uintptr_t *)(lib->base + rel->r_offset), x, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&ld_stats.lazy_bound, 1, __ATOMIC_RELAXED);
+
+	return x;
+}
+
+/**
+ * @brief Should this library's PLT relocations be bound lazily?
+ *
+ * We never bind ourselves lazily, as we may be relocated more than
+ * once and need our own PLT working while we do it.
+ */
+static bool use_lazy_binding(struct DlLib * lib) {
+	if (__bind_now || lib->bind_now || lib == __libc_ldso) return false;
+	if (!lib->dyn[DT_PLTGOT] || !lib->dyn[DT_JMPREL]) return false;
+	if (lib->dyn[DT_BIND_NOW] || (lib->dyn[DT_FLAGS] & DF_BIND_NOW)) return false;
+	return true;
+}
+
 /**
  * @brief Perform relocations for one library.
  *
  * Resolves symbols and applies all supported relocations
- * for a given library.
+ * for a given library. PLT relocations are left pointing at
+ * the lazy binding trampoline if we can use lazy binding.
  *
  * @param lib Library to relocate.
  */
@@ -333,6 +664,16 @@ static void relocate(struct DlLib * lib) {
 	const char * strtab = lib->strings;
 	Elf64_Sym  *symtab = lib->syms;
 
+	struct timeval start;
+	if (unlikely(__stats_ld)) gettimeofday(&start, NULL);
+
+	bool lazy = use_lazy_binding(lib);
+	if (lazy) {
+		/* The PLT's first entry pushes GOT[1] and jumps to GOT[2]. */
+		uintptr_t * got = (uintptr_t *)(their_base + their_dyn[DT_PLTGOT]);
+		got[1] = (uintptr_t)lib;
+		got[2] = (uintptr_t)&__dl_runtime_resolve;
+	}
 
 	for (int i = 0; i < 2; ++i) {
 		Elf64_Rela *table  = (void*)reltable;
@@ -358,6 +699,18 @@ static void relocate(struct DlLib * lib) {
 				break;
 			}
 
+			if (lazy && i == 1 && is_jump_slot(type)) {
+				/* The slot points back into the PLT, relative to our base; the
+				 * PLT will send the first call through __dl_runtime_resolve. */
+				uintptr_t * slot = (uintptr_t *)(table->r_offset + their_base);
+				*slot += their_base;
+				ld_stats.lazy++;
+				goto _continue;
+			}
+
+			ld_stats.relocations++;
+			if (is_relative(type)) ld_stats.relative++;
+
 			if (sym) {
 				x = sym->st_shndx == (SHN_ABS ? 0 : their_base) + sym->st_value;
 
@@ -365,18 +718,8 @@ static void relocate(struct DlLib * lib) {
 					/* Nothing to look up for local symbol; use offset fetched above. */
 				} else {
 					const char *name = strtab + sym->st_name;
-					Elf64_Word hash = elf_hash(name);
 
-					struct DlLib * dep = (is_copy(type) ? lib->next : all_libraries);
-
-					for (; dep; dep = dep->next) {
-						Elf64_Sym *maybe = elf_sym_lookup(dep->hash, dep->strings, dep->syms, name, hash);
-						if (maybe && maybe->st_shndx != SHN_UNDEF) {
-							resolved = maybe;
-							inlib = dep;
-							break;
-						}
-					}
+					resolved = find_symbol(is_copy(type) ? lib->next : all_libraries, name, &inlib);
 
 					if (resolved) {
 						if (unlikely(__trace_ld)) {
@@ -461,6 +804,12 @@ _continue:
 		reltable = their_base + their_dyn[DT_JMPREL];
 		size  = their_dyn[DT_PLTRELSZ];
 	}
+
+	if (unlikely(__stats_ld)) {
+		struct timeval end;
+		gettimeofday(&end, NULL);
+		ld_stats.reloc_time += (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+	}
 }
 
 static void setup_lib(struct DlLib * app, Elf64_Phdr *phdrs, size_t phnum);
@@ -923,6 +1272,8 @@ static void setup_lib(struct DlLib * app, Elf64_Phdr *phdrs, size_t phnum) {
 			app->full_dyn = _dyn;
 			while (_dyn->d_tag) {
 				if (_dyn->d_tag < 32) app->dyn[_dyn->d_tag] = _dyn->d_un.d_val;
+				else if (_dyn->d_tag == DT_GNU_HASH) app->gnu_hash = (void*)(app->base + _dyn->d_un.d_ptr);
+				else if (_dyn->d_tag == DT_FLAGS_1 && (_dyn->d_un.d_val & DF_1_NOW)) app->bind_now = true;
 				_dyn++;
 			}
 			break;
@@ -933,7 +1284,7 @@ static void setup_lib(struct DlLib * app, Elf64_Phdr *phdrs, size_t phnum) {
 
 	app->strings = (void*)(app->base + app->dyn[DT_STRTAB]);
 	app->syms    = (void*)(app->base + app->dyn[DT_SYMTAB]);
-	app->hash    = (void*)(app->base + app->dyn[DT_HASH]);
+	app->hash    = app->dyn[DT_HASH] ? (void*)(app->base + app->dyn[DT_HASH]) : NULL;
 
 	if (app->dyn[DT_RUNPATH]) app->runpath = (char *)(app->strings + app->dyn[DT_RUNPATH]);
 	else if (app->dyn[DT_RPATH]) app->rpath = (char *)(app->strings + app->dyn[DT_RPATH]);
@@ -1044,7 +1395,6 @@ static struct DlLib * lib_at(uintptr_t from) {
 
 void * dlsym(void *_lib, const char * name) {
 	struct DlLib * lib = _lib;
-	Elf64_Word hash = elf_hash(name);
 
 	if (lib == RTLD_NEXT) {
 		uintptr_t from = (uintptr_t)__builtin_return_address(0);
@@ -1055,12 +1405,9 @@ void * dlsym(void *_lib, const char * name) {
 
 	if (lib == NULL) lib = all_libraries;
 
-	for (struct DlLib * dep = lib; dep; dep = dep->next) {
-		Elf64_Sym *maybe = elf_sym_lookup(dep->hash, dep->strings, dep->syms, name, hash);
-		if (maybe && maybe->st_shndx != SHN_UNDEF) {
-			return (void*)(dep->base + maybe->st_value);
-		}
-	}
+	struct DlLib * inlib = NULL;
+	Elf64_Sym * sym = find_symbol(lib, name, &inlib);
+	if (sym) return (void*)(inlib->base + sym->st_value);
 
 	return NULL;
 }
@@ -1075,9 +1422,9 @@ int dladdr(const void * __restrict addr, Dl_info_t * __restrict dlip) {
 	dlip->dli_sname = NULL;
 	dlip->dli_saddr = NULL;
 
-	if (lib->hash && lib->syms && lib->strings) {
-		size_t sym_count = lib->hash[1];
-		for (size_t i = 0; i < sym_count; ++i) {
+	if (lib->syms && lib->strings) {
+		size_t count = sym_count(lib);
+		for (size_t i = 0; i < count; ++i) {
 			if (lib->syms[i].st_shndx == SHN_UNDEF) continue;
 			if ((lib->syms[i].st_info >> 4) == STB_LOCAL) continue;
 			if (!lib->syms[i].st_value) continue;
@@ -1102,6 +1449,33 @@ char * dlerror(void) {
 	return __ld_error;
 }
 
+/**
+ * @brief Report how many lazy bindings were actually needed.
+ */
+static void report_lazy_stats(void) {
+	__dl_dprintf("ld.so: final number of lazily bound symbols: %zu (of %zu)\n",
+		ld_stats.lazy_bound, ld_stats.lazy);
+}
+
+/**
+ * @brief Report LD_DEBUG=statistics for startup.
+ */
+static void report_stats(void) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	uint64_t total = (now.tv_sec - ld_stats.start.tv_sec) * 1000000 + (now.tv_usec - ld_stats.start.tv_usec);
+
+	__dl_dprintf("ld.so: runtime linker statistics:\n");
+	__dl_dprintf("ld.so:   total startup time in dynamic loader: %zu us\n", (size_t)total);
+	__dl_dprintf("ld.so:   time needed for relocation: %zu us\n", (size_t)ld_stats.reloc_time);
+	__dl_dprintf("ld.so:   number of relocations: %zu\n", ld_stats.relocations);
+	__dl_dprintf("ld.so:   number of relative relocations: %zu\n", ld_stats.relative);
+	__dl_dprintf("ld.so:   number of symbol lookups: %zu\n", ld_stats.lookups);
+	__dl_dprintf("ld.so:   number of deferred PLT relocations: %zu\n", ld_stats.lazy);
+
+	atexit(report_lazy_stats);
+}
+
 /**
  * @brief Actually execute code.
  *
@@ -1127,6 +1501,8 @@ static int run_app(struct DlLib * app, int argc, char * argv[], uintptr_t entryp
 	 * stdio, etc. */
 	__libc_init();
 
+	if (unlikely(__stats_ld)) report_stats();
+
 	for (struct DlLib * libs = app->next; libs; libs = libs->next) {
 		if (libs->constructed) continue;
 		run_ctors(libs);
@@ -1251,6 +1627,7 @@ int __libc_start(int argc, char *argv[], char *envp[]) {
 	Elf64_Header * ehdr = (void*)base;
 	Elf64_Phdr * phdrs = (void*)(base + ehdr->e_phoff);
 	Elf64_Dyn * _ldso_dyn = NULL;
+	uintptr_t _ldso_gnu_hash = 0;
 
 	for (size_t i = 0; i < ehdr->e_phnum; i++) {
 		if (phdrs[i].p_type == PT_DYNAMIC) {
@@ -1258,6 +1635,7 @@ int __libc_start(int argc, char *argv[], char *envp[]) {
 			_ldso_dyn = _dyn;
 			while (_dyn->d_tag) {
 				if (_dyn->d_tag < 32) dyn[_dyn->d_tag] = _dyn->d_un.d_val;
+				else if (_dyn->d_tag == DT_GNU_HASH) _ldso_gnu_hash = _dyn->d_un.d_ptr;
 				_dyn++;
 			}
 			break;
@@ -1284,19 +1662,27 @@ int __libc_start(int argc, char *argv[], char *envp[]) {
 				_fmt(AT_BASE,"#zx");
 				_fmt(AT_ENTRY,"#zx");
 				_fmt(AT_EXECFN,"s");
+				_fmt(AT_CLOCKPAGE,"#zx");
 				default:
 					__dl_dprintf("%#zx: %#zx\n", auxv_raw[i], auxv_raw[i+1]);
 			}
 		}
 	}
 
-	__trace_ld = !!simple_getenv("LD_DEBUG");
+	char * ld_debug = simple_getenv("LD_DEBUG");
+	if (ld_debug) {
+		if (!strcmp(ld_debug, "statistics")) __stats_ld = true;
+		else __trace_ld = true;
+	}
+	__bind_now = !!simple_getenv("LD_BIND_NOW");
 	if (!target_is_suid) {
 		__ld_preload = simple_getenv("LD_PRELOAD");
 		__ld_library_path = simple_getenv("LD_LIBRARY_PATH");
 	}
 	__make_tls();
 
+	if (__stats_ld) gettimeofday(&ld_stats.start, NULL);
+
 	extern char ** __argv;
 	__argv = argv;
 
@@ -1313,7 +1699,8 @@ int __libc_start(int argc, char *argv[], char *envp[]) {
 	memcpy(ldso->dyn, dyn, sizeof(dyn));
 	ldso->strings = (void*)(ldso->base + ldso->dyn[DT_STRTAB]);
 	ldso->syms    = (void*)(ldso->base + ldso->dyn[DT_SYMTAB]);
-	ldso->hash    = (void*)(ldso->base + ldso->dyn[DT_HASH]);
+	ldso->hash    = ldso->dyn[DT_HASH] ? (void*)(ldso->base + ldso->dyn[DT_HASH]) : NULL;
+	ldso->gnu_hash = _ldso_gnu_hash ? (void*)(ldso->base + _ldso_gnu_hash) : NULL;
 
 	if (!auxv[AT_BASE]) {
 		run_ctors(ldso);
@@ -2,9 +2,11 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <libc/internal.h>
 #include <libc/stdio/stdio_internal.h>
+#include <libc/pthread/internal.h>
 
 #include <libc/syscall.h>
 #include <sys/syscall.h>
@@ -26,6 +28,8 @@ static char ** __get_argv(void) {
 }
 
 void _exit(int val){
+	/* From any thread but the main one, this ends only that thread. */
+	if (__libc_tls_ready) __malloc_thread_release(pthread_self());
 	syscall_exit(val);
 	__builtin_unreachable();
 }
@@ -0,0 +1,50 @@
+#include <poll.h>
+#include <errno.h>
+#include <sys/select.h>
+
+int select(int nfds, fd_set * readfds, fd_set * writefds, fd_set * exceptfds, struct timeval * timeout) {
+	if (nfds < 0 || nfds > FD_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct pollfd fds[nfds ? nfds : 1];
+	int count = 0;
+	for (int fd = 0; fd < nfds; ++fd) {
+		short events = 0;
+		if (readfds && FD_ISSET(fd, readfds)) events |= POLLIN;
+		if (writefds && FD_ISSET(fd, writefds)) events |= POLLOUT;
+		if (!events) continue;
+		fds[count].fd = fd;
+		fds[count].events = events;
+		fds[count].revents = 0;
+		count++;
+	}
+
+	int ms = timeout ? (int)(timeout->tv_sec * 1000 + timeout->tv_usec / 1000) : -1;
+	if (poll(fds, count, ms) < 0) return -1;
+
+	for (int i = 0; i < count; ++i) {
+		if (fds[i].revents & POLLNVAL) {
+			errno = EBADF;
+			return -1;
+		}
+	}
+
+	if (readfds) FD_ZERO(readfds);
+	if (writefds) FD_ZERO(writefds);
+	if (exceptfds) FD_ZERO(exceptfds);
+
+	int out = 0;
+	for (int i = 0; i < count; ++i) {
+		if ((fds[i].events & POLLIN) && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+			FD_SET(fds[i].fd, readfds);
+			out++;
+		}
+		if ((fds[i].events & POLLOUT) && (fds[i].revents & (POLLOUT | POLLERR))) {
+			FD_SET(fds[i].fd, writefds);
+			out++;
+		}
+	}
+	return out;
+}
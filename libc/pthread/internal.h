@@ -1,6 +1,8 @@
 #pragma once
 
 #include <sys/types.h>
+#include <sys/futex.h>
+#include <libc/syscall.h>
 
 #define PTHREAD_STACK_SIZE 0x100000
 
@@ -10,9 +12,41 @@ struct __pthread {
 	void * arg;
 	int * err_addr;
 	int   thread_err_val;
+	void * malloc_cache;
 };
 
 void * __tls_get_addr(void*);
 void __make_tls(void);
 
+/* Set once the main thread has TLS, and thus threads can exist */
+extern int __libc_tls_ready;
+_hidden void __malloc_thread_release(struct __pthread * thread);
+
 extern int __errno __asm__("errno");
+
+extern int __libc_is_multicore;
+
+/* How many times to retry a contended lock before sleeping on it */
+#define PTHREAD_SPIN_COUNT 100
+
+static inline void __pthread_relax(void) {
+#if defined(__x86_64__)
+	asm volatile ("pause");
+#elif defined(__aarch64__)
+	asm volatile ("yield");
+#endif
+}
+
+static inline long __futex_wait(volatile void * addr, uint32_t val, const struct timespec * timeout) {
+	return syscall_futex((volatile uint32_t *)addr, FUTEX_WAIT, val, timeout, NULL);
+}
+
+static inline long __futex_wake(volatile void * addr, int count) {
+	return syscall_futex((volatile uint32_t *)addr, FUTEX_WAKE, count, NULL, NULL);
+}
+
+static inline long __futex_requeue(volatile void * addr, int count, int requeue, volatile void * addr2) {
+	return syscall_futex((volatile uint32_t *)addr, FUTEX_REQUEUE, count, (const struct timespec *)(uintptr_t)requeue, (volatile uint32_t *)addr2);
+}
+
+_hidden int __pthread_timeout(const struct timespec * abstime, struct timespec * out);
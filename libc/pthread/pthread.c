@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sched.h>
+#include <time.h>
 
 #include <sys/wait.h>
 #include <sys/mman.h>
@@ -22,11 +23,6 @@
 
 DEFN_SYSCALL1(set_tls_base, SYS_SETTLSBASE, uintptr_t);
 
-extern int __libc_is_multicore;
-static inline void _yield(void) {
-	if (!__libc_is_multicore) syscall_yield();
-}
-
 void * __tls_get_addr(void* input) {
 #ifdef __x86_64__
 	struct tls_index {
@@ -55,6 +51,8 @@ pthread_t pthread_self(void) {
 	return (struct __pthread*)(void*)(threadbase - 4096);
 }
 
+_hidden int __libc_tls_ready = 0;
+
 _hidden void __make_tls(void) {
 	char * tlsSpace = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 	struct __pthread * this = (void*)tlsSpace;
@@ -64,9 +62,11 @@ _hidden void __make_tls(void) {
 	char ** tlsSelf = (char **)(tlsSpace+4096);
 	*tlsSelf = (char*)tlsSelf;
 	syscall_set_tls_base((uintptr_t)tlsSelf);
+	__libc_tls_ready = 1;
 }
 
 void pthread_exit(void * value) {
+	__malloc_thread_release(pthread_self());
 	syscall_exit(0);
 	__builtin_unreachable();
 }
@@ -104,22 +104,60 @@ void pthread_cleanup_pop(int execute) {
 	/* do nothing */
 }
 
+/**
+ * Convert an absolute CLOCK_REALTIME deadline to the relative
+ * timeout futex waits expect. Returns ETIMEDOUT if it has passed.
+ */
+int __pthread_timeout(const struct timespec * abstime, struct timespec * out) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	out->tv_sec  = abstime->tv_sec - now.tv_sec;
+	out->tv_nsec = abstime->tv_nsec - now.tv_nsec;
+	if (out->tv_nsec < 0) {
+		out->tv_sec--;
+		out->tv_nsec += 1000000000L;
+	}
+	if (out->tv_sec < 0) return ETIMEDOUT;
+	return 0;
+}
+
+/*
+ * Uncontended locking and unlocking is a single atomic operation.
+ * A contended locker marks the mutex as having waiters (2) and sleeps
+ * on it, and only an unlocker that sees that mark enters the kernel.
+ */
 int pthread_mutex_lock(pthread_mutex_t *mutex) {
-	while (__sync_lock_test_and_set(mutex, 0x01)) {
-		_yield();
+	int c = __sync_val_compare_and_swap(mutex, 0, 1);
+	if (!c) return 0;
+
+	/* The holder may be running on another core and about to let go. */
+	if (__libc_is_multicore > 1) {
+		for (int i = 0; i < PTHREAD_SPIN_COUNT; ++i) {
+			__pthread_relax();
+			if (*mutex == 0 && !(c = __sync_val_compare_and_swap(mutex, 0, 1))) return 0;
+		}
+	}
+
+	if (c != 2) c = __sync_lock_test_and_set(mutex, 2);
+	while (c) {
+		__futex_wait(mutex, 2, NULL);
+		c = __sync_lock_test_and_set(mutex, 2);
 	}
 	return 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex) {
-	if (__sync_lock_test_and_set(mutex, 0x01)) {
+	if (!__sync_bool_compare_and_swap(mutex, 0, 1)) {
 		return EBUSY;
 	}
 	return 0;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t *mutex) {
-	__sync_lock_release(mutex);
+	if (__sync_fetch_and_sub(mutex, 1) != 1) {
+		__sync_lock_release(mutex);
+		__futex_wake(mutex, 1);
+	}
 	return 0;
 }
 
@@ -144,6 +182,8 @@ int pthread_attr_destroy(pthread_attr_t *attr) {
 int pthread_join(pthread_t thread, void **retval) {
 	int status;
 	int result = waitpid(thread->tid, &status, 0);
+	/* A thread killed by a signal never got to give back its malloc cache. */
+	if (result > 0) __malloc_thread_release(thread);
 	if (retval) {
 		*retval = (void*)(uintptr_t)status;
 	}
@@ -0,0 +1,39 @@
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <libc/pthread/internal.h>
+
+int pthread_barrier_init(pthread_barrier_t * barrier, const pthread_barrierattr_t * attr, unsigned int count) {
+	if (!count) return EINVAL;
+	barrier->lock = 0;
+	barrier->count = count;
+	barrier->waiting = 0;
+	barrier->generation = 0;
+	return 0;
+}
+
+int pthread_barrier_destroy(pthread_barrier_t * barrier) {
+	return 0;
+}
+
+int pthread_barrier_wait(pthread_barrier_t * barrier) {
+	pthread_mutex_lock(&barrier->lock);
+	uint32_t generation = barrier->generation;
+
+	if (++barrier->waiting == barrier->count) {
+		/* Last one in releases everyone else. */
+		barrier->waiting = 0;
+		__sync_fetch_and_add(&barrier->generation, 1);
+		pthread_mutex_unlock(&barrier->lock);
+		__futex_wake(&barrier->generation, INT_MAX);
+		return PTHREAD_BARRIER_SERIAL_THREAD;
+	}
+
+	pthread_mutex_unlock(&barrier->lock);
+	while (barrier->generation == generation) {
+		__futex_wait(&barrier->generation, generation, NULL);
+	}
+	return 0;
+}
@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <libc/pthread/internal.h>
+
+/*
+ * A condition variable is a sequence number that is bumped on every
+ * signal; waiters sleep until it changes. Waiters always reacquire
+ * the mutex in the contended state, which lets a broadcast wake one
+ * waiter and move the rest straight onto the mutex instead of waking
+ * them all only to have them fight over it.
+ */
+
+int pthread_cond_init(pthread_cond_t * cond, const pthread_condattr_t * attr) {
+	cond->seq = 0;
+	cond->mutex = NULL;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t * cond) {
+	return 0;
+}
+
+static int cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex, const struct timespec * abstime) {
+	int ret = 0;
+	uint32_t seq = cond->seq;
+	cond->mutex = mutex;
+
+	pthread_mutex_unlock(mutex);
+
+	if (abstime) {
+		struct timespec timeout;
+		if (__pthread_timeout(abstime, &timeout)) {
+			ret = ETIMEDOUT;
+		} else if (__futex_wait(&cond->seq, seq, &timeout) == -ETIMEDOUT) {
+			ret = ETIMEDOUT;
+		}
+	} else {
+		__futex_wait(&cond->seq, seq, NULL);
+	}
+
+	while (__sync_lock_test_and_set(mutex, 2)) {
+		__futex_wait(mutex, 2, NULL);
+	}
+
+	return ret;
+}
+
+int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+	return cond_wait(cond, mutex, NULL);
+}
+
+int pthread_cond_timedwait(pthread_cond_t * cond, pthread_mutex_t * mutex, const struct timespec * abstime) {
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) return EINVAL;
+	return cond_wait(cond, mutex, abstime);
+}
+
+int pthread_cond_signal(pthread_cond_t * cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	__futex_wake(&cond->seq, 1);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t * cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	if (cond->mutex) {
+		__futex_requeue(&cond->seq, 1, INT_MAX, cond->mutex);
+	} else {
+		__futex_wake(&cond->seq, INT_MAX);
+	}
+	return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <limits.h>
 #include <libc/syscall.h>
 #include <sys/syscall.h>
 #include <signal.h>
@@ -9,17 +10,27 @@
 
 #include <sys/wait.h>
 
-extern int __libc_is_multicore;
-static inline void _yield(void) {
-	if (!__libc_is_multicore) syscall_yield();
-}
+#include <libc/pthread/internal.h>
+
+/*
+ * The reader count is protected by the internal mutex. Threads that
+ * can not take the lock sleep on @c seq, which is bumped whenever the
+ * lock may have become available.
+ */
+#define ACQUIRE_LOCK() pthread_mutex_lock(&lock->lock)
+#define RELEASE_LOCK() pthread_mutex_unlock(&lock->lock)
 
-#define ACQUIRE_LOCK() do { while (__sync_lock_test_and_set(&lock->atomic_lock, 0x01)) { _yield(); } } while (0)
-#define RELEASE_LOCK() do { __sync_lock_release(&lock->atomic_lock); } while (0)
+static void wait_for_change(pthread_rwlock_t * lock) {
+	uint32_t seq = lock->seq;
+	RELEASE_LOCK();
+	__futex_wait(&lock->seq, seq, NULL);
+	ACQUIRE_LOCK();
+}
 
 int pthread_rwlock_init(pthread_rwlock_t * lock, void * args) {
 	lock->readers = 0;
-	lock->atomic_lock = 0;
+	lock->lock = 0;
+	lock->seq = 0;
 	if (args != NULL) {
 		fprintf(stderr, "pthread: pthread_rwlock_init arg unsupported\n");
 		return 1;
@@ -29,35 +40,63 @@ int pthread_rwlock_init(pthread_rwlock_t * lock, void * args) {
 
 int pthread_rwlock_wrlock(pthread_rwlock_t * lock) {
 	ACQUIRE_LOCK();
-	while (1) {
-		if (lock->readers == 0) {
-			lock->readers = -1;
-			lock->writerPid = syscall_getpid();
-			RELEASE_LOCK();
-			return 0;
-		}
-		_yield();
+	while (lock->readers != 0) {
+		wait_for_change(lock);
 	}
+	lock->readers = -1;
+	lock->writerPid = syscall_getpid();
+	RELEASE_LOCK();
+	return 0;
 }
 
 int pthread_rwlock_rdlock(pthread_rwlock_t * lock) {
 	ACQUIRE_LOCK();
-	while (1) {
-		if (lock->readers >= 0) {
-			lock->readers++;
-			RELEASE_LOCK();
-			return 0;
-		}
-		_yield();
+	while (lock->readers < 0) {
+		wait_for_change(lock);
+	}
+	lock->readers++;
+	RELEASE_LOCK();
+	return 0;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t * lock) {
+	int ret = EBUSY;
+	ACQUIRE_LOCK();
+	if (lock->readers == 0) {
+		lock->readers = -1;
+		lock->writerPid = syscall_getpid();
+		ret = 0;
+	}
+	RELEASE_LOCK();
+	return ret;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t * lock) {
+	int ret = EBUSY;
+	ACQUIRE_LOCK();
+	if (lock->readers >= 0) {
+		lock->readers++;
+		ret = 0;
 	}
+	RELEASE_LOCK();
+	return ret;
 }
 
 int pthread_rwlock_unlock(pthread_rwlock_t * lock) {
+	int wake = 0;
 	ACQUIRE_LOCK();
-	if (lock->readers > 0) lock->readers--;
-	else if (lock->readers < 0) lock->readers = 0;
-	else fprintf(stderr, "pthread: bad lock state detected\n");
+	if (lock->readers > 0) {
+		lock->readers--;
+		wake = !lock->readers;
+	} else if (lock->readers < 0) {
+		lock->readers = 0;
+		wake = 1;
+	} else {
+		fprintf(stderr, "pthread: bad lock state detected\n");
+	}
+	if (wake) __sync_fetch_and_add(&lock->seq, 1);
 	RELEASE_LOCK();
+	if (wake) __futex_wake(&lock->seq, INT_MAX);
 	return 0;
 }
 
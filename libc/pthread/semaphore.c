@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <semaphore.h>
+#include <errno.h>
+
+#include <libc/pthread/internal.h>
+
+/*
+ * The semaphore's value doubles as the futex word: waiters sleep while
+ * it is zero. Posters only enter the kernel when someone is waiting.
+ */
+
+int sem_init(sem_t * sem, int pshared, unsigned int value) {
+	sem->value = value;
+	sem->waiters = 0;
+	return 0;
+}
+
+int sem_destroy(sem_t * sem) {
+	return 0;
+}
+
+int sem_trywait(sem_t * sem) {
+	uint32_t value;
+	while ((value = sem->value) > 0) {
+		if (__sync_bool_compare_and_swap(&sem->value, value, value - 1)) return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+static int sem_wait_until(sem_t * sem, const struct timespec * abstime) {
+	while (1) {
+		uint32_t value = sem->value;
+		if (value > 0) {
+			if (__sync_bool_compare_and_swap(&sem->value, value, value - 1)) return 0;
+			continue;
+		}
+
+		struct timespec timeout;
+		if (abstime && __pthread_timeout(abstime, &timeout)) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		__sync_fetch_and_add(&sem->waiters, 1);
+		long ret = __futex_wait(&sem->value, 0, abstime ? &timeout : NULL);
+		__sync_fetch_and_sub(&sem->waiters, 1);
+
+		if (ret == -ETIMEDOUT) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+}
+
+int sem_wait(sem_t * sem) {
+	return sem_wait_until(sem, NULL);
+}
+
+int sem_timedwait(sem_t * sem, const struct timespec * abstime) {
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) {
+		errno = EINVAL;
+		return -1;
+	}
+	return sem_wait_until(sem, abstime);
+}
+
+int sem_post(sem_t * sem) {
+	__sync_fetch_and_add(&sem->value, 1);
+	if (sem->waiters) __futex_wake(&sem->value, 1);
+	return 0;
+}
+
+int sem_getvalue(sem_t * sem, int * sval) {
+	*sval = sem->value;
+	return 0;
+}
@@ -0,0 +1,20 @@
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <errno.h>
+
+DEFN_SYSCALL3(sched_setaffinity, SYS_SCHED_SETAFFINITY, pid_t, size_t, const void *);
+DEFN_SYSCALL3(sched_getaffinity, SYS_SCHED_GETAFFINITY, pid_t, size_t, void *);
+
+int sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t * mask) {
+	__sets_errno(syscall_sched_setaffinity(pid, cpusetsize, mask));
+}
+
+int sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t * mask) {
+	long ret = syscall_sched_getaffinity(pid, cpusetsize, mask);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
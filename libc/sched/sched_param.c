@@ -0,0 +1,16 @@
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <errno.h>
+
+DEFN_SYSCALL2(sched_getparam, SYS_SCHED_GETPARAM, pid_t, struct sched_param *);
+
+int sched_getparam(pid_t pid, struct sched_param * param) {
+	__sets_errno(syscall_sched_getparam(pid, param));
+}
+
+int sched_setparam(pid_t pid, const struct sched_param * param) {
+	int policy = sched_getscheduler(pid);
+	if (policy < 0) return -1;
+	return sched_setscheduler(pid, policy, param);
+}
@@ -0,0 +1,28 @@
+#include <sched.h>
+#include <errno.h>
+
+int sched_get_priority_min(int policy) {
+	switch (policy) {
+		case SCHED_OTHER:
+			return 0;
+		case SCHED_FIFO:
+		case SCHED_RR:
+			return SCHED_PRIORITY_MIN;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+}
+
+int sched_get_priority_max(int policy) {
+	switch (policy) {
+		case SCHED_OTHER:
+			return 0;
+		case SCHED_FIFO:
+		case SCHED_RR:
+			return SCHED_PRIORITY_MAX;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+}
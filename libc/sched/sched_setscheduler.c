@@ -0,0 +1,15 @@
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <errno.h>
+
+DEFN_SYSCALL1(sched_getscheduler, SYS_SCHED_GETSCHEDULER, pid_t);
+DEFN_SYSCALL3(sched_setscheduler, SYS_SCHED_SETSCHEDULER, pid_t, int, const struct sched_param *);
+
+int sched_getscheduler(pid_t pid) {
+	__sets_errno(syscall_sched_getscheduler(pid));
+}
+
+int sched_setscheduler(pid_t pid, int policy, const struct sched_param * param) {
+	__sets_errno(syscall_sched_setscheduler(pid, policy, param));
+}
@@ -44,19 +44,34 @@
  * # README #
  * ##########
  *
- * About the slab allocator
- * """"""""""""""""""""""""
+ * About this allocator
+ * """"""""""""""""""""
  *
- * This is a simple implementation of a "slab" allocator. It works by operating
- * on "bins" of items of predefined sizes and a set of pseudo-bins of any size.
- * When a new allocation request is made, the allocator determines if it will
- * fit in an existing bin. If there are no bins of the correct size for a given
- * allocation request, the allocator will make a bin and add it to a(n empty)
- * list of available bins of that size. In this implementation, we use sizes
- * from 4 bytes (32 bit) or 8 bytes (64-bit) to 2KB for bins, fitting a 4K page
- * size. The implementation allows the number of pages in a single bin to be
- * increased, as well as allowing for changing the size of page (though this
- * should, for the most part, remain 4KB under any modern system).
+ * This started life as a simple "slab" allocator operating on "bins" of
+ * items of predefined sizes. It still is one for small requests, but it
+ * now handles larger ones and threads properly:
+ *
+ * - Memory is obtained from the kernel in 1MiB "segments", aligned to
+ *   their size, so the segment (and with it the kind of allocation) for
+ *   any pointer we hand out is found by masking off its low bits.
+ *
+ * - Small requests (up to 1KiB) come from power-of-two bins. Each bin is
+ *   a list of pages carved out of small segments, each page holding a
+ *   stack of free cells. Every thread keeps a cache of free cells for
+ *   each bin, so most small allocations and frees never take a lock;
+ *   caches are refilled from and flushed back to the shared bins in
+ *   batches. Pages whose cells are all free are given back to their
+ *   segment, and empty segments are unmapped.
+ *
+ * - Medium requests (up to 256KiB) come from one of a few arenas, picked
+ *   per thread. Arenas carve their segments into chunks with boundary
+ *   tags, so freed chunks are coalesced with their free neighbours, and
+ *   segments that become entirely free are unmapped.
+ *
+ * - Anything larger gets a segment of its own, unmapped when freed.
+ *
+ * malloc_stats() and mallinfo() report what each of these is holding on
+ * to, and how often their locks were contended.
  *
  * Special thanks
  * """"""""""""""
@@ -68,49 +83,24 @@
  * derided me for not fixing the bugs and to-do items listed in the last
  * section of this readme.
  *
- * GCC Function Attributes
- * """""""""""""""""""""""
- *
- * A couple of GCC function attributes, designated by the __attribute__
- * directive, are used in this code to streamline optimization.
- * I've chosen to include a brief overview of the particular attributes
- * I am making use of:
- *
- * - malloc:
- *   Tells gcc that a given function is a memory allocator
- *   and that non-NULL values it returns should never be
- *   associated with other chunks of memory. We use this for
- *   alloc, realloc and calloc, as is requested in the gcc
- *   documentation for the attribute.
- *
- * - always_inline:
- *   Tells gcc to always inline the given code, regardless of the
- *   optmization level. Small functions that would be noticeably
- *   slower with the overhead of paramter handling are given
- *   this attribute.
- *
- * - pure:
- *   Tells gcc that a function only uses inputs and its output.
- *
  * Things to work on
  * """""""""""""""""
  *
  * TODO: Try to be more consistent on comment widths...
- * FIXME: Make thread safe! Not necessary for competition, but would be nice.
- * FIXME: Splitting/coalescing is broken. Fix this ASAP!
  *
 **/
 
 /* Includes {{{ */
 #include <libc/syscall.h>
-#include <assert.h>
 #include <stdint.h>
-#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <libc/internal.h>
+#include <libc/pthread/internal.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -118,475 +108,826 @@
  * Defines for often-used integral values
  * related to our binning and paging strategy.
  */
-#if defined(__x86_64__) || defined(__aarch64__)
-#define NUM_BINS 10U								/* Number of bins, total, under 64-bit. */
-#define SMALLEST_BIN_LOG 3U							/* Logarithm base two of the smallest bin: log_2(sizeof(int32)). */
-#else
-#define NUM_BINS 11U								/* Number of bins, total, under 32-bit. */
-#define SMALLEST_BIN_LOG 2U							/* Logarithm base two of the smallest bin: log_2(sizeof(int32)). */
-#endif
-#define BIG_BIN (NUM_BINS - 1)						/* Index for the big bin, (NUM_BINS - 1) */
+#define NUM_BINS 8U									/* Number of small bins, 8 bytes to 1KiB. */
+#define SMALLEST_BIN_LOG 3U							/* Logarithm base two of the smallest bin. */
 #define SMALLEST_BIN (1UL << SMALLEST_BIN_LOG)		/* Size of the smallest bin. */
+#define LARGEST_BIN (SMALLEST_BIN << (NUM_BINS - 1))	/* Size of the largest bin. */
 
 #define PAGE_SIZE 0x1000							/* Size of a page (in bytes), should be 4KB */
-#define PAGE_MASK (PAGE_SIZE - 1)					/* Block mask, size of a page * number of pages - 1. */
-#define SKIP_P INT32_MAX							/* INT32_MAX is half of UINT32_MAX; this gives us a 50% marker for skip lists. */
-#define SKIP_MAX_LEVEL 6							/* We have a maximum of 6 levels in our skip lists. */
+#define PAGE_MASK (PAGE_SIZE - 1)
+
+#define SEGMENT_SIZE 0x100000UL						/* Size (and alignment) of a segment. */
+#define SEGMENT_MASK (SEGMENT_SIZE - 1)
+#define SEGMENT_HEADER 64							/* Space at the start of a segment for its header. */
+
+#define NUM_ARENAS 4U								/* Arenas for medium allocations. */
+#define NUM_FREE_LISTS 16U							/* Free lists per arena, by power of two. */
+#define MEDIUM_MAX 0x40000UL						/* Largest request served from an arena. */
+
+#define TCACHE_BYTES 0x4000							/* Roughly how much a thread caches per bin... */
+#define TCACHE_MAX 64								/* ...but no more than this many cells. */
 
 #define BIN_MAGIC 0xDEFAD00D
 
 /* }}} */
+/* Locks {{{ */
 
 /*
- * Internal functions.
+ * Allocator locks count how often they are taken and how
+ * often someone had to wait for them, for malloc_stats().
+ * Both counters are only updated while holding the lock.
  */
-static void * __attribute__ ((malloc)) klmalloc(uintptr_t size);
-static void * __attribute__ ((malloc)) klrealloc(void * ptr, uintptr_t size);
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size);
-static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
-static void klfree(void * ptr);
-
-static int volatile mem_lock = 0;
-static const char * _lock_holder;
-
-static void spin_lock(int volatile * lock, const char * caller) {
-	while(__sync_lock_test_and_set(lock, 0x01)) {
-		syscall_yield();
+struct malloc_lock {
+	int volatile lock;
+	size_t acquired;
+	size_t contended;
+};
+
+static void spin_lock(struct malloc_lock * lock) {
+	if (__builtin_expect(__sync_lock_test_and_set(&lock->lock, 0x01), 0)) {
+		int spins = 0;
+		while (__sync_lock_test_and_set(&lock->lock, 0x01)) {
+			/* The holder may be running on another core and about to let go. */
+			if (__libc_is_multicore > 1 && spins++ < PTHREAD_SPIN_COUNT) {
+				__pthread_relax();
+			} else {
+				syscall_yield();
+			}
+		}
+		lock->contended++;
 	}
-	_lock_holder = caller;
+	lock->acquired++;
 }
 
-static void spin_unlock(int volatile * lock) {
-	__sync_lock_release(lock);
+static void spin_unlock(struct malloc_lock * lock) {
+	__sync_lock_release(&lock->lock);
 }
 
-_hidden void __libc_take_malloc_lock(void) {
-	spin_lock(&mem_lock, "fork");
-}
+/* }}} Locks */
+/* Segments {{{ */
 
-_hidden void __libc_release_malloc_lock(void) {
-	spin_unlock(&mem_lock);
-}
+enum segment_kind {
+	SEGMENT_SMALL = 1,	/* Pages for the small bins. */
+	SEGMENT_MEDIUM,		/* Chunks for an arena. */
+	SEGMENT_LARGE,		/* A single large allocation. */
+};
 
-void * __attribute__ ((malloc)) malloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klmalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
+/*
+ * Segment header - appears at the start of every segment.
+ */
+typedef struct _klmalloc_segment {
+	uint32_t magic;
+	uint32_t kind;
+	uintptr_t size;							/* Bytes mapped for this segment. */
+	struct _klmalloc_segment * next;		/* Next segment in the page pool or arena. */
+	struct _klmalloc_segment * prev;
+	struct _klmalloc_arena * arena;			/* Medium: the arena this segment belongs to. */
+	uintptr_t used;							/* Small: pages handed out. Large: offset of the allocation. */
+	uintptr_t bump;							/* Small: first page that has never been handed out. */
+	void * free_pages;						/* Small: stack of pages that were given back. */
+} klmalloc_segment;
 
-void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klrealloc(ptr, size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
+_Static_assert(sizeof(klmalloc_segment) <= SEGMENT_HEADER, "segment header too big");
 
-void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klcalloc(nmemb, size);
-	spin_unlock(&mem_lock);
-	return ret;
+static inline klmalloc_segment * __attribute__ ((always_inline, pure)) klmalloc_segment_of(void * ptr) {
+	return (klmalloc_segment *)((uintptr_t)ptr & ~SEGMENT_MASK);
 }
 
-void * __attribute__ ((malloc)) valloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klvalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
+static uintptr_t mapped_bytes = 0;		/* Everything we currently have mapped. */
+static uintptr_t mapped_peak = 0;		/* The most we have ever had mapped. */
+
+/*
+ * Map a new segment of at least @p size bytes, aligned to SEGMENT_SIZE.
+ *
+ * mmap doesn't take an alignment, so we ask for an extra segment's
+ * worth of space and give back whatever is on either side of the
+ * aligned part. The pages are not touched until they are used.
+ */
+static klmalloc_segment * klmalloc_segment_map(uintptr_t size, uint32_t kind) {
+	size = (size + PAGE_MASK) & ~PAGE_MASK;
+	uintptr_t raw = (uintptr_t)mmap(NULL, size + SEGMENT_SIZE, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if ((void*)raw == MAP_FAILED) return NULL;
+
+	uintptr_t aligned = (raw + SEGMENT_MASK) & ~SEGMENT_MASK;
+	uintptr_t end = raw + size + SEGMENT_SIZE;
+	if (aligned > raw) munmap((void*)raw, aligned - raw);
+	if (end > aligned + size) munmap((void*)(aligned + size), end - (aligned + size));
+
+	klmalloc_segment * segment = (klmalloc_segment *)aligned;
+	segment->magic = BIN_MAGIC;
+	segment->kind = kind;
+	segment->size = size;
+
+	uintptr_t now = __atomic_add_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+	uintptr_t peak = __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
+	while (now > peak && !__atomic_compare_exchange_n(&mapped_peak, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return segment;
 }
 
-void free(void * ptr) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	klfree(ptr);
-	spin_unlock(&mem_lock);
+static void klmalloc_segment_unmap(klmalloc_segment * segment) {
+	uintptr_t size = segment->size;
+	segment->magic = 0;
+	__atomic_sub_fetch(&mapped_bytes, size, __ATOMIC_RELAXED);
+	munmap(segment, size);
 }
 
+/* }}} Segments */
+/* Small bins {{{ */
 
-/* Bin management {{{ */
+/*
+ * Page header - at the front of every page of a small bin, followed
+ * by the page's cells. Free cells form a stack, each pointing to the
+ * next. Pages with free cells are on their bin's list.
+ */
+typedef struct _klmalloc_page {
+	struct _klmalloc_page * next;
+	struct _klmalloc_page * prev;
+	void * head;							/* Top of the stack of free cells. */
+	uint32_t magic;
+	uint16_t bin;							/* Bin index. */
+	uint16_t used;							/* Cells handed out, including to thread caches. */
+} klmalloc_page;
 
 /*
- * Adjust bin size in bin_size call to proper bounds.
+ * A shared bin, holding pages with free cells of one size.
  */
-static inline uintptr_t __attribute__ ((always_inline, pure)) klmalloc_adjust_bin(uintptr_t bin)
-{
-	if (bin <= (uintptr_t)SMALLEST_BIN_LOG)
-	{
-		return 0;
-	}
-	bin -= SMALLEST_BIN_LOG + 1;
-	if (bin > (uintptr_t)BIG_BIN) {
-		return BIG_BIN;
-	}
-	return bin;
-}
+static struct _klmalloc_bin {
+	struct malloc_lock lock;
+	klmalloc_page * first;					/* Pages with free cells. */
+	uintptr_t pages;						/* Pages owned by this bin. */
+	uintptr_t free;							/* Free cells on those pages. */
+} klmalloc_bins[NUM_BINS];
+
+/*
+ * Pool of pages for the small bins.
+ */
+static struct {
+	struct malloc_lock lock;
+	klmalloc_segment * first;
+	uintptr_t count;
+} klmalloc_pages;
 
 /*
  * Given a size value, find the correct bin
  * to place the requested allocation in.
  */
-static inline uintptr_t __attribute__ ((always_inline, pure)) klmalloc_bin_size(uintptr_t size) {
-	uintptr_t bin = sizeof(size) * CHAR_BIT - __builtin_clzl(size);
-	bin += !!(size & (size - 1));
-	return klmalloc_adjust_bin(bin);
+static inline unsigned int __attribute__ ((always_inline, pure)) klmalloc_bin_size(uintptr_t size) {
+	if (size <= SMALLEST_BIN) return 0;
+	return (sizeof(size) * 8 - __builtin_clzl(size - 1)) - SMALLEST_BIN_LOG;
+}
+
+static inline uintptr_t __attribute__ ((always_inline, pure)) klmalloc_bin_cells(unsigned int bin) {
+	return (PAGE_SIZE - sizeof(klmalloc_page)) >> (SMALLEST_BIN_LOG + bin);
 }
 
 /*
- * Bin header - One page of memory.
- * Appears at the front of a bin to point to the
- * previous bin (or NULL if the first), the next bin
- * (or NULL if the last) and the head of the bin, which
- * is a stack of cells of data.
+ * Take a page from the pool, mapping a new segment if they are all in use.
  */
-typedef struct _klmalloc_bin_header {
-	struct _klmalloc_bin_header *  next;	/* Pointer to the next node. */
-	void * head;							/* Head of this bin. */
-	uintptr_t size;							/* Size of this bin, if big; otherwise bin index. */
-	uint32_t bin_magic;
-} klmalloc_bin_header;
+static klmalloc_page * klmalloc_page_alloc(void) {
+	spin_lock(&klmalloc_pages.lock);
+
+	klmalloc_segment * segment;
+	for (segment = klmalloc_pages.first; segment; segment = segment->next) {
+		if (segment->free_pages || segment->bump < SEGMENT_SIZE / PAGE_SIZE) break;
+	}
+
+	if (!segment) {
+		segment = klmalloc_segment_map(SEGMENT_SIZE, SEGMENT_SMALL);
+		if (!segment) {
+			spin_unlock(&klmalloc_pages.lock);
+			return NULL;
+		}
+		segment->bump = 1; /* The first page is the header. */
+		segment->prev = NULL;
+		segment->next = klmalloc_pages.first;
+		if (segment->next) segment->next->prev = segment;
+		klmalloc_pages.first = segment;
+		klmalloc_pages.count++;
+	}
+
+	void * page;
+	if (segment->free_pages) {
+		page = segment->free_pages;
+		segment->free_pages = *(void **)page;
+	} else {
+		page = (void *)((uintptr_t)segment + segment->bump * PAGE_SIZE);
+		segment->bump++;
+	}
+	segment->used++;
+
+	spin_unlock(&klmalloc_pages.lock);
+	return page;
+}
 
 /*
- * A big bin header is basically the same as a regular bin header
- * only with a pointer to the previous (physically) instead of
- * a "next" and with a list of forward headers.
+ * Return a page to the pool, unmapping its segment if that was the
+ * last page in use and we have others.
  */
-typedef struct _klmalloc_big_bin_header {
-	struct _klmalloc_big_bin_header * next;
-	void * head;
-	uintptr_t size;
-	uint32_t bin_magic;
-} klmalloc_big_bin_header;
+static void klmalloc_page_release(klmalloc_page * page) {
+	klmalloc_segment * segment = klmalloc_segment_of(page);
+
+	spin_lock(&klmalloc_pages.lock);
+	segment->used--;
+	if (!segment->used && klmalloc_pages.count > 1) {
+		if (segment->prev) segment->prev->next = segment->next;
+		else klmalloc_pages.first = segment->next;
+		if (segment->next) segment->next->prev = segment->prev;
+		klmalloc_pages.count--;
+		spin_unlock(&klmalloc_pages.lock);
+		klmalloc_segment_unmap(segment);
+		return;
+	}
+	page->magic = 0;
+	*(void **)page = segment->free_pages;
+	segment->free_pages = page;
+	spin_unlock(&klmalloc_pages.lock);
+}
+
+static void klmalloc_bin_insert(struct _klmalloc_bin * bin, klmalloc_page * page) {
+	page->prev = NULL;
+	page->next = bin->first;
+	if (page->next) page->next->prev = page;
+	bin->first = page;
+}
 
+static void klmalloc_bin_remove(struct _klmalloc_bin * bin, klmalloc_page * page) {
+	if (page->prev) page->prev->next = page->next;
+	else bin->first = page->next;
+	if (page->next) page->next->prev = page->prev;
+	page->next = NULL;
+	page->prev = NULL;
+}
 
 /*
- * List of pages in a bin.
+ * Set up a fresh page for a bin. Called with the bin locked.
  */
-typedef struct _klmalloc_bin_header_head {
-	klmalloc_bin_header * first;
-} klmalloc_bin_header_head;
+static klmalloc_page * klmalloc_bin_grow(unsigned int bin_id) {
+	klmalloc_page * page = klmalloc_page_alloc();
+	if (!page) return NULL;
+
+	page->magic = BIN_MAGIC;
+	page->bin = bin_id;
+	page->used = 0;
+
+	/*
+	 * The page is made into a stack, with each cell
+	 * pointing to the next until the end, which
+	 * points to NULL.
+	 */
+	uintptr_t size = SMALLEST_BIN << bin_id;
+	uintptr_t cells = klmalloc_bin_cells(bin_id);
+	char * base = (char *)page + sizeof(klmalloc_page);
+	for (uintptr_t i = 0; i < cells; ++i) {
+		*(void **)(base + i * size) = (i + 1 < cells) ? base + (i + 1) * size : NULL;
+	}
+	page->head = base;
+
+	klmalloc_bins[bin_id].pages++;
+	klmalloc_bins[bin_id].free += cells;
+	klmalloc_bin_insert(&klmalloc_bins[bin_id], page);
+	return page;
+}
 
 /*
- * Array of available bins.
+ * Take up to @p want cells from a bin, as a list linked through
+ * their first words.
+ *
+ * @returns how many cells we got, which is only ever 0 if we are out of memory.
  */
-static klmalloc_bin_header_head klmalloc_bin_head[NUM_BINS - 1];	/* Small bins */
+static uintptr_t klmalloc_bin_take(unsigned int bin_id, uintptr_t want, void ** out) {
+	struct _klmalloc_bin * bin = &klmalloc_bins[bin_id];
+	void * list = NULL;
+	uintptr_t got = 0;
 
-/* }}} Bin management */
-/* Doubly-Linked List {{{ */
+	spin_lock(&bin->lock);
+	while (got < want) {
+		klmalloc_page * page = bin->first;
+		if (!page && !(page = klmalloc_bin_grow(bin_id))) break;
+		while (got < want && page->head) {
+			void ** cell = page->head;
+			page->head = *cell;
+			*cell = list;
+			list = cell;
+			page->used++;
+			got++;
+		}
+		if (!page->head) klmalloc_bin_remove(bin, page);
+	}
+	bin->free -= got;
+	spin_unlock(&bin->lock);
+
+	*out = list;
+	return got;
+}
 
 /*
- * Remove an entry from a page list.
- * Decouples the element from its
- * position in the list by linking
- * its neighbors to eachother.
+ * Return a cell to its page. Called with the bin locked.
  */
-static inline void __attribute__ ((always_inline)) klmalloc_list_decouple(klmalloc_bin_header_head *head, klmalloc_bin_header *node) {
-	klmalloc_bin_header *next	= node->next;
-	head->first = next;
-	node->next = NULL;
+static void klmalloc_bin_put(struct _klmalloc_bin * bin, void * ptr) {
+	klmalloc_page * page = (klmalloc_page *)((uintptr_t)ptr & ~(uintptr_t)PAGE_MASK);
+
+	if (!page->head) klmalloc_bin_insert(bin, page);
+	*(void **)ptr = page->head;
+	page->head = ptr;
+	page->used--;
+	bin->free++;
+
+	/* Keep one page around so a bin doesn't flap between having pages and not. */
+	if (!page->used && (bin->first != page || page->next)) {
+		klmalloc_bin_remove(bin, page);
+		bin->pages--;
+		bin->free -= klmalloc_bin_cells(page->bin);
+		klmalloc_page_release(page);
+	}
 }
 
+/* }}} Small bins */
+/* Thread caches {{{ */
+
 /*
- * Insert an entry into a page list.
- * The new entry is placed at the front
- * of the list and the existing border
- * elements are updated to point back
- * to it (our list is doubly linked).
+ * Per-thread cache of free cells for each small bin, hung off the
+ * thread's pthread structure. Only the owning thread touches it.
  */
-static inline void __attribute__ ((always_inline)) klmalloc_list_insert(klmalloc_bin_header_head *head, klmalloc_bin_header *node) {
-	node->next = head->first;
-	head->first = node;
+struct _klmalloc_tcache {
+	void * cells[NUM_BINS];
+	uint16_t count[NUM_BINS];
+	struct _klmalloc_arena * arena;			/* Arena for this thread's medium allocations. */
+};
+
+static unsigned int klmalloc_next_arena = 0;
+static struct _klmalloc_arena * klmalloc_arena_for(struct _klmalloc_tcache * cache);
+
+static inline uintptr_t __attribute__ ((always_inline, pure)) klmalloc_tcache_limit(unsigned int bin) {
+	uintptr_t n = TCACHE_BYTES >> (SMALLEST_BIN_LOG + bin);
+	return n > TCACHE_MAX ? TCACHE_MAX : n;
 }
 
 /*
- * Get the head of a page list.
- * Because redundant function calls
- * are really great, and just in case
- * we change the list implementation.
+ * Get the calling thread's cache, setting it up on first use.
+ *
+ * Threads only exist once ld.so has set up TLS; before then (and in
+ * static binaries, which never do) everything goes to the shared bins.
  */
-static inline klmalloc_bin_header * __attribute__ ((always_inline)) klmalloc_list_head(klmalloc_bin_header_head *head) {
-	return head->first;
+static struct _klmalloc_tcache * klmalloc_tcache(void) {
+	if (__builtin_expect(!__libc_tls_ready, 0)) return NULL;
+
+	struct __pthread * self = pthread_self();
+	if (__builtin_expect(self->malloc_cache != NULL, 1)) return self->malloc_cache;
+
+	void * cell;
+	if (!klmalloc_bin_take(klmalloc_bin_size(sizeof(struct _klmalloc_tcache)), 1, &cell)) return NULL;
+
+	struct _klmalloc_tcache * cache = cell;
+	memset(cache, 0, sizeof(struct _klmalloc_tcache));
+	cache->arena = klmalloc_arena_for(NULL);
+	self->malloc_cache = cache;
+	return cache;
 }
 
-/* }}} Lists */
-/* Stack {{{ */
 /*
- * Pop an item from a block.
- * Free space is stored as a stack,
- * so we get a free space for a bin
- * by popping a free node from the
- * top of the stack.
+ * Give cells back to the shared bin until only @p keep are left.
  */
-static void * klmalloc_stack_pop(klmalloc_bin_header *header) {
-	assert(header);
-	assert(header->head != NULL);
-	assert((uintptr_t)header->head > (uintptr_t)header);
-	if (header->size > NUM_BINS) {
-		assert((uintptr_t)header->head < (uintptr_t)header + header->size);
-	} else {
-		assert((uintptr_t)header->head < (uintptr_t)header + PAGE_SIZE);
-		assert((uintptr_t)header->head > (uintptr_t)header + sizeof(klmalloc_bin_header) - 1);
+static void klmalloc_tcache_flush(struct _klmalloc_tcache * cache, unsigned int bin_id, uintptr_t keep) {
+	struct _klmalloc_bin * bin = &klmalloc_bins[bin_id];
+	spin_lock(&bin->lock);
+	while (cache->count[bin_id] > keep) {
+		void ** cell = cache->cells[bin_id];
+		cache->cells[bin_id] = *cell;
+		cache->count[bin_id]--;
+		klmalloc_bin_put(bin, cell);
 	}
-	
-	/*
-	 * Remove the current head and point
-	 * the head to where the old head pointed.
-	 */
-	void *item = header->head;
-	uintptr_t **head = header->head;
-	uintptr_t *next = *head;
-	header->head = next;
-	return item;
+	spin_unlock(&bin->lock);
 }
 
 /*
- * Push an item into a block.
- * When we free memory, we need
- * to add the freed cell back
- * into the stack of free spaces
- * for the block.
+ * Give back the cells cached by @p thread, either as it exits or,
+ * for a thread that was killed outright, once it has been joined.
  */
-static void klmalloc_stack_push(klmalloc_bin_header *header, void *ptr) {
-	assert(ptr != NULL);
-	assert((uintptr_t)ptr > (uintptr_t)header);
-	if (header->size > NUM_BINS) {
-		assert((uintptr_t)ptr < (uintptr_t)header + header->size);
-	} else {
-		assert((uintptr_t)ptr < (uintptr_t)header + PAGE_SIZE);
+_hidden void __malloc_thread_release(struct __pthread * thread) {
+	if (!__libc_tls_ready) return;
+
+	struct _klmalloc_tcache * cache = __atomic_exchange_n((struct _klmalloc_tcache **)&thread->malloc_cache, NULL, __ATOMIC_ACQ_REL);
+	if (!cache) return;
+
+	for (unsigned int i = 0; i < NUM_BINS; ++i) {
+		if (cache->count[i]) klmalloc_tcache_flush(cache, i, 0);
+	}
+
+	struct _klmalloc_bin * bin = &klmalloc_bins[klmalloc_bin_size(sizeof(struct _klmalloc_tcache))];
+	spin_lock(&bin->lock);
+	klmalloc_bin_put(bin, cache);
+	spin_unlock(&bin->lock);
+}
+
+static void * __attribute__ ((malloc)) klmalloc_small(unsigned int bin_id) {
+	struct _klmalloc_tcache * cache = klmalloc_tcache();
+	void * cell;
+
+	if (!cache) {
+		return klmalloc_bin_take(bin_id, 1, &cell) ? cell : NULL;
+	}
+
+	if (__builtin_expect(!cache->count[bin_id], 0)) {
+		cache->count[bin_id] = klmalloc_bin_take(bin_id, (klmalloc_tcache_limit(bin_id) + 1) / 2, &cache->cells[bin_id]);
+		if (!cache->count[bin_id]) return NULL;
+	}
+
+	cell = cache->cells[bin_id];
+	cache->cells[bin_id] = *(void **)cell;
+	cache->count[bin_id]--;
+	return cell;
+}
+
+static void klfree_small(void * ptr) {
+	klmalloc_page * page = (klmalloc_page *)((uintptr_t)ptr & ~(uintptr_t)PAGE_MASK);
+	if (page->magic != BIN_MAGIC) return;
+	unsigned int bin_id = page->bin;
+
+	struct _klmalloc_tcache * cache = klmalloc_tcache();
+	if (!cache) {
+		struct _klmalloc_bin * bin = &klmalloc_bins[bin_id];
+		spin_lock(&bin->lock);
+		klmalloc_bin_put(bin, ptr);
+		spin_unlock(&bin->lock);
+		return;
+	}
+
+	*(void **)ptr = cache->cells[bin_id];
+	cache->cells[bin_id] = ptr;
+	if (++cache->count[bin_id] > klmalloc_tcache_limit(bin_id)) {
+		klmalloc_tcache_flush(cache, bin_id, klmalloc_tcache_limit(bin_id) / 2);
 	}
-	uintptr_t **item = (uintptr_t **)ptr;
-	*item = (uintptr_t *)header->head;
-	header->head = item;
 }
 
+/* }}} Thread caches */
+/* Arenas {{{ */
+
 /*
- * Is this cell stack empty?
- * If the head of the stack points
- * to NULL, we have exhausted the
- * stack, so there is no more free
- * space available in the block.
+ * Chunk header - in front of every medium allocation, and of every
+ * free region of an arena's segments. A chunk knows its own size and
+ * whether the chunk physically before it is free, and if it is, that
+ * chunk's size, so freed chunks can be merged with both neighbours.
  */
-static inline int __attribute__ ((always_inline)) klmalloc_stack_empty(klmalloc_bin_header *header) {
-	return header->head == NULL;
+typedef struct _klmalloc_chunk {
+	uintptr_t prev_size;					/* Size of the previous chunk, only valid if it is free. */
+	uintptr_t size;							/* Size of this chunk, header included, and flags. */
+	struct _klmalloc_chunk * next_free;		/* Free list links, only valid while free. */
+	struct _klmalloc_chunk * prev_free;
+} klmalloc_chunk;
+
+#define CHUNK_INUSE      1UL
+#define CHUNK_PREV_INUSE 2UL
+#define CHUNK_FLAGS      (CHUNK_INUSE | CHUNK_PREV_INUSE)
+#define CHUNK_HEADER     (2 * sizeof(uintptr_t))
+#define CHUNK_MIN        sizeof(klmalloc_chunk)
+#define CHUNK_SIZE(c)    ((c)->size & ~CHUNK_FLAGS)
+#define CHUNK_NEXT(c)    ((klmalloc_chunk *)((uintptr_t)(c) + CHUNK_SIZE(c)))
+#define CHUNK_OF(p)      ((klmalloc_chunk *)((uintptr_t)(p) - CHUNK_HEADER))
+
+/* A fresh segment is one free chunk, followed by an in-use header marking its end. */
+#define MEDIUM_CHUNK (SEGMENT_SIZE - SEGMENT_HEADER - CHUNK_HEADER)
+
+static struct _klmalloc_arena {
+	struct malloc_lock lock;
+	klmalloc_segment * first;
+	uintptr_t count;						/* Segments in this arena. */
+	klmalloc_chunk * free[NUM_FREE_LISTS];	/* Free chunks, by power of two. */
+	uintptr_t free_bytes;
+	uintptr_t free_chunks;
+	uintptr_t used_bytes;
+} klmalloc_arenas[NUM_ARENAS];
+
+static struct _klmalloc_arena * klmalloc_arena_for(struct _klmalloc_tcache * cache) {
+	if (cache) return cache->arena;
+	if (!__libc_tls_ready) return &klmalloc_arenas[0];
+	return &klmalloc_arenas[__atomic_fetch_add(&klmalloc_next_arena, 1, __ATOMIC_RELAXED) % NUM_ARENAS];
 }
 
-/* }}} Stack */
+static inline uintptr_t __attribute__ ((always_inline, pure)) klmalloc_chunk_need(uintptr_t size) {
+	uintptr_t need = (size + CHUNK_HEADER + 15) & ~(uintptr_t)15;
+	return need < CHUNK_MIN ? CHUNK_MIN : need;
+}
 
-/* malloc() {{{ */
-static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
-	/*
-	 * C standard implementation:
-	 * If size is zero, we can choose do a number of things.
-	 * This implementation will return a NULL pointer.
-	 */
-	if (__builtin_expect(size == 0, 0))
-		return NULL;
+static inline unsigned int __attribute__ ((always_inline, pure)) klmalloc_free_list(uintptr_t size) {
+	unsigned int i = (sizeof(size) * 8 - 1 - __builtin_clzl(size)) - 5; /* CHUNK_MIN is 32 */
+	return i < NUM_FREE_LISTS ? i : NUM_FREE_LISTS - 1;
+}
 
-	/*
-	 * Find the appropriate bin for the requested
-	 * allocation and start looking through that list.
-	 */
-	unsigned int bucket_id = klmalloc_bin_size(size);
+static void klmalloc_free_insert(struct _klmalloc_arena * arena, klmalloc_chunk * chunk) {
+	unsigned int i = klmalloc_free_list(CHUNK_SIZE(chunk));
+	chunk->prev_free = NULL;
+	chunk->next_free = arena->free[i];
+	if (chunk->next_free) chunk->next_free->prev_free = chunk;
+	arena->free[i] = chunk;
+	arena->free_bytes += CHUNK_SIZE(chunk);
+	arena->free_chunks++;
+}
 
-	if (bucket_id < BIG_BIN) {
-		/*
-		 * Small bins.
-		 */
-		klmalloc_bin_header * bin_header = klmalloc_list_head(&klmalloc_bin_head[bucket_id]);
-		if (!bin_header) {
-			/*
-			 * Grow the heap for the new bin.
-			 */
-			bin_header = (klmalloc_bin_header*)mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-			bin_header->bin_magic = BIN_MAGIC;
-			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
-
-			/*
-			 * Set the head of the stack.
-			 */
-			bin_header->head = (void*)((uintptr_t)bin_header + sizeof(klmalloc_bin_header));
-			/*
-			 * Insert the new bin at the front of
-			 * the list of bins for this size.
-			 */
-			klmalloc_list_insert(&klmalloc_bin_head[bucket_id], bin_header);
-			/*
-			 * Initialize the stack inside the bin.
-			 * The stack is initially full, with each
-			 * entry pointing to the next until the end
-			 * which points to NULL.
-			 */
-			uintptr_t adj = SMALLEST_BIN_LOG + bucket_id;
-			uintptr_t i, available = ((PAGE_SIZE - sizeof(klmalloc_bin_header)) >> adj) - 1;
-
-			uintptr_t **base = bin_header->head;
-			for (i = 0; i < available; ++i) {
-				/*
-				 * Our available memory is made into a stack, with each
-				 * piece of memory turned into a pointer to the next
-				 * available piece. When we want to get a new piece
-				 * of memory from this block, we just pop off a free
-				 * spot and give its address.
-				 */
-				base[i << bucket_id] = (uintptr_t *)&base[(i + 1) << bucket_id];
+static void klmalloc_free_remove(struct _klmalloc_arena * arena, klmalloc_chunk * chunk) {
+	unsigned int i = klmalloc_free_list(CHUNK_SIZE(chunk));
+	if (chunk->prev_free) chunk->prev_free->next_free = chunk->next_free;
+	else arena->free[i] = chunk->next_free;
+	if (chunk->next_free) chunk->next_free->prev_free = chunk->prev_free;
+	arena->free_bytes -= CHUNK_SIZE(chunk);
+	arena->free_chunks--;
+}
+
+/*
+ * Find and unlink a free chunk of at least @p need bytes.
+ *
+ * Only the list @p need falls in has to be searched; every chunk
+ * on the lists above it is big enough.
+ */
+static klmalloc_chunk * klmalloc_arena_find(struct _klmalloc_arena * arena, uintptr_t need) {
+	for (unsigned int i = klmalloc_free_list(need); i < NUM_FREE_LISTS; ++i) {
+		for (klmalloc_chunk * chunk = arena->free[i]; chunk; chunk = chunk->next_free) {
+			if (CHUNK_SIZE(chunk) >= need) {
+				klmalloc_free_remove(arena, chunk);
+				return chunk;
 			}
-			base[available << bucket_id] = NULL;
-			bin_header->size = bucket_id;
 		}
-		uintptr_t ** item = klmalloc_stack_pop(bin_header);
-		if (klmalloc_stack_empty(bin_header)) {
-			klmalloc_list_decouple(&(klmalloc_bin_head[bucket_id]),bin_header);
+	}
+	return NULL;
+}
+
+static int klmalloc_arena_grow(struct _klmalloc_arena * arena) {
+	klmalloc_segment * segment = klmalloc_segment_map(SEGMENT_SIZE, SEGMENT_MEDIUM);
+	if (!segment) return 0;
+
+	segment->arena = arena;
+	segment->prev = NULL;
+	segment->next = arena->first;
+	if (segment->next) segment->next->prev = segment;
+	arena->first = segment;
+	arena->count++;
+
+	klmalloc_chunk * chunk = (klmalloc_chunk *)((uintptr_t)segment + SEGMENT_HEADER);
+	chunk->size = MEDIUM_CHUNK | CHUNK_PREV_INUSE;
+	klmalloc_chunk * end = CHUNK_NEXT(chunk);
+	end->prev_size = MEDIUM_CHUNK;
+	end->size = CHUNK_INUSE;
+	klmalloc_free_insert(arena, chunk);
+	return 1;
+}
+
+/*
+ * Cut an in-use chunk down to @p need bytes, freeing the rest
+ * (along with the chunk after it, if that is free).
+ */
+static void klmalloc_chunk_trim(struct _klmalloc_arena * arena, klmalloc_chunk * chunk, uintptr_t need) {
+	uintptr_t have = CHUNK_SIZE(chunk);
+	if (have - need < CHUNK_MIN) return;
+
+	uintptr_t rest_size = have - need;
+	klmalloc_chunk * next = CHUNK_NEXT(chunk);
+	if (!(next->size & CHUNK_INUSE)) {
+		klmalloc_free_remove(arena, next);
+		rest_size += CHUNK_SIZE(next);
+	}
+
+	chunk->size = need | (chunk->size & CHUNK_FLAGS);
+	klmalloc_chunk * rest = CHUNK_NEXT(chunk);
+	rest->size = rest_size | CHUNK_PREV_INUSE;
+	next = CHUNK_NEXT(rest);
+	next->prev_size = rest_size;
+	next->size &= ~CHUNK_PREV_INUSE;
+	klmalloc_free_insert(arena, rest);
+
+	arena->used_bytes -= have - need;
+}
+
+static void * __attribute__ ((malloc)) klmalloc_medium(struct _klmalloc_arena * arena, uintptr_t size) {
+	uintptr_t need = klmalloc_chunk_need(size);
+
+	spin_lock(&arena->lock);
+	klmalloc_chunk * chunk = klmalloc_arena_find(arena, need);
+	if (!chunk) {
+		if (!klmalloc_arena_grow(arena)) {
+			spin_unlock(&arena->lock);
+			return NULL;
 		}
-		return item;
-	} else {
-		/*
-		 * Round requested size to a set of pages, plus the header size.
-		 */
-		uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
-		klmalloc_big_bin_header * bin_header = (klmalloc_big_bin_header*)mmap(NULL, PAGE_SIZE * pages, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-		bin_header->bin_magic = BIN_MAGIC;
-		assert((uintptr_t)bin_header % PAGE_SIZE == 0);
-		/*
-		 * Give the header the remaining space.
-		 */
-		bin_header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
-		assert((bin_header->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-		/*
-		 * Return the head of the block.
-		 */
-		bin_header->head = NULL;
-		return (void*)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header));
+		chunk = klmalloc_arena_find(arena, need);
 	}
+
+	chunk->size |= CHUNK_INUSE;
+	CHUNK_NEXT(chunk)->size |= CHUNK_PREV_INUSE;
+	arena->used_bytes += CHUNK_SIZE(chunk);
+	klmalloc_chunk_trim(arena, chunk, need);
+	spin_unlock(&arena->lock);
+
+	return (void *)((uintptr_t)chunk + CHUNK_HEADER);
 }
-/* }}} */
-/* free() {{{ */
-static void klfree(void *ptr) {
-	/*
-	 * C standard implementation: Do nothing when NULL is passed to free.
-	 */
-	if (__builtin_expect(ptr == NULL, 0)) {
+
+static void klfree_medium(struct _klmalloc_arena * arena, void * ptr) {
+	klmalloc_chunk * chunk = CHUNK_OF(ptr);
+
+	spin_lock(&arena->lock);
+	if (!(chunk->size & CHUNK_INUSE)) {
+		/* Double free; leave it alone. */
+		spin_unlock(&arena->lock);
 		return;
 	}
 
-	/*
-	 * Woah, woah, hold on, was this a page-aligned block?
-	 */
-	if ((uintptr_t)ptr % PAGE_SIZE == 0) {
-		/*
-		 * Well howdy-do, it was.
-		 */
-		ptr = (void *)((uintptr_t)ptr - 1);
+	uintptr_t size = CHUNK_SIZE(chunk);
+	arena->used_bytes -= size;
+
+	/* Merge with the chunks on either side, if they are free. */
+	klmalloc_chunk * next = CHUNK_NEXT(chunk);
+	if (!(next->size & CHUNK_INUSE)) {
+		klmalloc_free_remove(arena, next);
+		size += CHUNK_SIZE(next);
+	}
+	if (!(chunk->size & CHUNK_PREV_INUSE)) {
+		klmalloc_chunk * prev = (klmalloc_chunk *)((uintptr_t)chunk - chunk->prev_size);
+		klmalloc_free_remove(arena, prev);
+		size += CHUNK_SIZE(prev);
+		chunk = prev;
 	}
 
-	/*
-	 * Get our pointer to the head of this block by
-	 * page aligning it.
-	 */
-	klmalloc_bin_header * header = (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
-	assert((uintptr_t)header % PAGE_SIZE == 0);
+	/* Free chunks never have free neighbours, so the one before us is in use. */
+	chunk->size = size | CHUNK_PREV_INUSE;
+	next = CHUNK_NEXT(chunk);
+	next->prev_size = size;
+	next->size &= ~CHUNK_PREV_INUSE;
 
-	if (header->bin_magic != BIN_MAGIC)
+	if (size == MEDIUM_CHUNK && arena->count > 1) {
+		/* The whole segment is free, give it back. */
+		klmalloc_segment * segment = klmalloc_segment_of(chunk);
+		if (segment->prev) segment->prev->next = segment->next;
+		else arena->first = segment->next;
+		if (segment->next) segment->next->prev = segment->prev;
+		arena->count--;
+		spin_unlock(&arena->lock);
+		klmalloc_segment_unmap(segment);
 		return;
+	}
 
-	/*
-	 * For small bins, the bin number is stored in the size
-	 * field of the header. For large bins, the actual size
-	 * available in the bin is stored in this field. It's
-	 * easy to tell which is which, though.
-	 */
-	uintptr_t bucket_id = header->size;
-	if (bucket_id > (uintptr_t)NUM_BINS) {
-		bucket_id = BIG_BIN;
-		klmalloc_big_bin_header *bheader = (klmalloc_big_bin_header*)header;
-		
-		assert(bheader);
-		assert(bheader->head == NULL);
-		assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-
-		munmap(header, bheader->size + sizeof(klmalloc_big_bin_header));
-	} else {
-		/*
-		 * If the stack is empty, we are freeing
-		 * a block from a previously full bin.
-		 * Return it to the busy bins list.
-		 */
-		if (klmalloc_stack_empty(header)) {
-			klmalloc_list_insert(&klmalloc_bin_head[bucket_id], header);
+	klmalloc_free_insert(arena, chunk);
+	spin_unlock(&arena->lock);
+}
+
+/*
+ * Try to resize a medium allocation where it is, by trimming it or
+ * by taking over the free chunk after it.
+ */
+static int klmalloc_medium_resize(struct _klmalloc_arena * arena, void * ptr, uintptr_t size) {
+	klmalloc_chunk * chunk = CHUNK_OF(ptr);
+	uintptr_t need = klmalloc_chunk_need(size);
+
+	spin_lock(&arena->lock);
+	uintptr_t have = CHUNK_SIZE(chunk);
+	if (need > have) {
+		klmalloc_chunk * next = CHUNK_NEXT(chunk);
+		if ((next->size & CHUNK_INUSE) || have + CHUNK_SIZE(next) < need) {
+			spin_unlock(&arena->lock);
+			return 0;
 		}
-		/*
-		 * Push new space back into the stack.
-		 */
-		klmalloc_stack_push(header, ptr);
+		klmalloc_free_remove(arena, next);
+		chunk->size += CHUNK_SIZE(next);
+		CHUNK_NEXT(chunk)->size |= CHUNK_PREV_INUSE;
+		arena->used_bytes += CHUNK_SIZE(next);
 	}
+	klmalloc_chunk_trim(arena, chunk, need);
+	spin_unlock(&arena->lock);
+	return 1;
 }
-/* }}} */
-/* valloc() {{{ */
-static void * __attribute__ ((malloc)) klvalloc(uintptr_t size) {
+
+/* }}} Arenas */
+/* Large allocations {{{ */
+
+static uintptr_t large_count = 0;
+static uintptr_t large_bytes = 0;
+
+static void * __attribute__ ((malloc)) klmalloc_large(uintptr_t size, uintptr_t offset) {
+	klmalloc_segment * segment = klmalloc_segment_map(offset + size, SEGMENT_LARGE);
+	if (!segment) return NULL;
+	segment->used = offset;
+	__atomic_add_fetch(&large_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&large_bytes, segment->size, __ATOMIC_RELAXED);
+	return (void *)((uintptr_t)segment + offset);
+}
+
+static void klfree_large(klmalloc_segment * segment) {
+	__atomic_sub_fetch(&large_count, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&large_bytes, segment->size, __ATOMIC_RELAXED);
+	klmalloc_segment_unmap(segment);
+}
+
+/* }}} Large allocations */
+/* Public interface {{{ */
+
+_hidden void __libc_take_malloc_lock(void) {
+	for (unsigned int i = 0; i < NUM_BINS; ++i) spin_lock(&klmalloc_bins[i].lock);
+	spin_lock(&klmalloc_pages.lock);
+	for (unsigned int i = 0; i < NUM_ARENAS; ++i) spin_lock(&klmalloc_arenas[i].lock);
+}
+
+_hidden void __libc_release_malloc_lock(void) {
+	for (unsigned int i = 0; i < NUM_ARENAS; ++i) spin_unlock(&klmalloc_arenas[i].lock);
+	spin_unlock(&klmalloc_pages.lock);
+	for (unsigned int i = 0; i < NUM_BINS; ++i) spin_unlock(&klmalloc_bins[i].lock);
+}
+
+void * __attribute__ ((malloc)) malloc(uintptr_t size) {
 	/*
-	 * Allocate a page-aligned block.
-	 * XXX: THIS IS HORRIBLY, HORRIBLY WASTEFUL!! ONLY USE THIS
-	 *      IF YOU KNOW WHAT YOU ARE DOING!
+	 * C standard implementation:
+	 * If size is zero, we can choose do a number of things.
+	 * This implementation will return a NULL pointer.
 	 */
-	uintptr_t true_size = size + PAGE_SIZE - sizeof(klmalloc_big_bin_header); /* Here we go... */
-	void * result = klmalloc(true_size);
-	void * out = (void *)((uintptr_t)result + (PAGE_SIZE - sizeof(klmalloc_big_bin_header)));
-	assert((uintptr_t)out % PAGE_SIZE == 0);
-	return out;
+	if (__builtin_expect(size == 0, 0)) return NULL;
+
+	if (size <= LARGEST_BIN) return klmalloc_small(klmalloc_bin_size(size));
+	if (size <= MEDIUM_MAX) return klmalloc_medium(klmalloc_arena_for(klmalloc_tcache()), size);
+	if (size > (UINTPTR_MAX >> 1)) return NULL;
+	return klmalloc_large(size, SEGMENT_HEADER);
 }
-/* }}} */
-/* realloc() {{{ */
-static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
+
+void free(void * ptr) {
+	/*
+	 * C standard implementation: Do nothing when NULL is passed to free.
+	 */
+	if (__builtin_expect(ptr == NULL, 0)) return;
+
+	klmalloc_segment * segment = klmalloc_segment_of(ptr);
+	if (segment->magic != BIN_MAGIC) return;
+
+	switch (segment->kind) {
+		case SEGMENT_SMALL:
+			klfree_small(ptr);
+			break;
+		case SEGMENT_MEDIUM:
+			klfree_medium(segment->arena, ptr);
+			break;
+		case SEGMENT_LARGE:
+			klfree_large(segment);
+			break;
+	}
+}
+
+size_t malloc_usable_size(void * ptr) {
+	if (__builtin_expect(ptr == NULL, 0)) return 0;
+
+	klmalloc_segment * segment = klmalloc_segment_of(ptr);
+	if (segment->magic != BIN_MAGIC) return 0;
+
+	switch (segment->kind) {
+		case SEGMENT_SMALL:
+			return SMALLEST_BIN << ((klmalloc_page *)((uintptr_t)ptr & ~(uintptr_t)PAGE_MASK))->bin;
+		case SEGMENT_MEDIUM:
+			return CHUNK_SIZE(CHUNK_OF(ptr)) - CHUNK_HEADER;
+		case SEGMENT_LARGE:
+			return segment->size - segment->used;
+	}
+	return 0;
+}
+
+void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
 	/*
 	 * C standard implementation: When NULL is passed to realloc,
 	 * simply malloc the requested size and return a pointer to that.
 	 */
-	if (__builtin_expect(ptr == NULL, 0))
-		return klmalloc(size);
+	if (__builtin_expect(ptr == NULL, 0)) return malloc(size);
 
 	/*
 	 * C standard implementation: For a size of zero, free the
 	 * pointer and return NULL, allocating no new memory.
 	 */
-	if (__builtin_expect(size == 0, 0))
-	{
+	if (__builtin_expect(size == 0, 0)) {
 		free(ptr);
 		return NULL;
 	}
 
-	/*
-	 * Find the bin for the given pointer
-	 * by aligning it to a page.
-	 */
-	klmalloc_bin_header * header_old = (void *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
-	if (header_old->bin_magic != BIN_MAGIC) {
-		assert(0 && "Bad magic on realloc.");
-		return NULL;
-	}
+	klmalloc_segment * segment = klmalloc_segment_of(ptr);
+	if (segment->magic != BIN_MAGIC) return NULL;
 
-	uintptr_t old_size = header_old->size;
-	if (old_size < (uintptr_t)BIG_BIN) {
-		/*
-		 * If we are copying from a small bin,
-		 * we need to get the size of the bin
-		 * from its id.
-		 */
-		old_size = (1UL << (SMALLEST_BIN_LOG + old_size));
-	}
+	uintptr_t old_size = malloc_usable_size(ptr);
 
-	if (old_size == size) return ptr;
+	switch (segment->kind) {
+		case SEGMENT_SMALL:
+			/* Still the same bin? */
+			if (size <= old_size && size > old_size / 2) return ptr;
+			break;
+		case SEGMENT_MEDIUM:
+			if (size > LARGEST_BIN && size <= MEDIUM_MAX && klmalloc_medium_resize(segment->arena, ptr, size)) return ptr;
+			break;
+		case SEGMENT_LARGE:
+			if (size <= old_size && size > old_size / 2) return ptr;
+			break;
+	}
 
 	/*
 	 * Reallocate more memory.
 	 */
-	void * newptr = klmalloc(size);
+	void * newptr = malloc(size);
 	if (__builtin_expect(newptr != NULL, 1)) {
-
 		/*
 		 * Copy the old value into the new value.
 		 * Be sure to only copy as much as was in
 		 * the old block.
 		 */
 		memcpy(newptr, ptr, (old_size < size) ? old_size : size);
-		klfree(ptr);
+		free(ptr);
 		return newptr;
 	}
 
@@ -598,30 +939,131 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	 */
 	return NULL;
 }
-/* }}} */
-/* calloc() {{{ */
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size) {
+
+void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
 	/*
 	 * Allocate memory and zero it before returning
 	 * a pointer to the newly allocated memory.
-	 * 
-	 * Implemented by way of a simple malloc followed
-	 * by a memset to 0x00 across the length of the
-	 * requested memory chunk.
 	 */
-
-	void *ptr = klmalloc(nmemb * size);
-	if (ptr) memset(ptr,0x00,nmemb * size);
+	if (size && nmemb > UINTPTR_MAX / size) return NULL;
+	void * ptr = malloc(nmemb * size);
+	if (ptr) memset(ptr, 0x00, nmemb * size);
 	return ptr;
 }
-/* }}} */
 
-size_t malloc_usable_size(void *ptr) {
-	if (__builtin_expect(ptr == NULL, 0)) return 0;
-	if ((uintptr_t)ptr % PAGE_SIZE == 0) ptr = (void *)((uintptr_t)ptr - 1);
-	klmalloc_bin_header * header = (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
-	if (header->bin_magic != BIN_MAGIC) return 0;
-	uintptr_t bucket_id = header->size;
-	if (bucket_id > (uintptr_t)NUM_BINS) return header->size;
-	return (1UL << (SMALLEST_BIN_LOG + header->size));
+void * __attribute__ ((malloc)) valloc(uintptr_t size) {
+	/*
+	 * Allocate a page-aligned block.
+	 * These always get a segment of their own, and are rounded up
+	 * to whole pages, as ld.so maps over them.
+	 */
+	if (__builtin_expect(size == 0, 0)) return NULL;
+	if (size > (UINTPTR_MAX >> 1)) return NULL;
+	return klmalloc_large((size + PAGE_MASK) & ~(uintptr_t)PAGE_MASK, PAGE_SIZE);
 }
+
+/* }}} Public interface */
+/* Statistics {{{ */
+
+struct klmalloc_totals {
+	uintptr_t small_pages;		/* Pages owned by small bins */
+	uintptr_t small_used;		/* Bytes of cells handed out */
+	uintptr_t small_free;		/* Bytes of free cells on those pages */
+	uintptr_t small_cells;		/* Number of free cells on those pages */
+	uintptr_t small_segments;
+	uintptr_t arena_segments;
+	uintptr_t arena_used;
+	uintptr_t arena_free;
+	uintptr_t arena_chunks;		/* Number of free chunks */
+	uintptr_t large_count;
+	uintptr_t large_bytes;
+	uintptr_t mapped;
+	uintptr_t peak;
+};
+
+static void klmalloc_collect(struct klmalloc_totals * t) {
+	memset(t, 0, sizeof(struct klmalloc_totals));
+
+	for (unsigned int i = 0; i < NUM_BINS; ++i) {
+		struct _klmalloc_bin * bin = &klmalloc_bins[i];
+		uintptr_t size = SMALLEST_BIN << i;
+		spin_lock(&bin->lock);
+		t->small_pages += bin->pages;
+		t->small_used  += (bin->pages * klmalloc_bin_cells(i) - bin->free) * size;
+		t->small_free  += bin->free * size;
+		t->small_cells += bin->free;
+		spin_unlock(&bin->lock);
+	}
+
+	spin_lock(&klmalloc_pages.lock);
+	t->small_segments = klmalloc_pages.count;
+	spin_unlock(&klmalloc_pages.lock);
+
+	for (unsigned int i = 0; i < NUM_ARENAS; ++i) {
+		struct _klmalloc_arena * arena = &klmalloc_arenas[i];
+		spin_lock(&arena->lock);
+		t->arena_segments += arena->count;
+		t->arena_used     += arena->used_bytes;
+		t->arena_free     += arena->free_bytes;
+		t->arena_chunks   += arena->free_chunks;
+		spin_unlock(&arena->lock);
+	}
+
+	t->large_count = __atomic_load_n(&large_count, __ATOMIC_RELAXED);
+	t->large_bytes = __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+	t->mapped      = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+	t->peak        = __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
+}
+
+static int klmalloc_clamp(uintptr_t value) {
+	return value > 0x7FFFFFFF ? 0x7FFFFFFF : (int)value;
+}
+
+struct mallinfo mallinfo(void) {
+	struct klmalloc_totals t;
+	klmalloc_collect(&t);
+
+	struct mallinfo out;
+	out.arena    = klmalloc_clamp((t.small_segments + t.arena_segments) * SEGMENT_SIZE);
+	out.ordblks  = klmalloc_clamp(t.arena_chunks);
+	out.smblks   = klmalloc_clamp(t.small_cells);
+	out.hblks    = klmalloc_clamp(t.large_count);
+	out.hblkhd   = klmalloc_clamp(t.large_bytes);
+	out.usmblks  = klmalloc_clamp(t.peak);
+	out.fsmblks  = klmalloc_clamp(t.small_free);
+	out.uordblks = klmalloc_clamp(t.small_used + t.arena_used + t.large_bytes);
+	out.fordblks = klmalloc_clamp(t.small_free + t.arena_free);
+	out.keepcost = 0;
+	return out;
+}
+
+void malloc_stats(void) {
+	struct klmalloc_totals t;
+	struct malloc_lock locks[NUM_BINS + 1 + NUM_ARENAS];
+	klmalloc_collect(&t);
+
+	/* Snapshot the lock counters; fprintf may well call malloc. */
+	for (unsigned int i = 0; i < NUM_BINS; ++i) locks[i] = klmalloc_bins[i].lock;
+	locks[NUM_BINS] = klmalloc_pages.lock;
+	for (unsigned int i = 0; i < NUM_ARENAS; ++i) locks[NUM_BINS + 1 + i] = klmalloc_arenas[i].lock;
+
+	fprintf(stderr, "small bins:  %zu pages in %zu segments, %zu bytes in use, %zu bytes free\n",
+		(size_t)t.small_pages, (size_t)t.small_segments, (size_t)t.small_used, (size_t)t.small_free);
+	fprintf(stderr, "arenas:      %zu segments, %zu bytes in use, %zu bytes free in %zu chunks\n",
+		(size_t)t.arena_segments, (size_t)t.arena_used, (size_t)t.arena_free, (size_t)t.arena_chunks);
+	fprintf(stderr, "large:       %zu mappings, %zu bytes\n",
+		(size_t)t.large_count, (size_t)t.large_bytes);
+	fprintf(stderr, "system bytes     = %10zu\n", (size_t)t.mapped);
+	fprintf(stderr, "in use bytes     = %10zu\n", (size_t)(t.small_used + t.arena_used + t.large_bytes));
+	fprintf(stderr, "max system bytes = %10zu\n", (size_t)t.peak);
+	fprintf(stderr, "%-10s %12s %12s\n", "lock", "acquired", "contended");
+	for (unsigned int i = 0; i < NUM_BINS; ++i) {
+		fprintf(stderr, "bin %-6zu %12zu %12zu\n", (size_t)(SMALLEST_BIN << i), locks[i].acquired, locks[i].contended);
+	}
+	fprintf(stderr, "%-10s %12zu %12zu\n", "pages", locks[NUM_BINS].acquired, locks[NUM_BINS].contended);
+	for (unsigned int i = 0; i < NUM_ARENAS; ++i) {
+		fprintf(stderr, "arena %-4u %12zu %12zu\n", i, locks[NUM_BINS + 1 + i].acquired, locks[NUM_BINS + 1 + i].contended);
+	}
+}
+
+/* }}} Statistics */
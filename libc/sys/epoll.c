@@ -0,0 +1,28 @@
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <errno.h>
+
+DEFN_SYSCALL1(epoll_create, SYS_EPOLL_CREATE, int);
+DEFN_SYSCALL4(epoll_ctl, SYS_EPOLL_CTL, int, int, int, struct epoll_event *);
+DEFN_SYSCALL4(epoll_wait, SYS_EPOLL_WAIT, int, struct epoll_event *, int, int);
+
+int epoll_create1(int flags) {
+	__sets_errno(syscall_epoll_create(flags));
+}
+
+int epoll_create(int size) {
+	if (size <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event * event) {
+	__sets_errno(syscall_epoll_ctl(epfd, op, fd, event));
+}
+
+int epoll_wait(int epfd, struct epoll_event * events, int maxevents, int timeout) {
+	__sets_errno(syscall_epoll_wait(epfd, events, maxevents, timeout));
+}
@@ -0,0 +1,10 @@
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+#include <sys/futex.h>
+#include <errno.h>
+
+DEFN_SYSCALL5(futex, SYS_FUTEX, volatile uint32_t *, int, uint32_t, const struct timespec *, volatile uint32_t *);
+
+int futex(volatile uint32_t * uaddr, int op, uint32_t val, const struct timespec * timeout, volatile uint32_t * uaddr2) {
+	__sets_errno(syscall_futex(uaddr, op, val, timeout, uaddr2));
+}
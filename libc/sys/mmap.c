@@ -19,6 +19,36 @@ int munmap(void *addr, size_t length) {
 	__sets_errno(syscall_munmap(addr,length));
 }
 
+DEFN_SYSCALL3(mprotect, SYS_MPROTECT, void*, size_t, int);
+
+int mprotect(void *addr, size_t length, int prot) {
+	__sets_errno(syscall_mprotect(addr,length,prot));
+}
+
+DEFN_SYSCALL3(madvise, SYS_MADVISE, void*, size_t, int);
+
+int madvise(void *addr, size_t length, int advice) {
+	__sets_errno(syscall_madvise(addr,length,advice));
+}
+
+int posix_madvise(void *addr, size_t length, int advice) {
+	/* Returns the error instead of setting errno */
+	int madv;
+	switch (advice) {
+		case POSIX_MADV_NORMAL:     madv = MADV_NORMAL; break;
+		case POSIX_MADV_RANDOM:     madv = MADV_RANDOM; break;
+		case POSIX_MADV_SEQUENTIAL: madv = MADV_SEQUENTIAL; break;
+		case POSIX_MADV_WILLNEED:   madv = MADV_WILLNEED; break;
+		case POSIX_MADV_DONTNEED:
+			/* Only advice: unlike MADV_DONTNEED, this must not throw away the contents. */
+			return ((uintptr_t)addr & 0xFFF) ? EINVAL : 0;
+		default:
+			return EINVAL;
+	}
+	long result = syscall_madvise(addr,length,madv);
+	return result < 0 ? -result : 0;
+}
+
 int shm_open(const char * name, int flag, mode_t mode) {
 	if (*name != '/') return -EINVAL;
 	char rname[PATH_MAX];
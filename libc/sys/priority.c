@@ -0,0 +1,21 @@
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <errno.h>
+
+DEFN_SYSCALL2(getpriority, SYS_GETPRIORITY, int, id_t);
+DEFN_SYSCALL3(setpriority, SYS_SETPRIORITY, int, id_t, int);
+
+int getpriority(int which, id_t who) {
+	long ret = syscall_getpriority(which, who);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	/* The kernel biases the result by PRIO_MAX so it is never negative. */
+	return PRIO_MAX - ret;
+}
+
+int setpriority(int which, id_t who, int value) {
+	__sets_errno(syscall_setpriority(which, who, value));
+}
@@ -8,6 +8,10 @@
 #include <sys/times.h>
 #include <sys/signal.h>
 #include <sys/resource.h>
+#include <bits/sched.h>
+#include <bits/timespec.h>
+#include <sys/epoll.h>
+#include <poll.h>
 
 #include <libc/internal.h>
 
@@ -299,6 +303,22 @@ DECL_SYSCALL4(pread, int, void *, size_t, off_t);
 DECL_SYSCALL4(pwrite, int, const void *, size_t, off_t);
 DECL_SYSCALL6(mmap, void*, size_t, int, int, int, off_t);
 DECL_SYSCALL1(getsid, pid_t);
+DECL_SYSCALL2(getpriority, int, id_t);
+DECL_SYSCALL3(setpriority, int, id_t, int);
+DECL_SYSCALL1(sched_getscheduler, pid_t);
+DECL_SYSCALL3(sched_setscheduler, pid_t, int, const struct sched_param *);
+DECL_SYSCALL2(sched_getparam, pid_t, struct sched_param *);
+DECL_SYSCALL3(sched_setaffinity, pid_t, size_t, const void *);
+DECL_SYSCALL3(sched_getaffinity, pid_t, size_t, void *);
+DECL_SYSCALL2(nanosleep, const struct timespec *, struct timespec *);
+DECL_SYSCALL5(futex, volatile uint32_t *, int, uint32_t, const struct timespec *, volatile uint32_t *);
+DECL_SYSCALL1(epoll_create, int);
+DECL_SYSCALL4(epoll_ctl, int, int, int, struct epoll_event *);
+DECL_SYSCALL4(epoll_wait, int, struct epoll_event *, int, int);
+DECL_SYSCALL3(mprotect, void*, size_t, int);
+DECL_SYSCALL3(madvise, void*, size_t, int);
+DECL_SYSCALL4(fadvise, int, off_t, off_t, int);
+DECL_SYSCALL3(poll, struct pollfd *, nfds_t, int);
 
 _End_C_Header
 
@@ -0,0 +1,10 @@
+#include <time.h>
+#include <errno.h>
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+
+DEFN_SYSCALL2(nanosleep, SYS_NANOSLEEP, const struct timespec *, struct timespec *);
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+	__sets_errno(syscall_nanosleep(req, rem));
+}
@@ -0,0 +1,12 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+
+DEFN_SYSCALL4(fadvise, SYS_FADVISE, int, off_t, off_t, int);
+
+int posix_fadvise(int fd, off_t offset, off_t len, int advice) {
+	/* Returns the error instead of setting errno */
+	long result = syscall_fadvise(fd,offset,len,advice);
+	return result < 0 ? -result : 0;
+}
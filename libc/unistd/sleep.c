@@ -1,8 +1,10 @@
 #include <unistd.h>
 #include <libc/syscall.h>
+#include <sys/syscall.h>
 #include <errno.h>
 
+DEFN_SYSCALL2(sleep,  SYS_SLEEP, unsigned long, unsigned long);
+
 unsigned int sleep(unsigned int seconds) {
 	__sets_errno(syscall_sleep(seconds, 0));
 }
-
@@ -1,15 +1,7 @@
 #include <unistd.h>
-#include <libc/syscall.h>
-#include <sys/syscall.h>
-#include <errno.h>
-
-DEFN_SYSCALL2(sleep,  SYS_SLEEP, unsigned long, unsigned long);
-
-static int usleep_wrap(useconds_t usec) {
-	__sets_errno(syscall_sleep((usec / 10000) / 1000, (usec / 10000) % 1000));
-}
+#include <time.h>
 
 int usleep(useconds_t usec) {
-	return (usleep_wrap(usec) < 0) ? -1 : 0;
+	struct timespec req = { usec / 1000000, (usec % 1000000) * 1000 };
+	return nanosleep(&req, NULL);
 }
-
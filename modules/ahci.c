@@ -3,19 +3,47 @@
  * @file modules/ahci.c
  * @package x86_64
  *
- * @warning This is a stub driver.
+ * Drives SATA disks attached to AHCI controllers. Each port gets
+ * a command list with one command table per slot; commands are
+ * issued with native command queueing when both the controller and
+ * the disk support it, so up to 32 transfers can be outstanding on
+ * a port at once. Large requests are split across several slots and
+ * issued back to back before we wait for any of them.
+ *
+ * Reads and writes go through the shared block cache, which hands
+ * long uncached transfers down whole. Transfers DMA directly to and
+ * from the buffer we are given whenever it is sector-aligned kernel
+ * memory; user buffers and anything else go through a per-port bounce
+ * buffer. Completion is signalled by interrupt.
+ *
+ * Disks show up as /dev/sda, /dev/sdb, ...
+ *
+ * ATAPI ports are only idled; use the ata driver for optical drives.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2021 K. Lange
  */
+#include <bits/errno.h>
+#include <kernel/types.h>
 #include <kernel/syscall.h>
 #include <kernel/module.h>
 #include <kernel/printf.h>
+#include <kernel/string.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/mutex.h>
+#include <kernel/list.h>
 #include <kernel/pci.h>
 #include <kernel/vfs.h>
 #include <kernel/mmu.h>
+#include <kernel/trace.h>
+#include <kernel/blockcache.h>
+
+#include <kernel/arch/x86_64/irq.h>
+
+#include <sys/ioctl.h>
 
 static uint32_t mmio_read4(uintptr_t mmiobase, intptr_t offset) {
 	volatile uint32_t * data = (volatile uint32_t *)(mmiobase + offset);
@@ -36,6 +64,36 @@ static char * ahci_device_name(uint32_t pcidev, int port) {
 	return buf;
 }
 
+/* HBA registers */
+#define AHCI_CAP   0x00
+#define AHCI_GHC   0x04
+#define AHCI_IS    0x08
+#define AHCI_PI    0x0C
+#define AHCI_VS    0x10
+
+#define AHCI_CAP_NCS(c)  ((((c) >> 8) & 0x1F) + 1)
+#define AHCI_CAP_SSS     (1 << 27UL)
+#define AHCI_CAP_SNCQ    (1 << 30UL)
+#define AHCI_CAP_S64A    (1UL << 31UL)
+
+#define AHCI_GHC_IE      (1 << 1UL)
+#define AHCI_GHC_AE      (1UL << 31UL)
+
+/* Port registers, relative to 0x100 + port * 0x80 */
+#define AHCI_PXCLB   0x00
+#define AHCI_PXCLBU  0x04
+#define AHCI_PXFB    0x08
+#define AHCI_PXFBU   0x0C
+#define AHCI_PXIS    0x10
+#define AHCI_PXIE    0x14
+#define AHCI_PXCMD   0x18
+#define AHCI_PXTFD   0x20
+#define AHCI_PXSIG   0x24
+#define AHCI_PXSSTS  0x28
+#define AHCI_PXSERR  0x30
+#define AHCI_PXSACT  0x34
+#define AHCI_PXCI    0x38
+
 #define AHCI_PXCMD_ST    (1 << 0UL)
 #define AHCI_PXCMD_SUD   (1 << 1UL)
 #define AHCI_PXCMD_POD   (1 << 2UL)
@@ -45,7 +103,691 @@ static char * ahci_device_name(uint32_t pcidev, int port) {
 #define AHCI_PXCMD_FR    (1 << 14UL)
 #define AHCI_PXCMD_CR    (1 << 15UL)
 
+#define AHCI_PXIS_DHRS   (1 << 0UL)  /* D2H register FIS */
+#define AHCI_PXIS_PSS    (1 << 1UL)  /* PIO setup FIS */
+#define AHCI_PXIS_DSS    (1 << 2UL)  /* DMA setup FIS */
+#define AHCI_PXIS_SDBS   (1 << 3UL)  /* set device bits FIS, NCQ completions */
+#define AHCI_PXIS_IFS    (1 << 27UL) /* interface fatal */
+#define AHCI_PXIS_HBDS   (1 << 28UL) /* host bus data error */
+#define AHCI_PXIS_HBFS   (1 << 29UL) /* host bus fatal */
+#define AHCI_PXIS_TFES   (1 << 30UL) /* task file error */
+#define AHCI_PXIS_ERROR  (AHCI_PXIS_IFS | AHCI_PXIS_HBDS | AHCI_PXIS_HBFS | AHCI_PXIS_TFES)
+
+#define AHCI_PXTFD_ERR   0x01
+#define AHCI_PXTFD_DRQ   0x08
+#define AHCI_PXTFD_BSY   0x80
+
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_READ_FPDMA        0x60
+#define ATA_CMD_WRITE_FPDMA       0x61
+#define ATA_CMD_CACHE_FLUSH_EXT   0xEA
+#define ATA_CMD_IDENTIFY          0xEC
+
+#define FIS_TYPE_REG_H2D  0x27
+
+#define ATA_SECTOR_SIZE   512
+#define AHCI_SLOTS        32
+#define AHCI_TABLE_SIZE   4096
+#define AHCI_PRDT_MAX     ((AHCI_TABLE_SIZE - 128) / 16)
+#define AHCI_PRD_MAX      0x400000 /* bytes per PRDT entry */
+#define AHCI_BOUNCE_SIZE  0x20000
+#define AHCI_WAIT         1000000
+
+struct ahci_cmd_header {
+	uint16_t flags;   /* FIS length in dwords, then A/W/P/R/B/C bits */
+	uint16_t prdtl;
+	volatile uint32_t prdbc;
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __attribute__((packed));
+
+#define AHCI_HEADER_WRITE  (1 << 6)
+
+struct ahci_prd {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	uint32_t dbc;     /* byte count - 1 */
+} __attribute__((packed));
+
+struct ahci_cmd_table {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct ahci_prd prdt[AHCI_PRDT_MAX];
+} __attribute__((packed));
+
+struct fis_reg_h2d {
+	uint8_t type;
+	uint8_t flags;    /* bit 7: this is a command */
+	uint8_t command;
+	uint8_t feature_low;
+	uint8_t lba0, lba1, lba2;
+	uint8_t device;
+	uint8_t lba3, lba4, lba5;
+	uint8_t feature_high;
+	uint8_t count_low;
+	uint8_t count_high;
+	uint8_t icc;
+	uint8_t control;
+	uint8_t reserved[4];
+} __attribute__((packed));
+
+struct ahci_hba;
+
+struct ahci_port {
+	struct ahci_hba * hba;
+	uintptr_t regs;
+	int index;
+
+	struct ahci_cmd_header * cmd_list;
+	uintptr_t cmd_list_phys;
+	struct ahci_cmd_table * tables[AHCI_SLOTS];
+
+	int ncq;
+	uint32_t all_slots;
+	uint32_t free;       /* slots nobody owns */
+	uint32_t active;     /* issued, still owned by the device */
+	uint32_t completed;  /* finished, waiting for the issuer to collect */
+	uint32_t failed;     /* subset of completed that ended in an error */
+	uint64_t slot_lba[AHCI_SLOTS];   /* for tracing */
+	uint32_t slot_count[AHCI_SLOTS];
+	spin_lock_t lock;
+	list_t * wait;
+
+	uint8_t * bounce;
+	sched_mutex_t * bounce_lock;
+
+	uint16_t identify[256];
+	uint64_t sectors;
+	struct blockcache * cache;
+};
+
+struct ahci_hba {
+	uint32_t pcidev;
+	uintptr_t mmio;
+	uint32_t cap;
+	int irq;
+	struct ahci_port * ports[32];
+};
+
+#define AHCI_MAX_HBAS 8
+static struct ahci_hba * hbas[AHCI_MAX_HBAS];
+static int hba_count = 0;
+static char ahci_drive_char = 'a';
+
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames(size / 0x1000);
+	if (index == (uintptr_t)-1) return NULL;
+	*outphys = index << 12;
+	void * out = mmu_map_from_physical(index << 12);
+	memset(out, 0, size);
+	return out;
+}
+
+static void kvfree_p(uintptr_t phys, size_t size) {
+	for (size_t i = 0; i < size; i += 0x1000) mmu_frame_release(phys + i);
+}
+
+static uint32_t port_read(struct ahci_port * port, intptr_t reg) {
+	return mmio_read4(port->regs, reg);
+}
+
+static void port_write(struct ahci_port * port, intptr_t reg, uint32_t value) {
+	mmio_write4(port->regs, reg, value);
+}
+
+static int ahci_port_stop(struct ahci_port * port) {
+	port_write(port, AHCI_PXCMD, port_read(port, AHCI_PXCMD) & ~AHCI_PXCMD_ST);
+	for (int i = 0; i < AHCI_WAIT; ++i) {
+		if (!(port_read(port, AHCI_PXCMD) & AHCI_PXCMD_CR)) goto _stopped;
+	}
+	return 1;
+_stopped:
+	port_write(port, AHCI_PXCMD, port_read(port, AHCI_PXCMD) & ~AHCI_PXCMD_FRE);
+	for (int i = 0; i < AHCI_WAIT; ++i) {
+		if (!(port_read(port, AHCI_PXCMD) & AHCI_PXCMD_FR)) return 0;
+	}
+	return 1;
+}
+
+static void ahci_port_start(struct ahci_port * port) {
+	port_write(port, AHCI_PXSERR, 0xFFFFFFFF);
+	port_write(port, AHCI_PXIS, 0xFFFFFFFF);
+	port_write(port, AHCI_PXCMD, port_read(port, AHCI_PXCMD) | AHCI_PXCMD_FRE | AHCI_PXCMD_POD | AHCI_PXCMD_SUD);
+	for (int i = 0; i < AHCI_WAIT; ++i) {
+		if (!(port_read(port, AHCI_PXTFD) & (AHCI_PXTFD_BSY | AHCI_PXTFD_DRQ))) break;
+	}
+	port_write(port, AHCI_PXCMD, port_read(port, AHCI_PXCMD) | AHCI_PXCMD_ST);
+}
+
+/**
+ * @brief Can the device reach every byte of @p buffer directly?
+ *
+ * True if @p buffer is kernel memory and each page is mapped (and
+ * writable, if the device is going to write into it) and within the
+ * controller's addressing range. User pages are never used: another
+ * thread could unmap them, or fork could make them copy-on-write,
+ * while the device is still writing into their frames.
+ */
+static int ahci_can_dma(struct ahci_port * port, uint8_t * buffer, size_t size, int device_writes) {
+	if (PTR_INRANGE(buffer)) return 0;
+
+	uintptr_t end = (uintptr_t)buffer + size;
+	for (uintptr_t addr = (uintptr_t)buffer & ~0xFFFUL; addr < end; addr += 0x1000) {
+		union PML * page = mmu_get_page_other(this_core->current_pml, addr);
+		if (page) {
+			/* Ordinary 4KiB mapping; read-only pages must not be DMA'd into. */
+			if (!page->bits.present) return 0;
+			if (device_writes && !page->bits.writable) return 0;
+		}
+		uintptr_t phys = mmu_map_to_physical(this_core->current_pml, addr);
+		if ((intptr_t)phys < 0) return 0;
+		if (!(port->hba->cap & AHCI_CAP_S64A) && phys + 0x1000 > 0x100000000UL) return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Fill in the PRDT for slot @p slot to cover as much of @p buffer as fits.
+ *
+ * Physically contiguous pages are merged into one entry.
+ *
+ * @returns the number of bytes covered, always a multiple of the sector size.
+ */
+static size_t ahci_build_prdt(struct ahci_port * port, int slot, uint8_t * buffer, size_t size) {
+	struct ahci_prd * prdt = port->tables[slot]->prdt;
+	uintptr_t next = 0;
+	size_t total = 0;
+	int n = 0;
+
+	/* dbc holds the full length while we build, and length - 1 at the end. */
+	while (total < size) {
+		uintptr_t addr = (uintptr_t)buffer + total;
+		uintptr_t phys = mmu_map_to_physical(this_core->current_pml, addr);
+		size_t len = 0x1000 - (addr & 0xFFF);
+		if (len > size - total) len = size - total;
+
+		if (n && phys == next && prdt[n-1].dbc + len <= AHCI_PRD_MAX) {
+			prdt[n-1].dbc += len;
+		} else {
+			if (n == AHCI_PRDT_MAX) break;
+			prdt[n].dba  = phys & 0xFFFFFFFF;
+			prdt[n].dbau = (uint64_t)phys >> 32;
+			prdt[n].reserved = 0;
+			prdt[n].dbc  = len;
+			n++;
+		}
+		next = phys + len;
+		total += len;
+	}
+
+	/* Commands are in whole sectors, so trim back to the last sector boundary. */
+	size_t excess = total % ATA_SECTOR_SIZE;
+	total -= excess;
+	while (excess) {
+		if (prdt[n-1].dbc > excess) {
+			prdt[n-1].dbc -= excess;
+			excess = 0;
+		} else {
+			excess -= prdt[n-1].dbc;
+			n--;
+		}
+	}
+
+	for (int i = 0; i < n; ++i) {
+		prdt[i].dbc -= 1;
+	}
+	port->cmd_list[slot].prdtl = n;
+	return total;
+}
+
+/**
+ * @brief Set up the command FIS and header for slot @p slot.
+ */
+static void ahci_setup_command(struct ahci_port * port, int slot, uint8_t command, uint64_t lba, uint32_t count, int write) {
+	struct ahci_cmd_header * header = &port->cmd_list[slot];
+	struct fis_reg_h2d * fis = (struct fis_reg_h2d *)port->tables[slot]->cfis;
+
+	memset(fis, 0, sizeof(struct fis_reg_h2d));
+	fis->type    = FIS_TYPE_REG_H2D;
+	fis->flags   = 0x80;
+	fis->command = command;
+	fis->device  = (command == ATA_CMD_IDENTIFY) ? 0 : 0x40; /* LBA mode */
+	fis->lba0 = lba;
+	fis->lba1 = lba >> 8;
+	fis->lba2 = lba >> 16;
+	fis->lba3 = lba >> 24;
+	fis->lba4 = lba >> 32;
+	fis->lba5 = lba >> 40;
+
+	if (command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA) {
+		/* Queued commands carry the count in the feature field and the tag in the count field. */
+		fis->feature_low  = count;
+		fis->feature_high = count >> 8;
+		fis->count_low    = slot << 3;
+	} else {
+		fis->count_low  = count;
+		fis->count_high = count >> 8;
+	}
+
+	header->flags = (sizeof(struct fis_reg_h2d) / 4) | (write ? AHCI_HEADER_WRITE : 0);
+	header->prdbc = 0;
+}
+
+static void ahci_issue(struct ahci_port * port, int slot, int queued, uint64_t lba, uint32_t count, int write) {
+	uint32_t bit = 1UL << slot;
+	port->free   &= ~bit;
+	port->active |= bit;
+	port->slot_lba[slot]   = lba;
+	port->slot_count[slot] = count;
+	TRACE(write ? TRACE_BLOCK_WRITE_BEGIN : TRACE_BLOCK_READ_BEGIN, lba, count);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (queued) port_write(port, AHCI_PXSACT, bit);
+	port_write(port, AHCI_PXCI, bit);
+}
+
+/**
+ * @brief Hand slots the issuer is done with back to the free pool.
+ *
+ * @returns -EIO if any of them failed.
+ */
+static int ahci_collect(struct ahci_port * port, uint32_t slots, int write) {
+	int status = 0;
+	for (int slot = 0; slot < AHCI_SLOTS; ++slot) {
+		if (!(slots & (1UL << slot))) continue;
+		if (port->failed & (1UL << slot)) status = -EIO;
+		TRACE(write ? TRACE_BLOCK_WRITE_END : TRACE_BLOCK_READ_END, port->slot_lba[slot], port->slot_count[slot]);
+	}
+	port->completed &= ~slots;
+	port->failed    &= ~slots;
+	port->free      |= slots;
+	return status;
+}
+
+/**
+ * @brief Transfer whole sectors between the disk and a DMA-able buffer.
+ *
+ * Splits the transfer into as many commands as needed, issuing them
+ * as long as there are free slots, and returns once all of them have
+ * completed.
+ */
+static int ahci_rw(struct ahci_port * port, uint64_t lba, uint8_t * buffer, size_t size, int write) {
+	uint32_t issued = 0;
+	int status = 0;
+	uint8_t command = port->ncq ? (write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA)
+	                            : (write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+
+	spin_lock(port->lock);
+	while (size || issued) {
+		if (size && port->free && !status) {
+			int slot = __builtin_ctz(port->free);
+			size_t len = ahci_build_prdt(port, slot, buffer, size);
+			ahci_setup_command(port, slot, command, lba, len / ATA_SECTOR_SIZE, write);
+			ahci_issue(port, slot, port->ncq, lba, len / ATA_SECTOR_SIZE, write);
+			issued |= (1UL << slot);
+			lba    += len / ATA_SECTOR_SIZE;
+			buffer += len;
+			size   -= len;
+			continue;
+		}
+
+		uint32_t finished = port->completed & issued;
+		if (finished) {
+			if (ahci_collect(port, finished, write)) status = -EIO;
+			issued &= ~finished;
+			/* Someone else may have been waiting for a slot. */
+			wakeup_queue(port->wait);
+			continue;
+		}
+
+		if (status && !issued) break;
+
+		sleep_on_unlocking(port->wait, &port->lock);
+		spin_lock(port->lock);
+	}
+	spin_unlock(port->lock);
+
+	return status;
+}
+
+/**
+ * @brief Run a non-queued command with no data on an otherwise idle port.
+ */
+static int ahci_command_idle(struct ahci_port * port, uint8_t command) {
+	spin_lock(port->lock);
+	while (port->free != port->all_slots) {
+		sleep_on_unlocking(port->wait, &port->lock);
+		spin_lock(port->lock);
+	}
+	ahci_setup_command(port, 0, command, 0, 0, 0);
+	port->cmd_list[0].prdtl = 0;
+	ahci_issue(port, 0, 0, 0, 0, 0);
+	while (!(port->completed & 1)) {
+		sleep_on_unlocking(port->wait, &port->lock);
+		spin_lock(port->lock);
+	}
+	int status = ahci_collect(port, 1, 0);
+	wakeup_queue(port->wait);
+	spin_unlock(port->lock);
+	return status;
+}
+
+/**
+ * @brief Read or write arbitrary byte ranges of the disk.
+ *
+ * Sector-aligned requests into buffers we can DMA to go straight to
+ * the device. Anything else is staged through the bounce buffer,
+ * reading in the partial sectors at either end first when writing.
+ */
+static ssize_t ahci_io(struct ahci_port * port, off_t offset, size_t size, uint8_t * buffer, int write) {
+	off_t max = port->sectors * ATA_SECTOR_SIZE;
+	if (offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	if (!size) return 0;
+
+	if (!(offset % ATA_SECTOR_SIZE) && !(size % ATA_SECTOR_SIZE) && !((uintptr_t)buffer & 1) &&
+	    ahci_can_dma(port, buffer, size, !write)) {
+		int status = ahci_rw(port, offset / ATA_SECTOR_SIZE, buffer, size, write);
+		return status ? status : (ssize_t)size;
+	}
+
+	mutex_acquire(port->bounce_lock);
+	size_t done = 0;
+	while (done < size) {
+		off_t pos = offset + done;
+		off_t start = pos - (pos % ATA_SECTOR_SIZE);
+		size_t skip = pos - start;
+		size_t want = size - done;
+		if (want > AHCI_BOUNCE_SIZE - skip) want = AHCI_BOUNCE_SIZE - skip;
+		size_t span = (skip + want + ATA_SECTOR_SIZE - 1) & ~(ATA_SECTOR_SIZE - 1);
+		uint64_t lba = start / ATA_SECTOR_SIZE;
+		int status = 0;
+
+		if (write) {
+			if (skip) status = ahci_rw(port, lba, port->bounce, ATA_SECTOR_SIZE, 0);
+			if (!status && (skip + want) % ATA_SECTOR_SIZE && (span > ATA_SECTOR_SIZE || !skip)) {
+				status = ahci_rw(port, lba + span / ATA_SECTOR_SIZE - 1, port->bounce + span - ATA_SECTOR_SIZE, ATA_SECTOR_SIZE, 0);
+			}
+			if (!status) {
+				memcpy(port->bounce + skip, buffer + done, want);
+				status = ahci_rw(port, lba, port->bounce, span, 1);
+			}
+		} else {
+			status = ahci_rw(port, lba, port->bounce, span, 0);
+			if (!status) memcpy(buffer + done, port->bounce + skip, want);
+		}
+
+		if (status) {
+			mutex_release(port->bounce_lock);
+			return done ? (ssize_t)done : status;
+		}
+		done += want;
+	}
+	mutex_release(port->bounce_lock);
+	return size;
+}
+
+static int ahci_cache_read(void * device, uint64_t block, size_t count, uint8_t * buffer) {
+	ssize_t status = ahci_io(device, block * BLOCKCACHE_BLOCK, count * BLOCKCACHE_BLOCK, buffer, 0);
+	return status < 0 ? status : 0;
+}
+
+static int ahci_cache_write(void * device, uint64_t block, size_t count, uint8_t * buffer) {
+	ssize_t status = ahci_io(device, block * BLOCKCACHE_BLOCK, count * BLOCKCACHE_BLOCK, buffer, 1);
+	return status < 0 ? status : 0;
+}
+
+static ssize_t read_ahci(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct ahci_port * port = node->device;
+	off_t max = port->sectors * ATA_SECTOR_SIZE;
+	if (offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	return blockcache_read(port->cache, offset, size, buffer);
+}
+
+static ssize_t write_ahci(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct ahci_port * port = node->device;
+	off_t max = port->sectors * ATA_SECTOR_SIZE;
+	if (offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	return blockcache_write(port->cache, offset, size, buffer);
+}
+
+static void open_ahci(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_ahci(fs_node_t * node) {
+	return;
+}
+
+static int ioctl_ahci(fs_node_t * node, unsigned long request, void * argp) {
+	switch (request) {
+		case IOCTLSYNC: {
+			struct ahci_port * port = node->device;
+			int status = blockcache_sync(port->cache);
+			if (status) return status;
+			/* The disk may have its own write cache, too. */
+			return ahci_command_idle(port, ATA_CMD_CACHE_FLUSH_EXT);
+		}
+		default:
+			return blockcache_ioctl(((struct ahci_port *)node->device)->cache, request, argp);
+	}
+}
+
+static fs_node_t * ahci_device_create(struct ahci_port * port) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	snprintf(fnode->name, 10, "sd%c", ahci_drive_char);
+	fnode->device  = port;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = port->sectors * ATA_SECTOR_SIZE;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_ahci;
+	fnode->write   = write_ahci;
+	fnode->open    = open_ahci;
+	fnode->close   = close_ahci;
+	fnode->readdir = NULL;
+	fnode->finddir = NULL;
+	fnode->ioctl   = ioctl_ahci;
+	return fnode;
+}
+
+/**
+ * @brief Mark finished commands complete and wake their issuers.
+ *
+ * On an error every outstanding command is failed and the port is
+ * restarted; the issuers get -EIO.
+ */
+static void ahci_port_interrupt(struct ahci_port * port) {
+	spin_lock(port->lock);
+	uint32_t is = port_read(port, AHCI_PXIS);
+	port_write(port, AHCI_PXIS, is);
+
+	if (is & AHCI_PXIS_ERROR) {
+		port->failed    |= port->active;
+		port->completed |= port->active;
+		port->active = 0;
+		ahci_port_stop(port);
+		ahci_port_start(port);
+	} else {
+		uint32_t outstanding = port_read(port, AHCI_PXCI) | port_read(port, AHCI_PXSACT);
+		uint32_t done = port->active & ~outstanding;
+		port->completed |= done;
+		port->active &= ~done;
+	}
+
+	wakeup_queue(port->wait);
+	spin_unlock(port->lock);
+}
+
+static int ahci_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	for (int i = 0; i < hba_count; ++i) {
+		struct ahci_hba * hba = hbas[i];
+		if (hba->irq != irq) continue;
+		uint32_t is = mmio_read4(hba->mmio, AHCI_IS);
+		if (!is) continue;
+		for (int p = 0; p < 32; ++p) {
+			if ((is & (1UL << p)) && hba->ports[p]) ahci_port_interrupt(hba->ports[p]);
+		}
+		mmio_write4(hba->mmio, AHCI_IS, is);
+		handled = 1;
+	}
+
+	if (handled) irq_ack(irq);
+	return handled;
+}
+
+/**
+ * @brief Run IDENTIFY DEVICE by polling; interrupts are not enabled yet.
+ */
+static int ahci_identify(struct ahci_port * port) {
+	uintptr_t phys;
+	uint16_t * buf = kvmalloc_p(0x1000, &phys);
+	if (!buf) return 1;
+
+	ahci_setup_command(port, 0, ATA_CMD_IDENTIFY, 0, 0, 0);
+	port->tables[0]->prdt[0].dba  = phys & 0xFFFFFFFF;
+	port->tables[0]->prdt[0].dbau = (uint64_t)phys >> 32;
+	port->tables[0]->prdt[0].dbc  = ATA_SECTOR_SIZE - 1;
+	port->cmd_list[0].prdtl = 1;
+
+	port_write(port, AHCI_PXCI, 1);
+	int i;
+	for (i = 0; i < AHCI_WAIT; ++i) {
+		if (!(port_read(port, AHCI_PXCI) & 1)) break;
+	}
+	port_write(port, AHCI_PXIS, 0xFFFFFFFF);
+
+	int status = 0;
+	if (i == AHCI_WAIT || (port_read(port, AHCI_PXTFD) & AHCI_PXTFD_ERR)) {
+		status = 1;
+	} else {
+		memcpy(port->identify, buf, 512);
+	}
+
+	mmu_frame_release(phys);
+	return status;
+}
+
+/**
+ * @brief Release a port that failed to come up; it must already be stopped.
+ */
+static void ahci_port_free(struct ahci_port * p) {
+	for (int i = 0; i < AHCI_SLOTS; ++i) {
+		if (p->tables[i]) kvfree_p((uint64_t)p->cmd_list[i].ctbau << 32 | p->cmd_list[i].ctba, AHCI_TABLE_SIZE);
+	}
+	if (p->cmd_list) kvfree_p(p->cmd_list_phys, 0x1000);
+	if (p->wait) {
+		list_free(p->wait);
+		free(p->wait);
+	}
+	free(p);
+}
+
 #define DPRINT(fmt,...) fprintf(stderr, "%s: " fmt, ahci_device_name(pcidev,port), ##__VA_ARGS__)
+static void ahci_setup_disk(fs_node_t * stderr, struct ahci_hba * hba, int port) {
+	uint32_t pcidev = hba->pcidev;
+	struct ahci_port * p = calloc(1, sizeof(struct ahci_port));
+	p->hba   = hba;
+	p->regs  = hba->mmio + 0x100 + port * 0x80;
+	p->index = port;
+
+	if (ahci_port_stop(p)) {
+		DPRINT("port did not stop\n");
+		free(p);
+		return;
+	}
+
+	/* Command list and received FIS area share a page. */
+	p->cmd_list = kvmalloc_p(0x1000, &p->cmd_list_phys);
+	if (!p->cmd_list) goto _no_memory;
+	port_write(p, AHCI_PXCLB,  p->cmd_list_phys & 0xFFFFFFFF);
+	port_write(p, AHCI_PXCLBU, (uint64_t)p->cmd_list_phys >> 32);
+	port_write(p, AHCI_PXFB,   (p->cmd_list_phys + 0x400) & 0xFFFFFFFF);
+	port_write(p, AHCI_PXFBU,  (uint64_t)(p->cmd_list_phys + 0x400) >> 32);
+
+	int slots = AHCI_CAP_NCS(hba->cap);
+	for (int i = 0; i < slots; ++i) {
+		uintptr_t phys;
+		p->tables[i] = kvmalloc_p(AHCI_TABLE_SIZE, &phys);
+		if (!p->tables[i]) goto _no_memory;
+		p->cmd_list[i].ctba  = phys & 0xFFFFFFFF;
+		p->cmd_list[i].ctbau = (uint64_t)phys >> 32;
+	}
+	p->all_slots = slots == 32 ? 0xFFFFFFFF : ((1UL << slots) - 1);
+	p->free = p->all_slots;
+
+	ahci_port_start(p);
+
+	if (ahci_identify(p)) {
+		DPRINT("IDENTIFY failed\n");
+		ahci_port_stop(p);
+		ahci_port_free(p);
+		return;
+	}
+
+	p->sectors = (uint64_t)p->identify[100] | (uint64_t)p->identify[101] << 16 |
+	             (uint64_t)p->identify[102] << 32 | (uint64_t)p->identify[103] << 48;
+	if (!p->sectors) p->sectors = (uint32_t)p->identify[60] | (uint32_t)p->identify[61] << 16;
+
+	int depth = (p->identify[75] & 0x1F) + 1;
+	if ((hba->cap & AHCI_CAP_SNCQ) && (p->identify[76] & (1 << 8))) {
+		p->ncq = 1;
+		/* Tags must stay below the queue depth the disk reports. */
+		if (depth < slots) {
+			p->all_slots = depth == 32 ? 0xFFFFFFFF : ((1UL << depth) - 1);
+			p->free = p->all_slots;
+		}
+	}
+
+	char model[41];
+	for (int i = 0; i < 20; ++i) {
+		model[i*2]   = p->identify[27+i] >> 8;
+		model[i*2+1] = p->identify[27+i] & 0xFF;
+	}
+	model[40] = '\0';
+	for (int i = 39; i >= 0 && model[i] == ' '; --i) model[i] = '\0';
+
+	DPRINT("%s, %lu sectors, %s, %d slots\n", model, (unsigned long)p->sectors,
+		p->ncq ? "NCQ" : "no NCQ", __builtin_popcount(p->all_slots));
+
+	uintptr_t bounce_phys;
+	p->wait = list_create("ahci port waiters", p);
+	p->bounce = kvmalloc_p(AHCI_BOUNCE_SIZE, &bounce_phys);
+	if (!p->bounce) {
+		ahci_port_stop(p);
+		goto _no_memory;
+	}
+	p->bounce_lock = mutex_init("ahci bounce");
+
+	port_write(p, AHCI_PXIE, AHCI_PXIS_DHRS | AHCI_PXIS_PSS | AHCI_PXIS_DSS | AHCI_PXIS_SDBS | AHCI_PXIS_ERROR);
+	hba->ports[port] = p;
+
+	char devname[20];
+	snprintf(devname, 20, "/dev/sd%c", ahci_drive_char);
+	p->cache = blockcache_create(devname, p, ahci_cache_read, ahci_cache_write);
+	fs_node_t * node = ahci_device_create(p);
+	char options[21];
+	snprintf(options, 20, "%c", ahci_drive_char);
+	vfs_mount(devname, node, "ahci-hd", options);
+	ahci_drive_char++;
+	return;
+
+_no_memory:
+	DPRINT("out of memory\n");
+	ahci_port_free(p);
+}
+
 static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio_addr, int port) {
 	intptr_t offset = 0x100 + port * 0x80;
 	DPRINT("setting up ATAPI device\n");
@@ -69,66 +811,65 @@ static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio
 static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
 	if (pci_find_type(device) != 0x0106) return; /* Mass Storage, SATA controller */
 	if (pci_read_field(device, PCI_PROG_IF, 1) != 0x01) return; /* AHCI */
+	if (hba_count == AHCI_MAX_HBAS) return;
 	fs_node_t * stderr = extra;
 
 	fprintf(stderr, "ahci: located device at %#x\n", device);
 
+	/* Enable bus mastering and memory space, allow interrupts */
 	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
 	command_reg |= (1 << 2);
 	command_reg |= (1 << 1);
-	command_reg ^= (1 << 10);
+	command_reg &= ~(1 << 10);
 	pci_write_field(device, PCI_COMMAND, 2, command_reg);
 
-	fprintf(stderr, "ahci: examining PCI config space...\n");
-	fprintf(stderr, "ahci: interrupt line = %d\n", pci_get_interrupt(device));
-	fprintf(stderr, "ahci: BAR5 = %#x\n", pci_read_field(device, PCI_BAR5, 4));
+	uintptr_t mmio_addr = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000); /* 0x100 + 32 ports * 0x80 */
 
-	uintptr_t mmio_addr = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000); /* I have no idea how much space this needs */
-	fprintf(stderr, "ahci: mapping mmio to %#zx\n", mmio_addr);
+	struct ahci_hba * hba = calloc(1, sizeof(struct ahci_hba));
+	hba->pcidev = device;
+	hba->mmio   = mmio_addr;
+	hba->irq    = pci_get_interrupt(device);
 
-	uint32_t enabledPorts = mmio_read4(mmio_addr, 0x0C);
-	fprintf(stderr, "ahci: implemented ports = %#x\n", enabledPorts);
+	/* Telling host controller we are aware of it. */
+	mmio_write4(mmio_addr, AHCI_GHC, mmio_read4(mmio_addr, AHCI_GHC) | AHCI_GHC_AE);
+	hba->cap = mmio_read4(mmio_addr, AHCI_CAP);
 
-	uint32_t ahciVersion = mmio_read4(mmio_addr, 0x10);
-	fprintf(stderr, "ahci: version %d.%d%d\n",
+	uint32_t enabledPorts = mmio_read4(mmio_addr, AHCI_PI);
+	uint32_t ahciVersion = mmio_read4(mmio_addr, AHCI_VS);
+	fprintf(stderr, "ahci: version %d.%d%d, irq %d, %d command slots%s, ports %#x\n",
 		(ahciVersion >> 16) & 0xFFF,
 		(ahciVersion >> 8) & 0xFF,
-		(ahciVersion) & 0xFF);
-
-	fprintf(stderr, "ahci: Telling host controller we are aware of it.\n");
-	mmio_write4(mmio_addr, 0x04, mmio_read4(mmio_addr, 0x04) | (1 << 31UL));
+		(ahciVersion) & 0xFF,
+		hba->irq, AHCI_CAP_NCS(hba->cap),
+		(hba->cap & AHCI_CAP_SNCQ) ? ", NCQ" : "",
+		enabledPorts);
 
-	int offset = 0x100;
 	for (int port = 0; port < 32; ++port) {
-		if (enabledPorts & (1UL << port)) {
-			/* Check status */
-			uint32_t portSig    = mmio_read4(mmio_addr, offset + 0x24);
-			uint32_t portStatus = mmio_read4(mmio_addr, offset + 0x28);
-			fprintf(stderr, "ahci: port %d: status = %#x\n", port, portStatus);
-			fprintf(stderr, "ahci: port %d: sig    = %#x\n", port, portSig);
-
-			switch (portSig) {
-				case 0xeb140101:
-					fprintf(stderr, "ahci:           ATAPI (CD, DVD)\n");
-					ahci_setup_atapi(stderr, device, mmio_addr, port);
-					break;
-				case 0x00000101:
-					fprintf(stderr, "ahci:           hard disk\n");
-					break;
-				case 0xffff0101:
-					fprintf(stderr, "ahci:           no device\n");
-					break;
-				default:
-					fprintf(stderr, "ahci:           unsupported/unknown\n");
-					break;
-			}
+		if (!(enabledPorts & (1UL << port))) continue;
+		intptr_t offset = 0x100 + port * 0x80;
+		uint32_t portSig    = mmio_read4(mmio_addr, offset + AHCI_PXSIG);
+		uint32_t portStatus = mmio_read4(mmio_addr, offset + AHCI_PXSSTS);
 
+		/* Skip ports with nothing attached or no established link. */
+		if ((portStatus & 0xF) != 3) continue;
+
+		switch (portSig) {
+			case 0xeb140101:
+				ahci_setup_atapi(stderr, device, mmio_addr, port);
+				break;
+			case 0x00000101:
+				ahci_setup_disk(stderr, hba, port);
+				break;
+			default:
+				fprintf(stderr, "ahci: port %d: unsupported device, sig = %#x\n", port, portSig);
+				break;
 		}
-		offset += 0x80;
 	}
 
-
-	
+	hbas[hba_count++] = hba;
+	irq_install_handler(hba->irq, ahci_irq_handler, "ahci");
+	mmio_write4(mmio_addr, AHCI_IS, 0xFFFFFFFF);
+	mmio_write4(mmio_addr, AHCI_GHC, mmio_read4(mmio_addr, AHCI_GHC) | AHCI_GHC_IE);
 }
 
 static int init(int argc, char * argv[]) {
@@ -146,4 +887,3 @@ struct Module metadata = {
 	.init = init,
 	.fini = fini,
 };
-
@@ -27,6 +27,8 @@
 #include <kernel/time.h>
 #include <kernel/misc.h>
 #include <kernel/mutex.h>
+#include <kernel/trace.h>
+#include <kernel/blockcache.h>
 
 #include <kernel/arch/x86_64/ports.h>
 #include <kernel/arch/x86_64/irq.h>
@@ -188,6 +190,7 @@ struct ata_device {
 	uint32_t bar4;
 	uint32_t atapi_lba;
 	uint32_t atapi_sector_size;
+	struct blockcache * cache;
 };
 
 static struct ata_device ata_primary_master   = {.io_base = 0x1F0, .control = 0x3F6, .slave = 0};
@@ -202,30 +205,12 @@ static spin_lock_t atapi_cmd_lock = { 0 };
 #define ATA_CACHE_SIZE  4096
 #define SECTORS_PER_CACHE_BLOCK 8
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
 static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
+static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba);
 static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba);
 
-struct CacheEntry {
-	struct ata_device * dev;
-	uint64_t lba;
-	uint64_t last_use;
-	uint64_t flags;
-};
-
-#define CACHE_COUNT 4096
-
-static uint64_t hit_count = 0;
-static uint64_t miss_count = 0;
-static uint64_t eviction_count = 0;
-static uint64_t write_count = 0;
 static sched_mutex_t * ata_mutex = NULL;
 
-static struct CacheEntry * cache_entries = NULL;
-static char * cache_blocks = NULL;
-static uint64_t counter = 1;
-
 static off_t ata_max_offset(struct ata_device * dev) {
 	uint64_t sectors = dev->identity.sectors_48;
 	
@@ -247,53 +232,16 @@ static off_t atapi_max_offset(struct ata_device * dev) {
 
 static ssize_t read_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	struct ata_device * dev = (struct ata_device *)node->device;
-	unsigned int start_block = offset / ATA_CACHE_SIZE;
-	unsigned int end_block = (offset + size - 1) / ATA_CACHE_SIZE;
-	unsigned int x_offset = 0;
-
 
 	if (offset > ata_max_offset(dev)) {
 		return 0;
 	}
 
 	if (offset + (ssize_t)size > ata_max_offset(dev)) {
-		unsigned int i = ata_max_offset(dev) - offset;
-		size = i;
-	}
-
-	if (offset % ATA_CACHE_SIZE || size < ATA_CACHE_SIZE) {
-		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
-		if (prefix_size > size) prefix_size = size;
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
-
-		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), prefix_size);
-
-		free(tmp);
-
-		x_offset += prefix_size;
-		start_block++;
-	}
-
-	if ((offset + size)  % ATA_CACHE_SIZE && start_block <= end_block) {
-		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
-
-		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
-
-		free(tmp);
-
-		end_block--;
-	}
-
-	while (start_block <= end_block) {
-		ata_device_read_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_CACHE_SIZE;
-		start_block++;
+		size = ata_max_offset(dev) - offset;
 	}
 
-	return size;
+	return blockcache_read(dev->cache, offset, size, buffer);
 }
 
 static ssize_t read_atapi(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
@@ -353,55 +301,15 @@ static ssize_t read_atapi(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 static ssize_t write_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	struct ata_device * dev = (struct ata_device *)node->device;
 
-	unsigned int start_block = offset / ATA_CACHE_SIZE;
-	unsigned int end_block = (offset + size - 1) / ATA_CACHE_SIZE;
-
-	unsigned int x_offset = 0;
-
 	if (offset > ata_max_offset(dev)) {
 		return 0;
 	}
 
 	if (offset + (ssize_t)size > ata_max_offset(dev)) {
-		unsigned int i = ata_max_offset(dev) - offset;
-		size = i;
-	}
-
-	if (offset % ATA_CACHE_SIZE) {
-		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
-
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
-
-		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), buffer, prefix_size);
-		ata_device_write_sector(dev, start_block, (uint8_t *)tmp);
-
-		free(tmp);
-		x_offset += prefix_size;
-		start_block++;
-	}
-
-	if ((offset + size)  % ATA_CACHE_SIZE && start_block <= end_block) {
-		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
-
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
-
-		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
-
-		ata_device_write_sector(dev, end_block, (uint8_t *)tmp);
-
-		free(tmp);
-		end_block--;
-	}
-
-	while (start_block <= end_block) {
-		ata_device_write_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_CACHE_SIZE;
-		start_block++;
+		size = ata_max_offset(dev) - offset;
 	}
 
-	return size;
+	return blockcache_write(dev->cache, offset, size, buffer);
 }
 
 static void open_ata(fs_node_t * node, unsigned int flags) {
@@ -416,32 +324,35 @@ static int ioctl_ata(fs_node_t * node, unsigned long request, void * argp) {
 	struct ata_device * dev = (struct ata_device *)node->device;
 
 	switch (request) {
-		case IOCTLSYNC: {
-			mutex_acquire(ata_mutex);
-			for (int i = 0; i < CACHE_COUNT; ++i) {
-				if (cache_entries[i].dev == dev && cache_entries[i].flags & 1) {
-					eviction_count++;
-					memcpy(cache_entries[i].dev->dma_start, cache_blocks + i * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-					ata_device_write_sector_actual(cache_entries[i].dev, cache_entries[i].lba);
-					cache_entries[i].flags = 0;
-				}
-			}
-			mutex_release(ata_mutex);
-			return 0;
-		}
-
-		case 0x2A01234UL: {
-			uint64_t * args = argp;
-			memcpy(&args[0], &hit_count, sizeof(uint64_t));
-			memcpy(&args[1], &miss_count, sizeof(uint64_t));
-			memcpy(&args[2], &eviction_count, sizeof(uint64_t));
-			memcpy(&args[3], &write_count, sizeof(uint64_t));
-			return 0;
-		}
+		case IOCTLSYNC:
+			return blockcache_sync(dev->cache);
 
 		default:
-			return -ENOTTY;
+			return blockcache_ioctl(dev->cache, request, argp);
+	}
+}
+
+/* Block cache callbacks; the controller moves one cache block at a time. */
+static int ata_cache_read(void * device, uint64_t block, size_t count, uint8_t * buffer) {
+	struct ata_device * dev = device;
+	mutex_acquire(ata_mutex);
+	for (size_t i = 0; i < count; ++i) {
+		ata_device_read_sector_actual(dev, (block + i) * SECTORS_PER_CACHE_BLOCK);
+		memcpy(buffer + i * ATA_CACHE_SIZE, dev->dma_start, ATA_CACHE_SIZE);
+	}
+	mutex_release(ata_mutex);
+	return 0;
+}
+
+static int ata_cache_write(void * device, uint64_t block, size_t count, uint8_t * buffer) {
+	struct ata_device * dev = device;
+	mutex_acquire(ata_mutex);
+	for (size_t i = 0; i < count; ++i) {
+		memcpy(dev->dma_start, buffer + i * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
+		ata_device_write_sector_actual(dev, (block + i) * SECTORS_PER_CACHE_BLOCK);
 	}
+	mutex_release(ata_mutex);
+	return 0;
 }
 
 static fs_node_t * atapi_device_create(struct ata_device * device) {
@@ -540,7 +451,7 @@ static int ata_irq_handler(struct regs *r) {
 }
 
 static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
-	uintptr_t index = mmu_allocate_n_frames(size / 0x1000) << 12;
+	uintptr_t index = mmu_allocate_n_frames_or_panic(size / 0x1000) << 12;
 	*outphys = index;
 	return mmu_map_from_physical(index);
 }
@@ -726,6 +637,7 @@ static int ata_device_detect(struct ata_device * dev) {
 
 		char devname[64];
 		snprintf((char *)&devname, 20, "/dev/hd%c", ata_drive_char);
+		dev->cache = blockcache_create(devname, dev, ata_cache_read, ata_cache_write);
 		fs_node_t * node = ata_device_create(dev);
 		char options[21];
 		snprintf(options, 20, "%c", ata_drive_char);
@@ -764,6 +676,8 @@ static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba)
 
 	if (dev->is_atapi) return;
 
+	TRACE(TRACE_BLOCK_READ_BEGIN, lba, SECTORS_PER_CACHE_BLOCK);
+
 	ata_wait(dev, 0);
 
 	/* Stop */
@@ -823,6 +737,8 @@ static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba)
 
 	/* Inform device we are done. */
 	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
+
+	TRACE(TRACE_BLOCK_READ_END, lba, SECTORS_PER_CACHE_BLOCK);
 }
 
 static void ata_device_read_sector_atapi_actual(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
@@ -899,6 +815,8 @@ static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba
 	uint16_t bus = dev->io_base;
 	uint8_t slave = dev->slave;
 
+	TRACE(TRACE_BLOCK_WRITE_BEGIN, lba, SECTORS_PER_CACHE_BLOCK);
+
 	ata_wait(dev, 0);
 	outportb(dev->bar4, 0x00);
 	outportl(dev->bar4 + 0x04, dev->dma_prdt_phys);
@@ -951,85 +869,10 @@ static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba
 	outportb(bus + 0x07, ATA_CMD_CACHE_FLUSH);
 	ata_wait(dev, 0);
 #endif
-}
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
-	/* Is it in the cache? */
-	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
-		}
-	}
-	if (!found) {
-		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
-		}
-		ata_device_read_sector_actual(dev, lba);
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
-		cache_entries[oldest].flags = 0;
-		memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, dev->dma_start, ATA_CACHE_SIZE);
-	}
-	cache_entries[oldest].last_use = counter++;
-	memcpy(buf, cache_blocks + ATA_CACHE_SIZE * oldest, ATA_CACHE_SIZE);
-	mutex_release(ata_mutex);
+	TRACE(TRACE_BLOCK_WRITE_END, lba, SECTORS_PER_CACHE_BLOCK);
 }
 
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
-	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
-		}
-	}
-	if (!found) {
-		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
-		}
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
-	}
-	write_count++;
-	cache_entries[oldest].last_use = counter++;
-	memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, buf, ATA_CACHE_SIZE);
-	cache_entries[oldest].flags = 1;
-	mutex_release(ata_mutex);
-}
 static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
 	mutex_acquire(ata_mutex);
 	ata_device_read_sector_atapi_actual(dev, lba, buf);
@@ -1047,9 +890,6 @@ static int ata_initialize(int argc, char * argv[]) {
 
 	atapi_waiter = list_create("atapi waiter", NULL);
 
-	cache_entries = malloc(sizeof(struct CacheEntry) * CACHE_COUNT);
-	memset(cache_entries, 0, sizeof(struct CacheEntry) * CACHE_COUNT);
-	cache_blocks  = mmu_map_module(CACHE_COUNT * ATA_CACHE_SIZE);
 	ata_mutex = mutex_init("ata lock");
 
 	ata_device_detect(&ata_primary_master);
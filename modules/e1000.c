@@ -243,8 +243,6 @@ static void e1000_queuer(void * data) {
 		}
 		if (processed == 0) {
 			delay_yield(100000);
-		} else {
-			if (this_core->cpu_id == 0) switch_task(1);
 		}
 	}
 }
@@ -467,10 +465,10 @@ static void ints_off(struct e1000_nic * nic) {
 static void e1000_init(struct e1000_nic * nic) {
 	uint32_t e1000_device_pci = nic->pci_device;
 
-	nic->rx_phys = mmu_allocate_n_frames(2) << 12;
+	nic->rx_phys = mmu_allocate_n_frames_or_panic(2) << 12;
 	nic->rx = mmu_map_mmio_region(nic->rx_phys, 8192);
 
-	nic->tx_phys = mmu_allocate_n_frames(2) << 12;
+	nic->tx_phys = mmu_allocate_n_frames_or_panic(2) << 12;
 	nic->tx = mmu_map_mmio_region(nic->tx_phys, 8192);
 
 	memset((void*)nic->rx, 0, sizeof(struct e1000_rx_desc) * E1000_NUM_RX_DESC);
@@ -478,14 +476,14 @@ static void e1000_init(struct e1000_nic * nic) {
 
 	/* Allocate buffers */
 	for (int i = 0; i < E1000_NUM_RX_DESC; ++i) {
-		nic->rx[i].addr = mmu_allocate_a_frame() << 12;
+		nic->rx[i].addr = mmu_allocate_a_frame_or_panic() << 12;
 		nic->rx_virt[i] = mmu_map_mmio_region(nic->rx[i].addr, 4096);
 		mmu_frame_map_address(mmu_get_page((uintptr_t)nic->rx_virt[i],0),MMU_FLAG_KERNEL|MMU_FLAG_WRITABLE,nic->rx[i].addr);
 		nic->rx[i].status = 0;
 	}
 
 	for (int i = 0; i < E1000_NUM_TX_DESC; ++i) {
-		nic->tx[i].addr = mmu_allocate_a_frame() << 12;
+		nic->tx[i].addr = mmu_allocate_a_frame_or_panic() << 12;
 		nic->tx_virt[i] = mmu_map_mmio_region(nic->tx[i].addr, 4096);
 		mmu_frame_allocate(mmu_get_page((uintptr_t)nic->tx_virt[i],0),MMU_FLAG_KERNEL|MMU_FLAG_WRITABLE);
 		memset(nic->tx_virt[i], 0, 4096);
@@ -599,6 +597,9 @@ static void e1000_init(struct e1000_nic * nic) {
 	snprintf(worker_name, 33, "[%s]", nic->eth.if_name);
 	nic->queuer = spawn_worker_thread(e1000_queuer, worker_name, nic);
 
+	/* Keep the queuer off the BSP if there is anywhere else for it to go. */
+	sched_set_affinity(nic->queuer, ~1UL);
+
 	nic->configured = 1;
 
 	/* Twiddle interrupts */
@@ -243,10 +243,11 @@ static int es1371_install(int argc, char * argv[]) {
 	outportl(_device.portbase + ES_PORT_CONTROL, ctrl);
 
 	/* Get 8192 of audio buffer space */
-	uintptr_t addr = mmu_allocate_n_frames(2) << 12;
-	if (!addr) {
-		return -ENODEV;
+	uintptr_t index = mmu_allocate_n_frames(2);
+	if (index == (uintptr_t)-1) {
+		return -ENOMEM;
 	}
+	uintptr_t addr = index << 12;
 	if (addr > 0xFFFFffff) {
 		/* This thing only supports 32-bit physical addresses, so if we got something
 		 * too high (unlikely at early boot) we need to bail. */
@@ -209,6 +209,8 @@ typedef struct {
 
 	int flags;
 
+	uint32_t                  map_generation;      /* Bumped whenever an indirect block changes */
+
 	sched_mutex_t *           mutex;
 } ext2_fs_t;
 
@@ -267,7 +269,9 @@ static int read_block(ext2_fs_t * this, unsigned int block_no, uint8_t * buf) {
 	}
 
 	/* In such cases, we read directly from the block device */
-	read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)buf);
+	if (read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)buf) != this->block_size) {
+		return E_BADBLOCK;
+	}
 
 	/* And return SUCCESS */
 	return E_SUCCESS;
@@ -288,7 +292,9 @@ static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
 	}
 
 	/* This operation requires the filesystem lock */
-	write_fs(this->block_device, block_no * this->block_size, this->block_size, buf);
+	if (write_fs(this->block_device, block_no * this->block_size, this->block_size, buf) != this->block_size) {
+		return E_BADBLOCK;
+	}
 
 	/* We're done. */
 	return E_SUCCESS;
@@ -327,6 +333,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 
 		((uint32_t *)tmp)[iblock - EXT2_DIRECT_BLOCKS] = rblock;
 		write_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
+		__atomic_fetch_add(&this->map_generation, 1, __ATOMIC_RELEASE);
 
 		free(tmp);
 		return E_SUCCESS;
@@ -358,6 +365,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 
 		((uint32_t  *)tmp)[d] = rblock;
 		write_block(this, nblock, (uint8_t *)tmp);
+		__atomic_fetch_add(&this->map_generation, 1, __ATOMIC_RELEASE);
 
 		free(tmp);
 		return E_SUCCESS;
@@ -402,6 +410,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 
 		((uint32_t *)tmp)[g] = nblock;
 		write_block(this, nblock, (uint8_t *)tmp);
+		__atomic_fetch_add(&this->map_generation, 1, __ATOMIC_RELEASE);
 
 		free(tmp);
 		return E_SUCCESS;
@@ -483,6 +492,129 @@ static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 	return 0;
 }
 
+/*
+ * Indirect blocks most recently used to map blocks of an open file.
+ * Walking through a file keeps hitting the same ones, so this saves
+ * reading one or two extra blocks for every block of file data.
+ */
+#define EXT2_CHAIN_IND      0
+#define EXT2_CHAIN_DIND     1
+#define EXT2_CHAIN_DIND_IND 2
+#define EXT2_CHAINS         3
+
+struct ext2_chain {
+	unsigned int block;      /* Which indirect block is in pointers, or 0 */
+	uint32_t * pointers;
+};
+
+struct ext2_file {
+	spin_lock_t lock;
+	uint32_t generation;     /* this->map_generation when the chains were read */
+	struct ext2_chain chain[EXT2_CHAINS];
+};
+
+static struct ext2_file * ext2_file(fs_node_t * node) {
+	struct ext2_file * file = (struct ext2_file *)node->impl;
+	if (file) return file;
+
+	file = calloc(1, sizeof(struct ext2_file));
+	uint64_t expected = 0;
+	if (!__atomic_compare_exchange_n(&node->impl, &expected, (uintptr_t)file, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* Another thread got here first. */
+		free(file);
+		file = (struct ext2_file *)expected;
+	}
+	return file;
+}
+
+static void ext2_file_free(struct ext2_file * file) {
+	for (int i = 0; i < EXT2_CHAINS; ++i) {
+		if (file->chain[i].pointers) free(file->chain[i].pointers);
+	}
+	free(file);
+}
+
+/**
+ * ext2->chain_lookup Read entry `index` of indirect block `block`, through a file's chain cache.
+ */
+static unsigned int ext2_chain_lookup(ext2_fs_t * this, struct ext2_file * file, int level, unsigned int block, unsigned int index) {
+	if (!block) return 0;
+
+	struct ext2_chain * chain = &file->chain[level];
+	uint32_t generation = __atomic_load_n(&this->map_generation, __ATOMIC_ACQUIRE);
+
+	spin_lock(file->lock);
+	if (file->generation != generation) {
+		/* Something was allocated since; forget everything. */
+		for (int i = 0; i < EXT2_CHAINS; ++i) file->chain[i].block = 0;
+		file->generation = generation;
+	}
+	if (chain->block == block) {
+		unsigned int out = chain->pointers[index];
+		spin_unlock(file->lock);
+		return out;
+	}
+	spin_unlock(file->lock);
+
+	uint32_t * pointers = malloc(this->block_size);
+	read_block(this, block, (uint8_t *)pointers);
+	unsigned int out = pointers[index];
+
+	spin_lock(file->lock);
+	if (file->generation == generation && __atomic_load_n(&this->map_generation, __ATOMIC_ACQUIRE) == generation) {
+		uint32_t * old = chain->pointers;
+		chain->pointers = pointers;
+		chain->block = block;
+		pointers = old;
+	}
+	spin_unlock(file->lock);
+
+	if (pointers) free(pointers);
+	return out;
+}
+
+/**
+ * ext2->block_number get_block_number, using an open file's chain cache if we have one.
+ */
+static unsigned int ext2_block_number(ext2_fs_t * this, struct ext2_file * file, ext2_inodetable_t * inode, unsigned int iblock) {
+	unsigned int p = this->pointers_per_block;
+
+	if (iblock < EXT2_DIRECT_BLOCKS) return inode->block[iblock];
+	if (!file) return get_block_number(this, inode, iblock);
+
+	unsigned int i = iblock - EXT2_DIRECT_BLOCKS;
+	if (i < p) {
+		return ext2_chain_lookup(this, file, EXT2_CHAIN_IND, inode->block[EXT2_DIRECT_BLOCKS], i);
+	}
+
+	i -= p;
+	if (i < p * p) {
+		unsigned int mid = ext2_chain_lookup(this, file, EXT2_CHAIN_DIND, inode->block[EXT2_DIRECT_BLOCKS + 1], i / p);
+		return ext2_chain_lookup(this, file, EXT2_CHAIN_DIND_IND, mid, i % p);
+	}
+
+	/* Files big enough to need triply-indirect blocks are rare. */
+	return get_block_number(this, inode, iblock);
+}
+
+/**
+ * ext2->map_run Map a run of file blocks that are contiguous on disk.
+ *
+ * @param iblock First block within the inode
+ * @param max    Longest run the caller wants
+ * @param count  Set to the length of the run, at least 1
+ * @returns Real block number of the first block, or 0 for a hole
+ */
+static unsigned int ext2_map_run(ext2_fs_t * this, struct ext2_file * file, ext2_inodetable_t * inode, unsigned int iblock, unsigned int max, unsigned int * count) {
+	unsigned int first = ext2_block_number(this, file, inode, iblock);
+	unsigned int n = 1;
+	if (first) {
+		while (n < max && ext2_block_number(this, file, inode, iblock + n) == first + n) n++;
+	}
+	*count = n;
+	return first;
+}
+
 static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index) {
 	if (!index) {
 		dprintf("ext2: Attempt to write inode 0\n");
@@ -915,7 +1047,7 @@ static int mkdir_ext2(fs_node_t * parent, const char * name, mode_t permission,
 		fake->name_len = strlen(name);
 
 		memcpy(fake->name, name, fake->name_len);
-		fs_node_t * _out = calloc(1,sizeof(fs_node_t));
+		fs_node_t * _out = vfs_node_alloc();
 		node_from_file(this, inode, fake, _out);
 		*out = _out;
 
@@ -1001,7 +1133,7 @@ static int create_ext2(fs_node_t * parent, const char * name, mode_t permission,
 	fake->name_len = strlen(name);
 	memcpy(fake->name, name, fake->name_len);
 
-	fs_node_t * _out = calloc(1,sizeof(fs_node_t));
+	fs_node_t * _out = vfs_node_alloc();
 	node_from_file(this, inode, fake, _out);
 	*out = _out;
 
@@ -1113,8 +1245,7 @@ static fs_node_t * finddir_ext2(fs_node_t *node, const char *name) {
 		free(block);
 		return NULL;
 	}
-	fs_node_t *outnode = malloc(sizeof(fs_node_t));
-	memset(outnode, 0, sizeof(fs_node_t));
+	fs_node_t *outnode = vfs_node_alloc();
 
 	inode = read_inode(this, direntry->inode);
 
@@ -1236,91 +1367,134 @@ static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode) {
 	return inodet;
 }
 
+/*
+ * File data is mapped in runs of blocks that are contiguous on disk. Whole
+ * blocks go straight between the caller's buffer and the block device, one
+ * request per run; only partial blocks at either end are bounced.
+ */
 static ssize_t read_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
-	uint32_t end;
-	if (inode->size == 0) return 0;
-	if (offset + size > inode->size) {
-		end = inode->size;
-	} else {
-		end = offset + size;
+	if ((size_t)offset >= inode->size) {
+		free(inode);
+		return 0;
 	}
-	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
-	uint32_t size_to_read = end - offset;
+	size_t end = (offset + size > inode->size) ? inode->size : offset + size;
+	size_t size_to_read = end - offset;
+	unsigned int allocated = inode->blocks / (this->block_size / 512);
+	struct ext2_file * file = ext2_file(node);
+	uint8_t * buf = NULL;
+
+	for (size_t pos = offset; pos < end; ) {
+		unsigned int iblock = pos / this->block_size;
+		size_t in = pos % this->block_size;
+		size_t want = end - pos;
+		size_t count = this->block_size - in;
+		if (count > want) count = want;
+
+		unsigned int run = 0, real = 0;
+		if (iblock < allocated) {
+			unsigned int max = (in + want + this->block_size - 1) / this->block_size;
+			if (max > allocated - iblock) max = allocated - iblock;
+			real = ext2_map_run(this, file, inode, iblock, max, &run);
+		}
 
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), size_to_read);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), this->block_size - (offset % this->block_size));
-			} else {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, this->block_size);
+		if (!real) {
+			/* Past the allocated blocks, or a hole. */
+			memset(buffer + (pos - offset), 0, count);
+		} else if (!in && want >= this->block_size) {
+			size_t whole = want / this->block_size;
+			if (whole > run) whole = run;
+			count = whole * this->block_size;
+			ssize_t r = read_fs(this->block_device, (uint64_t)real * this->block_size, count, buffer + (pos - offset));
+			if (r < 0) {
+				free(inode);
+				if (buf) free(buf);
+				return pos > (size_t)offset ? (ssize_t)(pos - offset) : r;
 			}
+		} else {
+			if (!buf) buf = malloc(this->block_size);
+			read_block(this, real, buf);
+			memcpy(buffer + (pos - offset), buf + in, count);
 		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, end_size);
-		}
+
+		pos += count;
 	}
+
 	free(inode);
-	free(buf);
+	if (buf) free(buf);
 	return size_to_read;
 }
 
-static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_number, off_t offset, size_t size, uint8_t *buffer) {
+static ssize_t write_inode_buffer(ext2_fs_t * this, struct ext2_file * file, ext2_inodetable_t * inode, uint32_t inode_number, off_t offset, size_t size, uint8_t *buffer) {
+	if (!size) return 0;
 	uint32_t end = offset + size;
-	if (end > inode->size) {
-		inode->size = end;
-		write_inode(this, inode, inode_number);
-	}
 
-	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
-	uint32_t size_to_read = end - offset;
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, size_to_read);
-		inode_write_block(this, inode, inode_number, start_block, buf);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				int b = inode_read_block(this, inode, block_offset, buf);
-				memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, this->block_size - (offset % this->block_size));
-				inode_write_block(this, inode, inode_number, block_offset, buf);
-				if (!b) {
-					refresh_inode(this, inode, inode_number);
-				}
-			} else {
-				int b = inode_read_block(this, inode, block_offset, buf);
-				memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), this->block_size);
-				inode_write_block(this, inode, inode_number, block_offset, buf);
-				if (!b) {
-					refresh_inode(this, inode, inode_number);
-				}
-			}
+	/* Allocate everything first, so the whole write can be mapped in runs.
+	 * If the disk fills up, write as much as did fit. */
+	unsigned int per_block = this->block_size / 512;
+	unsigned int last_block = (end - 1) / this->block_size;
+	while (last_block >= inode->blocks / per_block) {
+		if (allocate_inode_block(this, inode, inode_number, inode->blocks / per_block) != E_SUCCESS) {
+			uint32_t allocated = (inode->blocks / per_block) * this->block_size;
+			if (allocated <= (uint32_t)offset) return -ENOSPC;
+			end = allocated;
+			break;
+		}
+		refresh_inode(this, inode, inode_number);
+	}
+
+	uint8_t * buf = NULL;
+	ssize_t error = -EIO;
+	size_t pos;
+	for (pos = offset; pos < end; ) {
+		unsigned int iblock = pos / this->block_size;
+		size_t in = pos % this->block_size;
+		size_t want = end - pos;
+		size_t count = this->block_size - in;
+		if (count > want) count = want;
+
+		unsigned int run;
+		unsigned int real = ext2_map_run(this, file, inode, iblock, (in + want + this->block_size - 1) / this->block_size, &run);
+
+		if (real && !in && want >= this->block_size) {
+			size_t whole = want / this->block_size;
+			if (whole > run) whole = run;
+			ssize_t written = write_fs(this->block_device, (uint64_t)real * this->block_size, whole * this->block_size, buffer + (pos - offset));
+			if (written > 0) pos += written - written % this->block_size;
+			if (written != (ssize_t)(whole * this->block_size)) break;
+			continue;
 		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), end_size);
-			inode_write_block(this, inode, inode_number, end_block, buf);
+
+		if (!buf) buf = malloc(this->block_size);
+		if (real) {
+			if (read_block(this, real, buf) != E_SUCCESS) break;
+		} else {
+			/* A hole in a sparse file; give it a block of its own. */
+			if (allocate_inode_block(this, inode, inode_number, iblock) != E_SUCCESS) {
+				error = -ENOSPC;
+				break;
+			}
+			refresh_inode(this, inode, inode_number);
+			real = get_block_number(this, inode, iblock);
+			memset(buf, 0, this->block_size);
 		}
+		memcpy(buf + in, buffer + (pos - offset), count);
+		if (write_block(this, real, buf) != E_SUCCESS) break;
+
+		pos += count;
 	}
-	free(buf);
-	return size_to_read;
+
+	if (buf) free(buf);
+
+	/* Only now is there anything out there worth extending the file over. */
+	size_t written = pos - offset;
+	if (!written) return error;
+	if (pos > inode->size) {
+		inode->size = pos;
+		write_inode(this, inode, inode_number);
+	}
+	return written;
 }
 
 static ssize_t write_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
@@ -1329,7 +1503,7 @@ static ssize_t write_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
 
-	ssize_t rv = write_inode_buffer(this, inode, node->inode, offset, size, buffer);
+	ssize_t rv = write_inode_buffer(this, ext2_file(node), inode, node->inode, offset, size, buffer);
 	free(inode);
 	return rv;
 }
@@ -1350,7 +1524,7 @@ static void open_ext2(fs_node_t *node, unsigned int flags) {
 }
 
 static void close_ext2(fs_node_t *node) {
-	/* Nothing to do here */
+	if (node->impl) ext2_file_free((struct ext2_file *)node->impl);
 }
 
 
@@ -1442,7 +1616,7 @@ static int symlink_ext2(fs_node_t * parent, const char * target, const char * na
 
 	/* If we didn't embed it in the inode just use write_inode_buffer to finish the job */
 	if (!embedded) {
-		write_inode_buffer(parent->device, inode, inode_no, 0, target_len, (uint8_t *)target);
+		write_inode_buffer(parent->device, NULL, inode, inode_no, 0, target_len, (uint8_t *)target);
 	}
 	free(inode);
 
@@ -1494,7 +1668,7 @@ static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t
 	/* File Flags */
 	fnode->flags = 0;
 	if ((inode->mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
-		fnode->flags   |= FS_FILE;
+		fnode->flags   |= FS_FILE | FS_CACHED;
 		fnode->read     = read_ext2;
 		fnode->write    = write_ext2;
 		fnode->truncate = truncate_ext2;
@@ -304,7 +304,7 @@ static ssize_t write_rectpipe(fs_node_t *node, off_t offset, size_t size, uint8_
 }
 
 static void * kvmalloc_p(size_t size, uint32_t * outphys) {
-	uintptr_t index = mmu_allocate_n_frames(size / 0x1000) << 12;
+	uintptr_t index = mmu_allocate_n_frames_or_panic(size / 0x1000) << 12;
 	*outphys = index;
 	return mmu_map_from_physical(index);
 }
@@ -0,0 +1,1021 @@
+/**
+ * @brief virtio block device driver
+ * @file modules/virtio-blk.c
+ * @package x86_64
+ * @package aarch64
+ *
+ * Supports both the legacy (0.9.5, I/O port) and modern (1.0, PCI
+ * capability) interfaces on x86-64; aarch64 has no port I/O, so only
+ * modern devices are usable there.
+ *
+ * When the device offers VIRTIO_BLK_F_MQ we set up one virtqueue per
+ * CPU (up to the number the device allows) and each request goes to
+ * the queue of the core that issued it. Every in-flight request owns
+ * a page holding its header, status byte and, with indirect
+ * descriptors, its descriptor table, so a request of any size only
+ * takes one slot in the ring. Large transfers are split into several
+ * requests that are all published before the device is notified once.
+ * Reads and writes go through the shared block cache.
+ *
+ * Disks show up as /dev/vda, /dev/vdb, ...
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/syscall.h>
+#include <kernel/module.h>
+#include <kernel/printf.h>
+#include <kernel/string.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/mutex.h>
+#include <kernel/list.h>
+#include <kernel/pci.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/trace.h>
+#include <kernel/blockcache.h>
+
+#if defined(__x86_64__)
+#include <kernel/arch/x86_64/ports.h>
+#include <kernel/arch/x86_64/irq.h>
+#elif defined(__aarch64__)
+#include <kernel/arch/aarch64/gic.h>
+#endif
+
+#include <sys/ioctl.h>
+
+/* Feature bits */
+#define VIRTIO_BLK_F_SIZE_MAX    (1ULL << 1)
+#define VIRTIO_BLK_F_SEG_MAX     (1ULL << 2)
+#define VIRTIO_BLK_F_RO          (1ULL << 5)
+#define VIRTIO_BLK_F_FLUSH       (1ULL << 9)
+#define VIRTIO_BLK_F_MQ          (1ULL << 12)
+#define VIRTIO_F_INDIRECT_DESC   (1ULL << 28)
+#define VIRTIO_F_VERSION_1       (1ULL << 32)
+
+#define VIRTIO_BLK_WANTED (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | \
+                           VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_MQ | VIRTIO_F_INDIRECT_DESC | VIRTIO_F_VERSION_1)
+
+/* Device status */
+#define VIRTIO_STATUS_ACKNOWLEDGE  1
+#define VIRTIO_STATUS_DRIVER       2
+#define VIRTIO_STATUS_DRIVER_OK    4
+#define VIRTIO_STATUS_FEATURES_OK  8
+#define VIRTIO_STATUS_FAILED       128
+
+/* Legacy I/O register layout, without MSI-X */
+#define VIRTIO_LEGACY_FEATURES     0x00
+#define VIRTIO_LEGACY_GUEST        0x04
+#define VIRTIO_LEGACY_QUEUE_PFN    0x08
+#define VIRTIO_LEGACY_QUEUE_SIZE   0x0C
+#define VIRTIO_LEGACY_QUEUE_SELECT 0x0E
+#define VIRTIO_LEGACY_QUEUE_NOTIFY 0x10
+#define VIRTIO_LEGACY_STATUS       0x12
+#define VIRTIO_LEGACY_ISR          0x13
+#define VIRTIO_LEGACY_CONFIG       0x14
+
+/* Modern capability types */
+#define VIRTIO_PCI_CAP_COMMON_CFG  1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG  2
+#define VIRTIO_PCI_CAP_ISR_CFG     3
+#define VIRTIO_PCI_CAP_DEVICE_CFG  4
+
+/* Offsets into struct virtio_blk_config */
+#define VIRTIO_BLK_CFG_CAPACITY    0
+#define VIRTIO_BLK_CFG_SIZE_MAX    8
+#define VIRTIO_BLK_CFG_SEG_MAX     12
+#define VIRTIO_BLK_CFG_NUM_QUEUES  34
+
+#define VIRTIO_BLK_T_IN     0
+#define VIRTIO_BLK_T_OUT    1
+#define VIRTIO_BLK_T_FLUSH  4
+
+#define VIRTQ_DESC_F_NEXT      1
+#define VIRTQ_DESC_F_WRITE     2
+#define VIRTQ_DESC_F_INDIRECT  4
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+#define VIRTIO_SECTOR_SIZE   512
+#define VIRTIO_QUEUE_MAX     256
+#define VIRTIO_BLK_SLOTS     32
+#define VIRTIO_BLK_SEGMENTS  250
+#define VIRTIO_BLK_QUEUES    32
+#define VIRTIO_BOUNCE_SIZE   0x20000
+
+struct virtio_pci_common_cfg {
+	volatile uint32_t device_feature_select;
+	volatile uint32_t device_feature;
+	volatile uint32_t driver_feature_select;
+	volatile uint32_t driver_feature;
+	volatile uint16_t msix_config;
+	volatile uint16_t num_queues;
+	volatile uint8_t  device_status;
+	volatile uint8_t  config_generation;
+
+	volatile uint16_t queue_select;
+	volatile uint16_t queue_size;
+	volatile uint16_t queue_msix_vector;
+	volatile uint16_t queue_enable;
+	volatile uint16_t queue_notify_off;
+	volatile uint64_t queue_desc;
+	volatile uint64_t queue_driver;
+	volatile uint64_t queue_device;
+} __attribute__((packed));
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct virtq_avail {
+	uint16_t flags;
+	volatile uint16_t idx;
+	uint16_t ring[];
+};
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+struct virtq_used {
+	volatile uint16_t flags;
+	volatile uint16_t idx;
+	struct virtq_used_elem ring[];
+};
+
+struct virtio_blk_req {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+/**
+ * One page per in-flight request. The header and status byte are
+ * what the device reads and writes around the data; the table is the
+ * indirect descriptor list, or a staging area we copy into the ring.
+ */
+struct virtio_blk_slot {
+	struct virtio_blk_req header;
+	volatile uint8_t status;
+	uint8_t pad[47];
+	struct virtq_desc table[VIRTIO_BLK_SEGMENTS + 2];
+};
+
+struct virtio_blk;
+
+struct virtio_blk_queue {
+	struct virtio_blk * dev;
+	int index;
+	uint16_t size;
+
+	struct virtq_desc * desc;
+	struct virtq_avail * avail;
+	struct virtq_used * used;
+
+	uint16_t free_head;     /* chained through desc[].next */
+	uint16_t free_count;
+	uint16_t last_used;
+	uint16_t pending;       /* added to the avail ring, not yet published */
+	uint8_t head_slot[VIRTIO_QUEUE_MAX];
+
+	struct virtio_blk_slot * slots[VIRTIO_BLK_SLOTS];
+	uintptr_t slot_phys[VIRTIO_BLK_SLOTS];
+	uint32_t slot_sectors[VIRTIO_BLK_SLOTS]; /* for tracing */
+	uint32_t free_slots;
+	uint32_t completed;
+	uint32_t failed;
+
+	uintptr_t notify;       /* modern notify address */
+	uintptr_t ring_phys;
+	size_t ring_size;
+
+	spin_lock_t lock;
+	list_t * wait;
+};
+
+struct virtio_blk {
+	uint32_t pcidev;
+	int legacy;
+	uint16_t io_base;
+	struct virtio_pci_common_cfg * common;
+	volatile uint8_t * isr;
+	uintptr_t notify_base;
+	uint32_t notify_mult;
+	uintptr_t config;
+	int irq;
+
+	uint64_t features;
+	uint64_t capacity;
+	uint32_t seg_max;
+	uint32_t size_max;
+
+	int queue_count;
+	struct virtio_blk_queue * queues[VIRTIO_BLK_QUEUES];
+
+	uint8_t * bounce;
+	sched_mutex_t * bounce_lock;
+
+	struct blockcache * cache;
+};
+
+#define VIRTIO_BLK_MAX_DEVICES 8
+static struct virtio_blk * devices[VIRTIO_BLK_MAX_DEVICES];
+static int device_count = 0;
+static char virtio_drive_char = 'a';
+
+#if defined(__x86_64__)
+#define page_is_writable(p) ((p)->bits.writable)
+#elif defined(__aarch64__)
+#define page_is_writable(p) (!((p)->bits.ap & 2))
+static uintptr_t next_bar = 0x12300000;
+#endif
+
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames((size + 0xFFF) / 0x1000);
+	if (index == (uintptr_t)-1) return NULL;
+	*outphys = index << 12;
+	void * out = mmu_map_from_physical(index << 12);
+	memset(out, 0, size);
+	return out;
+}
+
+static void kvfree_p(uintptr_t phys, size_t size) {
+	for (size_t i = 0; i < size; i += 0x1000) mmu_frame_release(phys + i);
+}
+
+static uint8_t virtio_get_status(struct virtio_blk * dev) {
+#if defined(__x86_64__)
+	if (dev->legacy) return inportb(dev->io_base + VIRTIO_LEGACY_STATUS);
+#endif
+	return dev->common->device_status;
+}
+
+static void virtio_set_status(struct virtio_blk * dev, uint8_t status) {
+#if defined(__x86_64__)
+	if (dev->legacy) {
+		outportb(dev->io_base + VIRTIO_LEGACY_STATUS, status);
+		return;
+	}
+#endif
+	dev->common->device_status = status;
+	__sync_synchronize();
+}
+
+static uint32_t virtio_config_read(struct virtio_blk * dev, int offset, int size) {
+#if defined(__x86_64__)
+	if (dev->legacy) {
+		uint16_t port = dev->io_base + VIRTIO_LEGACY_CONFIG + offset;
+		return size == 4 ? inportl(port) : size == 2 ? inports(port) : inportb(port);
+	}
+#endif
+	uintptr_t addr = dev->config + offset;
+	return size == 4 ? *(volatile uint32_t *)addr : size == 2 ? *(volatile uint16_t *)addr : *(volatile uint8_t *)addr;
+}
+
+static uint8_t virtio_read_isr(struct virtio_blk * dev) {
+#if defined(__x86_64__)
+	if (dev->legacy) return inportb(dev->io_base + VIRTIO_LEGACY_ISR);
+#endif
+	return *dev->isr;
+}
+
+static void virtio_notify(struct virtio_blk_queue * q) {
+#if defined(__x86_64__)
+	if (q->dev->legacy) {
+		outports(q->dev->io_base + VIRTIO_LEGACY_QUEUE_NOTIFY, q->index);
+		return;
+	}
+#endif
+	*(volatile uint16_t *)q->notify = q->index;
+}
+
+/**
+ * @brief Same test as the AHCI driver: can the device reach all of
+ *        @p buffer without a bounce buffer?
+ *
+ * Only kernel memory qualifies. User pages can be unmapped or made
+ * copy-on-write by another thread while a request is in flight, and
+ * looking them up without the image lock races with both.
+ */
+static int virtio_can_dma(uint8_t * buffer, size_t size, int device_writes) {
+	if (PTR_INRANGE(buffer)) return 0;
+
+	uintptr_t end = (uintptr_t)buffer + size;
+	for (uintptr_t addr = (uintptr_t)buffer & ~0xFFFUL; addr < end; addr += 0x1000) {
+		union PML * page = mmu_get_page_other(this_core->current_pml, addr);
+		if (page) {
+			if (!page->bits.present) return 0;
+			if (device_writes && !page_is_writable(page)) return 0;
+		}
+		if ((intptr_t)mmu_map_to_physical(this_core->current_pml, addr) < 0) return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Build the descriptor list for one request in its slot.
+ *
+ * @returns the number of data bytes covered (a multiple of the sector
+ *          size), and the number of descriptors used in @p count.
+ */
+static size_t virtio_blk_build(struct virtio_blk_queue * q, int slot, int type, uint64_t sector,
+		uint8_t * buffer, size_t size, int max_segments, int * count) {
+	struct virtio_blk_slot * s = q->slots[slot];
+	struct virtq_desc * table = s->table;
+	uintptr_t phys_base = q->slot_phys[slot];
+	uint32_t size_max = q->dev->size_max;
+
+	s->header.type = type;
+	s->header.reserved = 0;
+	s->header.sector = sector;
+	s->status = 0xFF;
+
+	table[0].addr  = phys_base + offsetof(struct virtio_blk_slot, header);
+	table[0].len   = sizeof(struct virtio_blk_req);
+	table[0].flags = VIRTQ_DESC_F_NEXT;
+
+	int n = 1;
+	size_t total = 0;
+	uintptr_t next = 0;
+	uint16_t data_flags = VIRTQ_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0);
+
+	while (total < size) {
+		uintptr_t addr = (uintptr_t)buffer + total;
+		uintptr_t phys = mmu_map_to_physical(this_core->current_pml, addr);
+		size_t len = 0x1000 - (addr & 0xFFF);
+		if (len > size - total) len = size - total;
+
+		if (n > 1 && phys == next && table[n-1].len + len <= size_max) {
+			table[n-1].len += len;
+		} else {
+			if (n - 1 == max_segments) break;
+			table[n].addr  = phys;
+			table[n].len   = len;
+			table[n].flags = data_flags;
+			n++;
+		}
+		next = phys + len;
+		total += len;
+	}
+
+	size_t excess = total % VIRTIO_SECTOR_SIZE;
+	total -= excess;
+	while (excess) {
+		if (table[n-1].len > excess) {
+			table[n-1].len -= excess;
+			excess = 0;
+		} else {
+			excess -= table[n-1].len;
+			n--;
+		}
+	}
+
+	table[n].addr  = phys_base + offsetof(struct virtio_blk_slot, status);
+	table[n].len   = 1;
+	table[n].flags = VIRTQ_DESC_F_WRITE;
+	n++;
+
+	for (int i = 0; i < n - 1; ++i) {
+		table[i].next = i + 1;
+	}
+	table[n-1].next = 0;
+
+	*count = n;
+	return total;
+}
+
+/**
+ * @brief Put a built request on the avail ring without publishing it.
+ */
+static void virtio_blk_queue_request(struct virtio_blk_queue * q, int slot, int count) {
+	struct virtio_blk_slot * s = q->slots[slot];
+	uint16_t head;
+
+	if (q->dev->features & VIRTIO_F_INDIRECT_DESC) {
+		head = q->free_head;
+		q->free_head = q->desc[head].next;
+		q->free_count--;
+		q->desc[head].addr  = q->slot_phys[slot] + offsetof(struct virtio_blk_slot, table);
+		q->desc[head].len   = count * sizeof(struct virtq_desc);
+		q->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+	} else {
+		head = q->free_head;
+		uint16_t d = head;
+		for (int i = 0; i < count; ++i) {
+			uint16_t following = q->desc[d].next;
+			q->desc[d].addr  = s->table[i].addr;
+			q->desc[d].len   = s->table[i].len;
+			q->desc[d].flags = s->table[i].flags;
+			if (i != count - 1) {
+				q->desc[d].next = following;
+				d = following;
+			} else {
+				q->free_head = following;
+			}
+		}
+		q->free_count -= count;
+	}
+
+	q->head_slot[head] = slot;
+	q->free_slots &= ~(1UL << slot);
+	q->avail->ring[(uint16_t)(q->avail->idx + q->pending) % q->size] = head;
+	q->pending++;
+}
+
+/**
+ * @brief Make everything queued visible to the device and kick it once.
+ */
+static void virtio_blk_publish(struct virtio_blk_queue * q) {
+	if (!q->pending) return;
+	__sync_synchronize();
+	q->avail->idx += q->pending;
+	q->pending = 0;
+	__sync_synchronize();
+	if (!(q->used->flags & VIRTQ_USED_F_NO_NOTIFY)) virtio_notify(q);
+}
+
+/**
+ * @brief Return descriptors from completed requests to the free list.
+ */
+static void virtio_blk_reap(struct virtio_blk_queue * q) {
+	while (q->last_used != q->used->idx) {
+		__sync_synchronize();
+		struct virtq_used_elem * elem = &q->used->ring[q->last_used % q->size];
+		uint16_t head = elem->id;
+		int slot = q->head_slot[head];
+
+		/* Walk to the end of the chain and splice it onto the free list. */
+		uint16_t tail = head;
+		int count = 1;
+		while (q->desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+			tail = q->desc[tail].next;
+			count++;
+		}
+		q->desc[tail].next = q->free_head;
+		q->free_head = head;
+		q->free_count += count;
+
+		q->completed |= (1UL << slot);
+		if (q->slots[slot]->status != 0) q->failed |= (1UL << slot);
+		q->last_used++;
+	}
+}
+
+static int virtio_blk_collect(struct virtio_blk_queue * q, uint32_t slots, int type) {
+	int status = 0;
+	for (int slot = 0; slot < VIRTIO_BLK_SLOTS; ++slot) {
+		if (!(slots & (1UL << slot))) continue;
+		if (q->failed & (1UL << slot)) status = -EIO;
+		if (type != VIRTIO_BLK_T_FLUSH) {
+			TRACE(type == VIRTIO_BLK_T_OUT ? TRACE_BLOCK_WRITE_END : TRACE_BLOCK_READ_END,
+				q->slots[slot]->header.sector, q->slot_sectors[slot]);
+		}
+	}
+	q->completed  &= ~slots;
+	q->failed     &= ~slots;
+	q->free_slots |= slots;
+	return status;
+}
+
+/**
+ * @brief Transfer whole sectors between the disk and a DMA-able buffer.
+ *
+ * As many requests as there are free slots and descriptors are added
+ * to this core's queue, then published together. A flush is a single
+ * request with no data.
+ */
+static int virtio_blk_rw(struct virtio_blk * dev, uint64_t sector, uint8_t * buffer, size_t size, int type) {
+	struct virtio_blk_queue * q = dev->queues[this_core->cpu_id % dev->queue_count];
+	int indirect = !!(dev->features & VIRTIO_F_INDIRECT_DESC);
+	int need = size || type == VIRTIO_BLK_T_FLUSH;
+	uint32_t issued = 0;
+	int status = 0;
+
+	spin_lock(q->lock);
+	while (need || issued) {
+		int max_segments = dev->seg_max;
+		if (!indirect && q->free_count - 2 < max_segments) max_segments = q->free_count - 2;
+
+		if (need && !status && q->free_slots && max_segments > 0) {
+			int slot = __builtin_ctz(q->free_slots);
+			int count;
+			size_t len = virtio_blk_build(q, slot, type, sector, buffer, size, max_segments, &count);
+			q->slot_sectors[slot] = len / VIRTIO_SECTOR_SIZE;
+			if (type != VIRTIO_BLK_T_FLUSH) {
+				TRACE(type == VIRTIO_BLK_T_OUT ? TRACE_BLOCK_WRITE_BEGIN : TRACE_BLOCK_READ_BEGIN, sector, len / VIRTIO_SECTOR_SIZE);
+			}
+			virtio_blk_queue_request(q, slot, count);
+			issued |= (1UL << slot);
+			sector += len / VIRTIO_SECTOR_SIZE;
+			buffer += len;
+			size   -= len;
+			need    = size > 0;
+			/* Keep filling the ring while we can; the device is told once. */
+			if (need && q->free_slots) continue;
+		}
+
+		virtio_blk_publish(q);
+
+		uint32_t finished = q->completed & issued;
+		if (finished) {
+			if (virtio_blk_collect(q, finished, type)) status = -EIO;
+			issued &= ~finished;
+			/* Someone else may have been waiting for a slot. */
+			wakeup_queue(q->wait);
+			continue;
+		}
+
+		if (status && !issued) break;
+
+		sleep_on_unlocking(q->wait, &q->lock);
+		spin_lock(q->lock);
+	}
+	spin_unlock(q->lock);
+
+	return status;
+}
+
+static ssize_t virtio_blk_io(struct virtio_blk * dev, off_t offset, size_t size, uint8_t * buffer, int write) {
+	off_t max = dev->capacity * VIRTIO_SECTOR_SIZE;
+	if (offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	if (!size) return 0;
+	if (write && (dev->features & VIRTIO_BLK_F_RO)) return -EROFS;
+
+	int type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+
+	if (!(offset % VIRTIO_SECTOR_SIZE) && !(size % VIRTIO_SECTOR_SIZE) && virtio_can_dma(buffer, size, !write)) {
+		int status = virtio_blk_rw(dev, offset / VIRTIO_SECTOR_SIZE, buffer, size, type);
+		return status ? status : (ssize_t)size;
+	}
+
+	mutex_acquire(dev->bounce_lock);
+	size_t done = 0;
+	while (done < size) {
+		off_t pos = offset + done;
+		off_t start = pos - (pos % VIRTIO_SECTOR_SIZE);
+		size_t skip = pos - start;
+		size_t want = size - done;
+		if (want > VIRTIO_BOUNCE_SIZE - skip) want = VIRTIO_BOUNCE_SIZE - skip;
+		size_t span = (skip + want + VIRTIO_SECTOR_SIZE - 1) & ~(VIRTIO_SECTOR_SIZE - 1);
+		uint64_t sector = start / VIRTIO_SECTOR_SIZE;
+		int status = 0;
+
+		if (write) {
+			if (skip) status = virtio_blk_rw(dev, sector, dev->bounce, VIRTIO_SECTOR_SIZE, VIRTIO_BLK_T_IN);
+			if (!status && (skip + want) % VIRTIO_SECTOR_SIZE && (span > VIRTIO_SECTOR_SIZE || !skip)) {
+				status = virtio_blk_rw(dev, sector + span / VIRTIO_SECTOR_SIZE - 1,
+					dev->bounce + span - VIRTIO_SECTOR_SIZE, VIRTIO_SECTOR_SIZE, VIRTIO_BLK_T_IN);
+			}
+			if (!status) {
+				memcpy(dev->bounce + skip, buffer + done, want);
+				status = virtio_blk_rw(dev, sector, dev->bounce, span, VIRTIO_BLK_T_OUT);
+			}
+		} else {
+			status = virtio_blk_rw(dev, sector, dev->bounce, span, VIRTIO_BLK_T_IN);
+			if (!status) memcpy(buffer + done, dev->bounce + skip, want);
+		}
+
+		if (status) {
+			mutex_release(dev->bounce_lock);
+			return done ? (ssize_t)done : status;
+		}
+		done += want;
+	}
+	mutex_release(dev->bounce_lock);
+	return size;
+}
+
+static int virtio_blk_cache_read(void * device, uint64_t block, size_t count, uint8_t * buffer) {
+	ssize_t status = virtio_blk_io(device, block * BLOCKCACHE_BLOCK, count * BLOCKCACHE_BLOCK, buffer, 0);
+	return status < 0 ? status : 0;
+}
+
+static int virtio_blk_cache_write(void * device, uint64_t block, size_t count, uint8_t * buffer) {
+	ssize_t status = virtio_blk_io(device, block * BLOCKCACHE_BLOCK, count * BLOCKCACHE_BLOCK, buffer, 1);
+	return status < 0 ? status : 0;
+}
+
+static ssize_t read_virtio_blk(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct virtio_blk * dev = node->device;
+	off_t max = dev->capacity * VIRTIO_SECTOR_SIZE;
+	if (offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	return blockcache_read(dev->cache, offset, size, buffer);
+}
+
+static ssize_t write_virtio_blk(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct virtio_blk * dev = node->device;
+	off_t max = dev->capacity * VIRTIO_SECTOR_SIZE;
+	if (dev->features & VIRTIO_BLK_F_RO) return -EROFS;
+	if (offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	return blockcache_write(dev->cache, offset, size, buffer);
+}
+
+static void open_virtio_blk(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_virtio_blk(fs_node_t * node) {
+	return;
+}
+
+static int ioctl_virtio_blk(fs_node_t * node, unsigned long request, void * argp) {
+	struct virtio_blk * dev = node->device;
+	switch (request) {
+		case IOCTLSYNC: {
+			int status = blockcache_sync(dev->cache);
+			if (status || !(dev->features & VIRTIO_BLK_F_FLUSH)) return status;
+			return virtio_blk_rw(dev, 0, NULL, 0, VIRTIO_BLK_T_FLUSH);
+		}
+		default:
+			return blockcache_ioctl(dev->cache, request, argp);
+	}
+}
+
+static fs_node_t * virtio_blk_device_create(struct virtio_blk * dev) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	snprintf(fnode->name, 10, "vd%c", virtio_drive_char);
+	fnode->device  = dev;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = (dev->features & VIRTIO_BLK_F_RO) ? 0440 : 0660;
+	fnode->length  = dev->capacity * VIRTIO_SECTOR_SIZE;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_virtio_blk;
+	fnode->write   = write_virtio_blk;
+	fnode->open    = open_virtio_blk;
+	fnode->close   = close_virtio_blk;
+	fnode->readdir = NULL;
+	fnode->finddir = NULL;
+	fnode->ioctl   = ioctl_virtio_blk;
+	return fnode;
+}
+
+static int virtio_blk_interrupt(struct virtio_blk * dev) {
+	/* Reading the ISR acknowledges the interrupt. */
+	uint8_t isr = virtio_read_isr(dev);
+	if (!(isr & 1)) return 0;
+
+	for (int i = 0; i < dev->queue_count; ++i) {
+		struct virtio_blk_queue * q = dev->queues[i];
+		spin_lock(q->lock);
+		if (q->last_used != q->used->idx) {
+			virtio_blk_reap(q);
+			wakeup_queue(q->wait);
+		}
+		spin_unlock(q->lock);
+	}
+	return 1;
+}
+
+#if defined(__x86_64__)
+static int virtio_blk_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+	for (int i = 0; i < device_count; ++i) {
+		if (devices[i]->irq == irq && virtio_blk_interrupt(devices[i])) handled = 1;
+	}
+	if (handled) irq_ack(irq);
+	return handled;
+}
+#elif defined(__aarch64__)
+static int virtio_blk_irq_handler(process_t * this, int irq, void * data) {
+	return virtio_blk_interrupt(data);
+}
+#endif
+
+/**
+ * @brief Size and lay out a split virtqueue the way legacy devices expect.
+ *
+ * Descriptors, then the avail ring, then the used ring on the next page.
+ */
+static void virtio_blk_queue_free(struct virtio_blk_queue * q) {
+	for (int i = 0; i < VIRTIO_BLK_SLOTS; ++i) {
+		if (q->slots[i]) kvfree_p(q->slot_phys[i], sizeof(struct virtio_blk_slot));
+	}
+	kvfree_p(q->ring_phys, q->ring_size);
+	if (q->wait) {
+		list_free(q->wait);
+		free(q->wait);
+	}
+	free(q);
+}
+
+static struct virtio_blk_queue * virtio_blk_queue_create(struct virtio_blk * dev, int index, uint16_t size, uintptr_t * phys) {
+	size_t avail_end = size * sizeof(struct virtq_desc) + sizeof(struct virtq_avail) + (size + 1) * sizeof(uint16_t);
+	size_t used_off  = (avail_end + 0xFFF) & ~0xFFFUL;
+	size_t total     = used_off + ((sizeof(struct virtq_used) + size * sizeof(struct virtq_used_elem) + sizeof(uint16_t) + 0xFFF) & ~0xFFFUL);
+
+	struct virtio_blk_queue * q = calloc(1, sizeof(struct virtio_blk_queue));
+	q->dev   = dev;
+	q->index = index;
+	q->size  = size;
+
+	char * ring = kvmalloc_p(total, phys);
+	if (!ring) {
+		free(q);
+		return NULL;
+	}
+	q->ring_phys = *phys;
+	q->ring_size = total;
+	q->desc  = (struct virtq_desc *)ring;
+	q->avail = (struct virtq_avail *)(ring + size * sizeof(struct virtq_desc));
+	q->used  = (struct virtq_used *)(ring + used_off);
+
+	for (int i = 0; i < size; ++i) {
+		q->desc[i].next = (i + 1) % size;
+	}
+	q->free_head  = 0;
+	q->free_count = size;
+
+	int slots = size < VIRTIO_BLK_SLOTS ? size : VIRTIO_BLK_SLOTS;
+	for (int i = 0; i < slots; ++i) {
+		q->slots[i] = kvmalloc_p(sizeof(struct virtio_blk_slot), &q->slot_phys[i]);
+		if (!q->slots[i]) {
+			virtio_blk_queue_free(q);
+			return NULL;
+		}
+	}
+	q->free_slots = slots == 32 ? 0xFFFFFFFF : ((1UL << slots) - 1);
+	q->wait = list_create("virtio-blk queue waiters", q);
+	return q;
+}
+
+/**
+ * @brief Map a memory BAR holding virtio configuration structures.
+ *
+ * QEMU puts all four structures in one 16KiB BAR.
+ */
+static uintptr_t virtio_map_bar(uint32_t device, int bar) {
+	uint32_t low = pci_read_field(device, PCI_BAR0 + bar * 4, 4);
+	uintptr_t base = low & ~0xF;
+	if ((low & 0x6) == 0x4) {
+		base |= (uint64_t)pci_read_field(device, PCI_BAR0 + bar * 4 + 4, 4) << 32;
+	}
+#if defined(__aarch64__)
+	/* Nothing assigns BARs for us here. */
+	if (!base) {
+		base = next_bar;
+		next_bar += 0x100000;
+		pci_write_field(device, PCI_BAR0 + bar * 4, 4, base | (low & 0xF));
+		if ((low & 0x6) == 0x4) pci_write_field(device, PCI_BAR0 + bar * 4 + 4, 4, 0);
+	}
+#endif
+	return (uintptr_t)mmu_map_mmio_region(base, 0x4000);
+}
+
+/**
+ * @brief Find the modern configuration structures in the capability list.
+ *
+ * @returns 0 if all of them were found.
+ */
+static int virtio_find_caps(struct virtio_blk * dev) {
+	uint32_t device = dev->pcidev;
+	uintptr_t bars[6] = {0};
+	int found = 0;
+
+	if (!(pci_read_field(device, PCI_STATUS, 2) & 0x10)) return 1;
+
+	uint8_t cap = pci_read_field(device, 0x34, 1) & ~3;
+	while (cap) {
+		uint8_t id   = pci_read_field(device, cap, 1);
+		uint8_t next = pci_read_field(device, cap + 1, 1) & ~3;
+		if (id == 0x09) {
+			uint8_t type   = pci_read_field(device, cap + 3, 1);
+			uint8_t bar    = pci_read_field(device, cap + 4, 1);
+			uint32_t offset = pci_read_field(device, cap + 8, 4);
+			if (bar < 6 && type >= VIRTIO_PCI_CAP_COMMON_CFG && type <= VIRTIO_PCI_CAP_DEVICE_CFG) {
+				if (!bars[bar]) bars[bar] = virtio_map_bar(device, bar);
+				uintptr_t addr = bars[bar] + offset;
+				switch (type) {
+					case VIRTIO_PCI_CAP_COMMON_CFG:
+						dev->common = (struct virtio_pci_common_cfg *)addr;
+						break;
+					case VIRTIO_PCI_CAP_NOTIFY_CFG:
+						dev->notify_base = addr;
+						dev->notify_mult = pci_read_field(device, cap + 16, 4);
+						break;
+					case VIRTIO_PCI_CAP_ISR_CFG:
+						dev->isr = (volatile uint8_t *)addr;
+						break;
+					case VIRTIO_PCI_CAP_DEVICE_CFG:
+						dev->config = addr;
+						break;
+				}
+				found |= (1 << type);
+			}
+		}
+		cap = next;
+	}
+
+	return found == 0x1E ? 0 : 1;
+}
+
+/**
+ * @brief Reset the device and agree on features.
+ *
+ * @returns 0 on success.
+ */
+static int virtio_negotiate(struct virtio_blk * dev) {
+	virtio_set_status(dev, 0);
+	virtio_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE);
+	virtio_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+#if defined(__x86_64__)
+	if (dev->legacy) {
+		uint64_t offered = inportl(dev->io_base + VIRTIO_LEGACY_FEATURES);
+		dev->features = offered & VIRTIO_BLK_WANTED & 0xFFFFFFFF;
+		outportl(dev->io_base + VIRTIO_LEGACY_GUEST, dev->features);
+		return 0;
+	}
+#endif
+
+	dev->common->device_feature_select = 0;
+	__sync_synchronize();
+	uint64_t offered = dev->common->device_feature;
+	dev->common->device_feature_select = 1;
+	__sync_synchronize();
+	offered |= (uint64_t)dev->common->device_feature << 32;
+
+	if (!(offered & VIRTIO_F_VERSION_1)) return 1;
+	dev->features = offered & VIRTIO_BLK_WANTED;
+
+	dev->common->driver_feature_select = 0;
+	dev->common->driver_feature = dev->features & 0xFFFFFFFF;
+	dev->common->driver_feature_select = 1;
+	dev->common->driver_feature = dev->features >> 32;
+	virtio_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
+
+	return !(virtio_get_status(dev) & VIRTIO_STATUS_FEATURES_OK);
+}
+
+static int virtio_setup_queue(struct virtio_blk * dev, int index) {
+	uintptr_t phys;
+	struct virtio_blk_queue * q;
+
+#if defined(__x86_64__)
+	if (dev->legacy) {
+		outports(dev->io_base + VIRTIO_LEGACY_QUEUE_SELECT, index);
+		uint16_t size = inports(dev->io_base + VIRTIO_LEGACY_QUEUE_SIZE);
+		/* Legacy devices choose the size and we have to use all of it. */
+		if (!size || size > VIRTIO_QUEUE_MAX) return 1;
+		q = virtio_blk_queue_create(dev, index, size, &phys);
+		if (!q) return 1;
+		outportl(dev->io_base + VIRTIO_LEGACY_QUEUE_PFN, phys >> 12);
+		dev->queues[index] = q;
+		return 0;
+	}
+#endif
+
+	dev->common->queue_select = index;
+	__sync_synchronize();
+	uint16_t size = dev->common->queue_size;
+	if (!size) return 1;
+	if (size > VIRTIO_QUEUE_MAX) size = VIRTIO_QUEUE_MAX;
+	dev->common->queue_size = size;
+
+	q = virtio_blk_queue_create(dev, index, size, &phys);
+	if (!q) return 1;
+	q->notify = dev->notify_base + dev->common->queue_notify_off * dev->notify_mult;
+	dev->common->queue_desc   = phys;
+	dev->common->queue_driver = phys + ((uintptr_t)q->avail - (uintptr_t)q->desc);
+	dev->common->queue_device = phys + ((uintptr_t)q->used - (uintptr_t)q->desc);
+	__sync_synchronize();
+	dev->common->queue_enable = 1;
+	dev->queues[index] = q;
+	return 0;
+}
+
+static void find_virtio_blk(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (vendorid != 0x1af4 || (deviceid != 0x1001 && deviceid != 0x1042)) return;
+	if (device_count == VIRTIO_BLK_MAX_DEVICES) return;
+	fs_node_t * stderr = extra;
+
+	struct virtio_blk * dev = calloc(1, sizeof(struct virtio_blk));
+	dev->pcidev = device;
+
+	/* Enable I/O, memory space and bus mastering, allow interrupts */
+	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 1) | (1 << 0);
+	command_reg &= ~(1 << 10);
+	pci_write_field(device, PCI_COMMAND, 2, command_reg);
+
+	if (virtio_find_caps(dev)) {
+#if defined(__x86_64__)
+		uint32_t bar0 = pci_read_field(device, PCI_BAR0, 4);
+		if (deviceid != 0x1001 || !(bar0 & 1)) {
+			fprintf(stderr, "virtio-blk: %#x: no usable interface\n", device);
+			free(dev);
+			return;
+		}
+		dev->legacy = 1;
+		dev->io_base = bar0 & ~0x3;
+#else
+		fprintf(stderr, "virtio-blk: %#x: legacy devices are not supported on this platform\n", device);
+		free(dev);
+		return;
+#endif
+	}
+
+	if (virtio_negotiate(dev)) {
+		fprintf(stderr, "virtio-blk: %#x: feature negotiation failed\n", device);
+		virtio_set_status(dev, VIRTIO_STATUS_FAILED);
+		free(dev);
+		return;
+	}
+
+	dev->capacity = virtio_config_read(dev, VIRTIO_BLK_CFG_CAPACITY, 4) |
+	                (uint64_t)virtio_config_read(dev, VIRTIO_BLK_CFG_CAPACITY + 4, 4) << 32;
+	dev->size_max = (dev->features & VIRTIO_BLK_F_SIZE_MAX) ? virtio_config_read(dev, VIRTIO_BLK_CFG_SIZE_MAX, 4) : 0;
+	if (!dev->size_max || dev->size_max > 0x400000) dev->size_max = 0x400000;
+	if (dev->size_max < 0x1000) dev->size_max = 0x1000;
+	dev->seg_max = (dev->features & VIRTIO_BLK_F_SEG_MAX) ? virtio_config_read(dev, VIRTIO_BLK_CFG_SEG_MAX, 4) : 0;
+	if (!dev->seg_max || dev->seg_max > VIRTIO_BLK_SEGMENTS) dev->seg_max = VIRTIO_BLK_SEGMENTS;
+
+	int queues = 1;
+	if (dev->features & VIRTIO_BLK_F_MQ) {
+		queues = virtio_config_read(dev, VIRTIO_BLK_CFG_NUM_QUEUES, 2);
+		if (queues > processor_count) queues = processor_count;
+		if (queues > VIRTIO_BLK_QUEUES) queues = VIRTIO_BLK_QUEUES;
+		if (queues < 1) queues = 1;
+	}
+
+	for (int i = 0; i < queues; ++i) {
+		if (virtio_setup_queue(dev, i)) break;
+		dev->queue_count++;
+	}
+
+	if (!dev->queue_count) {
+		fprintf(stderr, "virtio-blk: %#x: could not set up a virtqueue\n", device);
+		virtio_set_status(dev, VIRTIO_STATUS_FAILED);
+		free(dev);
+		return;
+	}
+
+	uintptr_t bounce_phys;
+	dev->bounce = kvmalloc_p(VIRTIO_BOUNCE_SIZE, &bounce_phys);
+	if (!dev->bounce) {
+		fprintf(stderr, "virtio-blk: %#x: out of memory\n", device);
+		/* Reset the device so it lets go of the queues before we free them. */
+		virtio_set_status(dev, 0);
+		for (int i = 0; i < dev->queue_count; ++i) virtio_blk_queue_free(dev->queues[i]);
+		free(dev);
+		return;
+	}
+	dev->bounce_lock = mutex_init("virtio-blk bounce");
+
+	devices[device_count++] = dev;
+
+#if defined(__x86_64__)
+	dev->irq = pci_get_interrupt(device);
+	irq_install_handler(dev->irq, virtio_blk_irq_handler, "virtio-blk");
+#elif defined(__aarch64__)
+	gic_map_pci_interrupt("virtio-blk", device, &dev->irq, virtio_blk_irq_handler, dev);
+#endif
+
+	virtio_set_status(dev, virtio_get_status(dev) | VIRTIO_STATUS_DRIVER_OK);
+
+	fprintf(stderr, "virtio-blk: %#x: %s, %lu sectors, %d queue%s%s%s\n", device,
+		dev->legacy ? "legacy" : "modern",
+		(unsigned long)dev->capacity,
+		dev->queue_count, dev->queue_count == 1 ? "" : "s",
+		(dev->features & VIRTIO_F_INDIRECT_DESC) ? ", indirect descriptors" : "",
+		(dev->features & VIRTIO_BLK_F_RO) ? ", read-only" : "");
+
+	char devname[20];
+	snprintf(devname, 20, "/dev/vd%c", virtio_drive_char);
+	dev->cache = blockcache_create(devname, dev, virtio_blk_cache_read, virtio_blk_cache_write);
+	fs_node_t * node = virtio_blk_device_create(dev);
+	char options[21];
+	snprintf(options, 20, "%c", virtio_drive_char);
+	vfs_mount(devname, node, "virtio-blk", options);
+	virtio_drive_char++;
+}
+
+static int init(int argc, char * argv[]) {
+	fs_node_t * node = FD_ENTRY(1); /* Get the stdout for the process that loaded the module */
+	pci_scan(find_virtio_blk, -1, node);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+struct Module metadata = {
+	.name = "virtio-blk",
+	.init = init,
+	.fini = fini,
+};
@@ -98,7 +98,7 @@ static uintptr_t pci_to_cpu(struct XHCIControllerData * controller, uint64_t add
 }
 
 static uintptr_t allocate_page(uint64_t * phys_out) {
-	uint64_t phys = mmu_allocate_a_frame() << 12;
+	uint64_t phys = mmu_allocate_a_frame_or_panic() << 12;
 	uintptr_t virt = (uintptr_t)mmu_map_mmio_region(phys, 4096);
 	memset((void*)virt,0,4096);
 	*phys_out = phys;
@@ -420,7 +420,7 @@ static void find_xhci(uint32_t device, uint16_t v, uint16_t d, void * extra) {
 		fprintf(stderr, "xhci: Device is unmapped. TODO: Check if this is behind a PCI bridge...\n");
 		return;
 		#if 0
-		mmio_addr = mmu_allocate_n_frames(2) << 12;
+		mmio_addr = mmu_allocate_n_frames_or_panic(2) << 12;
 		pci_write_field(device, PCI_BAR0, 4, (mmio_addr & 0xFFFFFFF0) | (1 << 2));
 		pci_write_field(device, PCI_BAR1, 4, (mmio_addr >> 32));
 		#endif
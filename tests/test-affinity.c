@@ -0,0 +1,94 @@
+/**
+ * @brief Check sched_setaffinity() and sched_getaffinity().
+ *
+ * Pins itself to the last core and checks that is where it runs,
+ * that a forked child keeps the same mask, and that masks without
+ * any real cores are rejected.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static int last_core(void) {
+	FILE * f = fopen("/proc/self/status", "r");
+	if (!f) return -1;
+	char line[256];
+	int core = -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "LastCore:", 9)) core = atoi(line + 9);
+	}
+	fclose(f);
+	return core;
+}
+
+int main(int argc, char * argv[]) {
+	int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_getaffinity");
+		return 1;
+	}
+	if (CPU_COUNT(&set) != cores) {
+		fprintf(stderr, "expected all %d cores to be allowed, got %d\n", cores, CPU_COUNT(&set));
+		return 1;
+	}
+
+	CPU_ZERO(&set);
+	if (sched_setaffinity(0, sizeof(set), &set) != -1 || errno != EINVAL) {
+		fprintf(stderr, "an empty mask should fail with EINVAL\n");
+		return 1;
+	}
+	CPU_SET(CPU_SETSIZE - 1, &set);
+	if (cores < CPU_SETSIZE && sched_setaffinity(0, sizeof(set), &set) != -1) {
+		fprintf(stderr, "a mask with only a missing core should fail\n");
+		return 1;
+	}
+
+	int target = cores - 1;
+	CPU_ZERO(&set);
+	CPU_SET(target, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_setaffinity");
+		return 1;
+	}
+
+	for (int i = 0; i < 10; ++i) {
+		sched_yield();
+		int core = last_core();
+		if (core != target) {
+			fprintf(stderr, "pinned to core %d, but ran on %d\n", target, core);
+			return 1;
+		}
+	}
+
+	pid_t pid = fork();
+	if (!pid) {
+		cpu_set_t child;
+		sched_getaffinity(0, sizeof(child), &child);
+		return !(CPU_COUNT(&child) == 1 && CPU_ISSET(target, &child));
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (WEXITSTATUS(status)) {
+		fprintf(stderr, "child did not inherit the mask\n");
+		return 1;
+	}
+
+	for (int i = 0; i < cores; ++i) CPU_SET(i, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_setaffinity (unpin)");
+		return 1;
+	}
+
+	return 0;
+}
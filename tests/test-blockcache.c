@@ -0,0 +1,72 @@
+/**
+ * @brief Check that repeated reads of a disk are served from the block cache.
+ *
+ * Reads the first block of the first cached disk we can find twice
+ * and compares the contents and the device's cache hit counter.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+static const char * disks[] = {
+	"/dev/hda", "/dev/hdb", "/dev/sda", "/dev/sdb", "/dev/vda", "/dev/vdb", NULL,
+};
+
+int main(int argc, char * argv[]) {
+	FILE * f = fopen("/proc/blockcache", "r");
+	if (!f) {
+		fprintf(stderr, "could not open /proc/blockcache\n");
+		return 1;
+	}
+	fclose(f);
+
+	int fd = -1;
+	const char * name = NULL;
+	for (const char ** disk = disks; *disk; ++disk) {
+		fd = open(*disk, O_RDONLY);
+		if (fd >= 0) {
+			name = *disk;
+			break;
+		}
+	}
+
+	if (fd < 0) {
+		fprintf(stderr, "no disks to test with\n");
+		return 0;
+	}
+
+	char first[512], second[512];
+	uint64_t before[4], after[4];
+
+	if (pread(fd, first, sizeof(first), 0) != sizeof(first) || ioctl(fd, IOCTLBLOCKSTATS, before) < 0) {
+		fprintf(stderr, "%s: could not read\n", name);
+		return 1;
+	}
+
+	if (pread(fd, second, sizeof(second), 0) != sizeof(second) || ioctl(fd, IOCTLBLOCKSTATS, after) < 0) {
+		fprintf(stderr, "%s: could not read again\n", name);
+		return 1;
+	}
+
+	if (memcmp(first, second, sizeof(first))) {
+		fprintf(stderr, "%s: contents changed between reads\n", name);
+		return 1;
+	}
+
+	if (after[0] <= before[0]) {
+		fprintf(stderr, "%s: second read was not a cache hit (%llu hits before, %llu after)\n", name,
+			(unsigned long long)before[0], (unsigned long long)after[0]);
+		return 1;
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,76 @@
+/**
+ * @brief Compare gettimeofday() through the clock page and the kernel.
+ *
+ * Checks that the time libc works out from the clock page agrees with
+ * what the system call says, that the page can't be made writable,
+ * and then times a pile of calls down each path.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <libc/syscall.h>
+
+#define CALLS 100000
+
+DEFN_SYSCALL2(gettimeofday, SYS_GETTIMEOFDAY, void *, void *);
+
+static uint64_t usec(struct timeval * t) {
+	return (uint64_t)t->tv_sec * 1000000 + t->tv_usec;
+}
+
+static uint64_t kernel_time(void) {
+	struct timeval t;
+	syscall_gettimeofday(&t, NULL);
+	return usec(&t);
+}
+
+static uint64_t libc_time(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return usec(&t);
+}
+
+static uint64_t bench(uint64_t (*func)(void)) {
+	uint64_t start = kernel_time();
+	for (int i = 0; i < CALLS; ++i) func();
+	return kernel_time() - start;
+}
+
+int main(int argc, char * argv[]) {
+	void * page = (void*)getauxval(AT_CLOCKPAGE);
+	if (!page) {
+		fprintf(stderr, "no clock page\n");
+		return 1;
+	}
+
+	for (int i = 0; i < 1000; ++i) {
+		uint64_t before = kernel_time();
+		uint64_t during = libc_time();
+		uint64_t after  = kernel_time();
+		if (during < before || during > after) {
+			fprintf(stderr, "clock page said %llu, kernel said %llu and %llu\n",
+				(unsigned long long)during, (unsigned long long)before, (unsigned long long)after);
+			return 1;
+		}
+	}
+
+	if (mprotect(page, 4096, PROT_READ | PROT_WRITE) == 0) {
+		fprintf(stderr, "clock page was made writable\n");
+		return 1;
+	}
+
+	uint64_t kernel = bench(kernel_time);
+	uint64_t libc = bench(libc_time);
+	fprintf(stderr, "%d calls: %llu us through the kernel, %llu us through the clock page\n",
+		CALLS, (unsigned long long)kernel, (unsigned long long)libc);
+
+	return 0;
+}
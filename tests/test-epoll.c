@@ -0,0 +1,139 @@
+/**
+ * @brief Check that epoll sets report the right files, in batches.
+ *
+ * Sets up a few pipes, writes to some of them, and checks what a
+ * level-triggered and an edge-triggered set each have to say about
+ * them, then does the same through poll().
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+#define PIPES 4
+
+int main(int argc, char * argv[]) {
+	int pipes[PIPES][2];
+	struct epoll_event events[PIPES];
+
+	int level = epoll_create1(EPOLL_CLOEXEC);
+	int edge  = epoll_create1(EPOLL_CLOEXEC);
+	if (level < 0 || edge < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	for (int i = 0; i < PIPES; ++i) {
+		pipe(pipes[i]);
+		struct epoll_event event = { .events = EPOLLIN, .data.u32 = i };
+		if (epoll_ctl(level, EPOLL_CTL_ADD, pipes[i][0], &event) < 0) {
+			perror("epoll_ctl");
+			return 1;
+		}
+		event.events |= EPOLLET;
+		if (epoll_ctl(edge, EPOLL_CTL_ADD, pipes[i][0], &event) < 0) {
+			perror("epoll_ctl (edge)");
+			return 1;
+		}
+	}
+
+	int count = epoll_wait(level, events, PIPES, 0);
+	if (count != 0) {
+		fprintf(stderr, "expected nothing to be ready yet, got %d\n", count);
+		return 1;
+	}
+
+	if (epoll_ctl(level, EPOLL_CTL_ADD, pipes[0][0], &events[0]) != -1) {
+		fprintf(stderr, "adding the same file twice should fail\n");
+		return 1;
+	}
+
+	write(pipes[1][1], "x", 1);
+	write(pipes[3][1], "x", 1);
+
+	count = epoll_wait(level, events, PIPES, 1000);
+	if (count != 2) {
+		fprintf(stderr, "level: expected 2 ready pipes, got %d\n", count);
+		return 1;
+	}
+	for (int i = 0; i < count; ++i) {
+		if (events[i].data.u32 != 1 && events[i].data.u32 != 3) {
+			fprintf(stderr, "pipe %u reported ready\n", events[i].data.u32);
+			return 1;
+		}
+	}
+
+	/* Level-triggered sets keep reporting; edge-triggered ones report once. */
+	count = epoll_wait(level, events, PIPES, 0);
+	if (count != 2) {
+		fprintf(stderr, "level: expected 2 pipes still ready, got %d\n", count);
+		return 1;
+	}
+	count = epoll_wait(edge, events, PIPES, 1000);
+	if (count != 2) {
+		fprintf(stderr, "edge: expected 2 ready pipes, got %d\n", count);
+		return 1;
+	}
+	count = epoll_wait(edge, events, PIPES, 0);
+	if (count != 0) {
+		fprintf(stderr, "edge: expected no repeats, got %d\n", count);
+		return 1;
+	}
+
+	char c;
+	read(pipes[1][0], &c, 1);
+	count = epoll_wait(level, events, PIPES, 0);
+	if (count != 1) {
+		fprintf(stderr, "level: expected 1 ready pipe after reading one, got %d\n", count);
+		return 1;
+	}
+	epoll_ctl(level, EPOLL_CTL_DEL, pipes[3][0], NULL);
+	count = epoll_wait(level, events, PIPES, 0);
+	if (count != 0) {
+		fprintf(stderr, "level: expected nothing after deleting the last one, got %d\n", count);
+		return 1;
+	}
+
+	struct pollfd fds[PIPES];
+	for (int i = 0; i < PIPES; ++i) {
+		fds[i].fd = pipes[i][0];
+		fds[i].events = POLLIN;
+	}
+	count = poll(fds, PIPES, 0);
+	if (count != 1 || fds[3].revents != POLLIN) {
+		fprintf(stderr, "poll: got %d, revents %#x\n", count, fds[3].revents);
+		return 1;
+	}
+
+	struct pollfd out = { .fd = pipes[0][1], .events = POLLIN | POLLOUT };
+	count = poll(&out, 1, 0);
+	if (count != 1 || out.revents != POLLOUT) {
+		fprintf(stderr, "poll write end: got %d, revents %#x\n", count, out.revents);
+		return 1;
+	}
+
+	close(pipes[0][1]);
+	count = poll(fds, 1, 0);
+	if (count != 1 || fds[0].revents != POLLHUP) {
+		fprintf(stderr, "poll hangup: got %d, revents %#x\n", count, fds[0].revents);
+		return 1;
+	}
+
+	if (!fork()) {
+		usleep(100000);
+		write(pipes[2][1], "x", 1);
+		return 0;
+	}
+	count = epoll_wait(level, events, PIPES, 5000);
+	if (count != 1 || events[0].data.u32 != 2) {
+		fprintf(stderr, "level: expected to be woken by pipe 2, got %d\n", count);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * @brief Check how many page faults it takes to fill in new memory.
+ *
+ * Writing through a fresh buffer should fault in batches, and a
+ * MAP_POPULATE buffer should not fault at all. Also punches holes
+ * in a pile of mappings to make sure lookups still find the rest.
+ * Fault counts come from MinFlt and MajFlt in /proc/self/status.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define PAGES 1024
+#define PILE 256
+
+static size_t faults(void) {
+	FILE * f = fopen("/proc/self/status", "r");
+	if (!f) return 0;
+	char line[256];
+	size_t total = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "MinFlt:", 7) || !strncmp(line, "MajFlt:", 7)) {
+			total += strtoul(line + 7, NULL, 10);
+		}
+	}
+	fclose(f);
+	return total;
+}
+
+static char * map(size_t size, int flags) {
+	char * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | flags, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return p;
+}
+
+int main(int argc, char * argv[]) {
+	size_t size = PAGES * 4096;
+
+	char * p = map(size, 0);
+	size_t before = faults();
+	for (size_t i = 0; i < size; i += 4096) p[i] = 1;
+	size_t sequential = faults() - before;
+	munmap(p, size);
+
+	if (sequential > PAGES / 4) {
+		fprintf(stderr, "writing %d pages took %zu faults\n", PAGES, sequential);
+		return 1;
+	}
+
+	p = map(size, MAP_POPULATE);
+	before = faults();
+	for (size_t i = 0; i < size; i += 4096) p[i] = 1;
+	size_t populated = faults() - before;
+	munmap(p, size);
+
+	/* Reading the status file may fault a little itself. */
+	if (populated > 4) {
+		fprintf(stderr, "populated buffer still took %zu faults\n", populated);
+		return 1;
+	}
+
+	char * pile[PILE];
+	for (int i = 0; i < PILE; ++i) {
+		pile[i] = map(3 * 4096, 0);
+		memset(pile[i], i, 3 * 4096);
+	}
+	for (int i = 0; i < PILE; i += 2) {
+		munmap(pile[i] + 4096, 4096);
+	}
+	for (int i = 0; i < PILE; ++i) {
+		if (pile[i][0] != (char)i || pile[i][2 * 4096] != (char)i) {
+			fprintf(stderr, "mapping %d lost its contents\n", i);
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "%zu faults for %d pages, %zu after MAP_POPULATE\n", sequential, PAGES, populated);
+	return 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * @brief Exercise the futex-backed pthread primitives.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define THREADS 4
+#define ITERATIONS 100000
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_barrier_t barrier;
+static sem_t sem;
+
+static long counter = 0;
+static int ready = 0;
+
+static void * worker(void * arg) {
+	pthread_barrier_wait(&barrier);
+
+	for (int i = 0; i < ITERATIONS; ++i) {
+		pthread_mutex_lock(&mutex);
+		counter++;
+		pthread_mutex_unlock(&mutex);
+	}
+
+	pthread_mutex_lock(&mutex);
+	while (!ready) pthread_cond_wait(&cond, &mutex);
+	pthread_mutex_unlock(&mutex);
+
+	sem_post(&sem);
+	return NULL;
+}
+
+int main(int argc, char * argv[]) {
+	pthread_t threads[THREADS];
+
+	pthread_barrier_init(&barrier, NULL, THREADS);
+	sem_init(&sem, 0, 0);
+
+	for (int i = 0; i < THREADS; ++i) {
+		pthread_create(&threads[i], NULL, worker, NULL);
+	}
+
+	pthread_mutex_lock(&mutex);
+	ready = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+
+	for (int i = 0; i < THREADS; ++i) {
+		sem_wait(&sem);
+	}
+
+	for (int i = 0; i < THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if (counter != (long)THREADS * ITERATIONS) {
+		fprintf(stderr, "mutex: expected %ld, got %ld\n", (long)THREADS * ITERATIONS, counter);
+		return 1;
+	}
+
+	/* Nobody will signal this, so it should time out. */
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += 50000000;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&mutex);
+	int ret = pthread_cond_timedwait(&cond, &mutex, &deadline);
+	pthread_mutex_unlock(&mutex);
+	if (ret != ETIMEDOUT) {
+		fprintf(stderr, "cond: expected timeout, got %d\n", ret);
+		return 1;
+	}
+
+	if (sem_trywait(&sem) != -1 || errno != EAGAIN) {
+		fprintf(stderr, "sem: expected EAGAIN from empty semaphore\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,133 @@
+/**
+ * @brief Hammer malloc from several threads at once.
+ *
+ * Each thread allocates, resizes and frees blocks of all three size
+ * classes, and hands some of its blocks to other threads to free.
+ * Pass -v to print malloc_stats() at the end.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define SLOTS 1024
+#define ITERATIONS 50000
+#define SHARED 64
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static void * shared[SHARED];
+
+static unsigned int next_random(unsigned int * seed) {
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static size_t pick_size(unsigned int * seed) {
+	unsigned int r = next_random(seed) % 100;
+	if (r == 0) return next_random(seed) % 400000 + 1; /* large */
+	if (r < 20) return next_random(seed) % 8000 + 1;   /* medium */
+	return next_random(seed) % 256 + 1;                /* small */
+}
+
+static int check(unsigned char * p, size_t size, unsigned char value) {
+	for (size_t i = 0; i < size; i += size / 8 + 1) {
+		if (p[i] != value) return 0;
+	}
+	return p[size-1] == value;
+}
+
+static void * worker(void * arg) {
+	unsigned int seed = (uintptr_t)arg;
+	void * blocks[SLOTS] = {0};
+	size_t sizes[SLOTS];
+
+	for (int i = 0; i < ITERATIONS; ++i) {
+		int slot = next_random(&seed) % SLOTS;
+		unsigned char value = slot;
+
+		if (!blocks[slot]) {
+			sizes[slot] = pick_size(&seed);
+			blocks[slot] = malloc(sizes[slot]);
+			if (!blocks[slot] || malloc_usable_size(blocks[slot]) < sizes[slot]) {
+				fprintf(stderr, "malloc(%zu) failed\n", sizes[slot]);
+				return (void*)1;
+			}
+			memset(blocks[slot], value, sizes[slot]);
+			continue;
+		}
+
+		if (!check(blocks[slot], sizes[slot], value)) {
+			fprintf(stderr, "block of %zu bytes was corrupted\n", sizes[slot]);
+			return (void*)1;
+		}
+
+		switch (next_random(&seed) % 4) {
+			case 0: {
+				size_t size = pick_size(&seed);
+				void * p = realloc(blocks[slot], size);
+				size_t kept = size < sizes[slot] ? size : sizes[slot];
+				if (!p || !check(p, kept, value)) {
+					fprintf(stderr, "realloc(%zu) lost data\n", size);
+					return (void*)1;
+				}
+				memset(p, value, size);
+				blocks[slot] = p;
+				sizes[slot] = size;
+				continue;
+			}
+			case 1: {
+				/* Give it to someone else to free. */
+				pthread_mutex_lock(&shared_lock);
+				int s = next_random(&seed) % SHARED;
+				void * old = shared[s];
+				shared[s] = blocks[slot];
+				pthread_mutex_unlock(&shared_lock);
+				free(old);
+				break;
+			}
+			default:
+				free(blocks[slot]);
+				break;
+		}
+		blocks[slot] = NULL;
+	}
+
+	for (int i = 0; i < SLOTS; ++i) free(blocks[i]);
+	return NULL;
+}
+
+int main(int argc, char * argv[]) {
+	pthread_t threads[THREADS];
+
+	for (int i = 0; i < THREADS; ++i) {
+		pthread_create(&threads[i], NULL, worker, (void*)(uintptr_t)(i + 1));
+	}
+
+	int failed = 0;
+	for (int i = 0; i < THREADS; ++i) {
+		void * retval;
+		pthread_join(threads[i], &retval);
+		if (retval) failed = 1;
+	}
+	if (failed) return 1;
+
+	for (int i = 0; i < SHARED; ++i) free(shared[i]);
+
+	struct mallinfo info = mallinfo();
+	if (info.hblks != 0) {
+		fprintf(stderr, "%d large blocks still mapped after freeing everything\n", info.hblks);
+		return 1;
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "-v")) malloc_stats();
+
+	return 0;
+}
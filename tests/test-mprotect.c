@@ -0,0 +1,143 @@
+/**
+ * @brief Check mprotect() and madvise() on anonymous memory.
+ *
+ * Makes a mapping read-only and checks that a child writing to it
+ * dies, that it can be made writable again without losing its
+ * contents, including after PROT_NONE hid it or a fork shared it,
+ * that MADV_DONTNEED gives back zeroes but POSIX_MADV_DONTNEED
+ * does not, and that advice over a hole fails but is still taken.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define PAGES 4
+
+/* Run @p func in a child and report how it ended. */
+static int child_signal(void (*func)(char *), char * arg) {
+	pid_t pid = fork();
+	if (!pid) {
+		func(arg);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	return WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+}
+
+static void poke(char * p) {
+	p[0] = 'x';
+}
+
+int main(int argc, char * argv[]) {
+	size_t size = PAGES * 4096;
+	char * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	memset(p, 'a', size);
+
+	if (mprotect(p + 4096, 4096, PROT_READ) < 0) {
+		perror("mprotect");
+		return 1;
+	}
+	if (child_signal(poke, p + 4096) != SIGSEGV) {
+		fprintf(stderr, "writing to a read-only page did not fault\n");
+		return 1;
+	}
+	if (child_signal(poke, p) != 0) {
+		fprintf(stderr, "writing next to a read-only page faulted\n");
+		return 1;
+	}
+	if (p[4096] != 'a') {
+		fprintf(stderr, "read-only page reads back %#x\n", p[4096]);
+		return 1;
+	}
+
+	if (mprotect(p + 2 * 4096, 4096, PROT_NONE) < 0) {
+		perror("mprotect PROT_NONE");
+		return 1;
+	}
+	if (child_signal(poke, p + 2 * 4096) != SIGSEGV) {
+		fprintf(stderr, "writing to a guard page did not fault\n");
+		return 1;
+	}
+
+	if (mprotect(p, size, PROT_READ | PROT_WRITE) < 0) {
+		perror("mprotect writable");
+		return 1;
+	}
+	if (p[4096] != 'a' || p[2 * 4096] != 'a') {
+		fprintf(stderr, "contents lost: %#x %#x\n", p[4096], p[2 * 4096]);
+		return 1;
+	}
+	p[4096] = 'b';
+	if (p[4096] != 'b') {
+		fprintf(stderr, "write after restoring access did not stick\n");
+		return 1;
+	}
+
+	/* After a fork, both sides must still get their own copy. */
+	mprotect(p, size, PROT_READ);
+	pid_t pid = fork();
+	if (!pid) {
+		mprotect(p, size, PROT_READ | PROT_WRITE);
+		p[0] = 'c';
+		_exit(0);
+	}
+	waitpid(pid, NULL, 0);
+	mprotect(p, size, PROT_READ | PROT_WRITE);
+	if (p[0] != 'a') {
+		fprintf(stderr, "child's write leaked into the parent\n");
+		return 1;
+	}
+	p[0] = 'd';
+	if (p[0] != 'd') {
+		fprintf(stderr, "parent can't write after fork\n");
+		return 1;
+	}
+
+	if (posix_madvise(p, size, POSIX_MADV_DONTNEED) != 0 || p[0] != 'd') {
+		fprintf(stderr, "POSIX_MADV_DONTNEED should leave contents alone (%#x)\n", p[0]);
+		return 1;
+	}
+	if (madvise(p, size, MADV_DONTNEED) < 0 || p[0] != 0) {
+		fprintf(stderr, "MADV_DONTNEED should give back zeroes (%#x)\n", p[0]);
+		return 1;
+	}
+	if (madvise(p, size, MADV_SEQUENTIAL) < 0) {
+		perror("madvise");
+		return 1;
+	}
+	if (madvise(p, size, 42) != -1) {
+		fprintf(stderr, "bad advice was accepted\n");
+		return 1;
+	}
+
+	/* A hole in the range is an error, but the rest still takes the advice. */
+	p[0] = 'e';
+	munmap(p + 4096, 4096);
+	if (madvise(p, size, MADV_DONTNEED) != -1 || errno != ENOMEM || p[0] != 0) {
+		fprintf(stderr, "MADV_DONTNEED over a hole should fail with ENOMEM and still zero the rest\n");
+		return 1;
+	}
+
+	munmap(p, size);
+	if (mprotect(p, size, PROT_READ) != -1 || errno != ENOMEM) {
+		fprintf(stderr, "mprotect of unmapped memory should fail with ENOMEM\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * @brief Check that /proc/profile records samples from a busy process.
+ *
+ * Spins for a while with the profiler running, then reads the samples
+ * back and looks for ones taken in our own userspace code.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+static int control(const char * cmd) {
+	int fd = open("/proc/profile", O_WRONLY);
+	if (fd < 0) return -errno;
+	int status = write(fd, cmd, strlen(cmd));
+	close(fd);
+	return status < 0 ? -errno : 0;
+}
+
+static uint64_t now(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static void __attribute__((noinline)) spin(void) {
+	volatile unsigned long x = 0;
+	uint64_t start = now();
+	while (now() - start < 200000) x++;
+}
+
+int main(int argc, char * argv[]) {
+	if (control("start") < 0) {
+		fprintf(stderr, "could not start profiler: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (control("bogus") != -EINVAL) {
+		fprintf(stderr, "bad command was accepted\n");
+		control("stop");
+		return 1;
+	}
+
+	control("clear");
+	spin();
+	control("stop");
+
+	FILE * f = fopen("/proc/profile", "r");
+	if (!f) {
+		fprintf(stderr, "could not read /proc/profile\n");
+		return 1;
+	}
+
+	int ours = 0, in_spin = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		int cpu, pid, tid;
+		char mode;
+		unsigned long ip;
+		if (sscanf(line, "%d %d %d %c %lx", &cpu, &pid, &tid, &mode, &ip) != 5) continue;
+		if (pid != getpid() || mode != 'u') continue;
+		ours++;
+		if (ip >= (uintptr_t)spin && ip < (uintptr_t)main) in_spin++;
+	}
+	fclose(f);
+
+	/* 200ms at one sample per millisecond; allow plenty of slack. */
+	fprintf(stderr, "%d userspace samples, %d in spin()\n", ours, in_spin);
+	if (ours < 20) {
+		fprintf(stderr, "expected at least 20\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * @brief Check posix_fadvise, and that readahead happens and is harmless.
+ *
+ * Drops a file from the page cache, reads its first two pages, and
+ * watches Cached in /proc/meminfo grow past them as the kernel reads
+ * ahead; then does the same for POSIX_FADV_WILLNEED. After that, reads
+ * the file front to back in odd-sized pieces and again in a scattered
+ * order under each hint, comparing every piece against the first copy.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Something big that nobody keeps mapped, so DONTNEED can drop all of it. */
+#define FILENAME "/usr/share/wallpapers/whiteeye.jpg"
+#define PIECE 1000
+#define FAR ((off_t)(~0UL >> 1)) /* the largest off_t */
+
+static size_t cached_kb(void) {
+	FILE * f = fopen("/proc/meminfo", "r");
+	if (!f) return 0;
+	char line[256];
+	size_t cached = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "Cached:", 7)) cached = strtoul(line + 7, NULL, 10);
+	}
+	fclose(f);
+	return cached;
+}
+
+/* Readahead happens in the background; give it a second to show up. */
+static size_t cache_growth(size_t before, size_t want) {
+	size_t now = cached_kb();
+	for (int i = 0; i < 20 && now < before + want; ++i) {
+		usleep(50000);
+		now = cached_kb();
+	}
+	return now > before ? now - before : 0;
+}
+
+static size_t gcd(size_t a, size_t b) {
+	while (b) {
+		size_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static int check_scattered(int fd, const char * copy, size_t size, const char * hint) {
+	char buf[PIECE];
+	/* Visit every piece once, but never two neighbours in a row. */
+	size_t pieces = (size + PIECE - 1) / PIECE;
+	size_t step = 7;
+	while (gcd(pieces, step) != 1) step += 2;
+	for (size_t i = 0, p = 0; i < pieces; ++i, p = (p + step) % pieces) {
+		size_t want = size - p * PIECE < PIECE ? size - p * PIECE : PIECE;
+		ssize_t r = pread(fd, buf, PIECE, p * PIECE);
+		if (r != (ssize_t)want || memcmp(buf, copy + p * PIECE, want)) {
+			fprintf(stderr, "%s: piece %zu differs (read %zd)\n", hint, p, r);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	int fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", FILENAME, strerror(errno));
+		return 1;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	size_t size = st.st_size;
+	size_t pages = size / 4096;
+	if (pages < 8) {
+		fprintf(stderr, "%s is too small to read ahead of\n", FILENAME);
+		return 1;
+	}
+
+	if (posix_fadvise(fd, 0, 0, 42) != EINVAL) {
+		fprintf(stderr, "bad advice was accepted\n");
+		return 1;
+	}
+	if (posix_fadvise(fd, 0, -1, POSIX_FADV_NORMAL) != EINVAL) {
+		fprintf(stderr, "negative length was accepted\n");
+		return 1;
+	}
+	if (posix_fadvise(-1, 0, 0, POSIX_FADV_NORMAL) != EBADF) {
+		fprintf(stderr, "bad descriptor was accepted\n");
+		return 1;
+	}
+	int pipes[2];
+	if (!pipe(pipes)) {
+		if (posix_fadvise(pipes[0], 0, 0, POSIX_FADV_NORMAL) != ESPIPE) {
+			fprintf(stderr, "advice on a pipe was accepted\n");
+			return 1;
+		}
+		close(pipes[0]);
+		close(pipes[1]);
+	}
+
+	/* Ranges reaching far past the end of the file must not tie up the kernel. */
+	alarm(5);
+	if (posix_fadvise(fd, 0, FAR, POSIX_FADV_WILLNEED) != 0 ||
+		posix_fadvise(fd, FAR - 1, FAR, POSIX_FADV_WILLNEED) != 0) {
+		fprintf(stderr, "willneed with a huge length was refused\n");
+		return 1;
+	}
+	alarm(0);
+
+	/* Two pages in a row under SEQUENTIAL should pull in much more than two pages. */
+	char page[4096];
+	size_t ahead = pages - 2 < 128 ? pages - 2 : 128;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	size_t before = cached_kb();
+	pread(fd, page, sizeof(page), 0);
+	pread(fd, page, sizeof(page), 4096);
+	size_t grew = cache_growth(before, (2 + ahead / 2) * 4);
+	if (grew < (2 + ahead / 2) * 4) {
+		fprintf(stderr, "sequential: reading 8 kB only cached %zu kB\n", grew);
+		return 1;
+	}
+
+	/* WILLNEED should read the range without us touching it. */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+	before = cached_kb();
+	if (posix_fadvise(fd, 0, size / 2, POSIX_FADV_WILLNEED) != 0) {
+		fprintf(stderr, "willneed was refused\n");
+		return 1;
+	}
+	grew = cache_growth(before, pages / 4 * 4);
+	if (grew < pages / 4 * 4) {
+		fprintf(stderr, "willneed: asked for %zu kB, only %zu kB cached\n", size / 2 / 1024, grew);
+		return 1;
+	}
+
+	/* A plain sequential read of the whole thing. */
+	char * copy = malloc(size + PIECE);
+	size_t total = 0;
+	ssize_t r;
+	lseek(fd, 0, SEEK_SET);
+	while ((r = read(fd, copy + total, PIECE)) > 0) total += r;
+	if (total != size) {
+		fprintf(stderr, "read %zu bytes of %zu\n", total, size);
+		return 1;
+	}
+
+	static const struct { int advice; const char * name; } hints[] = {
+		{ POSIX_FADV_RANDOM,     "random" },
+		{ POSIX_FADV_SEQUENTIAL, "sequential" },
+		{ POSIX_FADV_NORMAL,     "normal" },
+	};
+
+	for (size_t i = 0; i < sizeof(hints) / sizeof(*hints); ++i) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		posix_fadvise(fd, 0, 0, hints[i].advice);
+		if (check_scattered(fd, copy, size, hints[i].name)) return 1;
+	}
+
+	/* Ask for the first half in the background, then read all of it. */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	posix_fadvise(fd, 0, size / 2, POSIX_FADV_WILLNEED);
+	if (posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE) != 0) {
+		fprintf(stderr, "noreuse was refused\n");
+		return 1;
+	}
+	lseek(fd, 0, SEEK_SET);
+	char * again = malloc(size + PIECE);
+	total = 0;
+	while ((r = read(fd, again + total, 3 * PIECE)) > 0) total += r;
+	if (total != size || memcmp(copy, again, size)) {
+		fprintf(stderr, "second sequential read differs\n");
+		return 1;
+	}
+
+	close(fd);
+	return 0;
+}
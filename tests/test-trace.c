@@ -0,0 +1,77 @@
+/**
+ * @brief Check that /proc/trace records our system calls and switches.
+ *
+ * Sleeps in a short loop with tracing on, then reads the binary trace
+ * back and counts the events that belong to us.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <kernel/trace.h>
+
+static int control(const char * cmd) {
+	int fd = open("/proc/trace", O_WRONLY);
+	if (fd < 0) return -errno;
+	int status = write(fd, cmd, strlen(cmd));
+	close(fd);
+	return status < 0 ? -errno : 0;
+}
+
+int main(int argc, char * argv[]) {
+	if (control("clear") < 0 || control("start") < 0) {
+		fprintf(stderr, "could not start tracing: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (control("bogus") != -EINVAL) {
+		fprintf(stderr, "bad command was accepted\n");
+		control("stop");
+		return 1;
+	}
+
+	for (int i = 0; i < 10; ++i) {
+		getpid();
+		usleep(1000);
+	}
+
+	control("stop");
+
+	FILE * f = fopen("/proc/trace", "r");
+	if (!f) {
+		fprintf(stderr, "could not read /proc/trace\n");
+		return 1;
+	}
+
+	struct trace_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != TRACE_MAGIC || header.event_size != sizeof(struct trace_event)) {
+		fprintf(stderr, "bad header\n");
+		return 1;
+	}
+
+	int enters = 0, exits = 0, switches = 0;
+	struct trace_event e;
+	while (fread(&e, sizeof(e), 1, f) == 1) {
+		if (e.tid != getpid()) continue;
+		if (e.type == TRACE_SYSCALL_ENTER) enters++;
+		if (e.type == TRACE_SYSCALL_EXIT) exits++;
+		if (e.type == TRACE_SWITCH && e.b == (uint64_t)getpid()) switches++;
+	}
+	fclose(f);
+
+	fprintf(stderr, "%llu events, %d syscall entries, %d exits, %d switches to us\n",
+		(unsigned long long)header.count, enters, exits, switches);
+
+	/* Each iteration makes at least two system calls and sleeps once. */
+	if (enters < 20 || exits < 20 || switches < 10) return 1;
+
+	return 0;
+}